@@ -9,6 +9,12 @@
 #include <wininet.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <process.h>
+#include <malloc.h>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+# include <emmintrin.h>
+# define WININET_HEX_SSE2               /* format hex dumps with SSE2 */
+#endif
 
 #include "gsoapWinInet.h"
 
@@ -24,6 +30,53 @@
 
 #define ROUND_UP(value, step) (((value) % (step) == 0) ? (value) : ((((value) / (step)) + 1) * (step)))
 
+#define WININET_LATENCY_SAMPLES     64  /* number of recent latencies kept for hedging */
+#define WININET_HEDGE_MIN_SAMPLES   10  /* don't hedge until we have this many samples */
+#define WININET_WRITE_BLOCK      65536  /* block size used when writing the body separately */
+#define WININET_MAX_ENDPOINTS       32  /* maximum number of equivalent endpoints */
+#define WININET_ENDPOINT_RETRY   10000  /* ms an endpoint is avoided after it couldn't be reached */
+#define WININET_URL_BUCKETS         16  /* hash buckets for the parsed endpoints */
+#define WININET_MAX_URLS            64  /* parsed endpoints cached by each instance */
+#define WININET_TRACEPARENT_LEN     55  /* "00-" trace id "-" span id "-" flags */
+#define WININET_LOG_RECORD        8192  /* size of the pooled log records */
+#define WININET_LOG_POOL           256  /* maximum number of free log records kept */
+#define WININET_LOG_RING           256  /* records queued for a log file before logging waits, power of 2 */
+#define WININET_LOG_HOLD           100  /* ms that an instance keeps log output before queueing it */
+
+/* a block of log output queued for the writer thread, see wininet_log_commit() */
+struct wininet_logrec
+{
+    SLIST_ENTRY             entry;          /* must be first */
+    size_t                  nLen;           /* length of the text */
+    size_t                  nSize;          /* size of szText */
+    char                    szText[1];
+};
+
+/*  a slot of the queue of a log file. nSeq is the sequence number of the 
+    record that may be queued in it, plus one once the record has been queued */
+struct wininet_logslot
+{
+    volatile LONG           nSeq;
+    struct wininet_logrec * pRec;
+};
+
+/* a log file shared by all instances that log to the same path */
+struct wininet_logsink
+{
+    struct wininet_logsink * pNext;
+    char *                  pPath;
+    FILE *                  hFile;
+    HANDLE                  hWake;          /* wakes the writer when records are queued */
+    HANDLE                  hWritten;       /* set by the writer after each batch has been written */
+    HANDLE                  hThread;        /* writer thread */
+    volatile LONG           nQueued;        /* sequence number of the next record to queue */
+    volatile LONG           nWritten;       /* sequence number of the next record to write */
+    volatile LONG           nDropped;       /* records dropped because the queue was full, see wininet_setlogdrop() */
+    volatile BOOL           bStop;          /* the writer should exit once the queue is empty */
+    unsigned                nRefs;          /* instances using the log, protected by wininet_logsink_lock */
+    struct wininet_logslot  aQueue[WININET_LOG_RING];
+};
+
 /* plugin private data */
 
 #define WININET_VERSION "wininet-2.1"
@@ -31,6 +84,91 @@ static const char wininet_id[] = WININET_VERSION;
 
 enum LogFormat { LOGTYPE_UNKNOWN, LOGTYPE_TEXT, LOGTYPE_XML, LOGTYPE_HEX };
 
+/* SOAPAction operations whose responses may be cached */
+struct wininet_cache_rule
+{
+    struct wininet_cache_rule * pNext;
+    char *                      pAction;    /* SOAPAction to match, NULL matches all */
+    DWORD                       dwTtl;      /* lifetime of cached responses (ms) */
+    BOOL                        bRevalidate; /* revalidate expired responses with the server */
+};
+
+/* identifies a message sent to an endpoint */
+struct wininet_cache_key
+{
+    ULONGLONG                   nHash;      /* hash of the endpoint, action, credentials and message */
+    size_t                      uiMsgLen;   /* length of the message */
+    const char *                pEndpoint;  /* endpoint the message is sent to */
+    const char *                pAction;    /* SOAPAction of the message */
+};
+
+/* state of an endpoint shared by all plugin instances */
+struct wininet_endpoint
+{
+    struct wininet_endpoint *   pNext;
+    char *                      pUrl;           /* endpoint URL */
+    volatile LONG               nOutstanding;   /* requests currently being sent */
+    DWORD                       dwLatency;      /* moving average of the response time in ms, 0 = unknown */
+    BOOL                        bDown;          /* the server couldn't be reached */
+    DWORD                       dwDownUntil;    /* tick count until which a down endpoint is avoided */
+};
+
+/* a parsed endpoint URL, see wininet_url_get() */
+struct wininet_url
+{
+    struct wininet_url *    pNext;          /* next in the hash bucket */
+    ULONGLONG               nHash;          /* hash of the endpoint */
+    BOOL                    bCached;        /* owned by the cache, otherwise freed by the user */
+    INTERNET_SCHEME         nScheme;
+    INTERNET_PORT           nPort;
+    char *                  pHost;          /* stored after the endpoint */
+    char *                  pUrlPath;       /* path and extra info, stored after the host */
+    char                    szEndpoint[1];
+};
+
+/* constant headers for the messages to an endpoint, see wininet_setheadertemplate() */
+struct wininet_template
+{
+    struct wininet_template *   pNext;
+    char *                      pEndpoint;  /* NULL for all endpoints */
+    char *                      pHeaders;   /* formatted "key: value\r\n" lines */
+    size_t                      nHeadersLen;
+    DWORD                       dwKeys;     /* well known headers supplied, see wininet_template_key() */
+};
+
+/* fan-out configuration, see wininet_setfanout() */
+struct wininet_fanout
+{
+    char **                 ppEndpoints;
+    unsigned                nEndpoints;
+    unsigned                nRequired;      /* successful responses required, 0 = all */
+    wininet_fanout_callback pCallback;
+    void *                  pContext;
+    HANDLE                  hCompleted;     /* semaphore released as each request completes */
+    volatile LONG           nCompleted;     /* number of requests completed */
+    unsigned *              anCompleted;    /* endpoint indexes in the order they completed */
+};
+
+/* a connection being established in the background, see wininet_prewarm_async() */
+struct wininet_prewarm
+{
+    struct wininet_prewarm *    pNext;
+    HINTERNET                   hInternet;
+    char *                      pEndpoint;
+    DWORD                       dwFlags;        /* request flags, see wininet_prewarm_prepare() */
+    HANDLE                      hThread;
+    BOOL                        bResult;
+};
+
+/* a session of a plugin instance that uses a proxy decision */
+struct wininet_proxy_session
+{
+    struct wininet_proxy_session * pNext;
+    DWORD                       dwAccessType;   /* INTERNET_OPEN_TYPE_DIRECT or INTERNET_OPEN_TYPE_PROXY */
+    char *                      pProxy;         /* proxy list, empty for direct connections */
+    HINTERNET                   hInternet;
+};
+
 struct wininet_data
 {
     HINTERNET            hInternet;         /* internet session handle */
@@ -38,40 +176,626 @@ struct wininet_data
     HINTERNET            hRequest;          /* current request handle */
     BOOL                 bDisconnect;       /* connection is disconnected */
     DWORD                dwRequestFlags;    /* extra request flags from user */
-    char *               pUrlPath;          /* current URL path to use */
-    char *               pszErrorMessage;   /* wininet/system error message */
+    DWORD                dwActiveFlags;     /* flags used to open the current request */
+    const char *         pEndpoint;         /* current endpoint */
+    const char *         pHost;             /* current host name */
+    INTERNET_PORT        nPort;             /* current host port */
+    const char *         pUrlPath;          /* current URL path to use */
+    struct wininet_url * apUrls[WININET_URL_BUCKETS]; /* parsed endpoints, see wininet_url_get() */
+    unsigned             nUrls;             /* number of cached endpoints */
+    struct wininet_url * pUrlUncached;      /* current endpoint if it couldn't be cached */
+    char                 szErrorMessage[256]; /* error message when the message cache is full */
     char *               pUserAgent;        /* user agent header */
     char *               pBuffer;           /* send buffer */
     size_t               uiBufferSize;      /* current size of the buffer */
     size_t               uiBufferLenMax;    /* total length of the message */
     size_t               uiBufferLen;       /* length of data in buffer */
+    char *               pHeaders;          /* request headers added to the current request */
+    struct wininet_template * pTemplates;   /* header templates, see wininet_setheadertemplate() */
+    struct wininet_template * pTemplate;    /* template used for the current message */
+    size_t               uiHeadersSize;     /* current size of the headers buffer */
+    size_t               uiHeadersLen;      /* length of the headers in the buffer */
+    size_t               uiAuthHeaderPos;   /* offset of the preemptive Authorization header */
+    size_t               uiAuthHeaderLen;   /* length of the preemptive Authorization header, 0 = none */
     BOOL                 bIsChunkSize;      /* expecting a chunk size buffer */
     enum LogFormat       nLogFormat;        /* log data format */
     wininet_rse_callback pRseCallback;      /* wininet_resolve_send_error callback.  Allows clients to resolve ssl errors programatically */
-    FILE *               hLog;              /* debug log file */
+    struct wininet_logsink * hLog;          /* debug log file */
+    DWORD                dwLogCategories;   /* categories to log, see wininet_setloglevel() */
+    DWORD                dwLogMask;         /* categories logged, 0 if there is no log */
+    struct wininet_logrec * pLogRec;        /* log output not yet queued */
+    ULONGLONG            nLogTime;          /* millisecond of the cached timestamp */
+    ULONGLONG            nLogRecTime;       /* millisecond of the first output in pLogRec */
+    char                 szLogTime[20];     /* cached timestamp for the log */
+    DWORD                dwHedgeQuantile;   /* latency quantile (percent) to hedge at, 0 = disabled */
+    DWORD                dwHedgeMinDelay;   /* minimum delay before sending a hedged request (ms) */
+    volatile BOOL        bHedgeRace;        /* requests are being sent from worker threads */
+    struct wininet_sender * pHedge;         /* the hedged request while bHedgeRace */
+    volatile LONG        bPrimaryClosed;    /* the original request's connection closed while bHedgeRace */
+    volatile LONG        bHedgeClosed;      /* the hedged request's connection closed while bHedgeRace */
+    DWORD                adwLatency[WININET_LATENCY_SAMPLES]; /* recent response latencies (ms) */
+    unsigned             nLatencyCount;     /* number of valid latency samples */
+    unsigned             nLatencyNext;      /* next latency sample to be replaced */
+    BOOL                 bAuthCache;        /* cache credentials and send them preemptively */
+    DWORD                dwAuthSent;        /* WININET_AUTH_xxx with cached credentials applied */
+    DWORD                dwAuthBasic;       /* WININET_AUTH_xxx with a basic header added */
+    DWORD                dwAuthRetried;     /* WININET_AUTH_xxx resent with cached credentials */
+    DWORD                dwAuthChallenged;  /* WININET_AUTH_xxx challenges for this message */
+    char *               apAuthChallenge[2]; /* server and proxy challenges for this message */
+    char *               apAuthRealm[2];    /* realms of the cached server and proxy credentials sent */
+    size_t               uiExpectThreshold; /* minimum body size to use Expect: 100-continue, 0 = never */
+    BOOL                 bRedirectCache;    /* follow redirects ourselves and cache permanent ones */
+    char *               pAction;           /* SOAPAction of the current message */
+    struct wininet_cache_rule * pCacheRules; /* operations whose responses may be cached */
+    struct wininet_cache_key cacheKey;      /* identifies the message being captured */
+    char *               pCacheEndpoint;    /* endpoint of the message being captured */
+    DWORD                dwCacheTtl;        /* lifetime of the response being captured (ms) */
+    BOOL                 bCapture;          /* capture the response for the cache or waiting requests */
+    BOOL                 bCaptureCache;     /* store the captured response in the cache */
+    BOOL                 bCoalesce;         /* wait for identical requests in progress */
+    struct wininet_flight * pFlight;        /* identical requests waiting for this response */
+    char *               pCapture;          /* captured response headers and body */
+    size_t               uiCaptureSize;     /* current size of the capture buffer */
+    size_t               uiCaptureLen;      /* length of the captured response */
+    size_t               uiCaptureBody;     /* expected body length, or INVALID_BUFFER_LENGTH */
+    size_t               uiCaptureHeaders;  /* length of the captured headers */
+    char *               pCaptureETag;      /* ETag of the response being captured */
+    char *               pCaptureLastModified; /* Last-Modified of the response being captured */
+    BOOL                 bRevalidating;     /* a conditional request is being made */
+    char *               pValidETag;        /* ETag of the cached response being revalidated */
+    char *               pValidLastModified; /* Last-Modified of the cached response being revalidated */
+    char *               pReplay;           /* response to return from frecv instead of the network */
+    size_t               uiReplayLen;       /* length of the replay response */
+    size_t               uiReplayPos;       /* amount of the replay response returned */
+    struct wininet_endpoint * apEndpoints[WININET_MAX_ENDPOINTS]; /* equivalent endpoints */
+    unsigned             nEndpoints;
+    struct wininet_endpoint * pEndpointState; /* state of the current endpoint if it is one of ours */
+    DWORD                dwEndpointsTried;  /* endpoints that couldn't be reached for the current message */
+    unsigned             nRandom;           /* random state, see wininet_random() */
+    ULONG                nRequestId;        /* counter for request ids in the log */
+    BOOL                 bCircuitBreaker;   /* fail fast when a server is unhealthy */
+    BOOL                 bBreakerTrial;     /* the current message is the trial of a half-open circuit */
+    BOOL                 bBreakerPending;   /* the result of the current message hasn't been recorded */
+    BOOL                 bConcurrencyLimit; /* limit the messages in progress to each server */
+    struct wininet_limiter * pLimiter;      /* limiter whose slot the current message holds */
+    DWORD                dwLimiterStart;    /* tick count when the slot was taken */
+    struct wininet_fanout * pFanout;        /* send each message to several endpoints */
+    struct wininet_prewarm * pPrewarm;      /* connections being established in the background */
+    BOOL                 bProxyCache;       /* use the process wide proxy decisions */
+    struct wininet_proxy_session * pProxySessions; /* sessions for proxy decisions */
+    struct wininet_proxy_refresh * pProxyRefresh;  /* proxy decisions being refreshed */
+    HINTERNET            hSession;          /* session of the current connection */
+    HANDLE               hInitDone;         /* set when background initialization is complete */
+    DWORD                dwInitError;       /* error from opening the internet session */
+    BOOL                 bSending;          /* a request is being sent */
+    DWORD                dwSendStart;       /* tick count when the send started */
+    BOOL                 bSlotAcquired;     /* WinInet has started using a connection */
+    DWORD                dwSlotAcquired;    /* tick count when it did */
+    DWORD                dwIdleTimeout;     /* ms a connection may be idle before it is replaced, 0 = never */
+    DWORD                dwLastUsed;        /* tick count when the connection was last used */
+    BOOL                 bConnUsed;         /* a message has been exchanged on the connection */
+    BOOL                 bTracing;          /* send a traceparent header with each message */
+    ULONGLONG            nTraceState;       /* generator state for trace and span ids */
+    char                 szTraceContext[WININET_TRACEPARENT_LEN + 1]; /* parent supplied by the caller */
+    char                 szTraceParent[WININET_TRACEPARENT_LEN + 1];  /* traceparent of the current message */
+    BOOL                 bInFlight;         /* the current message's response hasn't been read yet */
+    struct wininet_stats stats;             /* statistics, see wininet_getstats() */
+};
+
+/* a request that is sent from a worker thread, e.g. hedged requests */
+struct wininet_sender
+{
+    struct wininet_data * pData;            /* plugin data */
+    HINTERNET            hConnection;       /* connection handle used by the request */
+    HINTERNET            hRequest;          /* request handle to send */
+    const char *         pBuf;              /* message to send */
+    size_t               uiBufLen;          /* length of the message */
+    HANDLE               hThread;           /* worker thread */
+    BOOL                 bResult;           /* result of HttpSendRequest */
+    DWORD                dwError;           /* error code if the send failed */
+    DWORD                dwOutcome;         /* WININET_SEND_xxx */
 };
 
+/* how a message was sent, see wininet_http_send() */
+#define WININET_SEND_EXPECT         0x01    /* Expect: 100-continue was used */
+#define WININET_SEND_REJECTED       0x02    /* the server stopped the upload */
+#define WININET_SEND_RESENT         0x04    /* resent for an authentication handshake */
+
 /*=============================================================================
   Local Functions
  ============================================================================*/
 
+/*  xorshift generator, each instance has its own state so that threads 
+    don't share anything */
+static unsigned
+wininet_random(
+    struct wininet_data *   a_pData
+    )
+{
+    unsigned nValue = a_pData->nRandom;
+    nValue ^= nValue << 13;
+    nValue ^= nValue >> 17;
+    nValue ^= nValue << 5;
+    a_pData->nRandom = nValue;
+    return nValue;
+}
+
 /*  create an incrementing semi-random, semi-unique value to use in request 
     headers. It doesn't matter if this is really unique or random, it just
-    provides a reference for matching debug logs together. It is assumed that 
-    srand() has been called. */
+    provides a reference for matching debug logs together. The counter and
+    random state belong to the instance so that no process wide state is 
+    touched for each message. */
 static void
 wininet_getreqid(
-    char * aBuf,
-    size_t aBufSiz
+    struct wininet_data *   a_pData,
+    char *                  aBuf,
+    size_t                  aBufSiz
     )
 {
-    static LONG counter = (LONG) GetTickCount();
-    LONG curr = InterlockedIncrement(&counter);
+    ULONG curr = ++a_pData->nRequestId;
+
+    /* use the span id when tracing so that server logs can be joined with the trace */
+    if (a_pData->szTraceParent[0]) {
+        _snprintf(aBuf, aBufSiz, "%.16s", a_pData->szTraceParent + 36);
+        aBuf[aBufSiz - 1] = 0;
+        return;
+    }
     _snprintf(aBuf, aBufSiz, "%lX%lX%lX", 
-        (ULONG)GetCurrentProcessId(), (ULONG)rand(), (ULONG)curr);
+        (ULONG)GetCurrentProcessId(), (ULONG)(wininet_random(a_pData) & 0x7FFF), curr);
+}
+
+/*  splitmix64 generator for trace and span ids. Each instance has its own 
+    state so ids are generated without locks or shared state. */
+static ULONGLONG
+wininet_trace_random(
+    struct wininet_data *   a_pData
+    )
+{
+    ULONGLONG nValue = (a_pData->nTraceState += 0x9E3779B97F4A7C15ULL);
+    nValue = (nValue ^ (nValue >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    nValue = (nValue ^ (nValue >> 27)) * 0x94D049BB133111EBULL;
+    return nValue ^ (nValue >> 31);
+}
+
+/* write a non-zero random id of a_nLen lower case hex digits */
+static void
+wininet_trace_id(
+    struct wininet_data *   a_pData,
+    char *                  a_pBuf,
+    size_t                  a_nLen
+    )
+{
+    const char hex[] = "0123456789abcdef";
+    ULONGLONG nValue = 0;
+    size_t n;
+
+    for (n = 0; n < a_nLen; ++n) {
+        if ((n & 15) == 0) {
+            do {
+                nValue = wininet_trace_random(a_pData);
+            }
+            while (!nValue);
+        }
+        a_pBuf[n] = hex[nValue & 0xF];
+        nValue >>= 4;
+    }
+}
+
+/*  check a W3C traceparent value: 00-<32 hex trace id>-<16 hex parent id>-<2 hex flags>
+    where the ids aren't all zeros */
+static BOOL
+wininet_trace_valid(
+    const char *    a_pszTraceParent
+    )
+{
+    const char * pFormat = "00-################################-################-##";
+    BOOL bTraceZero = TRUE;
+    BOOL bSpanZero = TRUE;
+    size_t n;
+
+    if (strlen(a_pszTraceParent) != WININET_TRACEPARENT_LEN) {
+        return FALSE;
+    }
+    for (n = 0; n < WININET_TRACEPARENT_LEN; ++n) {
+        char ch = a_pszTraceParent[n];
+        if (pFormat[n] != '#') {
+            if (ch != pFormat[n]) return FALSE;
+            continue;
+        }
+        if (!((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f'))) {
+            return FALSE;
+        }
+        if (ch != '0') {
+            if (n < 35) bTraceZero = FALSE;
+            else if (n < 52) bSpanZero = FALSE;
+        }
+    }
+    return !bTraceZero && !bSpanZero;
+}
+
+/*  create the traceparent for a new message. The trace id and flags of the 
+    caller's context are used if there is one, otherwise a new trace is 
+    started. The message always gets a new span id. */
+static void
+wininet_trace_begin(
+    struct wininet_data *   a_pData
+    )
+{
+    char * pTrace = a_pData->szTraceParent;
+
+    if (a_pData->szTraceContext[0]) {
+        memcpy(pTrace, a_pData->szTraceContext, WININET_TRACEPARENT_LEN + 1);
+    }
+    else {
+        memcpy(pTrace, "00-", 3);
+        wininet_trace_id(a_pData, pTrace + 3, 32);
+        memcpy(pTrace + 35, "-0000000000000000-01", 21);
+    }
+    wininet_trace_id(a_pData, pTrace + 36, 16);
+}
+
+/* process wide lock, initialized on first use and never destroyed */
+struct wininet_lock
+{
+    volatile LONG       nState;     /* 0 = uninitialized, 1 = initializing, 2 = ready */
+    CRITICAL_SECTION    cs;
+};
+
+static void
+wininet_lock_enter(
+    struct wininet_lock *   a_pLock
+    )
+{
+    if (a_pLock->nState != 2) {
+        if (InterlockedCompareExchange(&a_pLock->nState, 1, 0) == 0) {
+            InitializeCriticalSection(&a_pLock->cs);
+            InterlockedExchange(&a_pLock->nState, 2);
+        }
+        else {
+            while (a_pLock->nState != 2) Sleep(0);
+        }
+    }
+    EnterCriticalSection(&a_pLock->cs);
+}
+
+static void
+wininet_lock_leave(
+    struct wininet_lock *   a_pLock
+    )
+{
+    LeaveCriticalSection(&a_pLock->cs);
+}
+
+static struct wininet_lock      wininet_logsink_lock;
+static struct wininet_logsink * wininet_logsinks = NULL;
+static SLIST_HEADER             wininet_logrec_pool;    /* free records of WININET_LOG_RECORD bytes */
+static volatile DWORD           wininet_log_flush_ms = 0;
+static volatile BOOL            wininet_log_drop = FALSE;
+
+static struct wininet_logrec *
+wininet_logrec_alloc(
+    size_t  a_nSize
+    )
+{
+    struct wininet_logrec * pRec = NULL;
+
+    if (a_nSize <= WININET_LOG_RECORD) {
+        a_nSize = WININET_LOG_RECORD;
+        pRec = (struct wininet_logrec *) InterlockedPopEntrySList(&wininet_logrec_pool);
+    }
+    if (!pRec) {
+        pRec = (struct wininet_logrec *) _aligned_malloc(
+            sizeof(struct wininet_logrec) + a_nSize, MEMORY_ALLOCATION_ALIGNMENT);
+        if (!pRec) return NULL;
+        pRec->nSize = a_nSize;
+    }
+    pRec->nLen = 0;
+    return pRec;
+}
+
+static void
+wininet_logrec_free(
+    struct wininet_logrec * a_pRec
+    )
+{
+    if (a_pRec->nSize == WININET_LOG_RECORD 
+        && QueryDepthSList(&wininet_logrec_pool) < WININET_LOG_POOL) 
+    {
+        InterlockedPushEntrySList(&wininet_logrec_pool, &a_pRec->entry);
+    }
+    else {
+        _aligned_free(a_pRec);
+    }
+}
+
+/*  Write the queued records for a log file. Records are written in batches 
+    in the order they were queued, and the file is flushed after each batch 
+    or every wininet_log_flush_ms if that is set. */
+static unsigned __stdcall
+wininet_logsink_thread(
+    void *  a_pParam
+    )
+{
+    struct wininet_logsink * pSink = (struct wininet_logsink *) a_pParam;
+    struct wininet_logslot * pSlot;
+    DWORD   dwLastFlush = GetTickCount();
+    BOOL    bDirty = FALSE;
+    LONG    nPos;
+    LONG    nDropped;
+
+    for (;;) {
+        if (!pSink->bStop) {
+            WaitForSingleObject(pSink->hWake, 
+                bDirty && wininet_log_flush_ms ? wininet_log_flush_ms : INFINITE);
+        }
+        ResetEvent(pSink->hWritten);
+
+        /* write every record that has been queued, in order */
+        for (nPos = pSink->nWritten; ; ++nPos) {
+            pSlot = &pSink->aQueue[nPos & (WININET_LOG_RING - 1)];
+            if (pSlot->nSeq != nPos + 1) break;
+            fwrite(pSlot->pRec->szText, 1, pSlot->pRec->nLen, pSink->hFile);
+            wininet_logrec_free(pSlot->pRec);
+            InterlockedExchange(&pSlot->nSeq, nPos + WININET_LOG_RING);
+        }
+        if (nPos != pSink->nWritten) {
+            InterlockedExchange(&pSink->nWritten, nPos);
+            bDirty = TRUE;
+        }
+
+        nDropped = InterlockedExchange(&pSink->nDropped, 0);
+        if (nDropped) {
+            fprintf(pSink->hFile, "*** %ld log records were dropped, the log file is too slow ***\n", nDropped);
+            bDirty = TRUE;
+        }
+
+        if (bDirty && (!wininet_log_flush_ms || GetTickCount() - dwLastFlush >= wininet_log_flush_ms)) {
+            fflush(pSink->hFile);
+            dwLastFlush = GetTickCount();
+            bDirty = FALSE;
+        }
+        SetEvent(pSink->hWritten);
+
+        /* nothing more can be queued once the log is being closed */
+        if (pSink->bStop && nPos == pSink->nQueued) {
+            break;
+        }
+    }
+    fflush(pSink->hFile);
+    return 0;
+}
+
+/*  Get the log shared by all instances logging to a file, opening it and 
+    starting its writer thread the first time. Each call must be matched by 
+    a call to wininet_logsink_release(). */
+static struct wininet_logsink *
+wininet_logsink_get(
+    const char *    a_pLogFile
+    )
+{
+    struct wininet_logsink * pSink;
+
+    wininet_lock_enter(&wininet_logsink_lock);
+    for (pSink = wininet_logsinks; pSink; pSink = pSink->pNext) {
+        if (!stricmp(pSink->pPath, a_pLogFile)) break;
+    }
+    if (pSink) {
+        ++pSink->nRefs;
+    }
+    else {
+        pSink = (struct wininet_logsink *) malloc(sizeof(struct wininet_logsink));
+        if (pSink) {
+            LONG n;
+            memset(pSink, 0, sizeof(struct wininet_logsink));
+            for (n = 0; n < WININET_LOG_RING; ++n) {
+                pSink->aQueue[n].nSeq = n;
+            }
+            pSink->pPath = strdup(a_pLogFile);
+            pSink->hFile = fopen(a_pLogFile, "a");
+            pSink->hWake = CreateEventA(NULL, FALSE, FALSE, NULL);
+            pSink->hWritten = CreateEventA(NULL, TRUE, FALSE, NULL);
+            if (pSink->pPath && pSink->hFile && pSink->hWake && pSink->hWritten) {
+                pSink->hThread = (HANDLE) _beginthreadex(NULL, 0, 
+                    wininet_logsink_thread, pSink, 0, NULL);
+            }
+            if (!pSink->hThread) {
+                if (pSink->hWritten) CloseHandle(pSink->hWritten);
+                if (pSink->hWake) CloseHandle(pSink->hWake);
+                if (pSink->hFile) fclose(pSink->hFile);
+                free(pSink->pPath);
+                free(pSink);
+                pSink = NULL;
+            }
+            else {
+                pSink->nRefs = 1;
+                pSink->pNext = wininet_logsinks;
+                wininet_logsinks = pSink;
+            }
+        }
+    }
+    wininet_lock_leave(&wininet_logsink_lock);
+
+    return pSink;
+}
+
+/*  Stop using a log. When the last instance stops using it, the queued 
+    records are written, the writer thread exits and the file is closed. */
+static void
+wininet_logsink_release(
+    struct wininet_logsink *    a_pSink
+    )
+{
+    struct wininet_logsink ** ppSink;
+
+    wininet_lock_enter(&wininet_logsink_lock);
+    if (--a_pSink->nRefs > 0) {
+        wininet_lock_leave(&wininet_logsink_lock);
+        return;
+    }
+    for (ppSink = &wininet_logsinks; *ppSink; ppSink = &(*ppSink)->pNext) {
+        if (*ppSink == a_pSink) {
+            *ppSink = a_pSink->pNext;
+            break;
+        }
+    }
+    wininet_lock_leave(&wininet_logsink_lock);
+
+    a_pSink->bStop = TRUE;
+    SetEvent(a_pSink->hWake);
+    WaitForSingleObject(a_pSink->hThread, INFINITE);
+    CloseHandle(a_pSink->hThread);
+    CloseHandle(a_pSink->hWritten);
+    CloseHandle(a_pSink->hWake);
+    fclose(a_pSink->hFile);
+    free(a_pSink->pPath);
+    free(a_pSink);
+}
+
+/*  Wait until everything queued for a log before this call has been written 
+    and flush it. Records queued by other instances meanwhile aren't waited for. */
+static void
+wininet_logsink_drain(
+    struct wininet_logsink *    a_pSink
+    )
+{
+    LONG nTarget = a_pSink->nQueued;
+
+    SetEvent(a_pSink->hWake);
+    while (a_pSink->nWritten - nTarget < 0) {
+        WaitForSingleObject(a_pSink->hWritten, INFINITE);
+    }
+    fflush(a_pSink->hFile);
+}
+
+/*  Queue a record for the writer thread. Any number of threads may queue 
+    records at once. If the queue is full then this waits for the writer, 
+    unless dropping has been enabled with wininet_setlogdrop(). A dropped 
+    record is counted and the writer notes the number dropped in the log. */
+static void
+wininet_logsink_queue(
+    struct wininet_logsink *    a_pSink,
+    struct wininet_logrec *     a_pRec
+    )
+{
+    struct wininet_logslot * pSlot;
+    LONG nPos = a_pSink->nQueued;
+    LONG nPrev;
+
+    for (;;) {
+        pSlot = &a_pSink->aQueue[nPos & (WININET_LOG_RING - 1)];
+        if (pSlot->nSeq == nPos) {
+            /* the slot is free, claim it */
+            nPrev = InterlockedCompareExchange(&a_pSink->nQueued, nPos + 1, nPos);
+            if (nPrev == nPos) break;
+            nPos = nPrev;
+        }
+        else if (pSlot->nSeq - nPos < 0) {
+            /* the slot hasn't been written yet, the queue is full */
+            if (wininet_log_drop) {
+                InterlockedIncrement(&a_pSink->nDropped);
+                wininet_logrec_free(a_pRec);
+                return;
+            }
+            SetEvent(a_pSink->hWake);
+            WaitForSingleObject(a_pSink->hWritten, INFINITE);
+            nPos = a_pSink->nQueued;
+        }
+        else {
+            nPos = a_pSink->nQueued;
+        }
+    }
+    pSlot->pRec = a_pRec;
+    InterlockedExchange(&pSlot->nSeq, nPos + 1);
+    SetEvent(a_pSink->hWake);
+}
+
+/*  queue the output of this instance for the writer thread. This is done 
+    when the record is full, at the end of each call, before the instance 
+    blocks in WinInet and when the output has been kept for WININET_LOG_HOLD 
+    ms. Records only end with a complete line, see wininet_log_reserve(). */
+static void
+wininet_log_commit(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_logrec * pRec = a_pData->pLogRec;
+
+    if (!pRec || !pRec->nLen || !a_pData->hLog) {
+        return;
+    }
+    a_pData->pLogRec = NULL;
+    wininet_logsink_queue(a_pData->hLog, pRec);
+}
+
+/*  get space for at least a_nLen bytes of output in the current record, 
+    queueing the current record if it doesn't have room. A partial line at 
+    the end of the record is moved to the new record so that the lines of 
+    instances sharing a log file are never interleaved. */
+static char *
+wininet_log_reserve(
+    struct wininet_data *   a_pData,
+    size_t                  a_nLen
+    )
+{
+    struct wininet_logrec * pRec = a_pData->pLogRec;
+    struct wininet_logrec * pNewRec;
+    size_t nCarry = 0;
+
+    if (!pRec || pRec->nSize - pRec->nLen < a_nLen) {
+        if (pRec) {
+            while (nCarry < pRec->nLen && pRec->szText[pRec->nLen - nCarry - 1] != '\n') {
+                ++nCarry;
+            }
+        }
+
+        /* a long line that keeps growing gets room to grow */
+        pNewRec = wininet_logrec_alloc(nCarry + a_nLen > WININET_LOG_RECORD 
+            ? 2 * (nCarry + a_nLen) : nCarry + a_nLen);
+        if (!pNewRec) return NULL;
+        if (pRec) {
+            memcpy(pNewRec->szText, pRec->szText + pRec->nLen - nCarry, nCarry);
+            pNewRec->nLen = nCarry;
+            pRec->nLen -= nCarry;
+            if (pRec->nLen) {
+                wininet_log_commit(a_pData);
+            }
+            else {
+                wininet_logrec_free(pRec);
+            }
+        }
+        pRec = pNewRec;
+        a_pData->pLogRec = pRec;
+    }
+    return pRec->szText + pRec->nLen;
+}
+
+static void
+wininet_log_write(
+    struct wininet_data *   a_pData,
+    const void *            a_pBuf,
+    size_t                  a_nLen
+    )
+{
+    char * pText = wininet_log_reserve(a_pData, a_nLen);
+
+    if (!pText) return;
+    memcpy(pText, a_pBuf, a_nLen);
+    a_pData->pLogRec->nLen += a_nLen;
+}
+
+static void
+wininet_log_putc(
+    struct wininet_data *   a_pData,
+    char                    a_ch
+    )
+{
+    wininet_log_write(a_pData, &a_ch, 1);
 }
 
-/* NOTE: call via the WININET_LOGx macros for checking of a_pData */
+/*  NOTE: call via the WININET_LOGx macros for checking of a_pData. The line 
+    is formatted into the instance's record, see wininet_log_commit(). Room 
+    for the whole line is reserved before any of it is written. The 
+    timestamp is only formatted when the millisecond changes. */
 static void
 wininet_log(
     struct wininet_data *   a_pData,
@@ -80,24 +804,158 @@ wininet_log(
     )
 {
     va_list args;
-    struct timeb tb;
-    struct tm * ptm;
+    FILETIME ftNow;
+    FILETIME ftLocal;
+    SYSTEMTIME st;
+    ULONGLONG nNow;
+    char *  pText;
+    int     nLen;
+    int     nPrefix;
+    size_t  nAvail;
+    char    szPrefix[64];
+
+    GetSystemTimeAsFileTime(&ftNow);
+    nNow = (((ULONGLONG) ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime) / 10000;
+    if (nNow != a_pData->nLogTime) {
+        FileTimeToLocalFileTime(&ftNow, &ftLocal);
+        FileTimeToSystemTime(&ftLocal, &st);
+        _snprintf(a_pData->szLogTime, sizeof(a_pData->szLogTime), 
+            "%02u/%02u %02u:%02u:%02u.%03u",
+            st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+        a_pData->szLogTime[sizeof(a_pData->szLogTime) - 1] = 0;
+        a_pData->nLogTime = nNow;
+    }
+    if (!a_pData->pLogRec || !a_pData->pLogRec->nLen) {
+        a_pData->nLogRecTime = nNow;
+    }
+    /* the span id ties the lines of a message to its trace */
+    if (a_pData->bInFlight && a_pData->szTraceParent[0]) {
+        nPrefix = _snprintf(szPrefix, sizeof(szPrefix), "%s %p %.16s ", 
+            a_pData->szLogTime, a_pData, a_pData->szTraceParent + 36);
+    }
+    else {
+        nPrefix = _snprintf(szPrefix, sizeof(szPrefix), "%s %p ", a_pData->szLogTime, a_pData);
+    }
+    if (nPrefix < 0) nPrefix = 0;
 
+    /* format into the record after the prefix, making room if it doesn't fit */
+    pText = wininet_log_reserve(a_pData, nPrefix + 256);
+    if (!pText) return;
+    nAvail = a_pData->pLogRec->nSize - a_pData->pLogRec->nLen - nPrefix;
     va_start(args, a_pFormat);
+    nLen = _vsnprintf(pText + nPrefix, nAvail, a_pFormat, args);
+    va_end(args);
+    if (nLen < 0 || (size_t) nLen >= nAvail) {
+        va_start(args, a_pFormat);
+        nLen = _vscprintf(a_pFormat, args);
+        va_end(args);
+        if (nLen < 0) return;
+        pText = wininet_log_reserve(a_pData, nPrefix + nLen + 2);
+        if (!pText) return;
+        va_start(args, a_pFormat);
+        nLen = _vsnprintf(pText + nPrefix, nLen + 1, a_pFormat, args);
+        va_end(args);
+        if (nLen < 0) return;
+    }
+    memcpy(pText, szPrefix, nPrefix);
+    pText[nPrefix + nLen] = '\n';
+    a_pData->pLogRec->nLen += nPrefix + nLen + 1;
 
-    ftime(&tb);
-    ptm = localtime(&tb.time);
-    fprintf(a_pData->hLog, "%02u/%02u %02u:%02u:%02u.%03u %p ",
-        ptm->tm_mon + 1, ptm->tm_mday,
-        ptm->tm_hour, ptm->tm_min, ptm->tm_sec, tb.millitm,
-        a_pData);
-    vfprintf(a_pData->hLog, a_pFormat, args);
-    fputc('\n', a_pData->hLog);
+    if (nNow - a_pData->nLogRecTime >= WININET_LOG_HOLD) {
+        wininet_log_commit(a_pData);
+    }
+}
+
+/*  hex dump layout: 5 digit offset, the bytes in hex in groups of 8, then 
+    the bytes as ASCII. Every line is the same length, the last is padded. */
+#define WININET_HEX_COLS        24
+#define WININET_HEX_ASCII       (7 + 3 + WININET_HEX_COLS*3 + 2)
+#define WININET_HEX_LINE        (WININET_HEX_ASCII + WININET_HEX_COLS + 5 + 1)
+#define WININET_HEX_BLOCK       (WININET_LOG_RECORD / WININET_HEX_LINE)
+
+/* format up to WININET_HEX_COLS bytes as a line of the hex dump */
+static void
+wininet_hex_line(
+    char *                  a_pLine,
+    const unsigned char *   a_pBuf,
+    size_t                  a_nCount
+    )
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n;
+
+    for (n = 0; n < a_nCount; ++n) {
+        unsigned char ch = a_pBuf[n];
+        a_pLine[7+n*3+0+n/8] = hex[ch >> 4];
+        a_pLine[7+n*3+1+n/8] = hex[ch & 0xF];
+        a_pLine[WININET_HEX_ASCII+n] = ch >= 32 && ch < 127 ? (char) ch : '.';
+    }
+}
+
+#ifdef WININET_HEX_SSE2
+/* convert each byte of a_vNibbles (0 to 15) to a lowercase hex digit */
+static __m128i
+wininet_hex_digits(
+    __m128i                 a_vNibbles
+    )
+{
+    __m128i vLetters = _mm_cmpgt_epi8(a_vNibbles, _mm_set1_epi8(9));
+    vLetters = _mm_and_si128(vLetters, _mm_set1_epi8('a' - '0' - 10));
+    return _mm_add_epi8(_mm_add_epi8(a_vNibbles, _mm_set1_epi8('0')), vLetters);
+}
+
+/* replace each byte of a_vBytes that isn't printable ASCII with a '.' */
+static __m128i
+wininet_hex_ascii(
+    __m128i                 a_vBytes
+    )
+{
+    /* signed compares, so bytes of 128 and above are negative */
+    __m128i vPrint = _mm_and_si128(
+        _mm_cmpgt_epi8(a_vBytes, _mm_set1_epi8(31)), 
+        _mm_cmplt_epi8(a_vBytes, _mm_set1_epi8(127)));
+    return _mm_or_si128(_mm_and_si128(vPrint, a_vBytes), 
+        _mm_andnot_si128(vPrint, _mm_set1_epi8('.')));
+}
+
+/*  format exactly WININET_HEX_COLS bytes as a line of the hex dump. The hex 
+    digit pairs are converted together and then copied into their columns. */
+static void
+wininet_hex_line_sse2(
+    char *                  a_pLine,
+    const unsigned char *   a_pBuf
+    )
+{
+    const __m128i vMask = _mm_set1_epi8(0x0F);
+    __m128i vLow  = _mm_loadu_si128((const __m128i *) a_pBuf);
+    __m128i vHigh = _mm_loadl_epi64((const __m128i *) (a_pBuf + 16));
+    __m128i vHex;
+    char    szPairs[WININET_HEX_COLS * 2];
+    char *  pOut;
+    size_t  n;
+
+    vHex = wininet_hex_digits(_mm_and_si128(_mm_srli_epi16(vLow, 4), vMask));
+    vHex = _mm_unpacklo_epi8(vHex, wininet_hex_digits(_mm_and_si128(vLow, vMask)));
+    _mm_storeu_si128((__m128i *) szPairs, vHex);
+    vHex = wininet_hex_digits(_mm_and_si128(_mm_srli_epi16(vLow, 4), vMask));
+    vHex = _mm_unpackhi_epi8(vHex, wininet_hex_digits(_mm_and_si128(vLow, vMask)));
+    _mm_storeu_si128((__m128i *) (szPairs + 16), vHex);
+    vHex = wininet_hex_digits(_mm_and_si128(_mm_srli_epi16(vHigh, 4), vMask));
+    vHex = _mm_unpacklo_epi8(vHex, wininet_hex_digits(_mm_and_si128(vHigh, vMask)));
+    _mm_storeu_si128((__m128i *) (szPairs + 32), vHex);
+
+    for (n = 0, pOut = a_pLine + 7; n < WININET_HEX_COLS; ++n, pOut += 3) {
+        if (n && n % 8 == 0) ++pOut;
+        memcpy(pOut, szPairs + n*2, 2);
+    }
 
-    fflush(a_pData->hLog); /* as it is a debug log, flush it always */
+    _mm_storeu_si128((__m128i *) (a_pLine + WININET_HEX_ASCII), wininet_hex_ascii(vLow));
+    _mm_storel_epi64((__m128i *) (a_pLine + WININET_HEX_ASCII + 16), wininet_hex_ascii(vHigh));
 }
+#endif
 
-/* hex */
+/*  hex. The lines are formatted straight into the log record, as many as 
+    fit in a record at a time. */
 static void
 wininet_log_data_hex(
     struct wininet_data *   a_pData,
@@ -105,38 +963,36 @@ wininet_log_data_hex(
     const size_t            a_nBufLen
     )
 {
-#define cols        24
-#define linelen     (7 + cols*3 + cols/3 + 2 + cols + 2) /* offset + hex + space + space + ascii + LF NUL */
-
-    char line[linelen]; 
     const unsigned char * pBuf = (const unsigned char *) a_pBuf;
-    const char hex[] = "0123456789abcdef";
-    size_t n, idx = 0;
-
-    line[sizeof(line)-1] = 0;
-    line[sizeof(line)-2] = '\n';
+    size_t  idx = 0, count, lines, n;
+    char *  line;
 
     while (idx < a_nBufLen) {
-        size_t count = idx + cols > a_nBufLen ? a_nBufLen - idx : cols;
-        memset(line, ' ', sizeof(line)-2);
-        for (n = 0; n < count; ++n) {
-            register unsigned char ch = pBuf[idx+n];
+        lines = (a_nBufLen - idx + WININET_HEX_COLS - 1) / WININET_HEX_COLS;
+        if (lines > WININET_HEX_BLOCK) lines = WININET_HEX_BLOCK;
+        line = wininet_log_reserve(a_pData, lines * WININET_HEX_LINE);
+        if (!line) return;
+        a_pData->pLogRec->nLen += lines * WININET_HEX_LINE;
+
+        for (n = 0; n < lines; ++n, idx += count, line += WININET_HEX_LINE) {
+            count = idx + WININET_HEX_COLS > a_nBufLen ? a_nBufLen - idx : WININET_HEX_COLS;
+            memset(line, ' ', WININET_HEX_LINE - 1);
+            line[WININET_HEX_LINE - 1] = '\n';
             line[0] = '0' + (char) ((idx / 10000) % 10);
             line[1] = '0' + (char) ((idx / 1000) % 10);
             line[2] = '0' + (char) ((idx / 100) % 10);
             line[3] = '0' + (char) ((idx / 10) % 10);
             line[4] = '0' + (char) ((idx / 1) % 10);
             line[5] = ':';
-            line[7+n*3+0+n/8] = hex[ch >> 4];
-            line[7+n*3+1+n/8] = hex[ch & 0xF];
-            line[7+3+cols*3+2+n] = ch >= 32 && ch < 127 ? ch : '.';
+#ifdef WININET_HEX_SSE2
+            if (count == WININET_HEX_COLS) {
+                wininet_hex_line_sse2(line, pBuf + idx);
+                continue;
+            }
+#endif
+            wininet_hex_line(line, pBuf + idx, count);
         }
-        idx += count;
-        fwrite(line, 1, sizeof(line)-1, a_pData->hLog);
     }
-
-#undef linelen
-#undef cols
 }
 
 /* wrapped text */
@@ -153,11 +1009,17 @@ wininet_log_data_text(
 
     while (pBuf < pBufEnd) {
         const size_t linelen = 120;
+        char * pText;
         for (len = idx = 0; len < linelen && pBuf + idx < pBufEnd; ++idx, ++len) {
             if (pBuf[idx] == '\n') len = 0;
         }
-        fwrite(pBuf, 1, idx, a_pData->hLog);
-        fputc('\n', a_pData->hLog);
+
+        /* each piece and its newline are written together */
+        pText = wininet_log_reserve(a_pData, idx + 1);
+        if (!pText) return;
+        memcpy(pText, pBuf, idx);
+        pText[idx] = '\n';
+        a_pData->pLogRec->nLen += idx + 1;
         pBuf += idx;
     }
 }
@@ -268,7 +1130,7 @@ wininet_indent(
         line[len] = ' ';
     }
     line[len] = 0;
-    fwrite(line, 1, len, a_pData->hLog);
+    wininet_log_write(a_pData, line, len);
 }
 
 static void
@@ -296,10 +1158,10 @@ wininet_writetag(
                     break;
                 }
             }
-            fwrite(pBuf, 1, idx, a_pData->hLog);
+            wininet_log_write(a_pData, pBuf, idx);
             pBuf += idx;
             if (pBuf < pBufEnd || newline) {
-                fputc('\n', a_pData->hLog);
+                wininet_log_putc(a_pData, '\n');
                 if (*pBuf == '\r') ++pBuf;
                 if (*pBuf == '\n') ++pBuf;
                 newline = FALSE;
@@ -312,14 +1174,14 @@ wininet_writetag(
     }
 
     if (!a_pItem->nSplitAttribs) {
-        fwrite(a_pItem->pStart, 1, a_pItem->nLen, a_pData->hLog);
+        wininet_log_write(a_pData, a_pItem->pStart, a_pItem->nLen);
         return;
     }
 
     /* find the first attribute */
     for (pCurr = pBuf; pCurr < pBufEnd && *pCurr != ' '; ++pCurr);
     for (; pCurr < pBufEnd && *pCurr == ' '; ++pCurr);
-    fwrite(pBuf, 1, pCurr - pBuf, a_pData->hLog);
+    wininet_log_write(a_pData, pBuf, pCurr - pBuf);
     
     a_nIndent += 4;
     pBuf = pCurr;
@@ -337,9 +1199,9 @@ wininet_writetag(
         if (pCurr < pBufEnd && *pCurr == '>') ++pCurr;
 
         /* output this attrib */
-        fputc('\n', a_pData->hLog);
+        wininet_log_putc(a_pData, '\n');
         wininet_indent(a_pData, a_nIndent);
-        fwrite(pBuf, 1, pCurr - pBuf, a_pData->hLog);
+        wininet_log_write(a_pData, pBuf, pCurr - pBuf);
         pBuf = pCurr;
     }
 }
@@ -378,7 +1240,7 @@ wininet_log_data_xml(
             }
         }
         if (!item.nNewLine && !skipNewLine) {
-            fputc('\n', a_pData->hLog);
+            wininet_log_putc(a_pData, '\n');
         }
     }
 }
@@ -408,27 +1270,85 @@ wininet_log_data(
         break;
     }
 
-    fputc('\n', a_pData->hLog);
-    fflush(a_pData->hLog);
+    wininet_log_putc(a_pData, '\n');
 }
 
-#define WININET_LOG0(data, format)              if (data && data->hLog) wininet_log(data, format)           
-#define WININET_LOG1(data, format, a)           if (data && data->hLog) wininet_log(data, format, a)           
-#define WININET_LOG2(data, format, a,b)         if (data && data->hLog) wininet_log(data, format, a,b)         
-#define WININET_LOG3(data, format, a,b,c)       if (data && data->hLog) wininet_log(data, format, a,b,c)       
-#define WININET_LOG4(data, format, a,b,c,d)     if (data && data->hLog) wininet_log(data, format, a,b,c,d)     
+/*  dwLogMask is 0 when there is no log, so checking a category is a single 
+    test and the arguments are only evaluated when it will be logged. data 
+    must not be NULL, the plugin callbacks are only called for an instance 
+    and the API functions check it first. */
+#define WININET_LOG_ON(data, cat)                   ((data)->dwLogMask & (cat))
+#define WININET_LOGC0(data, cat, format)            if (WININET_LOG_ON(data, cat)) wininet_log(data, format)
+#define WININET_LOGC1(data, cat, format, a)         if (WININET_LOG_ON(data, cat)) wininet_log(data, format, a)
+#define WININET_LOGC2(data, cat, format, a,b)       if (WININET_LOG_ON(data, cat)) wininet_log(data, format, a,b)
+#define WININET_LOGC3(data, cat, format, a,b,c)     if (WININET_LOG_ON(data, cat)) wininet_log(data, format, a,b,c)
+#define WININET_LOGC4(data, cat, format, a,b,c,d)   if (WININET_LOG_ON(data, cat)) wininet_log(data, format, a,b,c,d)
+
+#define WININET_LOG0(data, format)              WININET_LOGC0(data, WININET_LOG_CALLS, format)
+#define WININET_LOG1(data, format, a)           WININET_LOGC1(data, WININET_LOG_CALLS, format, a)
+#define WININET_LOG2(data, format, a,b)         WININET_LOGC2(data, WININET_LOG_CALLS, format, a,b)
+#define WININET_LOG3(data, format, a,b,c)       WININET_LOGC3(data, WININET_LOG_CALLS, format, a,b,c)
+#define WININET_LOG4(data, format, a,b,c,d)     WININET_LOGC4(data, WININET_LOG_CALLS, format, a,b,c,d)
+
+/*  wininet.dll loaded as a data file for its error messages. It is loaded 
+    once and never freed so that formatting an error doesn't go through the 
+    loader lock each time. */
+static HINSTANCE
+wininet_message_module(void)
+{
+    static HINSTANCE hMessages = NULL;
+    static volatile LONG nLoaded = 0;
+    HINSTANCE hModule;
 
-static void
-wininet_free_error_message(
-    struct wininet_data * a_pData
+    if (nLoaded) {
+        return hMessages;
+    }
+    hModule = LoadLibraryExA("wininet.dll", NULL,
+        LOAD_LIBRARY_AS_DATAFILE | DONT_RESOLVE_DLL_REFERENCES);
+    if (InterlockedCompareExchangePointer((void * volatile *) &hMessages, hModule, NULL) != NULL) {
+        /* another thread loaded it first */
+        if (hModule) FreeLibrary(hModule);
+    }
+    InterlockedExchange(&nLoaded, 1);
+    return hMessages;
+}
+
+/*  a formatted error message, see wininet_error_message(). Messages are 
+    added to the front of the list and are never changed or freed, so the 
+    list can be read without a lock. */
+struct wininet_message
+{
+    struct wininet_message * pNext;
+    DWORD                dwId;
+    char                 szMessage[1];
+};
+
+#define WININET_MAX_MESSAGES    256     /* different error messages cached */
+
+static struct wininet_message * volatile wininet_messages = NULL;
+static volatile LONG wininet_message_count = 0;
+
+static const char *
+wininet_message_find(
+    DWORD   a_dwId
     )
 {
-    if (a_pData->pszErrorMessage) {
-        LocalFree(a_pData->pszErrorMessage);
-        a_pData->pszErrorMessage = NULL;
+    struct wininet_message * pMessage;
+
+    for (pMessage = wininet_messages; pMessage; pMessage = pMessage->pNext) {
+        if (pMessage->dwId == a_dwId) {
+            return pMessage->szMessage;
+        }
     }
+    return NULL;
 }
 
+/*  Get the text for an error code. Each message is formatted once and then 
+    returned from the process wide cache so that errors during an outage 
+    don't load libraries or allocate. The result remains valid for the life 
+    of the process, except when the cache is full where the message is 
+    formatted into the instance and is valid until the next call.
+ */
 static const char *
 wininet_error_message(
     struct wininet_data *   a_pData,
@@ -438,46 +1358,104 @@ wininet_error_message(
     HINSTANCE   hModule;
     DWORD       dwResult;
     DWORD       dwFormatFlags;
+    const char * pszCached;
+    char *      pszMessage = NULL;
+    struct wininet_message * pMessage;
+    struct wininet_message * pHead;
+    BOOL        bCache;
+
+    if (a_dwErrorMsgId == WININET_ERROR_CIRCUIT_OPEN) {
+        const static char szCircuitOpen[] = "The circuit breaker for the server is open";
+        return szCircuitOpen;
+    }
+    if (a_dwErrorMsgId == WININET_ERROR_LIMIT_EXCEEDED) {
+        const static char szLimitExceeded[] = "The concurrency limit for the server was reached";
+        return szLimitExceeded;
+    }
+    if (a_dwErrorMsgId == WININET_ERROR_QUORUM_FAILED) {
+        const static char szQuorumFailed[] = "Too few fan-out endpoints responded successfully";
+        return szQuorumFailed;
+    }
+
+    pszCached = wininet_message_find(a_dwErrorMsgId);
+    if (pszCached) {
+        return pszCached;
+    }
 
-    /* free any existing error message */
-    wininet_free_error_message(a_pData);
+    /*  reserve a slot in the cache before formatting so that the cache can't
+        grow past its limit when several threads miss at once */
+    bCache = (InterlockedIncrement(&wininet_message_count) <= WININET_MAX_MESSAGES);
+    if (!bCache) {
+        InterlockedDecrement(&wininet_message_count);
+    }
 
+    /*  a cached message is allocated so that long messages fit, otherwise it 
+        is formatted into the instance */
     dwFormatFlags = 
-        FORMAT_MESSAGE_ALLOCATE_BUFFER |
         FORMAT_MESSAGE_IGNORE_INSERTS |
         FORMAT_MESSAGE_FROM_SYSTEM;
+    if (bCache) {
+        dwFormatFlags |= FORMAT_MESSAGE_ALLOCATE_BUFFER;
+    }
 
-    /* load wininet.dll for the error messages */
-    hModule = LoadLibraryExA("wininet.dll", NULL,
-        LOAD_LIBRARY_AS_DATAFILE | DONT_RESOLVE_DLL_REFERENCES);
+    /* use wininet.dll for the error messages */
+    hModule = wininet_message_module();
     if (hModule) {
         dwFormatFlags |= FORMAT_MESSAGE_FROM_HMODULE;
     }
 
-    /* format the messages */
     dwResult = FormatMessageA(
         dwFormatFlags, 
         hModule, 
         a_dwErrorMsgId, 
         MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-        (LPSTR) &a_pData->pszErrorMessage,
-        0,
+        bCache ? (LPSTR) &pszMessage : a_pData->szErrorMessage,
+        bCache ? 0 : sizeof(a_pData->szErrorMessage),
         NULL);
+    if (!bCache) {
+        pszMessage = dwResult ? a_pData->szErrorMessage : NULL;
+    }
 
-    /* free the library if we loaded it */
-    if (hModule) {
-        FreeLibrary(hModule);
+    /* a message that couldn't be formatted isn't cached so that it is 
+       tried again next time */
+    if (!dwResult || !pszMessage) {
+        const static char szUnknown[] = "(unknown)";
+        if (bCache) {
+            InterlockedDecrement(&wininet_message_count);
+        }
+        return szUnknown;
     }
 
     /* remove the CR LF from the error message */
-    if (dwResult > 2) {
-        a_pData->pszErrorMessage[dwResult-2] = 0;
-        return a_pData->pszErrorMessage;
+    while (dwResult > 0 && (pszMessage[dwResult-1] == '\r' || pszMessage[dwResult-1] == '\n')) {
+        pszMessage[--dwResult] = 0;
     }
-    else {
-        const static char szUnknown[] = "(unknown)";
-        return szUnknown;
+    if (!bCache) {
+        return pszMessage;
+    }
+
+    /* add it to the cache, if another thread added it first then both are 
+       kept and the first one found is used */
+    pMessage = (struct wininet_message *) malloc(
+        sizeof(struct wininet_message) + dwResult);
+    if (pMessage) {
+        pMessage->dwId = a_dwErrorMsgId;
+        memcpy(pMessage->szMessage, pszMessage, dwResult + 1);
+        LocalFree(pszMessage);
+        do {
+            pHead = wininet_messages;
+            pMessage->pNext = pHead;
+        }
+        while (InterlockedCompareExchangePointer(
+            (void * volatile *) &wininet_messages, pMessage, pHead) != pHead);
+        return pMessage->szMessage;
     }
+
+    InterlockedDecrement(&wininet_message_count);
+    strncpy(a_pData->szErrorMessage, pszMessage, sizeof(a_pData->szErrorMessage));
+    a_pData->szErrorMessage[sizeof(a_pData->szErrorMessage) - 1] = 0;
+    LocalFree(pszMessage);
+    return a_pData->szErrorMessage;
 }
 
 static BOOL
@@ -496,7 +1474,7 @@ wininet_flag_set_option(
     bSuccess = InternetQueryOption(a_pData->hRequest, a_dwOption, &dwBuffer, &dwBufferLength);
     if (!bSuccess) {
         DWORD dwErrorCode = GetLastError();
-        WININET_LOG3(a_pData, "flag_set_option: failed to get option %X, error %d (%s)",
+        WININET_LOGC3(a_pData, WININET_LOG_ERRORS, "flag_set_option: failed to get option %X, error %d (%s)",
             a_dwOption, dwErrorCode, wininet_error_message(a_pData, dwErrorCode));
         return bSuccess;
     }
@@ -509,7 +1487,7 @@ wininet_flag_set_option(
     bSuccess = InternetSetOption(a_pData->hRequest, a_dwOption, &dwBuffer, dwBufferLength);
     if (!bSuccess) {
         DWORD dwErrorCode = GetLastError();
-        WININET_LOG3(a_pData, "flag_set_option: failed to set option %X, error %d (%s)",
+        WININET_LOGC3(a_pData, WININET_LOG_ERRORS, "flag_set_option: failed to set option %X, error %d (%s)",
             a_dwOption, dwErrorCode, wininet_error_message(a_pData, dwErrorCode));
     }
 
@@ -525,7 +1503,7 @@ wininet_resolve_send_error(
     wininet_rseReturn nRetVal = rseFalse;
     DWORD dwResult, dwLastError;
 
-    WININET_LOG2(a_pData, "resolve_send_error: code = %d (%s)",
+    WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "resolve_send_error: code = %d (%s)",
         a_dwErrorCode, wininet_error_message(a_pData, a_dwErrorCode));
 
     dwResult = InternetErrorDlg(GetDesktopWindow(), a_pData->hRequest, a_dwErrorCode,
@@ -543,7 +1521,7 @@ wininet_resolve_send_error(
     }
 
     if (nRetVal == rseTrue) {
-        WININET_LOG0(a_pData, "resolve_send_error: result = true");
+        WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "resolve_send_error: result = true");
 
         /* Ignore errors once they have been handled or ignored once */
         switch (a_dwErrorCode) {
@@ -551,7 +1529,7 @@ wininet_resolve_send_error(
            /*   ignore invalid SSL certificate dates on this connection if the 
                 client has indicated to ignore them this time 
             */
-            WININET_LOG0(a_pData, "resolve_send_error: ignoring "
+            WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "resolve_send_error: ignoring "
                 "ERROR_INTERNET_SEC_CERT_CN_INVALID in future");
             wininet_flag_set_option(a_pData, INTERNET_OPTION_SECURITY_FLAGS, 
                 SECURITY_FLAG_IGNORE_CERT_CN_INVALID);
@@ -559,7 +1537,7 @@ wininet_resolve_send_error(
         }
     }
     else {
-        WININET_LOG2(a_pData, "resolve_send_error: result = false, last error = %lu, %s",
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "resolve_send_error: result = false, last error = %lu, %s",
             dwLastError, wininet_error_message(a_pData, dwLastError));
     }
 
@@ -574,6 +1552,7 @@ wininet_set_timeout(
     int                     a_nTimeout
     )
 {
+    struct wininet_proxy_session * pSession;
     DWORD dwTimeout;
     BOOL bSuccess;
 
@@ -583,10 +1562,13 @@ wininet_set_timeout(
     dwTimeout = a_nTimeout * 1000;
 
     WININET_LOG3(a_pData, "set_timeout: %s = %d seconds (%lu ms)", a_pszTimeout, a_nTimeout, dwTimeout);
+    for (pSession = a_pData->pProxySessions; pSession; pSession = pSession->pNext) {
+        InternetSetOption(pSession->hInternet, a_dwOption, &dwTimeout, sizeof(DWORD));
+    }
     bSuccess = InternetSetOption(a_pData->hInternet, a_dwOption, &dwTimeout, sizeof(DWORD));
     if (!bSuccess) {
         DWORD dwErrorCode = GetLastError();
-        WININET_LOG3(a_pData, "set_timeout: failed to set %s timeout, error %d (%s)", 
+        WININET_LOGC3(a_pData, WININET_LOG_ERRORS, "set_timeout: failed to set %s timeout, error %d (%s)", 
             a_pszTimeout, dwErrorCode, wininet_error_message(a_pData, dwErrorCode));
         return dwErrorCode;
     }
@@ -594,1178 +1576,6664 @@ wininet_set_timeout(
     return 0;
 }
 
-/* check to ensure that our connection hasn't been disconnected 
-    and disconnect remaining handles if necessary.
- */
-static BOOL
-wininet_have_connection(
+/* update our timeouts to the latest value */
+static void
+wininet_update_timeouts(
     struct soap *           soap,
     struct wininet_data *   a_pData
     )
 {
-    /* close the connection */
-    BOOL bCloseConnection = a_pData->bDisconnect || !a_pData->hConnection;
-    if (bCloseConnection) {
-        if (a_pData->hRequest) {
-            WININET_LOG0(a_pData, "have_connection: have request = true, close connection = true -> closing request");
-            InternetCloseHandle(a_pData->hRequest);
-            a_pData->hRequest = NULL;
-        }
+    wininet_set_timeout(a_pData, "connect", 
+        INTERNET_OPTION_CONNECT_TIMEOUT, soap->connect_timeout);
+    wininet_set_timeout(a_pData, "send",    
+        INTERNET_OPTION_SEND_TIMEOUT, soap->send_timeout);
+    wininet_set_timeout(a_pData, "recv", 
+        INTERNET_OPTION_RECEIVE_TIMEOUT, soap->recv_timeout);
+}
 
-        if (a_pData->hConnection) {
-            WININET_LOG0(a_pData, "have_connection: have connection = true, close connection = true -> closing connection");
-            InternetCloseHandle(a_pData->hConnection);
-            a_pData->hConnection = NULL;
-        }
+/* credentials that were accepted by a server or proxy */
+struct wininet_auth
+{
+    struct wininet_auth *   pNext;
+    char *                  pHost;          /* server host, or the proxy for WININET_AUTH_PROXY */
+    INTERNET_PORT           nPort;          /* server port, 0 for WININET_AUTH_PROXY */
+    DWORD                   dwTarget;       /* WININET_AUTH_SERVER or WININET_AUTH_PROXY */
+    char *                  pScheme;        /* authentication scheme, e.g. Basic */
+    char *                  pRealm;         /* realm from the challenge, empty if there was none */
+    char *                  pPath;          /* directory of the server URL path the credentials were accepted for */
+    char *                  pUserName;
+    char *                  pPassword;
+};
 
-        soap->socket = SOAP_INVALID_SOCKET;
-        a_pData->bDisconnect = FALSE;
-    }
+#define WININET_AUTH_SERVER     0x1     /* 401 authentication */
+#define WININET_AUTH_PROXY      0x2     /* 407 proxy authentication */
 
-    /* are we still connected? */
-    if (!a_pData->hConnection) {
-        WININET_LOG0(a_pData, "have_connection: false");
-        return FALSE;
-    }
+static struct wininet_lock      wininet_auth_lock;
+static struct wininet_auth *    wininet_auth_list;
 
-    return TRUE;
+static void
+wininet_free_secret(
+    char *  a_pSecret
+    )
+{
+    if (a_pSecret) {
+        SecureZeroMemory(a_pSecret, strlen(a_pSecret));
+        free(a_pSecret);
+    }
 }
 
-static void CALLBACK
-wininet_callback(
-    HINTERNET   hInternet,
-    DWORD_PTR   dwContext,
-    DWORD       dwInternetStatus,
-    LPVOID      lpvStatusInformation,
-    DWORD       dwStatusInformationLength
+static void
+wininet_auth_free(
+    struct wininet_auth *   a_pAuth
     )
 {
-    struct soap * soap = (struct soap *) dwContext;
-    char buf[500] = { 0 };
-    const DWORD * pdw = (const DWORD *) lpvStatusInformation; /* sometimes */
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
+    free(a_pAuth->pHost);
+    free(a_pAuth->pScheme);
+    free(a_pAuth->pRealm);
+    free(a_pAuth->pPath);
+    wininet_free_secret(a_pAuth->pUserName);
+    wininet_free_secret(a_pAuth->pPassword);
+    free(a_pAuth);
+}
 
-    UNUSED_ARG(hInternet);
-    UNUSED_ARG(dwStatusInformationLength);
+/* find the entry for a realm in the cache, the lock must be held */
+static struct wininet_auth **
+wininet_auth_find(
+    const char *    a_pHost,
+    INTERNET_PORT   a_nPort,
+    DWORD           a_dwTarget,
+    const char *    a_pRealm
+    )
+{
+    struct wininet_auth ** ppAuth;
 
-    switch (dwInternetStatus) {
-    case INTERNET_STATUS_RESOLVING_NAME:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_RESOLVING_NAME: %s", 
-            (const char *) lpvStatusInformation);
-        break;
-    case INTERNET_STATUS_NAME_RESOLVED:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_NAME_RESOLVED: %s", 
-            (const char *) lpvStatusInformation);
-        break;
-    case INTERNET_STATUS_CONNECTING_TO_SERVER: 
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_CONNECTING_TO_SERVER");
-        break;
-    case INTERNET_STATUS_CONNECTED_TO_SERVER:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_CONNECTED_TO_SERVER");
-        break;
-    case INTERNET_STATUS_SENDING_REQUEST:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_SENDING_REQUEST");
-        break;
-    case INTERNET_STATUS_REQUEST_SENT:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_REQUEST_SENT, bytes sent = %lu", *pdw);
-        break;
-    case INTERNET_STATUS_RECEIVING_RESPONSE:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_RECEIVING_RESPONSE");
-        break;
-    case INTERNET_STATUS_RESPONSE_RECEIVED:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_RESPONSE_RECEIVED, bytes received = %lu", *pdw);
-        break;
-    case INTERNET_STATUS_CTL_RESPONSE_RECEIVED:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_CTL_RESPONSE_RECEIVED");
-        break;
-    case INTERNET_STATUS_PREFETCH:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_PREFETCH");
-        break;
-    case INTERNET_STATUS_CLOSING_CONNECTION:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_CLOSING_CONNECTION");
-        break;
-    case INTERNET_STATUS_CONNECTION_CLOSED:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_CONNECTION_CLOSED");
-        if (pData->hConnection) {
-            /*  the connection has been closed, so we close the handle here.
-                however only mark this for disconnection otherwise errors 
-                will occur when reading the data from the handle. In every 
-                function that uses the connection, first check to  see if 
-                it has been disconnected.
-             */
-            WININET_LOG0(pData, "callback: marking connection for disconnect");
-            pData->bDisconnect = TRUE;
+    for (ppAuth = &wininet_auth_list; *ppAuth; ppAuth = &(*ppAuth)->pNext) {
+        if ((*ppAuth)->nPort == a_nPort 
+            && (*ppAuth)->dwTarget == a_dwTarget
+            && !stricmp((*ppAuth)->pHost, a_pHost)
+            && !strcmp((*ppAuth)->pRealm, a_pRealm))
+        {
+            break;
         }
-        break;
-    case INTERNET_STATUS_HANDLE_CREATED:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_HANDLE_CREATED");
-        break;
-    case INTERNET_STATUS_HANDLE_CLOSING:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_HANDLE_CLOSING");
-        break;
-#ifdef INTERNET_STATUS_DETECTING_PROXY
-    case INTERNET_STATUS_DETECTING_PROXY:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_DETECTING_PROXY");
-        break;
-#endif
-    case INTERNET_STATUS_REQUEST_COMPLETE:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_REQUEST_COMPLETE");
-        break;
-    case INTERNET_STATUS_REDIRECT:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_REDIRECT, new url = %s", 
-            (const char *) lpvStatusInformation);
-        break;
-    case INTERNET_STATUS_INTERMEDIATE_RESPONSE:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_INTERMEDIATE_RESPONSE");
-        break;
-#ifdef INTERNET_STATUS_USER_INPUT_REQUIRED
-    case INTERNET_STATUS_USER_INPUT_REQUIRED:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_USER_INPUT_REQUIRED");
-        break;
-#endif
-    case INTERNET_STATUS_STATE_CHANGE:
-        if (*pdw & INTERNET_STATE_CONNECTED)            strcat(buf, ", CONNECTED");
-        if (*pdw & INTERNET_STATE_DISCONNECTED)         strcat(buf, ", DISCONNECTED");
-        if (*pdw & INTERNET_STATE_DISCONNECTED_BY_USER) strcat(buf, ", DISCONNECTED_BY_USER");
-        if (*pdw & INTERNET_STATE_IDLE)                 strcat(buf, ", IDLE");
-        if (*pdw & INTERNET_STATE_BUSY)                 strcat(buf, ", BUSY");
-        if (*pdw & INTERNET_STATUS_USER_INPUT_REQUIRED) strcat(buf, ", USER_INPUT_REQUIRED");
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_STATE_CHANGE: %s", &buf[2]);
-        break;
-#ifdef INTERNET_STATUS_COOKIE_SENT
-    case INTERNET_STATUS_COOKIE_SENT:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_COOKIE_SENT: count = %lu", *pdw);
-        break;
-#endif
-#ifdef INTERNET_STATUS_COOKIE_RECEIVED
-    case INTERNET_STATUS_COOKIE_RECEIVED:
-        WININET_LOG1(pData, "callback: INTERNET_STATUS_COOKIE_RECEIVED: count = %lu", *pdw);
-        break;
-#endif
-#ifdef INTERNET_STATUS_PRIVACY_IMPACTED
-    case INTERNET_STATUS_PRIVACY_IMPACTED:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_PRIVACY_IMPACTED");
-        break;
-#endif
-#ifdef INTERNET_STATUS_P3P_HEADER
-    case INTERNET_STATUS_P3P_HEADER:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_P3P_HEADER");
-        break;
-#endif
-#ifdef INTERNET_STATUS_P3P_POLICYREF
-    case INTERNET_STATUS_P3P_POLICYREF:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_P3P_POLICYREF");
-        break;
-#endif
-#ifdef INTERNET_STATUS_COOKIE_HISTORY
-    case INTERNET_STATUS_COOKIE_HISTORY:
-        WININET_LOG0(pData, "callback: INTERNET_STATUS_COOKIE_HISTORY");
-        break;
-#endif
-    default:
-        WININET_LOG1(pData, "callback: dwInternetStatus %d is unknown", 
-            dwInternetStatus);
     }
+    return ppAuth;
 }
 
-/* gsoap documentation:
-    Called by client proxy multiple times, to close a socket connection before
-    a new socket connection is established and at the end of communications 
-    when the SOAP_IO_KEEPALIVE flag is not set and soap.keep_alive = 0 
-    (indicating that the other party supports keep alive). Should return 
-    SOAP_OK, or a gSOAP error code. Built-in gSOAP function: tcp_disconnect
- */
-static int 
-wininet_fclose(struct soap * soap)
+/*  Find the entry to use for a request before its realm is known. Server 
+    credentials are used for the URL paths below the directory they were 
+    accepted for, the entry for the longest directory wins. The path is NULL 
+    for a proxy. The lock must be held. */
+static struct wininet_auth *
+wininet_auth_match(
+    const char *    a_pHost,
+    INTERNET_PORT   a_nPort,
+    DWORD           a_dwTarget,
+    const char *    a_pPath
+    )
 {
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
-
-    soap->error = SOAP_OK;
-
-    WININET_LOG0(pData, "fclose: setting disconnect to true");
-
-    /* force a disconnect by setting the disconnect flag to TRUE */
-    pData->bDisconnect = TRUE;
-    wininet_have_connection(soap, pData);
-
-    return SOAP_OK;
+    struct wininet_auth * pAuth;
+    struct wininet_auth * pBest = NULL;
+    size_t nLen;
+    size_t nBest = 0;
+
+    for (pAuth = wininet_auth_list; pAuth; pAuth = pAuth->pNext) {
+        if (pAuth->nPort != a_nPort 
+            || pAuth->dwTarget != a_dwTarget
+            || stricmp(pAuth->pHost, a_pHost) != 0)
+        {
+            continue;
+        }
+        nLen = strlen(pAuth->pPath);
+        if (a_pPath && strncmp(a_pPath, pAuth->pPath, nLen) != 0) {
+            continue;
+        }
+        if (!pBest || nLen > nBest) {
+            pBest = pAuth;
+            nBest = nLen;
+        }
+    }
+    return pBest;
 }
 
-/* copy the private data structure */
-static int  
-wininet_copy(
-    struct soap *           soap, 
-    struct soap_plugin *    a_pDst, 
-    struct soap_plugin *    a_pSrc
+/* get the realm of a challenge, or an empty string if there is none. The result must be freed */
+static char *
+wininet_auth_realm(
+    const char *    a_pChallenge
     )
 {
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
+    const char * pRealm = a_pChallenge ? strstr(a_pChallenge, "realm=\"") : NULL;
+    char * pResult;
+    size_t nLen = 0;
 
-    UNUSED_ARG(a_pDst);
-    UNUSED_ARG(a_pSrc);
+    if (pRealm) {
+        pRealm += 7;
+        for (nLen = 0; pRealm[nLen] && pRealm[nLen] != '"'; ++nLen);
+    }
+    pResult = (char *) malloc(nLen + 1);
+    if (pResult) {
+        if (nLen) memcpy(pResult, pRealm, nLen);
+        pResult[nLen] = 0;
+    }
+    return pResult;
+}
 
-    WININET_LOG0(pData, "copy: not supported");
-    _ASSERTE(!"wininet doesn't support copy");
+/*  Determine the key for the credentials of a target. Server credentials 
+    are cached per host, port and realm, proxy credentials per proxy and 
+    realm so that they are shared by all servers that are reached through 
+    it. Returns FALSE if there is no proxy for the session. */
+static BOOL
+wininet_auth_key(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget,
+    char *                  a_pszHost,
+    size_t                  a_uiHostLen,
+    INTERNET_PORT *         a_pnPort
+    )
+{
+    union {
+        INTERNET_PROXY_INFO info;
+        char                buf[1024];
+    } proxy;
+    DWORD dwLen = sizeof(proxy);
+
+    if (a_dwTarget == WININET_AUTH_SERVER) {
+        if (!a_pData->pHost) return FALSE;
+        strncpy(a_pszHost, a_pData->pHost, a_uiHostLen);
+        a_pszHost[a_uiHostLen - 1] = 0;
+        *a_pnPort = a_pData->nPort;
+        return TRUE;
+    }
 
-    return SOAP_FATAL_ERROR;
+    /* the proxy list for the session, see wininet_proxy_session() */
+    if (!a_pData->hSession
+        || !InternetQueryOption(a_pData->hSession, INTERNET_OPTION_PROXY, &proxy, &dwLen)
+        || proxy.info.dwAccessType != INTERNET_OPEN_TYPE_PROXY 
+        || !proxy.info.lpszProxy || !*proxy.info.lpszProxy) 
+    {
+        return FALSE;
+    }
+    strncpy(a_pszHost, (const char *) proxy.info.lpszProxy, a_uiHostLen);
+    a_pszHost[a_uiHostLen - 1] = 0;
+    *a_pnPort = 0;
+    return TRUE;
 }
 
-/* deallocate of our private structure */
-static void 
-wininet_delete(
-    struct soap *           soap, 
-    struct soap_plugin *    a_pPluginData
+/* remove credentials that have been rejected */
+static void
+wininet_auth_remove(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget
     )
 {
-    struct wininet_data * pData = 
-        (struct wininet_data *) a_pPluginData->data;
-
-    UNUSED_ARG(soap);
+    struct wininet_auth ** ppAuth;
+    struct wininet_auth * pAuth;
+    char szHost[1024];
+    INTERNET_PORT nPort;
+    const char * pRealm = a_pData->apAuthRealm[a_dwTarget - 1];
 
-    WININET_LOG0(pData, "delete: delete private data");
+    if (!pRealm || !wininet_auth_key(a_pData, a_dwTarget, szHost, sizeof(szHost), &nPort)) {
+        return;
+    }
 
-    /* force a disconnect of any existing connection */
-    pData->bDisconnect = TRUE;
-    wininet_have_connection(soap, pData);
-    if (pData->hInternet) {
-        InternetCloseHandle(pData->hInternet);
+    wininet_lock_enter(&wininet_auth_lock);
+    ppAuth = wininet_auth_find(szHost, nPort, a_dwTarget, pRealm);
+    pAuth = *ppAuth;
+    if (pAuth) {
+        *ppAuth = pAuth->pNext;
+        wininet_auth_free(pAuth);
     }
+    wininet_lock_leave(&wininet_auth_lock);
+}
 
-    /* free our data */
-    wininet_free_error_message(pData);
-    if (pData->pBuffer) {
-        free(pData->pBuffer);
-    }
-    if (pData->pUrlPath) {
-        free(pData->pUrlPath);
-    }
-    if (pData->pUserAgent) {
-        free(pData->pUserAgent);
+/* retrieve a string option from a handle, the result must be freed */
+static char *
+wininet_query_string_option(
+    HINTERNET   a_hInternet,
+    DWORD       a_dwOption
+    )
+{
+    char *  pValue;
+    DWORD   dwLen = 256;
+
+    pValue = (char *) malloc(dwLen);
+    while (pValue && !InternetQueryOption(a_hInternet, a_dwOption, pValue, &dwLen)) {
+        free(pValue);
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            return NULL;
+        }
+        pValue = (char *) malloc(++dwLen);
     }
-    if (pData->hLog) {
-        fclose(pData->hLog);
+    if (pValue && !*pValue) {
+        free(pValue);
+        pValue = NULL;
     }
-    free(pData);
+    return pValue;
 }
 
-/* gsoap documentation:
-    Called from a client proxy to open a connection to a Web Service located 
-    at endpoint. Input parameters host and port are micro-parsed from endpoint.
-    Should return a valid file descriptor, or SOAP_INVALID_SOCKET and 
-    soap->error set to an error code. Built-in gSOAP function: tcp_connect
-*/
-static SOAP_SOCKET  
-wininet_fopen(
-    struct soap *   soap, 
-    const char *    a_pszEndpoint, 
-    const char *    a_pszHost, 
-    int             a_nPort
+/*  Store the credentials that were used to successfully answer a challenge. 
+    a_pChallenge is the WWW-Authenticate or Proxy-Authenticate header value 
+    which is used to determine the scheme and realm.
+ */
+static void
+wininet_auth_store(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget,
+    const char *            a_pChallenge
     )
 {
-    URL_COMPONENTSA urlComponents;
-    char            szHost[MAX_PATH];
-    char            szUrlPath[MAX_PATH];
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
+    struct wininet_auth ** ppAuth;
+    struct wininet_auth * pAuth;
+    const char * pPath;
+    size_t nLen;
+    char szHost[1024];
+    INTERNET_PORT nPort;
+    BOOL bProxy = (a_dwTarget == WININET_AUTH_PROXY);
+
+    if (!wininet_auth_key(a_pData, a_dwTarget, szHost, sizeof(szHost), &nPort)) {
+        return;
+    }
 
-    soap->error = SOAP_OK;
+    pAuth = (struct wininet_auth *) malloc(sizeof(struct wininet_auth));
+    if (!pAuth) return;
+    memset(pAuth, 0, sizeof(struct wininet_auth));
+
+    pAuth->pUserName = wininet_query_string_option(a_pData->hRequest, 
+        bProxy ? INTERNET_OPTION_PROXY_USERNAME : INTERNET_OPTION_USERNAME);
+    pAuth->pPassword = wininet_query_string_option(a_pData->hRequest, 
+        bProxy ? INTERNET_OPTION_PROXY_PASSWORD : INTERNET_OPTION_PASSWORD);
+    if (!pAuth->pUserName) {
+        /* e.g. integrated authentication, nothing that we can cache */
+        WININET_LOG0(a_pData, "auth_store: no credentials available");
+        wininet_auth_free(pAuth);
+        return;
+    }
 
-    /* we parse the URL ourselves so we don't use these parameters */
-    UNUSED_ARG(a_pszHost);
-    UNUSED_ARG(a_nPort);
+    /* the scheme is the first token of the challenge */
+    a_pChallenge = a_pChallenge ? a_pChallenge : "";
+    for (nLen = 0; a_pChallenge[nLen] && a_pChallenge[nLen] != ' '; ++nLen);
+    pAuth->pScheme = (char *) malloc(nLen + 1);
+    if (pAuth->pScheme) {
+        memcpy(pAuth->pScheme, a_pChallenge, nLen);
+        pAuth->pScheme[nLen] = 0;
+    }
 
-    WININET_LOG1(pData, "fopen: endpoint = '%s'", a_pszEndpoint);
+    pAuth->pRealm = wininet_auth_realm(a_pChallenge);
 
-    if (!pData->hInternet) {
-        WININET_LOG0(pData, "fopen: not initialized");
-        soap->error = SOAP_ERR;
-        return SOAP_INVALID_SOCKET;
-    }
-    if (pData->hRequest) {
-        WININET_LOG0(pData, "fopen: closing existing request handle");
-        InternetCloseHandle(pData->hRequest);
-        pData->hRequest = NULL;
+    /*  server credentials are used for the directory of the URL path and 
+        below it, e.g. /app/ for /app/service?wsdl */
+    pPath = "";
+    nLen = 0;
+    if (!bProxy && a_pData->pUrlPath) {
+        pPath = a_pData->pUrlPath;
+        nLen = strcspn(pPath, "?#");
+        while (nLen > 0 && pPath[nLen - 1] != '/') --nLen;
     }
-    if (pData->hConnection) {
-        WININET_LOG0(pData, "fopen: closing existing connection handle");
-        InternetCloseHandle(pData->hConnection);
-        pData->hConnection = NULL;
+    pAuth->pPath = (char *) malloc(nLen + 1);
+    if (pAuth->pPath) {
+        if (nLen) memcpy(pAuth->pPath, pPath, nLen);
+        pAuth->pPath[nLen] = 0;
     }
 
-    /* parse out the url path */
-    memset(&urlComponents, 0, sizeof(urlComponents));
-    urlComponents.dwStructSize = sizeof(urlComponents);
-    urlComponents.lpszHostName      = szHost;
-    urlComponents.dwHostNameLength  = MAX_PATH;
-    urlComponents.lpszUrlPath       = szUrlPath;
-    urlComponents.dwUrlPathLength   = MAX_PATH;
-    if (!InternetCrackUrlA(a_pszEndpoint, 0, 0, &urlComponents)) {
-        soap->error = GetLastError();
-        WININET_LOG2(pData, 
-            "fopen: error %d (%s) in InternetCrackUrl", 
-            soap->error, wininet_error_message(pData, soap->error));
-        return SOAP_INVALID_SOCKET;
+    pAuth->pHost = strdup(szHost);
+    pAuth->nPort = nPort;
+    pAuth->dwTarget = a_dwTarget;
+    if (!pAuth->pHost || !pAuth->pScheme || !pAuth->pRealm || !pAuth->pPath || !pAuth->pPassword) {
+        wininet_auth_free(pAuth);
+        return;
     }
 
-    /* keep the URL path for when we create a request */
-    if (pData->pUrlPath) {
-        free(pData->pUrlPath);
+    WININET_LOG4(a_pData, "auth_store: caching %s credentials for %s, realm '%s' (%s)", 
+        pAuth->pScheme, pAuth->pHost, pAuth->pRealm, bProxy ? "proxy" : "server");
+
+    /*  replace any existing entry for the realm, which is then used for the 
+        directory that both paths are below */
+    wininet_lock_enter(&wininet_auth_lock);
+    ppAuth = wininet_auth_find(pAuth->pHost, pAuth->nPort, a_dwTarget, pAuth->pRealm);
+    if (*ppAuth) {
+        struct wininet_auth * pOld = *ppAuth;
+        for (nLen = 0; pOld->pPath[nLen] && pOld->pPath[nLen] == pAuth->pPath[nLen]; ++nLen);
+        while (nLen > 0 && pAuth->pPath[nLen - 1] != '/') --nLen;
+        pAuth->pPath[nLen] = 0;
+        *ppAuth = pOld->pNext;
+        wininet_auth_free(pOld);
     }
-    pData->pUrlPath = strdup(szUrlPath);
+    pAuth->pNext = wininet_auth_list;
+    wininet_auth_list = pAuth;
+    wininet_lock_leave(&wininet_auth_lock);
+}
 
-    /* add or remove the HTTPS flag as necessary */
-    if (urlComponents.nScheme == INTERNET_SCHEME_HTTPS) {
-        pData->dwRequestFlags |= INTERNET_FLAG_SECURE;
-    }
-    else {
-        pData->dwRequestFlags &= ~INTERNET_FLAG_SECURE;
+/* encode a string as base64, the result must be freed */
+static char *
+wininet_base64(
+    const char *    a_pIn,
+    size_t          a_nLen
+    )
+{
+    static const char szBase64[] = 
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char * pIn = (const unsigned char *) a_pIn;
+    char * pOut, * pResult;
+    size_t n;
+
+    pResult = pOut = (char *) malloc(((a_nLen + 2) / 3) * 4 + 1);
+    if (!pResult) return NULL;
+
+    for (n = 0; n + 2 < a_nLen; n += 3) {
+        *pOut++ = szBase64[pIn[n] >> 2];
+        *pOut++ = szBase64[((pIn[n] & 0x03) << 4) | (pIn[n+1] >> 4)];
+        *pOut++ = szBase64[((pIn[n+1] & 0x0F) << 2) | (pIn[n+2] >> 6)];
+        *pOut++ = szBase64[pIn[n+2] & 0x3F];
     }
-
-    /* update our timeouts to the latest value */
-    wininet_set_timeout(pData, "connect", 
-        INTERNET_OPTION_CONNECT_TIMEOUT, soap->connect_timeout);
-    wininet_set_timeout(pData, "send",    
-        INTERNET_OPTION_SEND_TIMEOUT, soap->send_timeout);
-    wininet_set_timeout(pData, "recv", 
-        INTERNET_OPTION_RECEIVE_TIMEOUT, soap->recv_timeout);
-
-    /* connect to the target url, if we haven't connected yet 
-       or if it was dropped */
-    pData->hConnection = InternetConnectA(pData->hInternet, 
-        szHost, urlComponents.nPort, "", "", INTERNET_SERVICE_HTTP, 
-        0, (DWORD_PTR) soap);
-    if (!pData->hConnection) {
-        soap->error = GetLastError();
-        WININET_LOG2(pData, "fopen: error %d (%s) in InternetConnect", 
-            soap->error, wininet_error_message(pData, soap->error));
-        return SOAP_INVALID_SOCKET;
+    if (n < a_nLen) {
+        *pOut++ = szBase64[pIn[n] >> 2];
+        if (n + 1 < a_nLen) {
+            *pOut++ = szBase64[((pIn[n] & 0x03) << 4) | (pIn[n+1] >> 4)];
+            *pOut++ = szBase64[(pIn[n+1] & 0x0F) << 2];
+        }
+        else {
+            *pOut++ = szBase64[(pIn[n] & 0x03) << 4];
+            *pOut++ = '=';
+        }
+        *pOut++ = '=';
     }
-
-    /* return 0 as our "connected" socket type */
-    WININET_LOG0(pData, "fopen: connected");
-    return 0;
+    *pOut = 0;
+    return pResult;
 }
 
-static int 
-wininet_create_request(
-    struct soap *   soap
+/*  Supply cached credentials for the current request. The credentials are 
+    set on the request handle so that WinInet can answer a challenge without 
+    asking the user. For basic authentication to a server over https the 
+    value of an Authorization header is returned so that the challenge round 
+    trip is avoided completely, it must be freed with wininet_free_secret(). 
+    Basic credentials are never sent preemptively over http, or to a proxy 
+    as the header would be sent through the tunnel to the server.
+ */
+static char *
+wininet_auth_apply(
+    struct wininet_data *   a_pData
     )
 {
-    DWORD dwFlags;
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
-
-    /*  Set up the flags for this connection */
-    dwFlags = INTERNET_FLAG_PRAGMA_NOCACHE | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_RELOAD;
-    dwFlags |= pData->dwRequestFlags;
-    if (soap->imode & SOAP_IO_KEEPALIVE || soap->omode & SOAP_IO_KEEPALIVE) {
-        dwFlags |= INTERNET_FLAG_KEEP_CONNECTION;
+    struct wininet_auth * pAuth;
+    DWORD   dwTarget;
+    BOOL    bProxy;
+    char *  pCredentials;
+    char *  pEncoded;
+    char *  pAuthorization = NULL;
+    size_t  nLen;
+    char    szHost[1024];
+    INTERNET_PORT nPort;
+
+    a_pData->dwAuthSent = 0;
+    a_pData->dwAuthBasic = 0;
+    a_pData->dwAuthRetried = 0;
+    a_pData->dwAuthChallenged = 0;
+    if (!a_pData->bAuthCache) {
+        return NULL;
     }
 
-    if (pData->hLog) {
-        char buf[1000] = { 0 };
+    for (dwTarget = WININET_AUTH_SERVER; dwTarget <= WININET_AUTH_PROXY; ++dwTarget) {
+        char ** ppRealm = &a_pData->apAuthRealm[dwTarget - 1];
 
-#define LOGFLAG(flag) if (dwFlags & INTERNET_FLAG_ ## flag) strcat(buf, ", " #flag);
-        LOGFLAG(RELOAD)
-        LOGFLAG(RAW_DATA)
-        LOGFLAG(EXISTING_CONNECT)
-        LOGFLAG(ASYNC)
-        LOGFLAG(PASSIVE)
-        LOGFLAG(NO_CACHE_WRITE)
-        LOGFLAG(MAKE_PERSISTENT)
-        LOGFLAG(FROM_CACHE)
-        LOGFLAG(SECURE)
-        LOGFLAG(KEEP_CONNECTION)
-        LOGFLAG(NO_AUTO_REDIRECT)
-        LOGFLAG(READ_PREFETCH)
-        LOGFLAG(NO_COOKIES)
-        LOGFLAG(NO_AUTH)
-        LOGFLAG(CACHE_IF_NET_FAIL)
-        LOGFLAG(IGNORE_CERT_CN_INVALID)
-        LOGFLAG(IGNORE_CERT_DATE_INVALID)
-        LOGFLAG(IGNORE_REDIRECT_TO_HTTPS)
-        LOGFLAG(IGNORE_REDIRECT_TO_HTTP)
-        LOGFLAG(RESYNCHRONIZE)
-        LOGFLAG(HYPERLINK)
-        LOGFLAG(NO_UI)
-        LOGFLAG(PRAGMA_NOCACHE)
-        LOGFLAG(CACHE_ASYNC)
-        LOGFLAG(FORMS_SUBMIT)
-        LOGFLAG(NEED_FILE)
-        LOGFLAG(RESTRICTED_ZONE)
-        LOGFLAG(TRANSFER_BINARY)
-        LOGFLAG(TRANSFER_ASCII)
-        LOGFLAG(FWD_BACK)
-        /*LOGFLAG(INTERNET_FLAG_BGUPDATE)*/
-#undef LOGFLAG
+        if (*ppRealm) {
+            free(*ppRealm);
+            *ppRealm = NULL;
+        }
+        if (!wininet_auth_key(a_pData, dwTarget, szHost, sizeof(szHost), &nPort)) {
+            continue;
+        }
 
-        wininet_log(pData, "create_request: using INTERNET_FLAG_xxx = %s", &buf[2]);
-    }
+        bProxy = (dwTarget == WININET_AUTH_PROXY);
+        wininet_lock_enter(&wininet_auth_lock);
+        pAuth = wininet_auth_match(szHost, nPort, dwTarget, 
+            bProxy ? NULL : (a_pData->pUrlPath ? a_pData->pUrlPath : "/"));
+        if (pAuth) {
+            *ppRealm = strdup(pAuth->pRealm);
+        }
+        if (!pAuth || !*ppRealm) {
+            wininet_lock_leave(&wininet_auth_lock);
+            continue;
+        }
 
-    /*  Note that although we specify HTTP/1.1 for the connection here, the 
-        actual connection may be HTTP/1.0 depending on the settings in the 
-        control panel. See the "Internet Options", "HTTP 1.1 settings".
-     */
-    pData->hRequest = HttpOpenRequestA(
-        pData->hConnection, "POST", pData->pUrlPath, "HTTP/1.1", NULL, NULL, 
-        dwFlags, (DWORD_PTR) soap);
-    if (!pData->hRequest) {
-        soap->error = GetLastError();
-        WININET_LOG2(pData, "create_request: error %d (%s) in HttpOpenRequest", 
-            soap->error, wininet_error_message(pData, soap->error));
-        return SOAP_ERR;
+        InternetSetOption(a_pData->hRequest, 
+            bProxy ? INTERNET_OPTION_PROXY_USERNAME : INTERNET_OPTION_USERNAME,
+            pAuth->pUserName, (DWORD) strlen(pAuth->pUserName) + 1);
+        InternetSetOption(a_pData->hRequest, 
+            bProxy ? INTERNET_OPTION_PROXY_PASSWORD : INTERNET_OPTION_PASSWORD,
+            pAuth->pPassword, (DWORD) strlen(pAuth->pPassword) + 1);
+        a_pData->dwAuthSent |= dwTarget;
+
+        WININET_LOG4(a_pData, "auth_apply: using cached %s credentials for %s, realm '%s' (%s)", 
+            pAuth->pScheme, pAuth->pHost, pAuth->pRealm, bProxy ? "proxy" : "server");
+
+        if (bProxy || stricmp(pAuth->pScheme, "Basic") != 0
+            || !(a_pData->dwRequestFlags & INTERNET_FLAG_SECURE)) 
+        {
+            wininet_lock_leave(&wininet_auth_lock);
+            continue;
+        }
+
+        /* user:password */
+        nLen = strlen(pAuth->pUserName) + 1 + strlen(pAuth->pPassword);
+        pCredentials = (char *) malloc(nLen + 1);
+        if (pCredentials) {
+            _snprintf(pCredentials, nLen + 1, "%s:%s", pAuth->pUserName, pAuth->pPassword);
+        }
+        wininet_lock_leave(&wininet_auth_lock);
+        if (!pCredentials) continue;
+
+        pEncoded = wininet_base64(pCredentials, nLen);
+        wininet_free_secret(pCredentials);
+        if (!pEncoded) continue;
+
+        nLen = strlen(pEncoded) + 7;
+        pAuthorization = (char *) malloc(nLen);
+        if (pAuthorization) {
+            _snprintf(pAuthorization, nLen, "Basic %s", pEncoded);
+            a_pData->dwAuthBasic |= dwTarget;
+        }
+        wininet_free_secret(pEncoded);
     }
 
-    WININET_LOG0(pData, "create_request: success");
-    return SOAP_OK;
+    if (a_pData->dwAuthSent) {
+        ++a_pData->stats.nAuthPreemptive;
+    }
+    return pAuthorization;
 }
 
-/* gsoap documentation:
-    Used by clients to check if the server is still responsive. 
-    Built-in gSOAP function: soap_poll.
-*/
-static int 
-wininet_fpoll(
-    struct soap * soap
+/*  Supply the cached credentials for a realm of the current server or proxy
+    to the request. Returns FALSE if there are none. */
+static BOOL
+wininet_auth_set_realm(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget,
+    const char *            a_pRealm
     )
 {
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
-
-    WININET_LOG0(pData, "fpoll");
+    struct wininet_auth * pAuth;
+    char *  pRealm;
+    char    szHost[1024];
+    INTERNET_PORT nPort;
+    BOOL    bProxy = (a_dwTarget == WININET_AUTH_PROXY);
 
-    /* ensure that our connection hasn't been disconnected */
-    if (!wininet_have_connection(soap, pData)) {
-        return SOAP_EOF;
+    if (!wininet_auth_key(a_pData, a_dwTarget, szHost, sizeof(szHost), &nPort)) {
+        return FALSE;
+    }
+    pRealm = strdup(a_pRealm);
+    if (!pRealm) {
+        return FALSE;
     }
 
-    return SOAP_OK; 
+    wininet_lock_enter(&wininet_auth_lock);
+    pAuth = *wininet_auth_find(szHost, nPort, a_dwTarget, pRealm);
+    if (!pAuth) {
+        wininet_lock_leave(&wininet_auth_lock);
+        free(pRealm);
+        return FALSE;
+    }
+    InternetSetOption(a_pData->hRequest, 
+        bProxy ? INTERNET_OPTION_PROXY_USERNAME : INTERNET_OPTION_USERNAME,
+        pAuth->pUserName, (DWORD) strlen(pAuth->pUserName) + 1);
+    InternetSetOption(a_pData->hRequest, 
+        bProxy ? INTERNET_OPTION_PROXY_PASSWORD : INTERNET_OPTION_PASSWORD,
+        pAuth->pPassword, (DWORD) strlen(pAuth->pPassword) + 1);
+    wininet_lock_leave(&wininet_auth_lock);
+
+    WININET_LOG1(a_pData, "auth_challenged: answering challenge with cached credentials for realm '%s'", pRealm);
+    free(a_pData->apAuthRealm[a_dwTarget - 1]);
+    a_pData->apAuthRealm[a_dwTarget - 1] = pRealm;
+    a_pData->dwAuthSent |= a_dwTarget;
+    a_pData->dwAuthBasic &= ~a_dwTarget;
+    return TRUE;
 }
 
-static int
-wininet_growbuffer(
-    struct wininet_data *   a_pData,
-    const char *            a_pModule,
-    size_t					a_nSize
+/* retrieve a response header, the result must be freed */
+static char *
+wininet_query_header(
+    HINTERNET   a_hRequest,
+    DWORD       a_dwQuery
     )
 {
-    a_pData->uiBufferSize = ROUND_UP(a_nSize, 4096); /* round up to 4096 boundary */
-    WININET_LOG2(a_pData, "%s: growing internal buffer to %lu bytes", 
-        a_pModule, a_pData->uiBufferSize);
-
-    a_pData->pBuffer = (char *) realloc(a_pData->pBuffer, a_pData->uiBufferSize);
-    if (!a_pData->pBuffer) {
-        WININET_LOG1(a_pData, "%s: realloc failed", a_pModule);
-        a_pData->uiBufferSize = 0;
-        return SOAP_EOM;
+    char *  pValue;
+    DWORD   dwLen = 256;
+
+    pValue = (char *) malloc(dwLen);
+    while (pValue && !HttpQueryInfoA(a_hRequest, a_dwQuery, pValue, &dwLen, NULL)) {
+        free(pValue);
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+            return NULL;
+        }
+        pValue = (char *) malloc(++dwLen);
     }
+    return pValue;
+}
 
-    return SOAP_OK;
+/* retrieve the challenge header for a 401 or 407 response */
+static char *
+wininet_auth_challenge(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget
+    )
+{
+    return wininet_query_header(a_pData->hRequest, (a_dwTarget == WININET_AUTH_PROXY) 
+        ? HTTP_QUERY_PROXY_AUTHENTICATE : HTTP_QUERY_WWW_AUTHENTICATE);
 }
 
-/* gsoap documentation:
-    Called by http_post and http_response (through the callbacks). Emits HTTP 
-    key: val header entries. Should return SOAP_OK, or a gSOAP error code. 
-    Built-in gSOAP function: http_post_header.
+/*  Handle a 401 or 407 response when the credential cache is enabled. 
+    Returns TRUE if the request should be resent without asking for 
+    credentials because cached credentials for a handshake based scheme 
+    have been supplied to the request. Cached credentials that are 
+    rejected are removed from the cache.
  */
-static int 
-wininet_fposthdr(
-    struct soap *   soap, 
-    const char *    a_pszKey, 
-    const char *    a_pszValue
-    )  
+static BOOL
+wininet_auth_challenged(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwTarget
+    )
 {
-    int     rc;
-    char    szHeader[4096];
-    int     nLen;
-    BOOL    bResult = FALSE;
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
-
-    soap->error = SOAP_OK;
+    char ** ppChallenge = &a_pData->apAuthChallenge[a_dwTarget - 1];
+    const char * pSentRealm = a_pData->apAuthRealm[a_dwTarget - 1];
+    char * pRealm;
 
-    /* ensure that our connection hasn't been disconnected */
-    if (!wininet_have_connection(soap, pData)) {
-        return SOAP_EOF;
+    if (!a_pData->bAuthCache) {
+        return FALSE;
     }
 
-    /* initialize a new request */
-    if (a_pszKey && !a_pszValue) {
-        WININET_LOG0(pData, "fposthdr: initialize request");
-
-        /* if we are using chunk output then we start with a chunk size */
-        pData->bIsChunkSize = ((soap->omode & SOAP_IO) == SOAP_IO_CHUNK);
-        pData->uiBufferLen = 0;
-        pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
-        pData->nLogFormat = LOGTYPE_UNKNOWN;
+    /*  a challenge for another realm of the server doesn't reject the 
+        credentials that were sent, they just don't apply. The cached 
+        credentials for that realm are used instead if there are any. */
+    if ((a_pData->dwAuthSent & a_dwTarget) && pSentRealm) {
+        pRealm = wininet_auth_challenge(a_pData, a_dwTarget);
+        if (pRealm) {
+            char * pChallenge = pRealm;
+            pRealm = wininet_auth_realm(pChallenge);
+            free(pChallenge);
+        }
+        if (pRealm && strcmp(pRealm, pSentRealm) != 0) {
+            WININET_LOG2(a_pData, "auth_challenged: challenged for realm '%s', cached credentials are for '%s'", 
+                pRealm, pSentRealm);
+            a_pData->dwAuthSent &= ~a_dwTarget;
+            if (!(a_pData->dwAuthRetried & a_dwTarget) && wininet_auth_set_realm(a_pData, a_dwTarget, pRealm)) {
+                a_pData->dwAuthRetried |= a_dwTarget;
+                free(pRealm);
+                return TRUE;
+            }
+        }
+        free(pRealm);
+    }
 
-        /* create new request for these headers */
-        rc = wininet_create_request(soap);
-        if (rc != SOAP_OK) return rc;
+    if (a_pData->dwAuthSent & a_dwTarget) {
+        if (!(a_pData->dwAuthBasic & a_dwTarget) && !(a_pData->dwAuthRetried & a_dwTarget)) {
+            WININET_LOG0(a_pData, "auth_challenged: answering challenge with cached credentials");
+            a_pData->dwAuthRetried |= a_dwTarget;
+            return TRUE;
+        }
 
-        return SOAP_OK;
+        WININET_LOG0(a_pData, "auth_challenged: cached credentials were rejected");
+        ++a_pData->stats.nAuthRejected;
+        wininet_auth_remove(a_pData, a_dwTarget);
+        a_pData->dwAuthSent &= ~a_dwTarget;
     }
 
-    /* completed request headers */
-    if (!a_pszKey) {
-        WININET_LOG0(pData, "fposthdr: complete headers");
-        return SOAP_OK;
+    /* remember the challenge so that we can cache the credentials used */
+    if (*ppChallenge) {
+        free(*ppChallenge);
     }
+    *ppChallenge = wininet_auth_challenge(a_pData, a_dwTarget);
+    a_pData->dwAuthChallenged |= a_dwTarget;
+    return FALSE;
+}
 
-    /* add a header */
-    if (a_pszValue) { 
-        char szTemp[200];
+/* the message was sent successfully, cache credentials if a challenge was answered */
+static void
+wininet_auth_complete(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwStatusCode
+    )
+{
+    DWORD dwTarget;
 
-        if (!strcmp(a_pszKey, "User-Agent")) {
-            if (pData->pUserAgent) {
-                a_pszValue = pData->pUserAgent;
-            }
+    if (!a_pData->bAuthCache 
+        || a_dwStatusCode == HTTP_STATUS_DENIED 
+        || a_dwStatusCode == HTTP_STATUS_PROXY_AUTH_REQ) 
+    {
+        return;
+    }
 
-            /* so that the request id shows up in IIS logs, add the request ID to the user agent */
-            if (pData->hLog) {
-                char szRequestId[50];
-                wininet_getreqid(szRequestId, sizeof(szRequestId));
-                nLen = _snprintf(szTemp, sizeof(szTemp), "%s [%s]", a_pszValue, szRequestId);
-                if (nLen < 0) {
-                    WININET_LOG0(pData, "fposthdr: EOM");
-                    return SOAP_EOM;
-                }
-                a_pszValue = szTemp;
-            }
+    for (dwTarget = WININET_AUTH_SERVER; dwTarget <= WININET_AUTH_PROXY; ++dwTarget) {
+        if (a_pData->dwAuthChallenged & dwTarget) {
+            wininet_auth_store(a_pData, dwTarget, a_pData->apAuthChallenge[dwTarget - 1]);
         }
-        
-        WININET_LOG2(pData, "fposthdr: header '%s: %s'", a_pszKey, a_pszValue);
-
-        /* determine the maximum length of this message so that we can
-           correctly determine when we have completed the send */
-        if (!strcmp(a_pszKey, "Content-Length")) {
-            _ASSERTE(pData->uiBufferLenMax == INVALID_BUFFER_LENGTH);
-            pData->uiBufferLenMax = strtoul(a_pszValue, NULL, 10);
-            if (pData->uiBufferSize < pData->uiBufferLenMax) {
-                int rc = wininet_growbuffer(pData, "fposthdr", pData->uiBufferLenMax);
-                if (rc != SOAP_OK) return rc;
-            }
+        else if (a_pData->dwAuthBasic & a_pData->dwAuthSent & dwTarget) {
+            /* credentials were accepted without a challenge */
+            ++a_pData->stats.nAuthSaved;
         }
-
-        /*! check to see what sort of data with have */
-        else if (!strcmp(a_pszKey, "Content-Encoding")) {
-            pData->nLogFormat = LOGTYPE_HEX;
+        if (a_pData->apAuthChallenge[dwTarget - 1]) {
+            free(a_pData->apAuthChallenge[dwTarget - 1]);
+            a_pData->apAuthChallenge[dwTarget - 1] = NULL;
         }
+    }
+}
 
-        else if (pData->nLogFormat == LOGTYPE_UNKNOWN && !strcmp(a_pszKey, "Content-Type")) {
-            if (strstr(a_pszValue, "text/xml")) {
-                pData->nLogFormat = LOGTYPE_XML;
-            }
-            else if (strstr(a_pszValue, "text/")) {
-                pData->nLogFormat = LOGTYPE_TEXT;
-            }
-            else {
-                pData->nLogFormat = LOGTYPE_HEX;
-            }
-        }
+#ifndef HTTP_STATUS_PERMANENT_REDIRECT
+# define HTTP_STATUS_PERMANENT_REDIRECT 308
+#endif
 
-        nLen = _snprintf(szHeader, sizeof(szHeader), "%s: %s\r\n", a_pszKey, a_pszValue);
-        if (nLen < 0) {
-            WININET_LOG0(pData, "fposthdr: EOM");
-            return SOAP_EOM;
-        }
+#define WININET_MAX_REDIRECTS   5   /* maximum redirects followed for a single message */
 
-        _ASSERTE(pData->hRequest != NULL);
-        bResult = HttpAddRequestHeadersA(pData->hRequest, szHeader, nLen, HTTP_ADDREQ_FLAG_ADD);
-        if (!bResult) {
-            /* not a critical error, so just log it */
-            WININET_LOG2(pData, "fposthdr: error %d (%s) in HttpAddRequestHeaders", 
-                soap->error, wininet_error_message(pData, GetLastError()));
-        }
-    }
+/* a permanent redirect that has been seen */
+struct wininet_redirect
+{
+    struct wininet_redirect *   pNext;
+    char *                      pFrom;          /* original endpoint */
+    char *                      pTo;            /* redirected endpoint */
+    DWORD                       dwCreated;      /* tick count when the redirect was seen */
+    DWORD                       dwLastUsed;     /* tick count when the redirect was last used */
+    unsigned long               nHits;          /* number of times the redirect was used */
+};
 
-    return SOAP_OK; 
+static struct wininet_lock          wininet_redirect_lock;
+static struct wininet_redirect *    wininet_redirect_list;
+static unsigned                     wininet_redirect_count;
+static unsigned                     wininet_redirect_max;   /* maximum entries, 0 = unlimited */
+static DWORD                        wininet_redirect_ttl;   /* lifetime in ms, 0 = unlimited */
+
+static void
+wininet_redirect_free(
+    struct wininet_redirect *   a_pRedirect
+    )
+{
+    free(a_pRedirect->pFrom);
+    free(a_pRedirect->pTo);
+    free(a_pRedirect);
 }
 
-static int
-wininet_get_headers(
-    struct wininet_data *   a_pData,
-    const char *            a_pModule,
-    DWORD                   a_dwFlags
+/* find an entry, removing it if it has expired. The lock must be held. */
+static struct wininet_redirect **
+wininet_redirect_find(
+    const char *    a_pszEndpoint
     )
 {
-    DWORD dwLen;
+    struct wininet_redirect ** ppRedirect = &wininet_redirect_list;
+    struct wininet_redirect * pRedirect;
+
+    while (*ppRedirect) {
+        pRedirect = *ppRedirect;
+        if (wininet_redirect_ttl && GetTickCount() - pRedirect->dwCreated > wininet_redirect_ttl) {
+            *ppRedirect = pRedirect->pNext;
+            wininet_redirect_free(pRedirect);
+            --wininet_redirect_count;
+            continue;
+        }
+        if (!strcmp(pRedirect->pFrom, a_pszEndpoint)) {
+            break;
+        }
+        ppRedirect = &pRedirect->pNext;
+    }
+    return ppRedirect;
+}
 
-    /* retrieve all of the response headers as NULL separated strings */
-    _ASSERTE(a_pData->uiBufferSize > 0);
-    dwLen = (DWORD) a_pData->uiBufferSize;
-    a_pData->pBuffer[0] = 0;
-    while (!HttpQueryInfoA(a_pData->hRequest, HTTP_QUERY_RAW_HEADERS | a_dwFlags, a_pData->pBuffer, &dwLen, 0) 
-        && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
-    {
-        int rc = wininet_growbuffer(a_pData, a_pModule, dwLen);
-        if (rc != SOAP_OK) return rc;
-        dwLen = (DWORD) a_pData->uiBufferSize;
+/* find the final target of any cached redirects, the result must be freed */
+static char *
+wininet_redirect_lookup(
+    const char *    a_pszEndpoint
+    )
+{
+    struct wininet_redirect * pRedirect;
+    const char * pTarget = NULL;
+    char * pResult = NULL;
+    int nHops;
+
+    wininet_lock_enter(&wininet_redirect_lock);
+    for (nHops = 0; nHops < WININET_MAX_REDIRECTS; ++nHops) {
+        pRedirect = *wininet_redirect_find(pTarget ? pTarget : a_pszEndpoint);
+        if (!pRedirect) break;
+        pRedirect->dwLastUsed = GetTickCount();
+        ++pRedirect->nHits;
+        pTarget = pRedirect->pTo;
+    }
+    if (pTarget) {
+        pResult = strdup(pTarget);
     }
+    wininet_lock_leave(&wininet_redirect_lock);
 
-    return SOAP_OK;
+    return pResult;
 }
 
+/* remember a permanent redirect */
 static void
-wininet_log_headers(
-    struct wininet_data *   a_pData,
-    const char *            a_pModule
+wininet_redirect_store(
+    const char *    a_pszFrom,
+    const char *    a_pszTo
     )
 {
-    const char * pHeader;
+    struct wininet_redirect ** ppRedirect;
+    struct wininet_redirect * pRedirect;
+    struct wininet_redirect ** ppOldest;
+
+    pRedirect = (struct wininet_redirect *) malloc(sizeof(struct wininet_redirect));
+    if (!pRedirect) return;
+    memset(pRedirect, 0, sizeof(struct wininet_redirect));
+    pRedirect->pFrom = strdup(a_pszFrom);
+    pRedirect->pTo = strdup(a_pszTo);
+    pRedirect->dwCreated = pRedirect->dwLastUsed = GetTickCount();
+    if (!pRedirect->pFrom || !pRedirect->pTo) {
+        wininet_redirect_free(pRedirect);
+        return;
+    }
 
-    /* log all of the headers */
-    for (pHeader = a_pData->pBuffer; *pHeader; pHeader += strlen(pHeader)+1) {
-        WININET_LOG2(a_pData, "%s header '%s'", a_pModule, pHeader);
+    wininet_lock_enter(&wininet_redirect_lock);
 
-        /*! check to see what sort of data with have */
-        if (!strnicmp(pHeader, "Content-Encoding:", 17)) {
-            a_pData->nLogFormat = LOGTYPE_HEX;
-        }
+    /* replace any existing entry */
+    ppRedirect = wininet_redirect_find(a_pszFrom);
+    if (*ppRedirect) {
+        struct wininet_redirect * pOld = *ppRedirect;
+        *ppRedirect = pOld->pNext;
+        wininet_redirect_free(pOld);
+        --wininet_redirect_count;
+    }
 
-        else if (a_pData->nLogFormat == LOGTYPE_UNKNOWN && !strnicmp(pHeader, "Content-Type:", 13)) {
-            if (strstr(pHeader, "text/xml")) {
-                a_pData->nLogFormat = LOGTYPE_XML;
-            }
-            else if (strstr(pHeader, "text/")) {
-                a_pData->nLogFormat = LOGTYPE_TEXT;
-            }
-            else {
-                a_pData->nLogFormat = LOGTYPE_HEX;
+    /* discard the least recently used entry if we are full */
+    if (wininet_redirect_max && wininet_redirect_count >= wininet_redirect_max) {
+        ppOldest = &wininet_redirect_list;
+        for (ppRedirect = &wininet_redirect_list; *ppRedirect; ppRedirect = &(*ppRedirect)->pNext) {
+            if (GetTickCount() - (*ppRedirect)->dwLastUsed > GetTickCount() - (*ppOldest)->dwLastUsed) {
+                ppOldest = ppRedirect;
             }
         }
+        if (*ppOldest) {
+            struct wininet_redirect * pOld = *ppOldest;
+            *ppOldest = pOld->pNext;
+            wininet_redirect_free(pOld);
+            --wininet_redirect_count;
+        }
     }
+
+    pRedirect->pNext = wininet_redirect_list;
+    wininet_redirect_list = pRedirect;
+    ++wininet_redirect_count;
+
+    wininet_lock_leave(&wininet_redirect_lock);
 }
 
-/* gsoap documentation:
-    Called for all send operations to emit contents of s of length n. 
-    Should return SOAP_OK, or a gSOAP error code. Built-in gSOAP 
-    function: fsend
+#define WININET_CACHE_BUCKETS   256                 /* hash buckets in the response cache */
+#define WININET_CACHE_DEFAULT   (8 * 1024 * 1024)   /* default response cache budget */
 
-   Notes:
-    I do a heap of buffering here because we need the entire message available
-    in a single buffer in order to iterate through the sending loop. I had 
-    hoped that the SOAP_IO_STORE flag would have worked to do the same, however
-    this still breaks the messages up into blocks. Although there were a number
-    of ways this could've been implemented, this works and supports all of the
-    possible SOAP_IO flags, even though the entire message is still buffered 
-    the same as if SOAP_IO_STORE was used.
-*/
-static int 
-wininet_fsend(
-    struct soap *   soap, 
-    const char *    a_pBuffer, 
-    size_t          a_uiBufferLen
+/* FNV-1a hash, used to identify identical messages */
+static ULONGLONG
+wininet_hash(
+    ULONGLONG       a_nHash,
+    const void *    a_pBuf,
+    size_t          a_nBufLen
     )
 {
-    BOOL        bResult;
-    BOOL        bRetryPost;
-    DWORD       dwStatusCode;
-    DWORD       dwStatusCodeLen;
-    wininet_rseReturn errorResolved;
-    int         nResult = SOAP_OK;
-    int         nAttempt = 1;
-    size_t      nSendSize = 0;
-    char *      pSendBuf = NULL;
-    struct wininet_data * pData = (struct wininet_data *) 
-        soap_lookup_plugin(soap, wininet_id);
+    const unsigned char * pBuf = (const unsigned char *) a_pBuf;
+    const unsigned char * pBufEnd = pBuf + a_nBufLen;
 
-    _ASSERTE(pData->hRequest != NULL);
+    while (pBuf < pBufEnd) {
+        a_nHash ^= *pBuf++;
+        a_nHash *= 0x100000001B3ULL;
+    }
+    return a_nHash;
+}
 
-    WININET_LOG1(pData, "fsend: data len = %lu bytes", a_uiBufferLen);
+#define WININET_HASH_INIT   0xCBF29CE484222325ULL
 
-    /* ensure that our connection hasn't been disconnected */
-    soap->error = SOAP_OK;
-    if (!wininet_have_connection(soap, pData)) {
-        return SOAP_EOF;
-    }
+/* a cached response */
+struct wininet_cache_entry
+{
+    struct wininet_cache_entry * pHashNext; /* next entry in the hash bucket */
+    struct wininet_cache_entry * pLruPrev;  /* more recently used entry */
+    struct wininet_cache_entry * pLruNext;  /* less recently used entry */
+    ULONGLONG                   nHash;
+    size_t                      uiMsgLen;
+    char *                      pEndpoint;
+    char *                      pAction;
+    char *                      pResponse;  /* response headers and body as passed to gsoap */
+    size_t                      uiResponseLen;
+    size_t                      uiSize;     /* total memory used by this entry */
+    DWORD                       dwStored;   /* tick count when the response was stored */
+    DWORD                       dwTtl;      /* lifetime of the response (ms) */
+    char *                      pETag;      /* ETag of the response for revalidation */
+    char *                      pLastModified; /* Last-Modified of the response for revalidation */
+};
 
-    /*  on the first time, if we don't know the size of the buffer, then we are either using
-        chunked send, or we need to slowly allocate the buffer as it comes.
-    */
-    if (pData->uiBufferLen == 0 && pData->uiBufferLenMax == INVALID_BUFFER_LENGTH) {
-        /*  If we are using chunked sending, then we don't know how big the
-            buffer will need to be. So we start with a 0 length buffer and
-            grow it later to ensure that it is always large enough.
-         */
-        if ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK) {
-            /* ensure we have a buffer large enough for this chunksize 
-               buffer, plus the next chunk of actual data, and a few extra 
-               bytes for the final "0" chunksize block. */
-            size_t uiChunkSize = strtoul(a_pBuffer, NULL, 16);
-            _ASSERTE(a_uiBufferLen > 0);
-            pData->uiBufferLenMax = uiChunkSize + a_uiBufferLen + 16;
-        }
+static struct wininet_lock          wininet_cache_lock;
+static struct wininet_cache_entry * wininet_cache_buckets[WININET_CACHE_BUCKETS];
+static struct wininet_cache_entry * wininet_cache_lru_head;    /* most recently used */
+static struct wininet_cache_entry * wininet_cache_lru_tail;    /* least recently used */
+static size_t                       wininet_cache_size;
+static unsigned                     wininet_cache_count;
+static size_t                       wininet_cache_limit = WININET_CACHE_DEFAULT;
 
-        /* empty bodies will set the buffer length to 0, permit this */
-        if (a_uiBufferLen == 0) {
-            pData->uiBufferLenMax = 0;
+/* the SOAPAction header value without quotes */
+static BOOL
+wininet_action_matches(
+    const char *    a_pRuleAction,
+    const char *    a_pAction
+    )
+{
+    size_t nLen;
+
+    if (!a_pRuleAction) return TRUE;
+    if (!a_pAction) return FALSE;
+    if (*a_pAction == '"') ++a_pAction;
+    nLen = strlen(a_pAction);
+    if (nLen > 0 && a_pAction[nLen-1] == '"') --nLen;
+    return strlen(a_pRuleAction) == nLen && !strncmp(a_pRuleAction, a_pAction, nLen);
+}
+
+/* find the cache rule for the current message */
+static struct wininet_cache_rule *
+wininet_cache_rule_find(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_cache_rule * pRule;
+
+    for (pRule = a_pData->pCacheRules; pRule; pRule = pRule->pNext) {
+        if (wininet_action_matches(pRule->pAction, a_pData->pAction)) {
+            return pRule;
         }
     }
+    return NULL;
+}
 
-    /*  If the currently supplied buffer from gsoap holds the entire message then just use 
-        that buffer as is. This will only be true when (1) not using chunked send (so 
-        uiBufferLenMax has been previously set to the Content-Length header length), and 
-        (2) gsoap is sending the entire message at one time. 
-     */
-    if (a_uiBufferLen == pData->uiBufferLenMax) {
-        WININET_LOG0(pData, "fsend: using gsoap supplied data buffer");
-        nSendSize = a_uiBufferLen;
-        pSendBuf  = (char *) a_pBuffer;
+/* add a cache rule, rules for specific actions are checked before the rule 
+   for all actions */
+static void
+wininet_cache_rule_insert(
+    struct wininet_data *       a_pData,
+    struct wininet_cache_rule * a_pRule
+    )
+{
+    struct wininet_cache_rule ** ppRule;
+
+    if (a_pRule->pAction) {
+        a_pRule->pNext = a_pData->pCacheRules;
+        a_pData->pCacheRules = a_pRule;
+    }
+    else {
+        for (ppRule = &a_pData->pCacheRules; *ppRule; ppRule = &(*ppRule)->pNext);
+        a_pRule->pNext = NULL;
+        *ppRule = a_pRule;
     }
+}
 
-    /*  If not using the gsoap buffer, then ensure that the current allocation
-        is large enough for the entire message. This is because authentication 
-        may require the entire message to be sent multiple times. Since this 
-        send is only a part of the message, we need to buffer until we have the 
-        entire message.
-    */
-    if (!pSendBuf) {
-        size_t uiNewBufferLen = pData->uiBufferLen + a_uiBufferLen;
-        if (!pData->pBuffer || uiNewBufferLen > pData->uiBufferSize) {
-            int rc = wininet_growbuffer(pData, "fsend", uiNewBufferLen);
-            if (rc != SOAP_OK) return rc;
+/*  Identify a message for the response cache and for coalescing. The 
+    credentials sent with the message (the Authorization and Cookie headers, 
+    including those from gSOAP's userid and the credential cache) are part 
+    of the key so that a response is never shared between different users. */
+static void
+wininet_cache_key_init(
+    struct wininet_data *       a_pData,
+    struct wininet_cache_key *  a_pKey,
+    const char *                a_pMsg,
+    size_t                      a_uiMsgLen
+    )
+{
+    const char * pLine = a_pData->pHeaders;
+    const char * pEnd = pLine + a_pData->uiHeadersLen;
+    const char * pNext;
+
+    a_pKey->pEndpoint = a_pData->pEndpoint ? a_pData->pEndpoint : "";
+    a_pKey->pAction   = a_pData->pAction ? a_pData->pAction : "";
+    a_pKey->uiMsgLen  = a_uiMsgLen;
+    a_pKey->nHash = wininet_hash(WININET_HASH_INIT, a_pKey->pEndpoint, strlen(a_pKey->pEndpoint) + 1);
+    a_pKey->nHash = wininet_hash(a_pKey->nHash, a_pKey->pAction, strlen(a_pKey->pAction) + 1);
+    for (; pLine && pLine < pEnd; pLine = pNext) {
+        pNext = strstr(pLine, "\r\n");
+        pNext = pNext ? pNext + 2 : pEnd;
+        if (!strnicmp(pLine, "Authorization:", 14) || !strnicmp(pLine, "Cookie:", 7)) {
+            a_pKey->nHash = wininet_hash(a_pKey->nHash, pLine, pNext - pLine);
         }
+    }
+    a_pKey->nHash = wininet_hash(a_pKey->nHash, a_pMsg, a_uiMsgLen);
+}
 
-        memcpy(pData->pBuffer + pData->uiBufferLen, a_pBuffer, a_uiBufferLen);
-        pData->uiBufferLen = uiNewBufferLen;
+/* unlink and free an entry. The lock must be held. */
+static void
+wininet_cache_remove(
+    struct wininet_cache_entry *    a_pEntry
+    )
+{
+    struct wininet_cache_entry ** ppEntry = 
+        &wininet_cache_buckets[a_pEntry->nHash % WININET_CACHE_BUCKETS];
+
+    while (*ppEntry != a_pEntry) ppEntry = &(*ppEntry)->pHashNext;
+    *ppEntry = a_pEntry->pHashNext;
+
+    if (a_pEntry->pLruPrev) a_pEntry->pLruPrev->pLruNext = a_pEntry->pLruNext;
+    else wininet_cache_lru_head = a_pEntry->pLruNext;
+    if (a_pEntry->pLruNext) a_pEntry->pLruNext->pLruPrev = a_pEntry->pLruPrev;
+    else wininet_cache_lru_tail = a_pEntry->pLruPrev;
+
+    wininet_cache_size -= a_pEntry->uiSize;
+    --wininet_cache_count;
+
+    free(a_pEntry->pEndpoint);
+    free(a_pEntry->pAction);
+    free(a_pEntry->pResponse);
+    free(a_pEntry->pETag);
+    free(a_pEntry->pLastModified);
+    free(a_pEntry);
+}
 
-        /*  when doing chunked transfers, and this is a chunk size block, and it is 
-            "0", then it is the last block. set the maximum size to continue to the 
-            actual send. */
-        if ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK
-             && pData->bIsChunkSize 
-             && a_pBuffer[2] == '0' && !isalnum(a_pBuffer[3]))
+/* find an entry for a key. The lock must be held. */
+static struct wininet_cache_entry *
+wininet_cache_find(
+    const struct wininet_cache_key *    a_pKey
+    )
+{
+    struct wininet_cache_entry * pEntry;
+
+    pEntry = wininet_cache_buckets[a_pKey->nHash % WININET_CACHE_BUCKETS];
+    for (; pEntry; pEntry = pEntry->pHashNext) {
+        if (pEntry->nHash == a_pKey->nHash 
+            && pEntry->uiMsgLen == a_pKey->uiMsgLen
+            && !strcmp(pEntry->pEndpoint, a_pKey->pEndpoint)
+            && !strcmp(pEntry->pAction, a_pKey->pAction))
         {
-            pData->uiBufferLenMax = pData->uiBufferLen;
+            break;
         }
+    }
+    return pEntry;
+}
 
-        /* continue if the entire message is not complete */
-        if (pData->uiBufferLen < pData->uiBufferLenMax) {
-            pData->bIsChunkSize = !pData->bIsChunkSize
-                && ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK);
-            return SOAP_OK;
-        }
+/* mark an entry as most recently used. The lock must be held. */
+static void
+wininet_cache_touch(
+    struct wininet_cache_entry *    a_pEntry
+    )
+{
+    if (wininet_cache_lru_head == a_pEntry) {
+        return;
+    }
 
-        /* message is complete, set the sending buffer */
-        nSendSize = pData->uiBufferLen;
-        pSendBuf  = pData->pBuffer;
+    /* unlink */
+    a_pEntry->pLruPrev->pLruNext = a_pEntry->pLruNext;
+    if (a_pEntry->pLruNext) a_pEntry->pLruNext->pLruPrev = a_pEntry->pLruPrev;
+    else wininet_cache_lru_tail = a_pEntry->pLruPrev;
 
-        WININET_LOG3(pData, "fsend: using %d%% (%lu bytes) of %lu byte internal buffer", 
-            (int)((pData->uiBufferLen * 100) / pData->uiBufferSize), 
-            pData->uiBufferLen, pData->uiBufferSize);
+    /* insert at the head */
+    a_pEntry->pLruPrev = NULL;
+    a_pEntry->pLruNext = wininet_cache_lru_head;
+    wininet_cache_lru_head->pLruPrev = a_pEntry;
+    wininet_cache_lru_head = a_pEntry;
+}
+
+#define WININET_CACHE_MISS      0   /* no usable cached response */
+#define WININET_CACHE_HIT       1   /* fresh cached response, set up for replay */
+#define WININET_CACHE_STALE     2   /* expired cached response that can be revalidated */
+
+/* copy a cached response to the replay buffer. The lock must be held. */
+static BOOL
+wininet_cache_replay(
+    struct wininet_data *           a_pData,
+    struct wininet_cache_entry *    a_pEntry
+    )
+{
+    a_pData->pReplay = (char *) malloc(a_pEntry->uiResponseLen);
+    if (!a_pData->pReplay) {
+        return FALSE;
     }
+    memcpy(a_pData->pReplay, a_pEntry->pResponse, a_pEntry->uiResponseLen);
+    a_pData->uiReplayLen = a_pEntry->uiResponseLen;
+    a_pData->uiReplayPos = 0;
+    wininet_cache_touch(a_pEntry);
+    return TRUE;
+}
 
-    /* output the data we are sending */
-    WININET_LOG1(pData, "fsend: sending message %lu bytes", nSendSize);
-    if (pData->hLog && nSendSize > 0) {
-        wininet_log_data(pData, "fsend: message data", pSendBuf, nSendSize);
+/*  Look up a cached response for a message. A fresh response is copied to 
+    the replay buffer so that it will be returned by frecv. If revalidation 
+    is allowed, the validators of an expired response are returned in 
+    a_pData so that a conditional request can be made. 
+ */
+static int
+wininet_cache_lookup(
+    struct wininet_data *               a_pData,
+    const struct wininet_cache_key *    a_pKey,
+    BOOL                                a_bRevalidate
+    )
+{
+    struct wininet_cache_entry * pEntry;
+    int nResult = WININET_CACHE_MISS;
+
+    wininet_lock_enter(&wininet_cache_lock);
+    pEntry = wininet_cache_find(a_pKey);
+    if (pEntry && GetTickCount() - pEntry->dwStored < pEntry->dwTtl) {
+        if (wininet_cache_replay(a_pData, pEntry)) {
+            nResult = WININET_CACHE_HIT;
+        }
     }
+    else if (pEntry && a_bRevalidate && (pEntry->pETag || pEntry->pLastModified)) {
+        a_pData->pValidETag = pEntry->pETag ? strdup(pEntry->pETag) : NULL;
+        a_pData->pValidLastModified = pEntry->pLastModified ? strdup(pEntry->pLastModified) : NULL;
+        nResult = WININET_CACHE_STALE;
+    }
+    else if (pEntry) {
+        wininet_cache_remove(pEntry);
+    }
+    wininet_lock_leave(&wininet_cache_lock);
 
-    /* we've now got the entire message, now we can enter our sending loop */
-    bRetryPost = TRUE;
+    return nResult;
+}
+
+/*  Replace a validator of a cache entry with the one from a 304 response, 
+    keeping the size of the cache up to date. The lock must be held. */
+static void
+wininet_cache_set_validator(
+    struct wininet_cache_entry *    a_pEntry,
+    char **                         a_ppValidator,
+    char **                         a_ppNew
+    )
+{
+    if (!*a_ppNew) {
+        return;
+    }
+    if (*a_ppValidator) {
+        a_pEntry->uiSize -= strlen(*a_ppValidator) + 1;
+        wininet_cache_size -= strlen(*a_ppValidator) + 1;
+        free(*a_ppValidator);
+    }
+    *a_ppValidator = *a_ppNew;
+    *a_ppNew = NULL;
+    a_pEntry->uiSize += strlen(*a_ppValidator) + 1;
+    wininet_cache_size += strlen(*a_ppValidator) + 1;
+}
+
+/*  The server has confirmed that the cached response for the current message 
+    is still valid. Refresh it with the validators and lifetime of the 304 
+    response and set it up for replay. Returns FALSE if the response is no 
+    longer in the cache. */
+static BOOL
+wininet_cache_revalidated(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_cache_entry * pEntry;
+    char * pETag;
+    char * pLastModified;
+    BOOL bResult = FALSE;
+
+    /* a 304 response carries the validators that the server would send now */
+    pETag = wininet_query_header(a_pData->hRequest, HTTP_QUERY_ETAG);
+    pLastModified = wininet_query_header(a_pData->hRequest, HTTP_QUERY_LAST_MODIFIED);
+
+    wininet_lock_enter(&wininet_cache_lock);
+    pEntry = wininet_cache_find(&a_pData->cacheKey);
+    if (pEntry && wininet_cache_replay(a_pData, pEntry)) {
+        wininet_cache_set_validator(pEntry, &pEntry->pETag, &pETag);
+        wininet_cache_set_validator(pEntry, &pEntry->pLastModified, &pLastModified);
+        pEntry->dwStored = GetTickCount();
+        pEntry->dwTtl = a_pData->dwCacheTtl;
+        bResult = TRUE;
+    }
+    wininet_lock_leave(&wininet_cache_lock);
+
+    free(pETag);
+    free(pLastModified);
+    return bResult;
+}
+
+/* add a captured response to the cache, discarding the least recently used 
+   responses to stay within the budget */
+static void
+wininet_cache_store(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_cache_entry * pEntry;
+    struct wininet_cache_key * pKey = &a_pData->cacheKey;
+    size_t uiSize;
+    size_t uiLimit;
+
+    /* responses that are always revalidated are useless without a validator */
+    if (!a_pData->dwCacheTtl && !a_pData->pCaptureETag && !a_pData->pCaptureLastModified) {
+        WININET_LOG0(a_pData, "cache_store: response has no validator, not caching");
+        return;
+    }
+
+    uiSize = sizeof(struct wininet_cache_entry) + a_pData->uiCaptureLen 
+        + strlen(pKey->pEndpoint) + strlen(pKey->pAction) + 2;
+    if (a_pData->pCaptureETag) uiSize += strlen(a_pData->pCaptureETag) + 1;
+    if (a_pData->pCaptureLastModified) uiSize += strlen(a_pData->pCaptureLastModified) + 1;
+    wininet_lock_enter(&wininet_cache_lock);
+    uiLimit = wininet_cache_limit;
+    wininet_lock_leave(&wininet_cache_lock);
+    if (uiSize > uiLimit) {
+        WININET_LOG1(a_pData, "cache_store: response too large to cache (%lu bytes)", uiSize);
+        return;
+    }
+
+    pEntry = (struct wininet_cache_entry *) malloc(sizeof(struct wininet_cache_entry));
+    if (!pEntry) return;
+    memset(pEntry, 0, sizeof(struct wininet_cache_entry));
+    pEntry->nHash         = pKey->nHash;
+    pEntry->uiMsgLen      = pKey->uiMsgLen;
+    pEntry->pEndpoint     = strdup(pKey->pEndpoint);
+    pEntry->pAction       = strdup(pKey->pAction);
+    pEntry->pResponse     = (char *) malloc(a_pData->uiCaptureLen);
+    pEntry->uiResponseLen = a_pData->uiCaptureLen;
+    pEntry->uiSize        = uiSize;
+    pEntry->dwStored      = GetTickCount();
+    pEntry->dwTtl         = a_pData->dwCacheTtl;
+    if (!pEntry->pEndpoint || !pEntry->pAction || !pEntry->pResponse) {
+        free(pEntry->pEndpoint);
+        free(pEntry->pAction);
+        free(pEntry->pResponse);
+        free(pEntry);
+        return;
+    }
+    memcpy(pEntry->pResponse, a_pData->pCapture, a_pData->uiCaptureLen);
+    pEntry->pETag = a_pData->pCaptureETag;
+    pEntry->pLastModified = a_pData->pCaptureLastModified;
+    a_pData->pCaptureETag = a_pData->pCaptureLastModified = NULL;
+
+    WININET_LOG1(a_pData, "cache_store: caching response (%lu bytes)", a_pData->uiCaptureLen);
+
+    wininet_lock_enter(&wininet_cache_lock);
+    {
+        struct wininet_cache_entry * pOld = wininet_cache_find(pKey);
+        if (pOld) {
+            wininet_cache_remove(pOld);
+        }
+    }
+
+    /* the limit may have been lowered since it was checked above */
+    if (uiSize > wininet_cache_limit) {
+        wininet_lock_leave(&wininet_cache_lock);
+        free(pEntry->pEndpoint);
+        free(pEntry->pAction);
+        free(pEntry->pResponse);
+        free(pEntry->pETag);
+        free(pEntry->pLastModified);
+        free(pEntry);
+        return;
+    }
+    while (wininet_cache_lru_tail && wininet_cache_size + uiSize > wininet_cache_limit) {
+        wininet_cache_remove(wininet_cache_lru_tail);
+    }
+    pEntry->pHashNext = wininet_cache_buckets[pEntry->nHash % WININET_CACHE_BUCKETS];
+    wininet_cache_buckets[pEntry->nHash % WININET_CACHE_BUCKETS] = pEntry;
+    pEntry->pLruNext = wininet_cache_lru_head;
+    if (wininet_cache_lru_head) wininet_cache_lru_head->pLruPrev = pEntry;
+    else wininet_cache_lru_tail = pEntry;
+    wininet_cache_lru_head = pEntry;
+    wininet_cache_size += uiSize;
+    ++wininet_cache_count;
+    wininet_lock_leave(&wininet_cache_lock);
+}
+
+/* an identical message that is currently being sent by another request */
+struct wininet_flight
+{
+    struct wininet_flight * pNext;
+    ULONGLONG               nHash;          /* hash of the endpoint, action and message */
+    size_t                  uiMsgLen;       /* length of the message */
+    char *                  pEndpoint;      /* endpoint the message is sent to */
+    char *                  pAction;        /* SOAPAction of the message */
+    HANDLE                  hDone;          /* signalled when the response is available */
+    LONG                    nRefs;          /* requests using this flight, the lock must be held */
+    BOOL                    bSuccess;       /* a response is available */
+    char *                  pResponse;      /* response headers and body as passed to gsoap */
+    size_t                  uiResponseLen;
+};
+
+/* the number of coalesced requests for an endpoint */
+struct wininet_coalesced
+{
+    struct wininet_coalesced * pNext;
+    char *                  pEndpoint;
+    unsigned long           nCount;
+};
+
+static struct wininet_lock          wininet_flight_lock;
+static struct wininet_flight *      wininet_flight_list;
+static struct wininet_coalesced *   wininet_coalesced_list;
+
+/* release a reference to a flight. The lock must be held. */
+static void
+wininet_flight_release(
+    struct wininet_flight * a_pFlight
+    )
+{
+    if (--a_pFlight->nRefs > 0) {
+        return;
+    }
+    CloseHandle(a_pFlight->hDone);
+    free(a_pFlight->pEndpoint);
+    free(a_pFlight->pAction);
+    free(a_pFlight->pResponse);
+    free(a_pFlight);
+}
+
+/* count a coalesced request for an endpoint. The lock must be held. */
+static void
+wininet_coalesced_count(
+    const char *    a_pszEndpoint
+    )
+{
+    struct wininet_coalesced * pCount;
+
+    for (pCount = wininet_coalesced_list; pCount; pCount = pCount->pNext) {
+        if (!strcmp(pCount->pEndpoint, a_pszEndpoint)) break;
+    }
+    if (!pCount) {
+        pCount = (struct wininet_coalesced *) malloc(sizeof(struct wininet_coalesced));
+        if (!pCount) return;
+        pCount->pEndpoint = strdup(a_pszEndpoint);
+        pCount->nCount = 0;
+        if (!pCount->pEndpoint) {
+            free(pCount);
+            return;
+        }
+        pCount->pNext = wininet_coalesced_list;
+        wininet_coalesced_list = pCount;
+    }
+    ++pCount->nCount;
+}
+
+/*  If an identical message (including its credentials, see 
+    wininet_cache_key_init()) is already being sent then wait for its response 
+    and set it up to be returned by frecv, returning TRUE. Otherwise this 
+    request becomes the one that others wait for and FALSE is returned. If 
+    the other request fails, FALSE is returned and the message must be sent.
+ */
+static BOOL
+wininet_flight_join(
+    struct wininet_data *               a_pData,
+    const struct wininet_cache_key *    a_pKey,
+    DWORD                               a_dwTimeout
+    )
+{
+    struct wininet_flight * pFlight;
+    BOOL bReplayed = FALSE;
+
+    wininet_lock_enter(&wininet_flight_lock);
+    for (pFlight = wininet_flight_list; pFlight; pFlight = pFlight->pNext) {
+        if (pFlight->nHash == a_pKey->nHash 
+            && pFlight->uiMsgLen == a_pKey->uiMsgLen
+            && !strcmp(pFlight->pEndpoint, a_pKey->pEndpoint)
+            && !strcmp(pFlight->pAction, a_pKey->pAction))
+        {
+            break;
+        }
+    }
+
+    if (!pFlight) {
+        /* we are the first, others will wait for our response */
+        pFlight = (struct wininet_flight *) malloc(sizeof(struct wininet_flight));
+        if (pFlight) {
+            memset(pFlight, 0, sizeof(struct wininet_flight));
+            pFlight->nHash     = a_pKey->nHash;
+            pFlight->uiMsgLen  = a_pKey->uiMsgLen;
+            pFlight->pEndpoint = strdup(a_pKey->pEndpoint);
+            pFlight->pAction   = strdup(a_pKey->pAction);
+            pFlight->hDone     = CreateEventA(NULL, TRUE, FALSE, NULL);
+            pFlight->nRefs     = 1;
+            if (!pFlight->pEndpoint || !pFlight->pAction || !pFlight->hDone) {
+                if (pFlight->hDone) CloseHandle(pFlight->hDone);
+                free(pFlight->pEndpoint);
+                free(pFlight->pAction);
+                free(pFlight);
+            }
+            else {
+                pFlight->pNext = wininet_flight_list;
+                wininet_flight_list = pFlight;
+                a_pData->pFlight = pFlight;
+                a_pData->bCapture = TRUE;
+            }
+        }
+        wininet_lock_leave(&wininet_flight_lock);
+        return FALSE;
+    }
+
+    ++pFlight->nRefs;
+    wininet_lock_leave(&wininet_flight_lock);
+
+    WININET_LOG0(a_pData, "flight_join: waiting for identical request in progress");
+    wininet_log_commit(a_pData);
+    if (WaitForSingleObject(pFlight->hDone, a_dwTimeout) == WAIT_OBJECT_0 && pFlight->bSuccess) {
+        a_pData->pReplay = (char *) malloc(pFlight->uiResponseLen);
+        if (a_pData->pReplay) {
+            memcpy(a_pData->pReplay, pFlight->pResponse, pFlight->uiResponseLen);
+            a_pData->uiReplayLen = pFlight->uiResponseLen;
+            a_pData->uiReplayPos = 0;
+            bReplayed = TRUE;
+        }
+    }
+
+    wininet_lock_enter(&wininet_flight_lock);
+    if (bReplayed) {
+        wininet_coalesced_count(a_pKey->pEndpoint);
+    }
+    wininet_flight_release(pFlight);
+    wininet_lock_leave(&wininet_flight_lock);
+
+    if (bReplayed) {
+        WININET_LOG1(a_pData, "flight_join: using response of identical request (%lu bytes)", 
+            a_pData->uiReplayLen);
+        ++a_pData->stats.nCoalesced;
+    }
+    else {
+        WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "flight_join: identical request failed, sending");
+    }
+    return bReplayed;
+}
+
+/*  Complete the flight that we are leading, passing the captured response to 
+    any requests that are waiting for it if a_bSuccess is set. */
+static void
+wininet_flight_publish(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bSuccess
+    )
+{
+    struct wininet_flight ** ppFlight;
+    struct wininet_flight * pFlight = a_pData->pFlight;
+
+    if (!pFlight) {
+        return;
+    }
+    a_pData->pFlight = NULL;
+
+    wininet_lock_enter(&wininet_flight_lock);
+
+    /* later identical messages must start a new flight */
+    for (ppFlight = &wininet_flight_list; *ppFlight; ppFlight = &(*ppFlight)->pNext) {
+        if (*ppFlight == pFlight) {
+            *ppFlight = pFlight->pNext;
+            break;
+        }
+    }
+
+    if (a_bSuccess && pFlight->nRefs > 1) {
+        pFlight->pResponse = (char *) malloc(a_pData->uiCaptureLen);
+        if (pFlight->pResponse) {
+            memcpy(pFlight->pResponse, a_pData->pCapture, a_pData->uiCaptureLen);
+            pFlight->uiResponseLen = a_pData->uiCaptureLen;
+            pFlight->bSuccess = TRUE;
+        }
+    }
+    SetEvent(pFlight->hDone);
+    wininet_flight_release(pFlight);
+
+    wininet_lock_leave(&wininet_flight_lock);
+}
+
+/* stop capturing the response, it can't be used */
+static void
+wininet_capture_abort(
+    struct wininet_data *   a_pData
+    )
+{
+    a_pData->bCapture = FALSE;
+    wininet_flight_publish(a_pData, FALSE);
+}
+
+/* the send/receive timeout in ms */
+static DWORD
+wininet_call_timeout(
+    struct soap *   soap
+    )
+{
+    int nSend = soap->send_timeout < 1 ? 60 * 60 : soap->send_timeout;
+    int nRecv = soap->recv_timeout < 1 ? 60 * 60 : soap->recv_timeout;
+    return (DWORD) (nSend + nRecv) * 1000;
+}
+
+/* discard any response capture or replay for the current message */
+static void
+wininet_response_reset(
+    struct wininet_data *   a_pData
+    )
+{
+    if (a_pData->pReplay) {
+        free(a_pData->pReplay);
+        a_pData->pReplay = NULL;
+    }
+    a_pData->uiReplayLen = a_pData->uiReplayPos = 0;
+    wininet_capture_abort(a_pData);
+    a_pData->bCaptureCache = FALSE;
+    a_pData->bRevalidating = FALSE;
+    a_pData->uiCaptureLen = 0;
+    if (a_pData->pCacheEndpoint) {
+        free(a_pData->pCacheEndpoint);
+        a_pData->pCacheEndpoint = NULL;
+    }
+    if (a_pData->pCaptureETag) {
+        free(a_pData->pCaptureETag);
+        a_pData->pCaptureETag = NULL;
+    }
+    if (a_pData->pCaptureLastModified) {
+        free(a_pData->pCaptureLastModified);
+        a_pData->pCaptureLastModified = NULL;
+    }
+    if (a_pData->pValidETag) {
+        free(a_pData->pValidETag);
+        a_pData->pValidETag = NULL;
+    }
+    if (a_pData->pValidLastModified) {
+        free(a_pData->pValidLastModified);
+        a_pData->pValidLastModified = NULL;
+    }
+}
+
+/* append received data to the capture buffer */
+static void
+wininet_capture_append(
+    struct wininet_data *   a_pData,
+    const char *            a_pBuf,
+    size_t                  a_nBufLen
+    )
+{
+    size_t uiNewLen = a_pData->uiCaptureLen + a_nBufLen;
+
+    if (uiNewLen > a_pData->uiCaptureSize) {
+        size_t uiNewSize = ROUND_UP(uiNewLen, 4096);
+        char * pNewCapture = (char *) realloc(a_pData->pCapture, uiNewSize);
+        if (!pNewCapture) {
+            WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "capture_append: realloc failed, not capturing");
+            wininet_capture_abort(a_pData);
+            return;
+        }
+        a_pData->pCapture = pNewCapture;
+        a_pData->uiCaptureSize = uiNewSize;
+    }
+
+    memcpy(a_pData->pCapture + a_pData->uiCaptureLen, a_pBuf, a_nBufLen);
+    a_pData->uiCaptureLen = uiNewLen;
+}
+
+/* the response headers have been received, decide if we can capture it */
+static void
+wininet_capture_begin(
+    struct wininet_data *   a_pData,
+    size_t                  a_uiHeadersLen
+    )
+{
+    DWORD dwValue;
+    DWORD dwValueLen = sizeof(dwValue);
+
+    if (!HttpQueryInfoA(a_pData->hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER,
+            &dwValue, &dwValueLen, NULL) || dwValue != HTTP_STATUS_OK) 
+    {
+        wininet_capture_abort(a_pData);
+        return;
+    }
+
+    dwValueLen = sizeof(dwValue);
+    a_pData->uiCaptureBody = INVALID_BUFFER_LENGTH;
+    if (HttpQueryInfoA(a_pData->hRequest, HTTP_QUERY_CONTENT_LENGTH | HTTP_QUERY_FLAG_NUMBER,
+            &dwValue, &dwValueLen, NULL)) 
+    {
+        a_pData->uiCaptureBody = dwValue;
+    }
+    a_pData->uiCaptureHeaders = a_uiHeadersLen;
+    a_pData->uiCaptureLen = 0;
+
+    /* keep the validators so that the response can be revalidated */
+    a_pData->pCaptureETag = wininet_query_header(a_pData->hRequest, HTTP_QUERY_ETAG);
+    a_pData->pCaptureLastModified = wininet_query_header(a_pData->hRequest, HTTP_QUERY_LAST_MODIFIED);
+}
+
+/*  Check the response cache for a message that is complete and ready to be 
+    sent. On a hit the cached response is set up to be returned by frecv. If
+    an expired response may be revalidated then its validators are set up to
+    be sent. Unless it is a hit, the response will be captured for the cache. 
+    Returns one of the WININET_CACHE_xxx values.
+ */
+static int
+wininet_cache_check(
+    struct wininet_data *   a_pData,
+    const char *            a_pMsg,
+    size_t                  a_uiMsgLen
+    )
+{
+    struct wininet_cache_rule * pRule;
+    struct wininet_cache_key key;
+    int nResult;
+
+    pRule = wininet_cache_rule_find(a_pData);
+    if (!pRule) {
+        return WININET_CACHE_MISS;
+    }
+
+    wininet_cache_key_init(a_pData, &key, a_pMsg, a_uiMsgLen);
+    nResult = wininet_cache_lookup(a_pData, &key, pRule->bRevalidate);
+    if (nResult == WININET_CACHE_HIT) {
+        WININET_LOG1(a_pData, "cache_check: cache hit, %lu bytes", a_pData->uiReplayLen);
+        ++a_pData->stats.nCacheHits;
+        return nResult;
+    }
+
+    if (nResult == WININET_CACHE_STALE) {
+        WININET_LOG0(a_pData, "cache_check: revalidating cached response");
+        ++a_pData->stats.nRevalidated;
+        a_pData->bRevalidating = TRUE;
+    }
+    else {
+        WININET_LOG0(a_pData, "cache_check: cache miss");
+        ++a_pData->stats.nCacheMisses;
+    }
+    a_pData->pCacheEndpoint = strdup(key.pEndpoint);
+    a_pData->cacheKey = key;
+    a_pData->cacheKey.pEndpoint = a_pData->pCacheEndpoint;
+    a_pData->dwCacheTtl = pRule->dwTtl;
+    a_pData->bCaptureCache = (a_pData->pCacheEndpoint != NULL);
+    a_pData->bCapture = a_pData->bCaptureCache;
+    return nResult;
+}
+
+/* the complete response has been captured */
+static void
+wininet_capture_complete(
+    struct wininet_data *   a_pData
+    )
+{
+    if (!a_pData->bCapture) {
+        return;
+    }
+    a_pData->bCapture = FALSE;
+    if (a_pData->bCaptureCache) {
+        wininet_cache_store(a_pData);
+    }
+    wininet_flight_publish(a_pData, TRUE);
+}
+
+static struct wininet_lock          wininet_endpoint_lock;
+static struct wininet_endpoint *    wininet_endpoint_list;
+static HANDLE                       wininet_probe_thread;
+static HANDLE                       wininet_probe_stop;
+static volatile DWORD               wininet_probe_interval;
+
+/*  find or add the shared state for an endpoint. The state is never freed as
+    the number of distinct endpoints configured is small. */
+static struct wininet_endpoint *
+wininet_endpoint_get(
+    const char *    a_pszUrl
+    )
+{
+    struct wininet_endpoint * pEndpoint;
+
+    wininet_lock_enter(&wininet_endpoint_lock);
+    for (pEndpoint = wininet_endpoint_list; pEndpoint; pEndpoint = pEndpoint->pNext) {
+        if (!strcmp(pEndpoint->pUrl, a_pszUrl)) break;
+    }
+    if (!pEndpoint) {
+        pEndpoint = (struct wininet_endpoint *) malloc(sizeof(struct wininet_endpoint));
+        if (pEndpoint) {
+            memset(pEndpoint, 0, sizeof(struct wininet_endpoint));
+            pEndpoint->pUrl = strdup(a_pszUrl);
+            if (!pEndpoint->pUrl) {
+                free(pEndpoint);
+                pEndpoint = NULL;
+            }
+            else {
+                pEndpoint->pNext = wininet_endpoint_list;
+                wininet_endpoint_list = pEndpoint;
+            }
+        }
+    }
+    wininet_lock_leave(&wininet_endpoint_lock);
+    return pEndpoint;
+}
+
+/* can the endpoint be used. The lock must be held. */
+static BOOL
+wininet_endpoint_available(
+    const struct wininet_endpoint * a_pEndpoint,
+    DWORD                           a_dwNow
+    )
+{
+    return !a_pEndpoint->bDown || (LONG) (a_dwNow - a_pEndpoint->dwDownUntil) >= 0;
+}
+
+/*  the expected cost of sending to an endpoint. Endpoints without a known 
+    latency cost nothing so that they are tried. The lock must be held. */
+static ULONGLONG
+wininet_endpoint_cost(
+    const struct wininet_endpoint * a_pEndpoint
+    )
+{
+    return (ULONGLONG) a_pEndpoint->dwLatency * (ULONGLONG) (a_pEndpoint->nOutstanding + 1);
+}
+
+/*  Choose one of the configured endpoints that hasn't already failed for the 
+    current message. Two of the available endpoints are chosen at random and 
+    the one with the lower expected cost is used. If none are available then 
+    one that is down is tried anyway. Returns NULL if all have been tried. */
+static struct wininet_endpoint *
+wininet_endpoint_select(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_endpoint * apCandidates[WININET_MAX_ENDPOINTS];
+    struct wininet_endpoint * pEndpoint = NULL;
+    unsigned nCandidates = 0;
+    unsigned nFirst, nSecond, n;
+    DWORD dwNow = GetTickCount();
+
+    wininet_lock_enter(&wininet_endpoint_lock);
+    for (n = 0; n < a_pData->nEndpoints; ++n) {
+        if (!(a_pData->dwEndpointsTried & (1UL << n)) 
+            && wininet_endpoint_available(a_pData->apEndpoints[n], dwNow)) 
+        {
+            apCandidates[nCandidates++] = a_pData->apEndpoints[n];
+        }
+    }
+    if (!nCandidates) {
+        for (n = 0; n < a_pData->nEndpoints; ++n) {
+            if (!(a_pData->dwEndpointsTried & (1UL << n))) {
+                apCandidates[nCandidates++] = a_pData->apEndpoints[n];
+            }
+        }
+    }
+    if (nCandidates) {
+        nFirst = wininet_random(a_pData) % nCandidates;
+        pEndpoint = apCandidates[nFirst];
+        if (nCandidates > 1) {
+            nSecond = (nFirst + 1 + wininet_random(a_pData) % (nCandidates - 1)) % nCandidates;
+            if (wininet_endpoint_cost(apCandidates[nSecond]) < wininet_endpoint_cost(pEndpoint)) {
+                pEndpoint = apCandidates[nSecond];
+            }
+        }
+    }
+    wininet_lock_leave(&wininet_endpoint_lock);
+
+    return pEndpoint;
+}
+
+/*  update the state of the current endpoint after a message was sent 
+    (a_bReached) or the server couldn't be reached */
+static void
+wininet_endpoint_complete(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bReached,
+    DWORD                   a_dwLatency
+    )
+{
+    struct wininet_endpoint * pEndpoint = a_pData->pEndpointState;
+
+    if (!pEndpoint) {
+        return;
+    }
+
+    wininet_lock_enter(&wininet_endpoint_lock);
+    if (a_bReached) {
+        if (!a_dwLatency) a_dwLatency = 1;
+        pEndpoint->bDown = FALSE;
+        pEndpoint->dwLatency = pEndpoint->dwLatency 
+            ? (pEndpoint->dwLatency * 7 + a_dwLatency) / 8 : a_dwLatency;
+    }
+    else {
+        pEndpoint->bDown = TRUE;
+        pEndpoint->dwDownUntil = GetTickCount() + WININET_ENDPOINT_RETRY;
+    }
+    wininet_lock_leave(&wininet_endpoint_lock);
+}
+
+/*  Parse an endpoint URL. The components are cracked as pointers into the 
+    endpoint and then copied so that there is no limit on their length. The 
+    result must be freed unless it is added to a cache. Returns NULL and sets 
+    the last error on failure. */
+static struct wininet_url *
+wininet_url_parse(
+    const char *    a_pszEndpoint,
+    ULONGLONG       a_nHash
+    )
+{
+    URL_COMPONENTSA urlComponents;
+    struct wininet_url * pUrl;
+    const char *    pPath;
+    size_t          nEndpointLen = strlen(a_pszEndpoint);
+    size_t          nPathLen;
+
+    memset(&urlComponents, 0, sizeof(urlComponents));
+    urlComponents.dwStructSize = sizeof(urlComponents);
+    urlComponents.dwHostNameLength  = 1;
+    urlComponents.dwUrlPathLength   = 1;
+    urlComponents.dwExtraInfoLength = 1;
+    if (!InternetCrackUrlA(a_pszEndpoint, 0, 0, &urlComponents)) {
+        return NULL;
+    }
+
+    /* the path and extra info are adjacent in the endpoint */
+    pPath = urlComponents.lpszUrlPath ? urlComponents.lpszUrlPath : urlComponents.lpszExtraInfo;
+    nPathLen = pPath ? urlComponents.dwUrlPathLength + urlComponents.dwExtraInfoLength : 0;
+
+    pUrl = (struct wininet_url *) malloc(sizeof(struct wininet_url) 
+        + nEndpointLen + 1 + urlComponents.dwHostNameLength + 1 + nPathLen);
+    if (!pUrl) {
+        SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        return NULL;
+    }
+    pUrl->pNext     = NULL;
+    pUrl->nHash     = a_nHash;
+    pUrl->bCached   = FALSE;
+    pUrl->nScheme   = urlComponents.nScheme;
+    pUrl->nPort     = urlComponents.nPort;
+    memcpy(pUrl->szEndpoint, a_pszEndpoint, nEndpointLen + 1);
+    pUrl->pHost = pUrl->szEndpoint + nEndpointLen + 1;
+    if (urlComponents.dwHostNameLength) {
+        memcpy(pUrl->pHost, urlComponents.lpszHostName, urlComponents.dwHostNameLength);
+    }
+    pUrl->pHost[urlComponents.dwHostNameLength] = 0;
+    pUrl->pUrlPath = pUrl->pHost + urlComponents.dwHostNameLength + 1;
+    if (nPathLen) {
+        memcpy(pUrl->pUrlPath, pPath, nPathLen);
+    }
+    pUrl->pUrlPath[nPathLen] = 0;
+
+    return pUrl;
+}
+
+/*  Get the parsed form of an endpoint, parsing it only the first time that 
+    it is used by this instance. If the cache is full then the result is not 
+    cached and must be freed by the caller. Returns NULL and sets the last 
+    error on failure. */
+static struct wininet_url *
+wininet_url_get(
+    struct wininet_data *   a_pData,
+    const char *            a_pszEndpoint
+    )
+{
+    struct wininet_url ** ppBucket;
+    struct wininet_url * pUrl;
+    ULONGLONG nHash = wininet_hash(WININET_HASH_INIT, a_pszEndpoint, strlen(a_pszEndpoint));
+
+    ppBucket = &a_pData->apUrls[nHash % WININET_URL_BUCKETS];
+    for (pUrl = *ppBucket; pUrl; pUrl = pUrl->pNext) {
+        if (pUrl->nHash == nHash && !strcmp(pUrl->szEndpoint, a_pszEndpoint)) {
+            return pUrl;
+        }
+    }
+
+    pUrl = wininet_url_parse(a_pszEndpoint, nHash);
+    if (pUrl && a_pData->nUrls < WININET_MAX_URLS) {
+        pUrl->bCached = TRUE;
+        pUrl->pNext = *ppBucket;
+        *ppBucket = pUrl;
+        ++a_pData->nUrls;
+    }
+    return pUrl;
+}
+
+/*  Send a HEAD request to a URL using the supplied session, returning TRUE if
+    the server responded with any status. */
+static BOOL
+wininet_http_head(
+    HINTERNET       a_hInternet,
+    const char *    a_pszUrl,
+    DWORD           a_dwFlags
+    )
+{
+    struct wininet_url * pUrl;
+    HINTERNET       hConnection;
+    HINTERNET       hRequest;
+    BOOL            bResult = FALSE;
+
+    pUrl = wininet_url_parse(a_pszUrl, 0);
+    if (!pUrl) {
+        return FALSE;
+    }
+    if (pUrl->nScheme == INTERNET_SCHEME_HTTPS) {
+        a_dwFlags |= INTERNET_FLAG_SECURE;
+    }
+
+    hConnection = InternetConnectA(a_hInternet, pUrl->pHost, pUrl->nPort, 
+        "", "", INTERNET_SERVICE_HTTP, 0, 0);
+    if (hConnection) {
+        hRequest = HttpOpenRequestA(hConnection, "HEAD", pUrl->pUrlPath, "HTTP/1.1", 
+            NULL, NULL, a_dwFlags | INTERNET_FLAG_PRAGMA_NOCACHE | INTERNET_FLAG_NO_CACHE_WRITE 
+            | INTERNET_FLAG_RELOAD | INTERNET_FLAG_NO_AUTO_REDIRECT, 0);
+        if (hRequest) {
+            bResult = HttpSendRequestA(hRequest, NULL, 0, NULL, 0);
+            InternetCloseHandle(hRequest);
+        }
+        InternetCloseHandle(hConnection);
+    }
+    free(pUrl);
+    return bResult;
+}
+
+/* periodically check whether each endpoint can be reached */
+static unsigned __stdcall
+wininet_probe_proc(
+    void * a_pArg
+    )
+{
+    struct wininet_endpoint * pEndpoint;
+    HINTERNET hInternet;
+    DWORD dwTimeout;
+    BOOL bReached;
+
+    UNUSED_ARG(a_pArg);
+
+    hInternet = InternetOpenA("gsoapWinInet", INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+    if (!hInternet) {
+        return 0;
+    }
+
+    while (WaitForSingleObject(wininet_probe_stop, wininet_probe_interval) == WAIT_TIMEOUT) {
+        dwTimeout = wininet_probe_interval;
+        InternetSetOption(hInternet, INTERNET_OPTION_CONNECT_TIMEOUT, &dwTimeout, sizeof(dwTimeout));
+        InternetSetOption(hInternet, INTERNET_OPTION_RECEIVE_TIMEOUT, &dwTimeout, sizeof(dwTimeout));
+
+        /* endpoints are only ever added to the head of the list */
+        wininet_lock_enter(&wininet_endpoint_lock);
+        pEndpoint = wininet_endpoint_list;
+        wininet_lock_leave(&wininet_endpoint_lock);
+
+        for (; pEndpoint; pEndpoint = pEndpoint->pNext) {
+            bReached = wininet_http_head(hInternet, pEndpoint->pUrl, 0);
+
+            wininet_lock_enter(&wininet_endpoint_lock);
+            if (!bReached) {
+                pEndpoint->bDown = TRUE;
+                pEndpoint->dwDownUntil = GetTickCount() + (wininet_probe_interval > WININET_ENDPOINT_RETRY 
+                    ? wininet_probe_interval : WININET_ENDPOINT_RETRY);
+            }
+            else if (pEndpoint->bDown) {
+                /* forget the latency so that the endpoint is tried again */
+                pEndpoint->bDown = FALSE;
+                pEndpoint->dwLatency = 0;
+            }
+            wininet_lock_leave(&wininet_endpoint_lock);
+        }
+    }
+
+    InternetCloseHandle(hInternet);
+    return 0;
+}
+
+/* circuit breaker state of a server shared by all plugin instances */
+struct wininet_breaker
+{
+    struct wininet_breaker *    pNext;
+    char *                      pHost;
+    INTERNET_PORT               nPort;
+    int                         nState;         /* WININET_CIRCUIT_xxx */
+    DWORD                       dwHistory;      /* recent results, 1 = failure, newest in bit 0 */
+    unsigned                    nSamples;       /* number of results in the history */
+    unsigned                    nFailures;      /* number of failures in the history */
+    DWORD                       dwOpened;       /* tick count when the circuit was opened */
+    BOOL                        bTrial;         /* a trial request is in progress while half-open */
+    DWORD                       dwTrialStart;   /* tick count when the trial started */
+    unsigned long               nOpened;        /* number of times the circuit was opened */
+};
+
+#define WININET_CIRCUIT_WINDOW  20  /* number of recent results used for the failure rate */
+
+static struct wininet_lock          wininet_breaker_lock;
+static struct wininet_breaker *     wininet_breaker_list;
+static unsigned                     wininet_breaker_percent  = 50;
+static unsigned                     wininet_breaker_minimum  = 10;
+static DWORD                        wininet_breaker_open_ms  = 30 * 1000;
+
+/* find or add the circuit breaker of a server. The lock must be held. */
+static struct wininet_breaker *
+wininet_breaker_get(
+    const char *    a_pszHost,
+    INTERNET_PORT   a_nPort
+    )
+{
+    struct wininet_breaker * pBreaker;
+
+    for (pBreaker = wininet_breaker_list; pBreaker; pBreaker = pBreaker->pNext) {
+        if (pBreaker->nPort == a_nPort && !stricmp(pBreaker->pHost, a_pszHost)) {
+            return pBreaker;
+        }
+    }
+
+    pBreaker = (struct wininet_breaker *) malloc(sizeof(struct wininet_breaker));
+    if (!pBreaker) return NULL;
+    memset(pBreaker, 0, sizeof(struct wininet_breaker));
+    pBreaker->pHost = strdup(a_pszHost);
+    if (!pBreaker->pHost) {
+        free(pBreaker);
+        return NULL;
+    }
+    pBreaker->nPort = a_nPort;
+    pBreaker->nState = WININET_CIRCUIT_CLOSED;
+    pBreaker->pNext = wininet_breaker_list;
+    wininet_breaker_list = pBreaker;
+    return pBreaker;
+}
+
+/*  Determine if a message may be sent to the current server. While the 
+    circuit is open all messages are refused until the open time has passed, 
+    then a single trial message is allowed through (half-open). */
+static BOOL
+wininet_breaker_allow(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_breaker * pBreaker;
+    BOOL bAllow = TRUE;
+    DWORD dwNow = GetTickCount();
+
+    a_pData->bBreakerTrial = FALSE;
+    a_pData->bBreakerPending = TRUE;
+    if (!a_pData->bCircuitBreaker || !a_pData->pHost) {
+        return TRUE;
+    }
+
+    wininet_lock_enter(&wininet_breaker_lock);
+    pBreaker = wininet_breaker_get(a_pData->pHost, a_pData->nPort);
+    if (pBreaker && pBreaker->nState != WININET_CIRCUIT_CLOSED) {
+        if (pBreaker->nState == WININET_CIRCUIT_OPEN 
+            && dwNow - pBreaker->dwOpened >= wininet_breaker_open_ms) 
+        {
+            pBreaker->nState = WININET_CIRCUIT_HALF_OPEN;
+            pBreaker->bTrial = FALSE;
+        }
+
+        /* a trial that never completed doesn't block the circuit forever */
+        if (pBreaker->nState == WININET_CIRCUIT_HALF_OPEN 
+            && (!pBreaker->bTrial || dwNow - pBreaker->dwTrialStart >= wininet_breaker_open_ms)) 
+        {
+            pBreaker->bTrial = TRUE;
+            pBreaker->dwTrialStart = dwNow;
+            a_pData->bBreakerTrial = TRUE;
+        }
+        else {
+            bAllow = FALSE;
+        }
+    }
+    wininet_lock_leave(&wininet_breaker_lock);
+
+    if (a_pData->bBreakerTrial) {
+        WININET_LOG2(a_pData, "breaker_allow: sending trial message to %s:%u", 
+            a_pData->pHost, (unsigned) a_pData->nPort);
+    }
+    if (!bAllow) {
+        WININET_LOG2(a_pData, "breaker_allow: circuit to %s:%u is open", 
+            a_pData->pHost, (unsigned) a_pData->nPort);
+        ++a_pData->stats.nCircuitRejected;
+        a_pData->bBreakerPending = FALSE;
+    }
+    return bAllow;
+}
+
+/*  record the result of a message sent to the current server. Only the 
+    first result of each message is recorded, retries and the reading of the 
+    response don't count again. */
+static void
+wininet_breaker_record(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bFailed
+    )
+{
+    struct wininet_breaker * pBreaker;
+    int nOldState, nNewState;
+
+    if (!a_pData->bBreakerPending) {
+        return;
+    }
+    a_pData->bBreakerPending = FALSE;
+    if (!a_pData->bCircuitBreaker || !a_pData->pHost) {
+        return;
+    }
+
+    wininet_lock_enter(&wininet_breaker_lock);
+    pBreaker = wininet_breaker_get(a_pData->pHost, a_pData->nPort);
+    if (!pBreaker) {
+        wininet_lock_leave(&wininet_breaker_lock);
+        return;
+    }
+    nOldState = pBreaker->nState;
+
+    if (pBreaker->nState == WININET_CIRCUIT_HALF_OPEN) {
+        /* only the result of the trial message decides the state */
+        if (a_pData->bBreakerTrial) {
+            pBreaker->bTrial = FALSE;
+            if (a_bFailed) {
+                pBreaker->nState = WININET_CIRCUIT_OPEN;
+                pBreaker->dwOpened = GetTickCount();
+            }
+            else {
+                pBreaker->nState = WININET_CIRCUIT_CLOSED;
+                pBreaker->dwHistory = 0;
+                pBreaker->nSamples = pBreaker->nFailures = 0;
+            }
+        }
+    }
+    else if (pBreaker->nState == WININET_CIRCUIT_CLOSED) {
+        if (pBreaker->nSamples == WININET_CIRCUIT_WINDOW) {
+            if (pBreaker->dwHistory & (1UL << (WININET_CIRCUIT_WINDOW - 1))) {
+                --pBreaker->nFailures;
+            }
+        }
+        else {
+            ++pBreaker->nSamples;
+        }
+        pBreaker->dwHistory = ((pBreaker->dwHistory << 1) | (a_bFailed ? 1 : 0)) 
+            & ((1UL << WININET_CIRCUIT_WINDOW) - 1);
+        if (a_bFailed) {
+            ++pBreaker->nFailures;
+        }
+
+        if (pBreaker->nSamples >= wininet_breaker_minimum 
+            && pBreaker->nFailures * 100 >= pBreaker->nSamples * wininet_breaker_percent)
+        {
+            pBreaker->nState = WININET_CIRCUIT_OPEN;
+            pBreaker->dwOpened = GetTickCount();
+        }
+    }
+    nNewState = pBreaker->nState;
+    if (nNewState == WININET_CIRCUIT_OPEN && nOldState != WININET_CIRCUIT_OPEN) {
+        ++pBreaker->nOpened;
+    }
+    wininet_lock_leave(&wininet_breaker_lock);
+
+    a_pData->bBreakerTrial = FALSE;
+    if (nNewState != nOldState) {
+        if (nNewState == WININET_CIRCUIT_OPEN) {
+            WININET_LOG2(a_pData, "breaker_record: opened circuit to %s:%u", 
+                a_pData->pHost, (unsigned) a_pData->nPort);
+            ++a_pData->stats.nCircuitOpened;
+        }
+        else {
+            WININET_LOG2(a_pData, "breaker_record: closed circuit to %s:%u", 
+                a_pData->pHost, (unsigned) a_pData->nPort);
+            ++a_pData->stats.nCircuitClosed;
+        }
+    }
+}
+
+/* errors which show that the server is unavailable or not responding */
+static BOOL
+wininet_is_server_error(
+    DWORD   a_dwError
+    )
+{
+    switch (a_dwError) {
+    case ERROR_INTERNET_CANNOT_CONNECT:
+    case ERROR_INTERNET_NAME_NOT_RESOLVED:
+    case ERROR_INTERNET_TIMEOUT:
+    case ERROR_INTERNET_CONNECTION_ABORTED:
+    case ERROR_INTERNET_CONNECTION_RESET:
+    case ERROR_HTTP_INVALID_SERVER_RESPONSE:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* concurrency limit of a server shared by all plugin instances */
+struct wininet_limiter
+{
+    struct wininet_limiter *    pNext;
+    char *                      pHost;
+    INTERNET_PORT               nPort;
+    unsigned                    nLimit;         /* current limit of messages in progress */
+    unsigned                    nSuccesses;     /* successes since the limit was last increased */
+    unsigned                    nInFlight;      /* messages in progress */
+    unsigned                    nQueued;        /* messages waiting for a slot */
+    unsigned long               nRejected;      /* messages refused */
+    DWORD                       dwLastDecrease; /* tick count when the limit was last decreased */
+    BOOL                        bDecreased;     /* dwLastDecrease is valid */
+    HANDLE                      hSlot;          /* auto-reset event set when a slot is released */
+};
+
+#ifndef HTTP_STATUS_TOO_MANY_REQUESTS
+# define HTTP_STATUS_TOO_MANY_REQUESTS 429
+#endif
+
+static struct wininet_lock          wininet_limiter_lock;
+static struct wininet_limiter *     wininet_limiter_list;
+static unsigned                     wininet_limiter_initial  = 8;
+static unsigned                     wininet_limiter_max      = 256;
+static DWORD                        wininet_limiter_latency  = 0;
+static DWORD                        wininet_limiter_wait     = 0;
+
+/* find or add the limiter of a server. The lock must be held. */
+static struct wininet_limiter *
+wininet_limiter_get(
+    const char *    a_pszHost,
+    INTERNET_PORT   a_nPort
+    )
+{
+    struct wininet_limiter * pLimiter;
+
+    for (pLimiter = wininet_limiter_list; pLimiter; pLimiter = pLimiter->pNext) {
+        if (pLimiter->nPort == a_nPort && !stricmp(pLimiter->pHost, a_pszHost)) {
+            return pLimiter;
+        }
+    }
+
+    pLimiter = (struct wininet_limiter *) malloc(sizeof(struct wininet_limiter));
+    if (!pLimiter) return NULL;
+    memset(pLimiter, 0, sizeof(struct wininet_limiter));
+    pLimiter->pHost = strdup(a_pszHost);
+    pLimiter->hSlot = CreateEventA(NULL, FALSE, FALSE, NULL);
+    if (!pLimiter->pHost || !pLimiter->hSlot) {
+        if (pLimiter->hSlot) CloseHandle(pLimiter->hSlot);
+        free(pLimiter->pHost);
+        free(pLimiter);
+        return NULL;
+    }
+    pLimiter->nPort = a_nPort;
+    pLimiter->nLimit = wininet_limiter_initial;
+    pLimiter->pNext = wininet_limiter_list;
+    wininet_limiter_list = pLimiter;
+    return pLimiter;
+}
+
+/*  Take a slot for sending a message to the current server. If the limit of
+    messages in progress has been reached then wait for a slot for up to the 
+    configured time. Returns FALSE if the message must be refused. */
+static BOOL
+wininet_limiter_acquire(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_limiter * pLimiter;
+    DWORD dwStart = GetTickCount();
+    DWORD dwElapsed;
+    BOOL bQueued = FALSE;
+
+    if (!a_pData->bConcurrencyLimit || !a_pData->pHost) {
+        return TRUE;
+    }
+
+    wininet_lock_enter(&wininet_limiter_lock);
+    pLimiter = wininet_limiter_get(a_pData->pHost, a_pData->nPort);
+    if (!pLimiter) {
+        wininet_lock_leave(&wininet_limiter_lock);
+        return TRUE;
+    }
+
+    while (pLimiter->nInFlight >= pLimiter->nLimit) {
+        dwElapsed = GetTickCount() - dwStart;
+        if (dwElapsed >= wininet_limiter_wait) {
+            if (bQueued) --pLimiter->nQueued;
+            ++pLimiter->nRejected;
+            wininet_lock_leave(&wininet_limiter_lock);
+
+            WININET_LOG2(a_pData, "limiter_acquire: limit of %u reached for %s, refusing",
+                pLimiter->nLimit, pLimiter->pHost);
+            ++a_pData->stats.nLimitRejected;
+            return FALSE;
+        }
+        if (!bQueued) {
+            bQueued = TRUE;
+            ++pLimiter->nQueued;
+            ++a_pData->stats.nLimitQueued;
+            WININET_LOG2(a_pData, "limiter_acquire: limit of %u reached for %s, waiting",
+                pLimiter->nLimit, pLimiter->pHost);
+        }
+        wininet_lock_leave(&wininet_limiter_lock);
+        wininet_log_commit(a_pData);
+        WaitForSingleObject(pLimiter->hSlot, wininet_limiter_wait - dwElapsed);
+        wininet_lock_enter(&wininet_limiter_lock);
+    }
+
+    if (bQueued) --pLimiter->nQueued;
+    ++pLimiter->nInFlight;
+
+    /* pass on the wakeup if there is still room for other waiters */
+    if (pLimiter->nQueued && pLimiter->nInFlight < pLimiter->nLimit) {
+        SetEvent(pLimiter->hSlot);
+    }
+    wininet_lock_leave(&wininet_limiter_lock);
+
+    a_pData->pLimiter = pLimiter;
+    a_pData->dwLimiterStart = GetTickCount();
+    return TRUE;
+}
+
+/*  Release the slot of the current message. If a_bRecord is set the limit is 
+    adjusted: increased by one after a full limit of messages succeeded, or 
+    reduced by a quarter when the server showed it is overloaded (a_bOverload
+    or a slow response). Only messages that started after the last decrease 
+    can reduce it again. */
+static void
+wininet_limiter_release(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bRecord,
+    BOOL                    a_bOverload
+    )
+{
+    struct wininet_limiter * pLimiter = a_pData->pLimiter;
+    DWORD dwLatency;
+    unsigned nOldLimit, nNewLimit;
+
+    if (!pLimiter) {
+        return;
+    }
+    a_pData->pLimiter = NULL;
+
+    dwLatency = GetTickCount() - a_pData->dwLimiterStart;
+    if (wininet_limiter_latency && dwLatency > wininet_limiter_latency) {
+        a_bOverload = TRUE;
+    }
+
+    wininet_lock_enter(&wininet_limiter_lock);
+    --pLimiter->nInFlight;
+    nOldLimit = pLimiter->nLimit;
+    if (a_bRecord && a_bOverload) {
+        if (!pLimiter->bDecreased 
+            || (LONG) (a_pData->dwLimiterStart - pLimiter->dwLastDecrease) >= 0) 
+        {
+            /* small limits are still reduced by at least one */
+            pLimiter->nLimit -= pLimiter->nLimit / 4 > 1 ? pLimiter->nLimit / 4 : 1;
+            if (pLimiter->nLimit < 1) pLimiter->nLimit = 1;
+            pLimiter->nSuccesses = 0;
+            pLimiter->dwLastDecrease = GetTickCount();
+            pLimiter->bDecreased = TRUE;
+        }
+    }
+    else if (a_bRecord) {
+        if (++pLimiter->nSuccesses >= pLimiter->nLimit) {
+            pLimiter->nSuccesses = 0;
+            if (pLimiter->nLimit < wininet_limiter_max) {
+                ++pLimiter->nLimit;
+            }
+        }
+    }
+    if (pLimiter->nQueued && pLimiter->nInFlight < pLimiter->nLimit) {
+        SetEvent(pLimiter->hSlot);
+    }
+    nNewLimit = pLimiter->nLimit;
+    wininet_lock_leave(&wininet_limiter_lock);
+
+    if (nNewLimit != nOldLimit) {
+        WININET_LOG2(a_pData, "limiter_release: limit for %s is now %u", 
+            pLimiter->pHost, nNewLimit);
+    }
+}
+
+static void
+wininet_fanout_free(
+    struct wininet_fanout * a_pFanout
+    )
+{
+    unsigned n;
+
+    if (!a_pFanout) {
+        return;
+    }
+    for (n = 0; n < a_pFanout->nEndpoints; ++n) {
+        free(a_pFanout->ppEndpoints[n]);
+    }
+    free(a_pFanout->ppEndpoints);
+    free(a_pFanout->anCompleted);
+    if (a_pFanout->hCompleted) {
+        CloseHandle(a_pFanout->hCompleted);
+    }
+    free(a_pFanout);
+}
+
+/*  Connect to an endpoint so that the name resolution, proxy detection, 
+    connection and TLS handshake are done. The connection is kept by WinInet
+    for the session and will be used by the next request to the server, so 
+    it is made with the same request flags. */
+static BOOL
+wininet_prewarm_endpoint(
+    HINTERNET       a_hInternet,
+    const char *    a_pszEndpoint,
+    DWORD           a_dwFlags
+    )
+{
+    return wininet_http_head(a_hInternet, a_pszEndpoint, a_dwFlags | INTERNET_FLAG_KEEP_CONNECTION);
+}
+
+static unsigned __stdcall
+wininet_prewarm_thread(
+    void * a_pArg
+    )
+{
+    struct wininet_prewarm * pPrewarm = (struct wininet_prewarm *) a_pArg;
+
+    pPrewarm->bResult = wininet_prewarm_endpoint(pPrewarm->hInternet, 
+        pPrewarm->pEndpoint, pPrewarm->dwFlags);
+    return 0;
+}
+
+/*  Free background connections that have completed, or wait for all of them
+    if a_bWait is set. */
+static void
+wininet_prewarm_reap(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bWait
+    )
+{
+    struct wininet_prewarm ** ppPrewarm = &a_pData->pPrewarm;
+    struct wininet_prewarm * pPrewarm;
+
+    while (*ppPrewarm) {
+        pPrewarm = *ppPrewarm;
+        if (WaitForSingleObject(pPrewarm->hThread, a_bWait ? INFINITE : 0) != WAIT_OBJECT_0) {
+            ppPrewarm = &pPrewarm->pNext;
+            continue;
+        }
+        WININET_LOG2(a_pData, "prewarm: '%s' %s", pPrewarm->pEndpoint, 
+            pPrewarm->bResult ? "connected" : "failed");
+        if (pPrewarm->bResult) {
+            ++a_pData->stats.nPrewarmed;
+        }
+        *ppPrewarm = pPrewarm->pNext;
+        CloseHandle(pPrewarm->hThread);
+        free(pPrewarm->pEndpoint);
+        free(pPrewarm);
+    }
+}
+
+/*  The proxy decision for a server. The OS proxy discovery (WPAD and PAC 
+    evaluation) is slow and would otherwise be repeated by WinInet for every
+    plugin instance. Entries are never freed as the number of servers used 
+    by a process is small. */
+struct wininet_proxy
+{
+    struct wininet_proxy *  pNext;
+    char *                  pServer;        /* scheme://host:port */
+    int                     nType;          /* WININET_PROXY_xxx */
+    char *                  pProxy;         /* proxy list for WININET_PROXY_NAMED */
+    DWORD                   dwResolved;     /* tick count when the decision was made */
+    BOOL                    bRefreshing;    /* a background refresh is in progress */
+};
+
+/* an entry being refreshed in the background */
+struct wininet_proxy_refresh
+{
+    struct wininet_proxy_refresh * pNext;
+    struct wininet_proxy *  pEntry;
+    char *                  pUrl;
+    HANDLE                  hThread;
+};
+
+static struct wininet_lock          wininet_proxy_lock;
+static struct wininet_proxy *       wininet_proxy_list;
+static DWORD                        wininet_proxy_ttl = 5 * 60 * 1000;
+static wininet_proxy_resolver       wininet_proxy_resolve_fn;
+static void *                       wininet_proxy_resolve_ctx;
+
+/*  the parts of winhttp.h that we need. It can't be included together with 
+    wininet.h and is loaded dynamically so that it isn't a dependency. */
+typedef struct {
+    DWORD       dwFlags;
+    DWORD       dwAutoDetectFlags;
+    LPCWSTR     lpszAutoConfigUrl;
+    LPVOID      lpvReserved;
+    DWORD       dwReserved;
+    BOOL        fAutoLogonIfChallenged;
+} wininet_winhttp_autoproxy_options;
+
+typedef struct {
+    DWORD       dwAccessType;
+    LPWSTR      lpszProxy;
+    LPWSTR      lpszProxyBypass;
+} wininet_winhttp_proxy_info;
+
+typedef struct {
+    BOOL        fAutoDetect;
+    LPWSTR      lpszAutoConfigUrl;
+    LPWSTR      lpszProxy;
+    LPWSTR      lpszProxyBypass;
+} wininet_winhttp_ie_config;
+
+#define WININET_WINHTTP_AUTOPROXY_AUTO_DETECT   0x00000001
+#define WININET_WINHTTP_AUTOPROXY_CONFIG_URL    0x00000002
+#define WININET_WINHTTP_AUTO_DETECT_TYPE_DHCP   0x00000001
+#define WININET_WINHTTP_AUTO_DETECT_TYPE_DNS_A  0x00000002
+#define WININET_WINHTTP_ACCESS_TYPE_NO_PROXY    1
+#define WININET_WINHTTP_ACCESS_TYPE_NAMED_PROXY 3
+
+typedef HINTERNET (WINAPI * wininet_WinHttpOpen)(LPCWSTR, DWORD, LPCWSTR, LPCWSTR, DWORD);
+typedef BOOL (WINAPI * wininet_WinHttpCloseHandle)(HINTERNET);
+typedef BOOL (WINAPI * wininet_WinHttpGetProxyForUrl)(HINTERNET, LPCWSTR, 
+    wininet_winhttp_autoproxy_options *, wininet_winhttp_proxy_info *);
+typedef BOOL (WINAPI * wininet_WinHttpGetIEProxyConfigForCurrentUser)(wininet_winhttp_ie_config *);
+
+static volatile LONG                                    wininet_winhttp_state;
+static wininet_WinHttpOpen                              wininet_winhttp_open;
+static wininet_WinHttpCloseHandle                       wininet_winhttp_close;
+static wininet_WinHttpGetProxyForUrl                    wininet_winhttp_get_proxy;
+static wininet_WinHttpGetIEProxyConfigForCurrentUser    wininet_winhttp_get_config;
+
+/* load winhttp.dll once for the process. Returns FALSE if it isn't available. */
+static BOOL
+wininet_winhttp_load(void)
+{
+    HMODULE hModule;
+
+    wininet_lock_enter(&wininet_proxy_lock);
+    if (!wininet_winhttp_state) {
+        wininet_winhttp_state = -1;
+        hModule = LoadLibraryA("winhttp.dll");
+        if (hModule) {
+            wininet_winhttp_open  = (wininet_WinHttpOpen) 
+                GetProcAddress(hModule, "WinHttpOpen");
+            wininet_winhttp_close = (wininet_WinHttpCloseHandle) 
+                GetProcAddress(hModule, "WinHttpCloseHandle");
+            wininet_winhttp_get_proxy = (wininet_WinHttpGetProxyForUrl) 
+                GetProcAddress(hModule, "WinHttpGetProxyForUrl");
+            wininet_winhttp_get_config = (wininet_WinHttpGetIEProxyConfigForCurrentUser) 
+                GetProcAddress(hModule, "WinHttpGetIEProxyConfigForCurrentUser");
+            if (wininet_winhttp_open && wininet_winhttp_close 
+                && wininet_winhttp_get_proxy && wininet_winhttp_get_config) 
+            {
+                wininet_winhttp_state = 1;
+            }
+        }
+    }
+    wininet_lock_leave(&wininet_proxy_lock);
+    return wininet_winhttp_state == 1;
+}
+
+/*  Determine the proxy for a URL the way the OS does, using the automatic 
+    proxy settings of the current user. Static proxy settings are left to 
+    WinInet as they are cheap to apply. */
+static int
+wininet_proxy_resolve_os(
+    void *          a_pContext,
+    const char *    a_pszUrl,
+    char *          a_pszProxy,
+    size_t          a_uiProxyLen
+    )
+{
+    wininet_winhttp_ie_config config;
+    wininet_winhttp_autoproxy_options options;
+    wininet_winhttp_proxy_info info;
+    HINTERNET hSession;
+    WCHAR szUrl[2048];
+    int nType = WININET_PROXY_DEFAULT;
+
+    UNUSED_ARG(a_pContext);
+
+    if (!wininet_winhttp_load()) {
+        return WININET_PROXY_DEFAULT;
+    }
+
+    memset(&config, 0, sizeof(config));
+    if (!wininet_winhttp_get_config(&config)) {
+        return WININET_PROXY_DEFAULT;
+    }
+    memset(&options, 0, sizeof(options));
+    if (config.fAutoDetect) {
+        options.dwFlags |= WININET_WINHTTP_AUTOPROXY_AUTO_DETECT;
+        options.dwAutoDetectFlags = WININET_WINHTTP_AUTO_DETECT_TYPE_DHCP 
+            | WININET_WINHTTP_AUTO_DETECT_TYPE_DNS_A;
+    }
+    if (config.lpszAutoConfigUrl) {
+        options.dwFlags |= WININET_WINHTTP_AUTOPROXY_CONFIG_URL;
+        options.lpszAutoConfigUrl = config.lpszAutoConfigUrl;
+    }
+    options.fAutoLogonIfChallenged = TRUE;
+
+    if (options.dwFlags 
+        && MultiByteToWideChar(CP_ACP, 0, a_pszUrl, -1, szUrl, sizeof(szUrl)/sizeof(szUrl[0]))) 
+    {
+        hSession = wininet_winhttp_open(NULL, WININET_WINHTTP_ACCESS_TYPE_NO_PROXY, NULL, NULL, 0);
+        if (hSession) {
+            memset(&info, 0, sizeof(info));
+            if (wininet_winhttp_get_proxy(hSession, szUrl, &options, &info)) {
+                if (info.dwAccessType == WININET_WINHTTP_ACCESS_TYPE_NAMED_PROXY && info.lpszProxy) {
+                    if (WideCharToMultiByte(CP_ACP, 0, info.lpszProxy, -1, 
+                        a_pszProxy, (int) a_uiProxyLen, NULL, NULL)) 
+                    {
+                        nType = WININET_PROXY_NAMED;
+                    }
+                }
+                else {
+                    nType = WININET_PROXY_DIRECT;
+                }
+                if (info.lpszProxy) GlobalFree(info.lpszProxy);
+                if (info.lpszProxyBypass) GlobalFree(info.lpszProxyBypass);
+            }
+            wininet_winhttp_close(hSession);
+        }
+    }
+
+    if (config.lpszAutoConfigUrl) GlobalFree(config.lpszAutoConfigUrl);
+    if (config.lpszProxy) GlobalFree(config.lpszProxy);
+    if (config.lpszProxyBypass) GlobalFree(config.lpszProxyBypass);
+    return nType;
+}
+
+/* determine the proxy for a URL and store it in the entry */
+static void
+wininet_proxy_resolve(
+    struct wininet_proxy *  a_pEntry,
+    const char *            a_pszUrl
+    )
+{
+    char szProxy[1024];
+    char * pProxy = NULL;
+    int nType;
+    wininet_proxy_resolver pResolver;
+    void * pContext;
+
+    wininet_lock_enter(&wininet_proxy_lock);
+    pResolver = wininet_proxy_resolve_fn ? wininet_proxy_resolve_fn : wininet_proxy_resolve_os;
+    pContext = wininet_proxy_resolve_ctx;
+    wininet_lock_leave(&wininet_proxy_lock);
+
+    szProxy[0] = 0;
+    nType = pResolver(pContext, a_pszUrl, szProxy, sizeof(szProxy));
+    if (nType == WININET_PROXY_NAMED) {
+        szProxy[sizeof(szProxy) - 1] = 0;
+        pProxy = strdup(szProxy);
+        if (!pProxy) nType = WININET_PROXY_DEFAULT;
+    }
+    else if (nType != WININET_PROXY_DIRECT) {
+        nType = WININET_PROXY_DEFAULT;
+    }
+
+    wininet_lock_enter(&wininet_proxy_lock);
+    free(a_pEntry->pProxy);
+    a_pEntry->pProxy = pProxy;
+    a_pEntry->nType = nType;
+    a_pEntry->dwResolved = GetTickCount();
+    a_pEntry->bRefreshing = FALSE;
+    wininet_lock_leave(&wininet_proxy_lock);
+}
+
+static unsigned __stdcall
+wininet_proxy_refresh_thread(
+    void * a_pArg
+    )
+{
+    struct wininet_proxy_refresh * pRefresh = (struct wininet_proxy_refresh *) a_pArg;
+
+    wininet_proxy_resolve(pRefresh->pEntry, pRefresh->pUrl);
+    return 0;
+}
+
+/*  Free background refreshes that have completed, or wait for all of them
+    if a_bWait is set. */
+static void
+wininet_proxy_refresh_reap(
+    struct wininet_data *   a_pData,
+    BOOL                    a_bWait
+    )
+{
+    struct wininet_proxy_refresh ** ppRefresh = &a_pData->pProxyRefresh;
+    struct wininet_proxy_refresh * pRefresh;
+
+    while (*ppRefresh) {
+        pRefresh = *ppRefresh;
+        if (WaitForSingleObject(pRefresh->hThread, a_bWait ? INFINITE : 0) != WAIT_OBJECT_0) {
+            ppRefresh = &pRefresh->pNext;
+            continue;
+        }
+        *ppRefresh = pRefresh->pNext;
+        CloseHandle(pRefresh->hThread);
+        free(pRefresh->pUrl);
+        free(pRefresh);
+    }
+}
+
+/*  Get the cached proxy decision for a server as an INTERNET_OPEN_TYPE_xxx, 
+    with the proxy list for INTERNET_OPEN_TYPE_PROXY. The decision is made on 
+    the first connection to the server and refreshed in the background when 
+    it expires. */
+static DWORD
+wininet_proxy_decision(
+    struct wininet_data *   a_pData,
+    const char *            a_pszUrl,
+    INTERNET_SCHEME         a_nScheme,
+    const char *            a_pszHost,
+    INTERNET_PORT           a_nPort,
+    char *                  a_pszProxy,
+    size_t                  a_uiProxyLen
+    )
+{
+    struct wininet_proxy * pEntry;
+    struct wininet_proxy_refresh * pRefresh = NULL;
+    char szServer[MAX_PATH + 32];
+    BOOL bResolve = FALSE;
+    DWORD dwAccessType;
+    DWORD dwStart;
+
+    wininet_proxy_refresh_reap(a_pData, FALSE);
+
+    _snprintf(szServer, sizeof(szServer), "%s://%s:%u", 
+        a_nScheme == INTERNET_SCHEME_HTTPS ? "https" : "http", a_pszHost, (unsigned) a_nPort);
+    szServer[sizeof(szServer) - 1] = 0;
+
+    wininet_lock_enter(&wininet_proxy_lock);
+    for (pEntry = wininet_proxy_list; pEntry; pEntry = pEntry->pNext) {
+        if (!stricmp(pEntry->pServer, szServer)) break;
+    }
+    if (!pEntry) {
+        pEntry = (struct wininet_proxy *) calloc(1, sizeof(struct wininet_proxy));
+        if (pEntry) {
+            pEntry->pServer = strdup(szServer);
+            if (!pEntry->pServer) {
+                free(pEntry);
+                pEntry = NULL;
+            }
+            else {
+                pEntry->bRefreshing = TRUE;
+                pEntry->pNext = wininet_proxy_list;
+                wininet_proxy_list = pEntry;
+                bResolve = TRUE;
+            }
+        }
+    }
+    else if (!pEntry->bRefreshing && GetTickCount() - pEntry->dwResolved >= wininet_proxy_ttl) {
+        pRefresh = (struct wininet_proxy_refresh *) calloc(1, sizeof(struct wininet_proxy_refresh));
+        if (pRefresh) {
+            pRefresh->pEntry = pEntry;
+            pRefresh->pUrl = strdup(a_pszUrl);
+            if (!pRefresh->pUrl) {
+                free(pRefresh);
+                pRefresh = NULL;
+            }
+            else {
+                pEntry->bRefreshing = TRUE;
+            }
+        }
+    }
+    wininet_lock_leave(&wininet_proxy_lock);
+    if (!pEntry) {
+        return INTERNET_OPEN_TYPE_PRECONFIG;
+    }
+
+    /* the first connection to the server has to wait for the decision */
+    if (bResolve) {
+        dwStart = GetTickCount();
+        wininet_proxy_resolve(pEntry, a_pszUrl);
+        a_pData->stats.nProxyResolveMs += GetTickCount() - dwStart;
+        ++a_pData->stats.nProxyResolved;
+    }
+    else {
+        ++a_pData->stats.nProxyHits;
+    }
+
+    /*  later ones use the expired decision while it is refreshed. The thread 
+        is joined by wininet_proxy_refresh_reap(). */
+    if (pRefresh) {
+        WININET_LOG1(a_pData, "proxy_decision: refreshing proxy for %s", szServer);
+        pRefresh->hThread = (HANDLE) _beginthreadex(NULL, 0, 
+            wininet_proxy_refresh_thread, pRefresh, 0, NULL);
+        if (pRefresh->hThread) {
+            pRefresh->pNext = a_pData->pProxyRefresh;
+            a_pData->pProxyRefresh = pRefresh;
+        }
+        else {
+            wininet_lock_enter(&wininet_proxy_lock);
+            pEntry->bRefreshing = FALSE;
+            wininet_lock_leave(&wininet_proxy_lock);
+            free(pRefresh->pUrl);
+            free(pRefresh);
+        }
+    }
+
+    wininet_lock_enter(&wininet_proxy_lock);
+    switch (pEntry->nType) {
+    case WININET_PROXY_DIRECT:
+        dwAccessType = INTERNET_OPEN_TYPE_DIRECT;
+        break;
+    case WININET_PROXY_NAMED:
+        strncpy(a_pszProxy, pEntry->pProxy, a_uiProxyLen);
+        a_pszProxy[a_uiProxyLen - 1] = 0;
+        dwAccessType = INTERNET_OPEN_TYPE_PROXY;
+        break;
+    default:
+        dwAccessType = INTERNET_OPEN_TYPE_PRECONFIG;
+        break;
+    }
+    wininet_lock_leave(&wininet_proxy_lock);
+    return dwAccessType;
+}
+
+/* check to ensure that our connection hasn't been disconnected 
+    and disconnect remaining handles if necessary.
+ */
+static BOOL
+wininet_have_connection(
+    struct soap *           soap,
+    struct wininet_data *   a_pData
+    )
+{
+    /* close the connection */
+    BOOL bCloseConnection = a_pData->bDisconnect || !a_pData->hConnection;
+    if (bCloseConnection) {
+        if (a_pData->hRequest) {
+            WININET_LOG0(a_pData, "have_connection: have request = true, close connection = true -> closing request");
+            InternetCloseHandle(a_pData->hRequest);
+            a_pData->hRequest = NULL;
+        }
+
+        if (a_pData->hConnection) {
+            WININET_LOG0(a_pData, "have_connection: have connection = true, close connection = true -> closing connection");
+            InternetCloseHandle(a_pData->hConnection);
+            a_pData->hConnection = NULL;
+        }
+
+        soap->socket = SOAP_INVALID_SOCKET;
+        a_pData->bDisconnect = FALSE;
+        a_pData->bConnUsed = FALSE;
+    }
+
+    /* are we still connected? */
+    if (!a_pData->hConnection) {
+        WININET_LOG0(a_pData, "have_connection: false");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void CALLBACK
+wininet_callback(
+    HINTERNET   hInternet,
+    DWORD_PTR   dwContext,
+    DWORD       dwInternetStatus,
+    LPVOID      lpvStatusInformation,
+    DWORD       dwStatusInformationLength
+    )
+{
+    struct soap * soap = (struct soap *) dwContext;
+    char buf[500] = { 0 };
+    const DWORD * pdw = (const DWORD *) lpvStatusInformation; /* sometimes */
+    struct wininet_data * pData = soap ? (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id) : NULL;
+
+    UNUSED_ARG(dwStatusInformationLength);
+
+    if (!pData) {
+        return;
+    }
+
+    /* the first network activity of a send shows that a connection was obtained */
+    if (pData->bSending && !pData->bSlotAcquired) {
+        switch (dwInternetStatus) {
+        case INTERNET_STATUS_RESOLVING_NAME:
+        case INTERNET_STATUS_CONNECTING_TO_SERVER:
+        case INTERNET_STATUS_SENDING_REQUEST:
+            pData->dwSlotAcquired = GetTickCount();
+            pData->bSlotAcquired = TRUE;
+            break;
+        }
+    }
+
+    /*  During a hedged send the callbacks come from the sending threads, so 
+        nothing is logged. Closed connections are noted for each request so 
+        that the state of the request that wins can be kept. */
+    if (pData->bHedgeRace) {
+        if (dwInternetStatus == INTERNET_STATUS_CONNECTION_CLOSED) {
+            if (pData->pHedge && (hInternet == pData->pHedge->hRequest 
+                || hInternet == pData->pHedge->hConnection)) 
+            {
+                InterlockedExchange(&pData->bHedgeClosed, TRUE);
+            }
+            else {
+                InterlockedExchange(&pData->bPrimaryClosed, TRUE);
+            }
+        }
+        return;
+    }
+
+    switch (dwInternetStatus) {
+    case INTERNET_STATUS_RESOLVING_NAME:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_RESOLVING_NAME: %s", 
+            (const char *) lpvStatusInformation);
+        break;
+    case INTERNET_STATUS_NAME_RESOLVED:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_NAME_RESOLVED: %s", 
+            (const char *) lpvStatusInformation);
+        break;
+    case INTERNET_STATUS_CONNECTING_TO_SERVER: 
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_CONNECTING_TO_SERVER");
+        break;
+    case INTERNET_STATUS_CONNECTED_TO_SERVER:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_CONNECTED_TO_SERVER");
+        break;
+    case INTERNET_STATUS_SENDING_REQUEST:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_SENDING_REQUEST");
+        break;
+    case INTERNET_STATUS_REQUEST_SENT:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_REQUEST_SENT, bytes sent = %lu", *pdw);
+        break;
+    case INTERNET_STATUS_RECEIVING_RESPONSE:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_RECEIVING_RESPONSE");
+        break;
+    case INTERNET_STATUS_RESPONSE_RECEIVED:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_RESPONSE_RECEIVED, bytes received = %lu", *pdw);
+        break;
+    case INTERNET_STATUS_CTL_RESPONSE_RECEIVED:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_CTL_RESPONSE_RECEIVED");
+        break;
+    case INTERNET_STATUS_PREFETCH:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_PREFETCH");
+        break;
+    case INTERNET_STATUS_CLOSING_CONNECTION:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_CLOSING_CONNECTION");
+        break;
+    case INTERNET_STATUS_CONNECTION_CLOSED:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_CONNECTION_CLOSED");
+        if (pData->hConnection) {
+            /*  the connection has been closed, so we close the handle here.
+                however only mark this for disconnection otherwise errors 
+                will occur when reading the data from the handle. In every 
+                function that uses the connection, first check to  see if 
+                it has been disconnected.
+             */
+            WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: marking connection for disconnect");
+            pData->bDisconnect = TRUE;
+        }
+        break;
+    case INTERNET_STATUS_HANDLE_CREATED:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_HANDLE_CREATED");
+        break;
+    case INTERNET_STATUS_HANDLE_CLOSING:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_HANDLE_CLOSING");
+        break;
+#ifdef INTERNET_STATUS_DETECTING_PROXY
+    case INTERNET_STATUS_DETECTING_PROXY:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_DETECTING_PROXY");
+        break;
+#endif
+    case INTERNET_STATUS_REQUEST_COMPLETE:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_REQUEST_COMPLETE");
+        break;
+    case INTERNET_STATUS_REDIRECT:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_REDIRECT, new url = %s", 
+            (const char *) lpvStatusInformation);
+        break;
+    case INTERNET_STATUS_INTERMEDIATE_RESPONSE:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_INTERMEDIATE_RESPONSE");
+        break;
+#ifdef INTERNET_STATUS_USER_INPUT_REQUIRED
+    case INTERNET_STATUS_USER_INPUT_REQUIRED:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_USER_INPUT_REQUIRED");
+        break;
+#endif
+    case INTERNET_STATUS_STATE_CHANGE:
+        if (*pdw & INTERNET_STATE_CONNECTED)            strcat(buf, ", CONNECTED");
+        if (*pdw & INTERNET_STATE_DISCONNECTED)         strcat(buf, ", DISCONNECTED");
+        if (*pdw & INTERNET_STATE_DISCONNECTED_BY_USER) strcat(buf, ", DISCONNECTED_BY_USER");
+        if (*pdw & INTERNET_STATE_IDLE)                 strcat(buf, ", IDLE");
+        if (*pdw & INTERNET_STATE_BUSY)                 strcat(buf, ", BUSY");
+        if (*pdw & INTERNET_STATUS_USER_INPUT_REQUIRED) strcat(buf, ", USER_INPUT_REQUIRED");
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_STATE_CHANGE: %s", &buf[2]);
+        break;
+#ifdef INTERNET_STATUS_COOKIE_SENT
+    case INTERNET_STATUS_COOKIE_SENT:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_COOKIE_SENT: count = %lu", *pdw);
+        break;
+#endif
+#ifdef INTERNET_STATUS_COOKIE_RECEIVED
+    case INTERNET_STATUS_COOKIE_RECEIVED:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_COOKIE_RECEIVED: count = %lu", *pdw);
+        break;
+#endif
+#ifdef INTERNET_STATUS_PRIVACY_IMPACTED
+    case INTERNET_STATUS_PRIVACY_IMPACTED:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_PRIVACY_IMPACTED");
+        break;
+#endif
+#ifdef INTERNET_STATUS_P3P_HEADER
+    case INTERNET_STATUS_P3P_HEADER:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_P3P_HEADER");
+        break;
+#endif
+#ifdef INTERNET_STATUS_P3P_POLICYREF
+    case INTERNET_STATUS_P3P_POLICYREF:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_P3P_POLICYREF");
+        break;
+#endif
+#ifdef INTERNET_STATUS_COOKIE_HISTORY
+    case INTERNET_STATUS_COOKIE_HISTORY:
+        WININET_LOGC0(pData, WININET_LOG_STATUS, "callback: INTERNET_STATUS_COOKIE_HISTORY");
+        break;
+#endif
+    default:
+        WININET_LOGC1(pData, WININET_LOG_STATUS, "callback: dwInternetStatus %d is unknown", 
+            dwInternetStatus);
+    }
+}
+
+/* gsoap documentation:
+    Called by client proxy multiple times, to close a socket connection before
+    a new socket connection is established and at the end of communications 
+    when the SOAP_IO_KEEPALIVE flag is not set and soap.keep_alive = 0 
+    (indicating that the other party supports keep alive). Should return 
+    SOAP_OK, or a gSOAP error code. Built-in gSOAP function: tcp_disconnect
+ */
+static int 
+wininet_fclose(struct soap * soap)
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    soap->error = SOAP_OK;
+
+    WININET_LOG0(pData, "fclose: setting disconnect to true");
+
+    /* force a disconnect by setting the disconnect flag to TRUE */
+    pData->bDisconnect = TRUE;
+    wininet_have_connection(soap, pData);
+    wininet_capture_abort(pData);
+    wininet_limiter_release(pData, FALSE, FALSE);
+    pData->bInFlight = FALSE;
+    wininet_log_commit(pData);
+
+    return SOAP_OK;
+}
+
+/* copy the private data structure */
+static int  
+wininet_copy(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pDst, 
+    struct soap_plugin *    a_pSrc
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    UNUSED_ARG(a_pDst);
+    UNUSED_ARG(a_pSrc);
+
+    WININET_LOG0(pData, "copy: not supported");
+    _ASSERTE(!"wininet doesn't support copy");
+
+    return SOAP_FATAL_ERROR;
+}
+
+/* deallocate of our private structure */
+static void 
+wininet_delete(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pPluginData
+    )
+{
+    struct wininet_data * pData = 
+        (struct wininet_data *) a_pPluginData->data;
+    unsigned n;
+
+    UNUSED_ARG(soap);
+
+    WININET_LOG0(pData, "delete: delete private data");
+
+    /* force a disconnect of any existing connection */
+    pData->bDisconnect = TRUE;
+    wininet_have_connection(soap, pData);
+    wininet_prewarm_reap(pData, TRUE);
+    wininet_proxy_refresh_reap(pData, TRUE);
+    if (pData->hInitDone) {
+        WaitForSingleObject(pData->hInitDone, INFINITE);
+        CloseHandle(pData->hInitDone);
+    }
+    while (pData->pProxySessions) {
+        struct wininet_proxy_session * pSession = pData->pProxySessions;
+        pData->pProxySessions = pSession->pNext;
+        InternetCloseHandle(pSession->hInternet);
+        free(pSession->pProxy);
+        free(pSession);
+    }
+    if (pData->hInternet) {
+        InternetCloseHandle(pData->hInternet);
+    }
+
+    /* free our data */
+    if (pData->apAuthChallenge[0]) {
+        free(pData->apAuthChallenge[0]);
+    }
+    if (pData->apAuthChallenge[1]) {
+        free(pData->apAuthChallenge[1]);
+    }
+    free(pData->apAuthRealm[0]);
+    free(pData->apAuthRealm[1]);
+    if (pData->pBuffer) {
+        free(pData->pBuffer);
+    }
+    while (pData->pTemplates) {
+        struct wininet_template * pTemplate = pData->pTemplates;
+        pData->pTemplates = pTemplate->pNext;
+        free(pTemplate->pEndpoint);
+        free(pTemplate->pHeaders);
+        free(pTemplate);
+    }
+    if (pData->pHeaders) {
+        free(pData->pHeaders);
+    }
+    wininet_response_reset(pData);
+    wininet_limiter_release(pData, FALSE, FALSE);
+    wininet_fanout_free(pData->pFanout);
+    if (pData->pCapture) {
+        free(pData->pCapture);
+    }
+    if (pData->pAction) {
+        free(pData->pAction);
+    }
+    while (pData->pCacheRules) {
+        struct wininet_cache_rule * pRule = pData->pCacheRules;
+        pData->pCacheRules = pRule->pNext;
+        free(pRule->pAction);
+        free(pRule);
+    }
+    for (n = 0; n < WININET_URL_BUCKETS; ++n) {
+        while (pData->apUrls[n]) {
+            struct wininet_url * pUrl = pData->apUrls[n];
+            pData->apUrls[n] = pUrl->pNext;
+            free(pUrl);
+        }
+    }
+    if (pData->pUrlUncached) {
+        free(pData->pUrlUncached);
+    }
+    if (pData->pUserAgent) {
+        free(pData->pUserAgent);
+    }
+    if (pData->hLog) {
+        /* the log is shared, it is closed when the last instance releases it */
+        wininet_log_commit(pData);
+        wininet_logsink_release(pData->hLog);
+    }
+    if (pData->pLogRec) {
+        wininet_logrec_free(pData->pLogRec);
+    }
+    free(pData);
+}
+
+/*  Open the internet session using the standard IE proxy config. This may be 
+    called from a worker thread during background initialization so it must 
+    not log. */
+static BOOL
+wininet_session_open(
+    struct wininet_data *   a_pData
+    )
+{
+    a_pData->hInternet = InternetOpenA("gsoap/" WININET_VERSION, 
+        INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+    if (!a_pData->hInternet) {
+        a_pData->dwInitError = GetLastError();
+        return FALSE;
+    }
+
+    /* set up the callback function so we get notifications */
+    InternetSetStatusCallbackA(a_pData->hInternet, wininet_callback);
+    return TRUE;
+}
+
+static DWORD WINAPI
+wininet_session_thread(
+    LPVOID  a_pArg
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) a_pArg;
+
+    wininet_session_open(pData);
+    SetEvent(pData->hInitDone);
+    return 0;
+}
+
+/*  Ensure that the internet session is open. When the plugin was registered 
+    lazily it is opened now, in the background mode we wait for it. Sets 
+    soap->error and returns FALSE on failure. */
+static BOOL
+wininet_session_ready(
+    struct soap *           soap, 
+    struct wininet_data *   a_pData
+    )
+{
+    if (a_pData->hInitDone) {
+        wininet_log_commit(a_pData);
+        WaitForSingleObject(a_pData->hInitDone, INFINITE);
+        CloseHandle(a_pData->hInitDone);
+        a_pData->hInitDone = NULL;
+        WININET_LOG1(a_pData, "session: background initialization %s", 
+            a_pData->hInternet ? "complete" : "failed");
+    }
+    if (a_pData->hInternet) {
+        return TRUE;
+    }
+
+    WININET_LOG0(a_pData, "session: opening internet session");
+    if (!wininet_session_open(a_pData)) {
+        soap->error = a_pData->dwInitError;
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "session: error %d (%s) in InternetOpen", 
+            soap->error, wininet_error_message(a_pData, soap->error));
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*  Find or open the session of this instance that uses a proxy decision. 
+    WinInet only sets the proxy for a whole session, so each decision other 
+    than the system settings gets its own session with the same callback and 
+    timeouts as the main one. Changing the proxy of a shared session would 
+    affect connections being made by other threads, e.g. for prewarming. 
+    Falls back to the main session on failure. */
+static HINTERNET
+wininet_proxy_session_open(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwAccessType,
+    const char *            a_pszProxy
+    )
+{
+    static const DWORD adwTimeouts[] = {
+        INTERNET_OPTION_CONNECT_TIMEOUT, 
+        INTERNET_OPTION_SEND_TIMEOUT, 
+        INTERNET_OPTION_RECEIVE_TIMEOUT
+    };
+    struct wininet_proxy_session * pSession;
+    DWORD dwTimeout;
+    DWORD dwLen;
+    unsigned n;
+
+    for (pSession = a_pData->pProxySessions; pSession; pSession = pSession->pNext) {
+        if (pSession->dwAccessType == a_dwAccessType 
+            && !strcmp(pSession->pProxy, a_pszProxy ? a_pszProxy : "")) 
+        {
+            return pSession->hInternet;
+        }
+    }
+
+    pSession = (struct wininet_proxy_session *) calloc(1, sizeof(struct wininet_proxy_session));
+    if (!pSession) {
+        return a_pData->hInternet;
+    }
+    pSession->dwAccessType = a_dwAccessType;
+    pSession->pProxy = strdup(a_pszProxy ? a_pszProxy : "");
+    if (pSession->pProxy) {
+        pSession->hInternet = InternetOpenA("gsoap/" WININET_VERSION, 
+            a_dwAccessType, a_pszProxy, NULL, 0);
+    }
+    if (!pSession->hInternet) {
+        DWORD dwErrorCode = GetLastError();
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "proxy_session: error %d (%s) in InternetOpen", 
+            dwErrorCode, wininet_error_message(a_pData, dwErrorCode));
+        free(pSession->pProxy);
+        free(pSession);
+        return a_pData->hInternet;
+    }
+
+    WININET_LOG1(a_pData, "proxy_session: opened session for %s", 
+        a_pszProxy ? a_pszProxy : "direct connections");
+    InternetSetStatusCallbackA(pSession->hInternet, wininet_callback);
+    for (n = 0; n < sizeof(adwTimeouts) / sizeof(adwTimeouts[0]); ++n) {
+        dwLen = sizeof(dwTimeout);
+        if (InternetQueryOption(a_pData->hInternet, adwTimeouts[n], &dwTimeout, &dwLen)) {
+            InternetSetOption(pSession->hInternet, adwTimeouts[n], &dwTimeout, sizeof(dwTimeout));
+        }
+    }
+    pSession->pNext = a_pData->pProxySessions;
+    a_pData->pProxySessions = pSession;
+    return pSession->hInternet;
+}
+
+/*  Get the session to connect to a server with, which uses the cached proxy
+    decision for the server if the proxy cache is enabled. */
+static HINTERNET
+wininet_proxy_session(
+    struct wininet_data *   a_pData,
+    struct wininet_url *    a_pUrl
+    )
+{
+    char szProxy[1024];
+    DWORD dwAccessType;
+
+    if (!a_pData->bProxyCache) {
+        return a_pData->hInternet;
+    }
+
+    /* the main session already uses the system settings */
+    dwAccessType = wininet_proxy_decision(a_pData, a_pUrl->szEndpoint, a_pUrl->nScheme, 
+        a_pUrl->pHost, a_pUrl->nPort, szProxy, sizeof(szProxy));
+    if (dwAccessType == INTERNET_OPEN_TYPE_PRECONFIG) {
+        return a_pData->hInternet;
+    }
+    return wininet_proxy_session_open(a_pData, dwAccessType, 
+        dwAccessType == INTERNET_OPEN_TYPE_PROXY ? szProxy : NULL);
+}
+
+/*  parse the endpoint and connect to the server. The current connection 
+    and request handles must already have been closed. Sets soap->error and 
+    returns FALSE on failure.
+ */
+static BOOL
+wininet_connect(
+    struct soap *           soap, 
+    struct wininet_data *   a_pData,
+    const char *            a_pszEndpoint
+    )
+{
+    struct wininet_url * pUrl;
+
+    /* parse out the url path */
+    pUrl = wininet_url_get(a_pData, a_pszEndpoint);
+    if (!pUrl) {
+        soap->error = GetLastError();
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, 
+            "connect: error %d (%s) in InternetCrackUrl", 
+            soap->error, wininet_error_message(a_pData, soap->error));
+        return FALSE;
+    }
+
+    /*  keep the endpoint that we are connected to, the URL path for when we 
+        create a request and the host for when we need a second connection */
+    a_pData->pEndpoint = pUrl->szEndpoint;
+    a_pData->pUrlPath = pUrl->pUrlPath;
+    a_pData->pHost = pUrl->pHost;
+    a_pData->nPort = pUrl->nPort;
+
+    /* an endpoint that didn't fit in the cache is kept until the next one */
+    if (a_pData->pUrlUncached) {
+        free(a_pData->pUrlUncached);
+    }
+    a_pData->pUrlUncached = pUrl->bCached ? NULL : pUrl;
+
+    /* add or remove the HTTPS flag as necessary */
+    if (pUrl->nScheme == INTERNET_SCHEME_HTTPS) {
+        a_pData->dwRequestFlags |= INTERNET_FLAG_SECURE;
+    }
+    else {
+        a_pData->dwRequestFlags &= ~INTERNET_FLAG_SECURE;
+    }
+
+    /* use the proxy that was previously found for this server */
+    a_pData->hSession = wininet_proxy_session(a_pData, pUrl);
+
+    /* connect to the target url, if we haven't connected yet 
+       or if it was dropped */
+    a_pData->hConnection = InternetConnectA(a_pData->hSession, 
+        pUrl->pHost, pUrl->nPort, "", "", INTERNET_SERVICE_HTTP, 
+        0, (DWORD_PTR) soap);
+    if (!a_pData->hConnection) {
+        soap->error = GetLastError();
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "connect: error %d (%s) in InternetConnect", 
+            soap->error, wininet_error_message(a_pData, soap->error));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*  Prepare to prewarm an endpoint the same way as wininet_connect() would 
+    connect to it: with our timeouts and the proxy decision for the server. 
+    Returns the session and request flags to use, or sets soap->error and 
+    returns FALSE if the endpoint can't be parsed. */
+static BOOL
+wininet_prewarm_prepare(
+    struct soap *           soap, 
+    struct wininet_data *   a_pData,
+    const char *            a_pszEndpoint,
+    HINTERNET *             a_phSession,
+    DWORD *                 a_pdwFlags
+    )
+{
+    struct wininet_url * pUrl;
+
+    pUrl = wininet_url_get(a_pData, a_pszEndpoint);
+    if (!pUrl) {
+        soap->error = GetLastError();
+        WININET_LOGC2(a_pData, WININET_LOG_ERRORS, 
+            "prewarm: error %d (%s) in InternetCrackUrl", 
+            soap->error, wininet_error_message(a_pData, soap->error));
+        return FALSE;
+    }
+
+    wininet_update_timeouts(soap, a_pData);
+    *a_phSession = wininet_proxy_session(a_pData, pUrl);
+
+    /* wininet_http_head() adds the HTTPS flag as necessary */
+    *a_pdwFlags = a_pData->dwRequestFlags & ~INTERNET_FLAG_SECURE;
+    if (!pUrl->bCached) {
+        free(pUrl);
+    }
+    return TRUE;
+}
+
+/* gsoap documentation:
+    Called from a client proxy to open a connection to a Web Service located 
+    at endpoint. Input parameters host and port are micro-parsed from endpoint.
+    Should return a valid file descriptor, or SOAP_INVALID_SOCKET and 
+    soap->error set to an error code. Built-in gSOAP function: tcp_connect
+*/
+static SOAP_SOCKET  
+wininet_fopen(
+    struct soap *   soap, 
+    const char *    a_pszEndpoint, 
+    const char *    a_pszHost, 
+    int             a_nPort
+    )
+{
+    char *          pRedirect = NULL;
+    BOOL            bConnected;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    soap->error = SOAP_OK;
+
+    /* we parse the URL ourselves so we don't use these parameters */
+    UNUSED_ARG(a_pszHost);
+    UNUSED_ARG(a_nPort);
+
+    WININET_LOG1(pData, "fopen: endpoint = '%s'", a_pszEndpoint);
+
+    if (!wininet_session_ready(soap, pData)) {
+        WININET_LOG0(pData, "fopen: not initialized");
+        return SOAP_INVALID_SOCKET;
+    }
+    if (pData->hRequest) {
+        WININET_LOG0(pData, "fopen: closing existing request handle");
+        InternetCloseHandle(pData->hRequest);
+        pData->hRequest = NULL;
+    }
+    if (pData->hConnection) {
+        WININET_LOG0(pData, "fopen: closing existing connection handle");
+        InternetCloseHandle(pData->hConnection);
+        pData->hConnection = NULL;
+    }
+
+    /* choose one of the equivalent endpoints instead */
+    pData->pEndpointState = NULL;
+    if (pData->nEndpoints) {
+        pData->dwEndpointsTried = 0;
+        pData->pEndpointState = wininet_endpoint_select(pData);
+        a_pszEndpoint = pData->pEndpointState->pUrl;
+        WININET_LOG1(pData, "fopen: chose endpoint '%s'", a_pszEndpoint);
+    }
+
+    /* use the target of a permanent redirect if we have seen one */
+    if (pData->bRedirectCache) {
+        pRedirect = wininet_redirect_lookup(a_pszEndpoint);
+        if (pRedirect) {
+            WININET_LOG1(pData, "fopen: using cached redirect to '%s'", pRedirect);
+            ++pData->stats.nRedirectHits;
+            a_pszEndpoint = pRedirect;
+        }
+    }
+
+    wininet_update_timeouts(soap, pData);
+    bConnected = wininet_connect(soap, pData, a_pszEndpoint);
+    if (pRedirect) {
+        free(pRedirect);
+    }
+    if (!bConnected) {
+        return SOAP_INVALID_SOCKET;
+    }
+
+    /* return 0 as our "connected" socket type */
+    WININET_LOG0(pData, "fopen: connected");
+    return 0;
+}
+
+/*  Headers for the request are collected in a buffer and added to the 
+    request in a single call once they are complete. The buffer is kept so 
+    that the request can be recreated on another connection if necessary. 
+    Make room for another a_nLen bytes of headers. */
+static int
+wininet_reserve_headers(
+    struct wininet_data *   a_pData,
+    size_t                  a_nLen
+    )
+{
+    size_t uiNewLen = a_pData->uiHeadersLen + a_nLen;
+
+    if (uiNewLen + 1 > a_pData->uiHeadersSize) {
+        size_t uiNewSize = ROUND_UP(uiNewLen + 1, 1024);
+        char * pNewHeaders = (char *) realloc(a_pData->pHeaders, uiNewSize);
+        if (!pNewHeaders) {
+            WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "reserve_headers: realloc failed");
+            return SOAP_EOM;
+        }
+        a_pData->pHeaders = pNewHeaders;
+        a_pData->uiHeadersSize = uiNewSize;
+    }
+    return SOAP_OK;
+}
+
+/*  The preemptive Authorization header is kept with the other headers so 
+    that every request for the message sends it. It is replaced when the 
+    request is recreated, e.g. for another server. */
+static int
+wininet_save_auth_header(
+    struct wininet_data *   a_pData,
+    const char *            a_pszValue
+    )
+{
+    size_t nValueLen = strlen(a_pszValue);
+    char * pHeader;
+    int rc;
+
+    rc = wininet_reserve_headers(a_pData, nValueLen + 17);
+    if (rc != SOAP_OK) return rc;
+
+    pHeader = a_pData->pHeaders + a_pData->uiHeadersLen;
+    memcpy(pHeader, "Authorization: ", 15);
+    memcpy(pHeader + 15, a_pszValue, nValueLen);
+    memcpy(pHeader + 15 + nValueLen, "\r\n", 3);
+
+    /* the credentials are not logged */
+    WININET_LOGC0(a_pData, WININET_LOG_HEADERS, "create_request: header 'Authorization: (cached)'");
+    a_pData->uiAuthHeaderPos = a_pData->uiHeadersLen;
+    a_pData->uiAuthHeaderLen = nValueLen + 17;
+    a_pData->uiHeadersLen += a_pData->uiAuthHeaderLen;
+    return SOAP_OK;
+}
+
+/* remove the preemptive Authorization header added for the previous request */
+static void
+wininet_remove_auth_header(
+    struct wininet_data *   a_pData
+    )
+{
+    char * pHeader;
+
+    if (!a_pData->uiAuthHeaderLen) {
+        return;
+    }
+
+    pHeader = a_pData->pHeaders + a_pData->uiAuthHeaderPos;
+    SecureZeroMemory(pHeader, a_pData->uiAuthHeaderLen);
+    memmove(pHeader, pHeader + a_pData->uiAuthHeaderLen, 
+        a_pData->uiHeadersLen - a_pData->uiAuthHeaderPos - a_pData->uiAuthHeaderLen + 1);
+    a_pData->uiHeadersLen -= a_pData->uiAuthHeaderLen;
+    a_pData->uiAuthHeaderLen = 0;
+}
+
+static int 
+wininet_create_request(
+    struct soap *   soap
+    )
+{
+    DWORD dwFlags;
+    char * pAuthorization;
+    int rc;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    /*  Set up the flags for this connection */
+    dwFlags = INTERNET_FLAG_PRAGMA_NOCACHE | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_RELOAD;
+    dwFlags |= pData->dwRequestFlags;
+    if (soap->imode & SOAP_IO_KEEPALIVE || soap->omode & SOAP_IO_KEEPALIVE) {
+        dwFlags |= INTERNET_FLAG_KEEP_CONNECTION;
+    }
+    if (pData->bRedirectCache) {
+        dwFlags |= INTERNET_FLAG_NO_AUTO_REDIRECT;
+    }
+
+    if (WININET_LOG_ON(pData, WININET_LOG_CALLS)) {
+        char buf[1000] = { 0 };
+
+#define LOGFLAG(flag) if (dwFlags & INTERNET_FLAG_ ## flag) strcat(buf, ", " #flag);
+        LOGFLAG(RELOAD)
+        LOGFLAG(RAW_DATA)
+        LOGFLAG(EXISTING_CONNECT)
+        LOGFLAG(ASYNC)
+        LOGFLAG(PASSIVE)
+        LOGFLAG(NO_CACHE_WRITE)
+        LOGFLAG(MAKE_PERSISTENT)
+        LOGFLAG(FROM_CACHE)
+        LOGFLAG(SECURE)
+        LOGFLAG(KEEP_CONNECTION)
+        LOGFLAG(NO_AUTO_REDIRECT)
+        LOGFLAG(READ_PREFETCH)
+        LOGFLAG(NO_COOKIES)
+        LOGFLAG(NO_AUTH)
+        LOGFLAG(CACHE_IF_NET_FAIL)
+        LOGFLAG(IGNORE_CERT_CN_INVALID)
+        LOGFLAG(IGNORE_CERT_DATE_INVALID)
+        LOGFLAG(IGNORE_REDIRECT_TO_HTTPS)
+        LOGFLAG(IGNORE_REDIRECT_TO_HTTP)
+        LOGFLAG(RESYNCHRONIZE)
+        LOGFLAG(HYPERLINK)
+        LOGFLAG(NO_UI)
+        LOGFLAG(PRAGMA_NOCACHE)
+        LOGFLAG(CACHE_ASYNC)
+        LOGFLAG(FORMS_SUBMIT)
+        LOGFLAG(NEED_FILE)
+        LOGFLAG(RESTRICTED_ZONE)
+        LOGFLAG(TRANSFER_BINARY)
+        LOGFLAG(TRANSFER_ASCII)
+        LOGFLAG(FWD_BACK)
+        /*LOGFLAG(INTERNET_FLAG_BGUPDATE)*/
+#undef LOGFLAG
+
+        wininet_log(pData, "create_request: using INTERNET_FLAG_xxx = %s", &buf[2]);
+    }
+    pData->dwActiveFlags = dwFlags;
+
+    /*  Note that although we specify HTTP/1.1 for the connection here, the 
+        actual connection may be HTTP/1.0 depending on the settings in the 
+        control panel. See the "Internet Options", "HTTP 1.1 settings".
+     */
+    pData->hRequest = HttpOpenRequestA(
+        pData->hConnection, "POST", pData->pUrlPath, "HTTP/1.1", NULL, NULL, 
+        dwFlags, (DWORD_PTR) soap);
+    if (!pData->hRequest) {
+        soap->error = GetLastError();
+        WININET_LOGC2(pData, WININET_LOG_ERRORS, "create_request: error %d (%s) in HttpOpenRequest", 
+            soap->error, wininet_error_message(pData, soap->error));
+        return SOAP_ERR;
+    }
+
+    /* supply any cached credentials for this server */
+    wininet_remove_auth_header(pData);
+    pAuthorization = wininet_auth_apply(pData);
+    if (pAuthorization) {
+        rc = wininet_save_auth_header(pData, pAuthorization);
+        wininet_free_secret(pAuthorization);
+        if (rc != SOAP_OK) return rc;
+    }
+
+    WININET_LOG0(pData, "create_request: success");
+    return SOAP_OK;
+}
+
+/* gsoap documentation:
+    Used by clients to check if the server is still responsive. 
+    Built-in gSOAP function: soap_poll.
+*/
+static int 
+wininet_fpoll(
+    struct soap * soap
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    WININET_LOG0(pData, "fpoll");
+
+    /*  the server or a proxy has probably closed a connection that has been 
+        idle for too long, so our handles are replaced. This only resets our 
+        state, WinInet may still send the next message on the socket that it 
+        kept, so that send still counts as being on a reused connection for 
+        the stale connection retry. */
+    if (pData->dwIdleTimeout && pData->bConnUsed && pData->hConnection
+        && GetTickCount() - pData->dwLastUsed > pData->dwIdleTimeout) 
+    {
+        WININET_LOGC1(pData, WININET_LOG_TIMING, "fpoll: connection idle for %lu ms, closing", 
+            GetTickCount() - pData->dwLastUsed);
+        ++pData->stats.nIdleClosed;
+        pData->bDisconnect = TRUE;
+        wininet_have_connection(soap, pData);
+        pData->bConnUsed = TRUE;
+        return SOAP_EOF;
+    }
+
+    /* ensure that our connection hasn't been disconnected */
+    if (!wininet_have_connection(soap, pData)) {
+        return SOAP_EOF;
+    }
+
+    return SOAP_OK; 
+}
+
+static int
+wininet_growbuffer(
+    struct wininet_data *   a_pData,
+    const char *            a_pModule,
+    size_t					a_nSize
+    )
+{
+    a_pData->uiBufferSize = ROUND_UP(a_nSize, 4096); /* round up to 4096 boundary */
+    WININET_LOG2(a_pData, "%s: growing internal buffer to %lu bytes", 
+        a_pModule, a_pData->uiBufferSize);
+
+    a_pData->pBuffer = (char *) realloc(a_pData->pBuffer, a_pData->uiBufferSize);
+    if (!a_pData->pBuffer) {
+        WININET_LOGC1(a_pData, WININET_LOG_ERRORS, "%s: realloc failed", a_pModule);
+        a_pData->uiBufferSize = 0;
+        return SOAP_EOM;
+    }
+
+    return SOAP_OK;
+}
+
+/* append "key: value[ [suffix]]\r\n" to the request headers */
+static int
+wininet_save_header(
+    struct wininet_data *   a_pData,
+    const char *            a_pszKey,
+    const char *            a_pszValue,
+    const char *            a_pszSuffix
+    )
+{
+    size_t nKeyLen = strlen(a_pszKey);
+    size_t nValueLen = strlen(a_pszValue);
+    size_t nSuffixLen = a_pszSuffix ? strlen(a_pszSuffix) : 0;
+    char * pHeader;
+    int rc;
+
+    rc = wininet_reserve_headers(a_pData, nKeyLen + nValueLen + nSuffixLen + 7);
+    if (rc != SOAP_OK) return rc;
+
+    pHeader = a_pData->pHeaders + a_pData->uiHeadersLen;
+    memcpy(pHeader, a_pszKey, nKeyLen);
+    pHeader += nKeyLen;
+    *pHeader++ = ':';
+    *pHeader++ = ' ';
+    memcpy(pHeader, a_pszValue, nValueLen);
+    pHeader += nValueLen;
+    if (a_pszSuffix) {
+        *pHeader++ = ' ';
+        *pHeader++ = '[';
+        memcpy(pHeader, a_pszSuffix, nSuffixLen);
+        pHeader += nSuffixLen;
+        *pHeader++ = ']';
+    }
+    *pHeader++ = '\r';
+    *pHeader++ = '\n';
+    *pHeader = 0;
+
+    WININET_LOGC2(a_pData, WININET_LOG_HEADERS, "fposthdr: header '%.*s'", 
+        (int) (pHeader - a_pData->pHeaders - a_pData->uiHeadersLen - 2), 
+        a_pData->pHeaders + a_pData->uiHeadersLen);
+    a_pData->uiHeadersLen = pHeader - a_pData->pHeaders;
+    return SOAP_OK;
+}
+
+/* add the collected headers to the request */
+static void
+wininet_submit_headers(
+    struct wininet_data *   a_pData
+    )
+{
+    const char * pStart = a_pData->pHeaders;
+    const char * pEnd = pStart + a_pData->uiHeadersLen;
+    const char * pNext;
+
+    if (!pStart || pStart == pEnd) {
+        return;
+    }
+
+    _ASSERTE(a_pData->hRequest != NULL);
+    if (HttpAddRequestHeadersA(a_pData->hRequest, pStart, (DWORD) (pEnd - pStart), HTTP_ADDREQ_FLAG_ADD)) {
+        return;
+    }
+
+    /*  not a critical error, so just log it and add the headers that we can. 
+        Some of the headers may already have been added by the failed call so 
+        they are replaced rather than duplicated. */
+    WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "fposthdr: error %d (%s) in HttpAddRequestHeaders, adding separately", 
+        GetLastError(), wininet_error_message(a_pData, GetLastError()));
+    for (; pStart < pEnd; pStart = pNext) {
+        pNext = strstr(pStart, "\r\n");
+        pNext = pNext ? pNext + 2 : pEnd;
+        if (!HttpAddRequestHeadersA(a_pData->hRequest, pStart, (DWORD) (pNext - pStart), 
+            HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE)) 
+        {
+            WININET_LOGC4(a_pData, WININET_LOG_ERRORS, "fposthdr: error %d (%s) adding header '%.*s'", 
+                GetLastError(), wininet_error_message(a_pData, GetLastError()), 
+                (int) (pNext - pStart - 2), pStart);
+        }
+    }
+}
+
+/*  Find the header template for the current endpoint. A template for the 
+    endpoint is preferred to one for all endpoints. */
+static struct wininet_template *
+wininet_template_find(
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_template * pTemplate;
+    struct wininet_template * pDefault = NULL;
+
+    for (pTemplate = a_pData->pTemplates; pTemplate; pTemplate = pTemplate->pNext) {
+        if (!pTemplate->pEndpoint) {
+            pDefault = pTemplate;
+        }
+        else if (a_pData->pEndpoint && !strcmp(pTemplate->pEndpoint, a_pData->pEndpoint)) {
+            return pTemplate;
+        }
+    }
+    return pDefault;
+}
+
+/* the headers sent by gsoap and the plugin that a template may supply */
+static const char * const wininet_template_keys[] = {
+    "Host", "User-Agent", "Content-Type", "Accept", "Accept-Encoding", 
+    "Content-Encoding", "Connection", "Authorization", "Cookie", "traceparent"
+};
+#define WININET_TEMPLATE_OTHER  0x80000000  /* the template supplies other headers */
+
+/*  Get the bit for a header name in wininet_template::dwKeys, or 
+    WININET_TEMPLATE_OTHER if it isn't one of the well known headers. */
+static DWORD
+wininet_template_key(
+    const char *    a_pKey,
+    size_t          a_nKeyLen
+    )
+{
+    const char * pName;
+    size_t n;
+
+    for (n = 0; n < sizeof(wininet_template_keys) / sizeof(wininet_template_keys[0]); ++n) {
+        pName = wininet_template_keys[n];
+        if ((pName[0] | 0x20) == (a_pKey[0] | 0x20) && !strnicmp(pName, a_pKey, a_nKeyLen) 
+            && !pName[a_nKeyLen]) 
+        {
+            return 1UL << n;
+        }
+    }
+    return WININET_TEMPLATE_OTHER;
+}
+
+/*  check if the template for the current message supplies a header. The 
+    well known headers are checked with the mask made when the template was 
+    set, the template's lines are only searched for other headers. */
+static BOOL
+wininet_template_has(
+    struct wininet_template *   a_pTemplate,
+    const char *                a_pszKey
+    )
+{
+    const char * pLine = a_pTemplate->pHeaders;
+    const char * pEnd = pLine + a_pTemplate->nHeadersLen;
+    size_t nKeyLen = strlen(a_pszKey);
+    DWORD dwKey = wininet_template_key(a_pszKey, nKeyLen);
+
+    if (dwKey != WININET_TEMPLATE_OTHER || !(a_pTemplate->dwKeys & WININET_TEMPLATE_OTHER)) {
+        return (a_pTemplate->dwKeys & dwKey) != 0;
+    }
+    while (pLine < pEnd) {
+        if (!strnicmp(pLine, a_pszKey, nKeyLen) && pLine[nKeyLen] == ':') {
+            return TRUE;
+        }
+        pLine = strchr(pLine, '\n') + 1;
+    }
+    return FALSE;
+}
+
+/* gsoap documentation:
+    Called by http_post and http_response (through the callbacks). Emits HTTP 
+    key: val header entries. Should return SOAP_OK, or a gSOAP error code. 
+    Built-in gSOAP function: http_post_header.
+ */
+static int 
+wininet_fposthdr(
+    struct soap *   soap, 
+    const char *    a_pszKey, 
+    const char *    a_pszValue
+    )  
+{
+    int     rc;
+    char    szRequestId[50];
+    const char * pszSuffix = NULL;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    soap->error = SOAP_OK;
+
+    /* ensure that our connection hasn't been disconnected */
+    if (!wininet_have_connection(soap, pData)) {
+        return SOAP_EOF;
+    }
+
+    /* initialize a new request */
+    if (a_pszKey && !a_pszValue) {
+        WININET_LOG0(pData, "fposthdr: initialize request");
+
+        /* if we are using chunk output then we start with a chunk size */
+        pData->bIsChunkSize = ((soap->omode & SOAP_IO) == SOAP_IO_CHUNK);
+        pData->uiBufferLen = 0;
+        pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+        pData->nLogFormat = LOGTYPE_UNKNOWN;
+        pData->uiHeadersLen = 0;
+        pData->uiAuthHeaderLen = 0;
+        wininet_response_reset(pData);
+
+        /* start a new span for this message */
+        pData->szTraceParent[0] = 0;
+        pData->bInFlight = TRUE;
+        if (pData->bTracing) {
+            wininet_trace_begin(pData);
+            WININET_LOG1(pData, "fposthdr: traceparent = %s", pData->szTraceParent);
+        }
+
+        /* the constant headers for this endpoint are already formatted */
+        pData->pTemplate = wininet_template_find(pData);
+        if (pData->pTemplate) {
+            WININET_LOGC1(pData, WININET_LOG_HEADERS, "fposthdr: using header template for '%s'", 
+                pData->pTemplate->pEndpoint ? pData->pTemplate->pEndpoint : "(all endpoints)");
+            rc = wininet_reserve_headers(pData, pData->pTemplate->nHeadersLen);
+            if (rc != SOAP_OK) return rc;
+            memcpy(pData->pHeaders, pData->pTemplate->pHeaders, pData->pTemplate->nHeadersLen + 1);
+            pData->uiHeadersLen = pData->pTemplate->nHeadersLen;
+        }
+        if (pData->szTraceParent[0] 
+            && !(pData->pTemplate && wininet_template_has(pData->pTemplate, "traceparent"))) 
+        {
+            rc = wininet_save_header(pData, "traceparent", pData->szTraceParent, NULL);
+            if (rc != SOAP_OK) return rc;
+        }
+        wininet_limiter_release(pData, FALSE, FALSE);
+        if (pData->pAction) {
+            free(pData->pAction);
+            pData->pAction = NULL;
+        }
+
+        /* create new request for these headers */
+        rc = wininet_create_request(soap);
+        if (rc != SOAP_OK) return rc;
+
+        return SOAP_OK;
+    }
+
+    /* completed request headers */
+    if (!a_pszKey) {
+        WININET_LOGC0(pData, WININET_LOG_HEADERS, "fposthdr: complete headers");
+        wininet_submit_headers(pData);
+        return SOAP_OK;
+    }
+
+    /* add a header */
+    if (a_pszValue) { 
+        if (!strcmp(a_pszKey, "User-Agent")) {
+            if (pData->pUserAgent) {
+                a_pszValue = pData->pUserAgent;
+            }
+
+            /* so that the request id shows up in IIS logs, add the request ID to the user agent */
+            if (pData->hLog) {
+                wininet_getreqid(pData, szRequestId, sizeof(szRequestId));
+                pszSuffix = szRequestId;
+            }
+        }
+
+        /* determine the maximum length of this message so that we can
+           correctly determine when we have completed the send */
+        if (!strcmp(a_pszKey, "Content-Length")) {
+            _ASSERTE(pData->uiBufferLenMax == INVALID_BUFFER_LENGTH);
+            pData->uiBufferLenMax = strtoul(a_pszValue, NULL, 10);
+            if (pData->uiBufferSize < pData->uiBufferLenMax) {
+                int rc = wininet_growbuffer(pData, "fposthdr", pData->uiBufferLenMax);
+                if (rc != SOAP_OK) return rc;
+            }
+        }
+
+        /*! check to see what sort of data with have */
+        else if (!strcmp(a_pszKey, "Content-Encoding")) {
+            pData->nLogFormat = LOGTYPE_HEX;
+        }
+
+        /* the operation is used to determine if the response can be cached */
+        else if (!strcmp(a_pszKey, "SOAPAction")) {
+            if (pData->pAction) {
+                free(pData->pAction);
+            }
+            pData->pAction = strdup(a_pszValue);
+        }
+
+        else if (pData->nLogFormat == LOGTYPE_UNKNOWN && !strcmp(a_pszKey, "Content-Type")) {
+            if (strstr(a_pszValue, "text/xml")) {
+                pData->nLogFormat = LOGTYPE_XML;
+            }
+            else if (strstr(a_pszValue, "text/")) {
+                pData->nLogFormat = LOGTYPE_TEXT;
+            }
+            else {
+                pData->nLogFormat = LOGTYPE_HEX;
+            }
+        }
+
+        /*  the headers are added to the request when they are complete, 
+            the template replaces any headers that it supplies */
+        if (pData->pTemplate && wininet_template_has(pData->pTemplate, a_pszKey)) {
+            WININET_LOGC1(pData, WININET_LOG_HEADERS, "fposthdr: header '%s' supplied by template", a_pszKey);
+        }
+        else {
+            rc = wininet_save_header(pData, a_pszKey, a_pszValue, pszSuffix);
+            if (rc != SOAP_OK) return rc;
+        }
+    }
+
+    return SOAP_OK; 
+}
+
+static int
+wininet_get_headers(
+    struct wininet_data *   a_pData,
+    const char *            a_pModule,
+    DWORD                   a_dwFlags
+    )
+{
+    DWORD dwLen;
+
+    /* retrieve all of the response headers as NULL separated strings */
+    _ASSERTE(a_pData->uiBufferSize > 0);
+    dwLen = (DWORD) a_pData->uiBufferSize;
+    a_pData->pBuffer[0] = 0;
+    while (!HttpQueryInfoA(a_pData->hRequest, HTTP_QUERY_RAW_HEADERS | a_dwFlags, a_pData->pBuffer, &dwLen, 0) 
+        && GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+    {
+        int rc = wininet_growbuffer(a_pData, a_pModule, dwLen);
+        if (rc != SOAP_OK) return rc;
+        dwLen = (DWORD) a_pData->uiBufferSize;
+    }
+
+    return SOAP_OK;
+}
+
+static void
+wininet_log_headers(
+    struct wininet_data *   a_pData,
+    const char *            a_pModule
+    )
+{
+    const char * pHeader;
+
+    /* log all of the headers */
+    for (pHeader = a_pData->pBuffer; *pHeader; pHeader += strlen(pHeader)+1) {
+        WININET_LOGC2(a_pData, WININET_LOG_HEADERS, "%s header '%s'", a_pModule, pHeader);
+
+        /*! check to see what sort of data with have */
+        if (!strnicmp(pHeader, "Content-Encoding:", 17)) {
+            a_pData->nLogFormat = LOGTYPE_HEX;
+        }
+
+        else if (a_pData->nLogFormat == LOGTYPE_UNKNOWN && !strnicmp(pHeader, "Content-Type:", 13)) {
+            if (strstr(pHeader, "text/xml")) {
+                a_pData->nLogFormat = LOGTYPE_XML;
+            }
+            else if (strstr(pHeader, "text/")) {
+                a_pData->nLogFormat = LOGTYPE_TEXT;
+            }
+            else {
+                a_pData->nLogFormat = LOGTYPE_HEX;
+            }
+        }
+    }
+}
+
+/*  Send a request on a request handle. Messages of at least the configured 
+    size are sent with "Expect: 100-continue" using HttpSendRequestEx so that 
+    the headers are sent first and the body is written in blocks. A server 
+    that rejects the message (e.g. 401, 407, 413) before reading the body 
+    stops the upload instead of the entire message being transmitted. Sets 
+    the last error on failure as HttpSendRequest does. This may be called 
+    from a worker thread so it doesn't log or update the statistics, how the 
+    message was sent is returned as WININET_SEND_xxx flags instead.
+ */
+static BOOL
+wininet_http_send(
+    struct wininet_data *   a_pData,
+    HINTERNET               a_hRequest,
+    const char *            a_pSendBuf,
+    size_t                  a_nSendSize,
+    DWORD *                 a_pdwOutcome
+    )
+{
+    static const char szExpect[] = "Expect: 100-continue\r\n";
+    INTERNET_BUFFERSA buffers;
+    DWORD   dwWritten, dwError;
+    size_t  nSent;
+    BOOL    bResult;
+    int     nRetry;
+
+    *a_pdwOutcome = 0;
+    if (!a_pData->uiExpectThreshold || a_nSendSize < a_pData->uiExpectThreshold) {
+        return HttpSendRequestA(a_hRequest, NULL, 0, 
+            (LPVOID) a_pSendBuf, (DWORD) a_nSendSize);
+    }
+
+    HttpAddRequestHeadersA(a_hRequest, szExpect, sizeof(szExpect) - 1, 
+        HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
+    *a_pdwOutcome |= WININET_SEND_EXPECT;
+
+    /* WinInet requests a resend during some authentication handshakes */
+    for (nRetry = 0; nRetry < 5; ++nRetry) {
+        memset(&buffers, 0, sizeof(buffers));
+        buffers.dwStructSize  = sizeof(buffers);
+        buffers.dwBufferTotal = (DWORD) a_nSendSize;
+        if (!HttpSendRequestExA(a_hRequest, &buffers, NULL, 0, 0)) {
+            return FALSE;
+        }
+
+        dwError = 0;
+        for (nSent = 0; nSent < a_nSendSize; nSent += dwWritten) {
+            DWORD dwBlock = (DWORD) (a_nSendSize - nSent);
+            if (dwBlock > WININET_WRITE_BLOCK) dwBlock = WININET_WRITE_BLOCK;
+            if (!InternetWriteFile(a_hRequest, a_pSendBuf + nSent, dwBlock, &dwWritten) 
+                || dwWritten == 0) 
+            {
+                dwError = GetLastError();
+                break;
+            }
+        }
+
+        bResult = HttpEndRequestA(a_hRequest, NULL, 0, 0);
+        if (!bResult && GetLastError() == ERROR_INTERNET_FORCE_RETRY) {
+            *a_pdwOutcome |= WININET_SEND_RESENT;
+            continue;
+        }
+
+        if (dwError) {
+            if (bResult) {
+                /* the server responded before the whole body was sent */
+                *a_pdwOutcome |= WININET_SEND_REJECTED;
+                return TRUE;
+            }
+            SetLastError(dwError);
+        }
+        return bResult;
+    }
+
+    return FALSE;
+}
+
+/*  add the conditional headers for revalidating a cached response. They are 
+    not saved with the other headers so that they are only sent while the 
+    response is being revalidated. */
+static void
+wininet_add_conditional_headers(
+    struct wininet_data *   a_pData,
+    HINTERNET               a_hRequest
+    )
+{
+    char szHeader[1024];
+
+    if (!a_pData->bRevalidating) {
+        return;
+    }
+    if (a_pData->pValidETag) {
+        _snprintf(szHeader, sizeof(szHeader), "If-None-Match: %s\r\n", a_pData->pValidETag);
+        szHeader[sizeof(szHeader) - 1] = 0;
+        HttpAddRequestHeadersA(a_hRequest, szHeader, (DWORD) -1L, 
+            HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
+    }
+    if (a_pData->pValidLastModified) {
+        _snprintf(szHeader, sizeof(szHeader), "If-Modified-Since: %s\r\n", a_pData->pValidLastModified);
+        szHeader[sizeof(szHeader) - 1] = 0;
+        HttpAddRequestHeadersA(a_hRequest, szHeader, (DWORD) -1L, 
+            HTTP_ADDREQ_FLAG_ADD | HTTP_ADDREQ_FLAG_REPLACE);
+    }
+}
+
+/*  add the saved headers to another request for the same message. The Host 
+    header is skipped when the request is for a different server so that 
+    WinInet supplies the correct one. Credentials (Authorization and Cookie) 
+    are skipped when the request is for a different origin. */
+static void
+wininet_add_saved_headers(
+    struct wininet_data *   a_pData,
+    HINTERNET               a_hRequest,
+    BOOL                    a_bSkipHost,
+    BOOL                    a_bSkipCredentials
+    )
+{
+    const char * pStart = a_pData->pHeaders;
+    const char * pEnd = pStart + a_pData->uiHeadersLen;
+    const char * pLine;
+    const char * pOwnAuth = NULL;
+
+    if (!pStart || pStart == pEnd) {
+        return;
+    }
+    if (a_pData->uiAuthHeaderLen && a_hRequest == a_pData->hRequest) {
+        pOwnAuth = pStart + a_pData->uiAuthHeaderPos;
+    }
+
+    for (pLine = pStart; (a_bSkipHost || a_bSkipCredentials) && pLine < pEnd; ) {
+        const char * pNext = strstr(pLine, "\r\n");
+        pNext = pNext ? pNext + 2 : pEnd;
+        if ((a_bSkipHost && !strnicmp(pLine, "Host:", 5))
+            || (a_bSkipCredentials && pLine != pOwnAuth
+                && (!strnicmp(pLine, "Authorization:", 14) || !strnicmp(pLine, "Cookie:", 7))))
+        {
+            if (pLine > pStart) {
+                HttpAddRequestHeadersA(a_hRequest, pStart, (DWORD) (pLine - pStart), HTTP_ADDREQ_FLAG_ADD);
+            }
+            pStart = pNext;
+        }
+        pLine = pNext;
+    }
+
+    if (pStart < pEnd) {
+        HttpAddRequestHeadersA(a_hRequest, pStart, (DWORD) (pEnd - pStart), HTTP_ADDREQ_FLAG_ADD);
+    }
+    wininet_add_conditional_headers(a_pData, a_hRequest);
+}
+
+/*  Follow a redirect response by sending the message again to the new 
+    location, caching the redirect if it is permanent (301, 308). Returns 
+    TRUE if the message should be resent. If the redirect could not be 
+    followed after the current request has been closed then the request 
+    handle will be NULL. */
+static BOOL
+wininet_follow_redirect(
+    struct soap *           soap,
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwStatusCode,
+    int *                   a_pnRedirects
+    )
+{
+    char    szLocation[2048];
+    char    szTarget[2048];
+    DWORD   dwLen = sizeof(szLocation);
+    struct wininet_url * pTarget;
+    BOOL    bSecure = (a_pData->dwRequestFlags & INTERNET_FLAG_SECURE) != 0;
+    BOOL    bTargetSecure;
+    BOOL    bSameOrigin;
+
+    switch (a_dwStatusCode) {
+    case HTTP_STATUS_MOVED:                 /* 301 */
+    case HTTP_STATUS_REDIRECT:              /* 302 */
+    case HTTP_STATUS_REDIRECT_KEEP_VERB:    /* 307 */
+    case HTTP_STATUS_PERMANENT_REDIRECT:    /* 308 */
+        break;
+    default:
+        return FALSE;
+    }
+
+    if (++*a_pnRedirects > WININET_MAX_REDIRECTS) {
+        WININET_LOG0(a_pData, "follow_redirect: too many redirects");
+        return FALSE;
+    }
+
+    if (!HttpQueryInfoA(a_pData->hRequest, HTTP_QUERY_LOCATION, szLocation, &dwLen, NULL)) {
+        WININET_LOG0(a_pData, "follow_redirect: no location");
+        return FALSE;
+    }
+
+    /* the location may be relative to the current endpoint */
+    dwLen = sizeof(szTarget);
+    if (!InternetCombineUrlA(a_pData->pEndpoint, szLocation, szTarget, &dwLen, 0)) {
+        WININET_LOG1(a_pData, "follow_redirect: invalid location '%s'", szLocation);
+        return FALSE;
+    }
+
+    pTarget = wininet_url_get(a_pData, szTarget);
+    if (!pTarget) {
+        WININET_LOG1(a_pData, "follow_redirect: invalid location '%s'", szTarget);
+        return FALSE;
+    }
+    bTargetSecure = (pTarget->nScheme == INTERNET_SCHEME_HTTPS);
+    bSameOrigin = bSecure == bTargetSecure && pTarget->nPort == a_pData->nPort 
+        && !stricmp(pTarget->pHost, a_pData->pHost);
+    if (!pTarget->bCached) {
+        free(pTarget);
+    }
+
+    /* the message must never be sent in clear after being sent securely */
+    if (bSecure && !bTargetSecure) {
+        WININET_LOGC1(a_pData, WININET_LOG_ERRORS, "follow_redirect: refusing redirect from https to '%s'", szTarget);
+        return FALSE;
+    }
+
+    /*  only cache redirects that were received and lead over https, anyone 
+        could have supplied one received in clear */
+    WININET_LOG2(a_pData, "follow_redirect: %lu redirect to '%s'", a_dwStatusCode, szTarget);
+    if ((a_dwStatusCode == HTTP_STATUS_MOVED || a_dwStatusCode == HTTP_STATUS_PERMANENT_REDIRECT)
+        && bSecure && bTargetSecure) 
+    {
+        wininet_redirect_store(a_pData->pEndpoint, szTarget);
+    }
+    ++a_pData->stats.nRedirectsFollowed;
+
+    /* reconnect to the new location and recreate the request */
+    InternetCloseHandle(a_pData->hRequest);
+    a_pData->hRequest = NULL;
+    InternetCloseHandle(a_pData->hConnection);
+    a_pData->hConnection = NULL;
+    if (!wininet_connect(soap, a_pData, szTarget)) {
+        return FALSE;
+    }
+    if (wininet_create_request(soap) != SOAP_OK) {
+        return FALSE;
+    }
+    wininet_add_saved_headers(a_pData, a_pData->hRequest, TRUE, !bSameOrigin);
+
+    return TRUE;
+}
+
+/* log and count how a message was sent by wininet_http_send() */
+static void
+wininet_send_outcome(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwOutcome
+    )
+{
+    if (a_dwOutcome & WININET_SEND_EXPECT) {
+        ++a_pData->stats.nExpectContinue;
+    }
+    if (a_dwOutcome & WININET_SEND_RESENT) {
+        WININET_LOG0(a_pData, "http_send: resent for authentication handshake");
+    }
+    if (a_dwOutcome & WININET_SEND_REJECTED) {
+        WININET_LOG0(a_pData, "http_send: upload stopped by server");
+        ++a_pData->stats.nExpectRejected;
+    }
+}
+
+/* errors where the message can't have reached the server */
+static BOOL
+wininet_is_connect_error(
+    DWORD   a_dwError
+    )
+{
+    switch (a_dwError) {
+    case ERROR_INTERNET_CANNOT_CONNECT:
+    case ERROR_INTERNET_NAME_NOT_RESOLVED:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* errors where a kept alive connection may have been closed by the server before our send */
+static BOOL
+wininet_is_stale_error(
+    DWORD   a_dwError
+    )
+{
+    switch (a_dwError) {
+    case ERROR_INTERNET_CONNECTION_RESET:
+    case ERROR_INTERNET_CONNECTION_ABORTED:
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*  The send failed on a reused connection that the server had probably 
+    already closed. Recreate the request so that WinInet sends it on a new 
+    connection. Returns TRUE if the message should be resent. */
+static BOOL
+wininet_stale_retry(
+    struct soap *           soap,
+    struct wininet_data *   a_pData
+    )
+{
+    WININET_LOG0(a_pData, "stale_retry: connection was closed by the server, resending");
+    ++a_pData->stats.nStaleRetries;
+
+    InternetCloseHandle(a_pData->hRequest);
+    a_pData->hRequest = NULL;
+    if (wininet_create_request(soap) != SOAP_OK) {
+        return FALSE;
+    }
+    wininet_add_saved_headers(a_pData, a_pData->hRequest, TRUE, FALSE);
+
+    return TRUE;
+}
+
+/*  The current endpoint couldn't be reached, connect to another of the 
+    configured endpoints and recreate the request. Returns TRUE if the message 
+    should be resent. If another endpoint was chosen but the request couldn't
+    be created then the request handle will be NULL. */
+static BOOL
+wininet_endpoint_failover(
+    struct soap *           soap,
+    struct wininet_data *   a_pData
+    )
+{
+    struct wininet_endpoint * pEndpoint;
+    unsigned n;
+
+    if (!a_pData->pEndpointState) {
+        return FALSE;
+    }
+    for (n = 0; n < a_pData->nEndpoints; ++n) {
+        if (a_pData->apEndpoints[n] == a_pData->pEndpointState) {
+            a_pData->dwEndpointsTried |= 1UL << n;
+        }
+    }
+
+    pEndpoint = wininet_endpoint_select(a_pData);
+    if (!pEndpoint) {
+        WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "endpoint_failover: no more endpoints");
+        return FALSE;
+    }
+    WININET_LOGC1(a_pData, WININET_LOG_ERRORS, "endpoint_failover: trying '%s'", pEndpoint->pUrl);
+    ++a_pData->stats.nFailovers;
+
+    InternetCloseHandle(a_pData->hRequest);
+    a_pData->hRequest = NULL;
+    InternetCloseHandle(a_pData->hConnection);
+    a_pData->hConnection = NULL;
+    a_pData->pEndpointState = pEndpoint;
+    if (!wininet_connect(soap, a_pData, pEndpoint->pUrl)) {
+        return FALSE;
+    }
+    if (wininet_create_request(soap) != SOAP_OK) {
+        return FALSE;
+    }
+    wininet_add_saved_headers(a_pData, a_pData->hRequest, TRUE, FALSE);
+
+    return TRUE;
+}
+
+/* automatic tuning of the WinInet connections per server, see wininet_conns_autotune() */
+static struct wininet_lock      wininet_conns_lock;
+static DWORD                    wininet_conns_max;          /* 0 = tuning disabled */
+static DWORD                    wininet_conns_threshold;    /* slot wait in ms that counts as queueing */
+static unsigned                 wininet_conns_waits;        /* sends that queued since the last change */
+
+#define WININET_CONNS_WAITS     8   /* queued sends before the connection limit is raised */
+#define WININET_CONNS_STEP      2   /* connections added each time */
+
+/* set the WinInet limit of connections to each server for the process */
+static BOOL
+wininet_conns_set(
+    DWORD   a_dwMaxConns
+    )
+{
+    return InternetSetOption(NULL, INTERNET_OPTION_MAX_CONNS_PER_SERVER, 
+            &a_dwMaxConns, sizeof(a_dwMaxConns))
+        && InternetSetOption(NULL, INTERNET_OPTION_MAX_CONNS_PER_1_0_SERVER, 
+            &a_dwMaxConns, sizeof(a_dwMaxConns));
+}
+
+static DWORD
+wininet_conns_get(void)
+{
+    DWORD dwMaxConns = 0;
+    DWORD dwLen = sizeof(dwMaxConns);
+
+    InternetQueryOption(NULL, INTERNET_OPTION_MAX_CONNS_PER_SERVER, &dwMaxConns, &dwLen);
+    return dwMaxConns;
+}
+
+/*  Split the time of the last send into the time spent waiting for WinInet 
+    to give us a connection and the time on the network. The first network 
+    activity reported to the callback is when the connection was obtained. 
+    When sends wait repeatedly the connection limit is raised if tuning is 
+    enabled. */
+static void
+wininet_record_slot_wait(
+    struct wininet_data *   a_pData
+    )
+{
+    DWORD dwTotal = GetTickCount() - a_pData->dwSendStart;
+    DWORD dwWait = 0;
+    DWORD dwMaxConns = 0;
+
+    if (a_pData->bSlotAcquired) {
+        dwWait = a_pData->dwSlotAcquired - a_pData->dwSendStart;
+        if (dwWait > dwTotal) dwWait = dwTotal;
+    }
+    a_pData->bSending = FALSE;
+    a_pData->stats.nSlotWaitMs += dwWait;
+    a_pData->stats.nNetworkMs += dwTotal - dwWait;
+    WININET_LOGC2(a_pData, WININET_LOG_TIMING, "send: %lu ms waiting for a connection, %lu ms on the network", 
+        dwWait, dwTotal - dwWait);
+
+    if (!wininet_conns_max || dwWait < wininet_conns_threshold) {
+        return;
+    }
+
+    wininet_lock_enter(&wininet_conns_lock);
+    if (wininet_conns_max && ++wininet_conns_waits >= WININET_CONNS_WAITS) {
+        wininet_conns_waits = 0;
+        dwMaxConns = wininet_conns_get();
+        if (dwMaxConns < wininet_conns_max) {
+            dwMaxConns += WININET_CONNS_STEP;
+            if (dwMaxConns > wininet_conns_max) dwMaxConns = wininet_conns_max;
+            wininet_conns_set(dwMaxConns);
+        }
+        else {
+            dwMaxConns = 0;
+        }
+    }
+    wininet_lock_leave(&wininet_conns_lock);
+
+    if (dwMaxConns) {
+        WININET_LOGC2(a_pData, WININET_LOG_TIMING, "record_slot_wait: waited %lu ms for a connection, "
+            "raised connections per server to %lu", dwWait, dwMaxConns);
+    }
+}
+
+/* remember the latency of a completed send for the hedging quantile */
+static void
+wininet_record_latency(
+    struct wininet_data *   a_pData,
+    DWORD                   a_dwLatency
+    )
+{
+    a_pData->adwLatency[a_pData->nLatencyNext] = a_dwLatency;
+    a_pData->nLatencyNext = (a_pData->nLatencyNext + 1) % WININET_LATENCY_SAMPLES;
+    if (a_pData->nLatencyCount < WININET_LATENCY_SAMPLES) {
+        ++a_pData->nLatencyCount;
+    }
+}
+
+/* determine how long to wait for a response before sending a hedged 
+   request. Returns INFINITE if we should not hedge. */
+static DWORD
+wininet_hedge_delay(
+    struct wininet_data *   a_pData
+    )
+{
+    DWORD adwSorted[WININET_LATENCY_SAMPLES];
+    DWORD dwLatency;
+    unsigned n, m, nIndex;
+
+    if (!a_pData->dwHedgeQuantile || a_pData->nLatencyCount < WININET_HEDGE_MIN_SAMPLES) {
+        return INFINITE;
+    }
+
+    /* insertion sort of a small number of samples */
+    for (n = 0; n < a_pData->nLatencyCount; ++n) {
+        dwLatency = a_pData->adwLatency[n];
+        for (m = n; m > 0 && adwSorted[m-1] > dwLatency; --m) {
+            adwSorted[m] = adwSorted[m-1];
+        }
+        adwSorted[m] = dwLatency;
+    }
+
+    nIndex = (a_pData->nLatencyCount * a_pData->dwHedgeQuantile + 99) / 100;
+    if (nIndex > 0) --nIndex;
+    dwLatency = adwSorted[nIndex];
+    if (dwLatency < a_pData->dwHedgeMinDelay) {
+        dwLatency = a_pData->dwHedgeMinDelay;
+    }
+    return dwLatency;
+}
+
+static unsigned __stdcall
+wininet_sender_thread(
+    void * a_pArg
+    )
+{
+    struct wininet_sender * pSender = (struct wininet_sender *) a_pArg;
+
+    pSender->bResult = wininet_http_send(pSender->pData, pSender->hRequest, 
+        pSender->pBuf, pSender->uiBufLen, &pSender->dwOutcome);
+    pSender->dwError = pSender->bResult ? 0 : GetLastError();
+    return 0;
+}
+
+static BOOL
+wininet_sender_start(
+    struct wininet_sender * a_pSender
+    )
+{
+    a_pSender->hThread = (HANDLE) _beginthreadex(NULL, 0, 
+        wininet_sender_thread, a_pSender, 0, NULL);
+    return a_pSender->hThread != NULL;
+}
+
+/* wait for a sender to finish, cancelling the send first if requested */
+static void
+wininet_sender_finish(
+    struct wininet_sender * a_pSender,
+    BOOL                    a_bCancel
+    )
+{
+    if (a_bCancel && a_pSender->hRequest) {
+        /* closing the handle aborts the blocking send */
+        InternetCloseHandle(a_pSender->hRequest);
+        a_pSender->hRequest = NULL;
+    }
+    if (a_pSender->hThread) {
+        WaitForSingleObject(a_pSender->hThread, INFINITE);
+        CloseHandle(a_pSender->hThread);
+        a_pSender->hThread = NULL;
+    }
+    if (a_bCancel && a_pSender->hConnection) {
+        InternetCloseHandle(a_pSender->hConnection);
+        a_pSender->hConnection = NULL;
+    }
+}
+
+/*  open a second connection and request for the current message, using the 
+    same flags and headers as the current request. The handles have the same 
+    context as the current ones so that the connection is tracked if the 
+    hedged request wins, see wininet_callback(). */
+static BOOL
+wininet_open_duplicate(
+    struct soap *           soap,
+    struct wininet_data *   a_pData,
+    struct wininet_sender * a_pSender
+    )
+{
+    a_pSender->hConnection = InternetConnectA(a_pData->hSession, 
+        a_pData->pHost, a_pData->nPort, "", "", INTERNET_SERVICE_HTTP, 0, (DWORD_PTR) soap);
+    if (!a_pSender->hConnection) {
+        return FALSE;
+    }
+
+    a_pSender->hRequest = HttpOpenRequestA(a_pSender->hConnection, "POST", 
+        a_pData->pUrlPath, "HTTP/1.1", NULL, NULL, a_pData->dwActiveFlags, (DWORD_PTR) soap);
+    if (!a_pSender->hRequest) {
+        InternetCloseHandle(a_pSender->hConnection);
+        a_pSender->hConnection = NULL;
+        return FALSE;
+    }
+
+    wininet_add_saved_headers(a_pData, a_pSender->hRequest, FALSE, FALSE);
+    return TRUE;
+}
+
+/*  Send the request. When hedging is enabled and no response arrives within 
+    the configured latency quantile, the same message is sent on a second 
+    connection. This must only be enabled for idempotent operations. The 
+    first successful response is used and the other request is cancelled. 
+    The winning handles are left in a_pData. The requests are sent from 
+    worker threads, the statistics and connection state are only updated 
+    here once both have finished. Sets the last error on failure as 
+    HttpSendRequest does.
+ */
+static BOOL
+wininet_send_hedged(
+    struct soap *           soap,
+    struct wininet_data *   a_pData,
+    const char *            a_pSendBuf,
+    size_t                  a_nSendSize,
+    BOOL                    a_bAllowHedge
+    )
+{
+    struct wininet_sender primary, hedge;
+    struct wininet_sender * pWinner = &primary;
+    HANDLE  ahThreads[2];
+    DWORD   dwDelay, dwWait, dwError;
+    BOOL    bHedged = FALSE;
+    BOOL    bHedgeFailed = FALSE;
+    BOOL    bResult;
+
+    dwDelay = a_bAllowHedge ? wininet_hedge_delay(a_pData) : INFINITE;
+    if (dwDelay == INFINITE) {
+        bResult = wininet_http_send(a_pData, a_pData->hRequest, a_pSendBuf, a_nSendSize, &dwWait);
+        dwError = GetLastError();
+        wininet_send_outcome(a_pData, dwWait);
+        SetLastError(dwError);
+        return bResult;
+    }
+
+    memset(&primary, 0, sizeof(primary));
+    primary.pData       = a_pData;
+    primary.hConnection = a_pData->hConnection;
+    primary.hRequest    = a_pData->hRequest;
+    primary.pBuf        = a_pSendBuf;
+    primary.uiBufLen    = a_nSendSize;
+    hedge = primary;
+    hedge.hConnection = hedge.hRequest = NULL;
+
+    /* from now on the callbacks come from the sending threads */
+    a_pData->pHedge = &hedge;
+    a_pData->bPrimaryClosed = FALSE;
+    a_pData->bHedgeClosed = FALSE;
+    a_pData->bHedgeRace = TRUE;
+
+    if (!wininet_sender_start(&primary)) {
+        a_pData->bHedgeRace = FALSE;
+        a_pData->pHedge = NULL;
+        WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "send_hedged: failed to start thread, sending directly");
+        return wininet_send_hedged(soap, a_pData, a_pSendBuf, a_nSendSize, FALSE);
+    }
+
+    /* wait for the primary request up to the hedging delay, then send the duplicate */
+    if (WaitForSingleObject(primary.hThread, dwDelay) == WAIT_OBJECT_0) {
+        wininet_sender_finish(&primary, FALSE);
+    }
+    else if (!wininet_open_duplicate(soap, a_pData, &hedge) || !wininet_sender_start(&hedge)) {
+        bHedgeFailed = TRUE;
+        wininet_sender_finish(&hedge, TRUE);
+        wininet_sender_finish(&primary, FALSE);
+    }
+    else {
+        /* take the first successful response, or the last failure */
+        bHedged = TRUE;
+        ahThreads[0] = primary.hThread;
+        ahThreads[1] = hedge.hThread;
+        dwWait = WaitForMultipleObjects(2, ahThreads, FALSE, INFINITE);
+        pWinner = (dwWait == WAIT_OBJECT_0 + 1) ? &hedge : &primary;
+        if (!pWinner->bResult) {
+            struct wininet_sender * pOther = (pWinner == &primary) ? &hedge : &primary;
+            wininet_sender_finish(pOther, FALSE);
+            if (pOther->bResult) {
+                pWinner = pOther;
+            }
+        }
+        wininet_sender_finish(pWinner == &hedge ? &primary : &hedge, TRUE);
+        wininet_sender_finish(pWinner, FALSE);
+    }
+
+    /* both threads have finished */
+    a_pData->bHedgeRace = FALSE;
+    a_pData->pHedge = NULL;
+    wininet_send_outcome(a_pData, primary.dwOutcome);
+    if (bHedged) {
+        WININET_LOGC1(a_pData, WININET_LOG_TIMING, "send_hedged: no response after %lu ms, sent hedged request", dwDelay);
+        ++a_pData->stats.nHedged;
+        wininet_send_outcome(a_pData, hedge.dwOutcome);
+    }
+    else if (bHedgeFailed) {
+        WININET_LOGC0(a_pData, WININET_LOG_ERRORS, "send_hedged: failed to create hedged request");
+    }
+
+    if (pWinner == &hedge) {
+        WININET_LOG0(a_pData, "send_hedged: hedged request won, original cancelled");
+        ++a_pData->stats.nHedgeWins;
+        a_pData->hConnection = hedge.hConnection;
+        a_pData->hRequest    = hedge.hRequest;
+    }
+    else if (bHedged) {
+        WININET_LOG0(a_pData, "send_hedged: original request won, hedged request cancelled");
+    }
+
+    /* closing the losing request doesn't affect the connection we are now using */
+    if (pWinner == &hedge ? a_pData->bHedgeClosed : a_pData->bPrimaryClosed) {
+        WININET_LOGC0(a_pData, WININET_LOG_STATUS, "send_hedged: marking connection for disconnect");
+        a_pData->bDisconnect = TRUE;
+    }
+
+    SetLastError(pWinner->dwError);
+    return pWinner->bResult;
+}
+
+/* a copy of the message being sent to one of the fan-out endpoints */
+struct wininet_fanout_worker
+{
+    struct wininet_fanout * pFanout;
+    unsigned                nIndex;         /* index of the endpoint */
+    const char *            pBuf;           /* message shared by all workers */
+    size_t                  uiBufLen;
+    HINTERNET               hConnection;
+    HINTERNET               hRequest;
+    HANDLE                  hThread;
+    DWORD                   dwError;        /* 0 if a response was received */
+    DWORD                   dwStatusCode;
+    char *                  pResponse;      /* response headers and body as passed to gsoap */
+    size_t                  uiResponseLen;
+};
+
+/*  Read the entire response of a request into a new buffer in the same form 
+    as frecv passes it to gsoap: the headers (excluding those handled by 
+    WinInet) followed by the body. Returns FALSE on failure. */
+static BOOL
+wininet_read_response(
+    HINTERNET   a_hRequest,
+    char **     a_ppResponse,
+    size_t *    a_puiResponseLen
+    )
+{
+    char *  pResponse = NULL;
+    char *  pNew;
+    size_t  uiSize = 0;
+    size_t  uiLen = 0;
+    DWORD   dwLen = 0;
+    DWORD   dwRead;
+    char *  pLine;
+    char *  pNext;
+    char *  pHeaders;
+
+    /* the headers are returned as CRLF separated lines ending with a blank line */
+    HttpQueryInfoA(a_hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, NULL, &dwLen, NULL);
+    if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) {
+        return FALSE;
+    }
+    pHeaders = (char *) malloc(dwLen + 1);
+    if (!pHeaders) {
+        return FALSE;
+    }
+    if (!HttpQueryInfoA(a_hRequest, HTTP_QUERY_RAW_HEADERS_CRLF, pHeaders, &dwLen, NULL)) {
+        free(pHeaders);
+        return FALSE;
+    }
+    pHeaders[dwLen] = 0;
+
+    uiSize = ROUND_UP(dwLen + 2 + 4096, 4096);
+    pResponse = (char *) malloc(uiSize);
+    if (!pResponse) {
+        free(pHeaders);
+        return FALSE;
+    }
+
+    for (pLine = pHeaders; *pLine; pLine = pNext) {
+        pNext = strstr(pLine, "\r\n");
+        pNext = pNext ? pNext + 2 : pLine + strlen(pLine);
+        if (pNext - pLine <= 2 
+            || !strnicmp(pLine, "Transfer-Encoding:", 18) 
+            || !strnicmp(pLine, "WWW-Authenticate:", 17)) 
+        {
+            continue;
+        }
+        memcpy(pResponse + uiLen, pLine, pNext - pLine);
+        uiLen += pNext - pLine;
+    }
+    pResponse[uiLen++] = '\r';
+    pResponse[uiLen++] = '\n';
+    free(pHeaders);
+
+    for (;;) {
+        if (uiSize - uiLen < 4096) {
+            uiSize *= 2;
+            pNew = (char *) realloc(pResponse, uiSize);
+            if (!pNew) break;
+            pResponse = pNew;
+        }
+        if (!InternetReadFile(a_hRequest, pResponse + uiLen, (DWORD) (uiSize - uiLen), &dwRead)) {
+            break;
+        }
+        if (!dwRead) {
+            *a_ppResponse = pResponse;
+            *a_puiResponseLen = uiLen;
+            return TRUE;
+        }
+        uiLen += dwRead;
+    }
+
+    free(pResponse);
+    return FALSE;
+}
+
+/* send the message to one fan-out endpoint and read the entire response */
+static unsigned __stdcall
+wininet_fanout_thread(
+    void * a_pArg
+    )
+{
+    struct wininet_fanout_worker * pWorker = (struct wininet_fanout_worker *) a_pArg;
+    DWORD dwLen = sizeof(pWorker->dwStatusCode);
+
+    if (!HttpSendRequestA(pWorker->hRequest, NULL, 0, 
+            (void *) pWorker->pBuf, (DWORD) pWorker->uiBufLen)) 
+    {
+        pWorker->dwError = GetLastError();
+    }
+    else if (!HttpQueryInfoA(pWorker->hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, 
+            &pWorker->dwStatusCode, &dwLen, NULL)
+        || !wininet_read_response(pWorker->hRequest, &pWorker->pResponse, &pWorker->uiResponseLen))
+    {
+        pWorker->dwError = GetLastError();
+        if (!pWorker->dwError) pWorker->dwError = ERROR_INTERNET_INTERNAL_ERROR;
+    }
+
+    /* queue our completion for the calling thread */
+    pWorker->pFanout->anCompleted[InterlockedIncrement(&pWorker->pFanout->nCompleted) - 1] = pWorker->nIndex;
+    ReleaseSemaphore(pWorker->pFanout->hCompleted, 1, NULL);
+    return 0;
+}
+
+/* create the connection and request for a fan-out endpoint */
+static BOOL
+wininet_fanout_open(
+    struct wininet_data *           a_pData,
+    struct wininet_fanout_worker *  a_pWorker,
+    const char *                    a_pszEndpoint
+    )
+{
+    struct wininet_url * pUrl;
+    DWORD           dwFlags = a_pData->dwActiveFlags & ~INTERNET_FLAG_SECURE;
+    BOOL            bSameOrigin;
+
+    pUrl = wininet_url_get(a_pData, a_pszEndpoint);
+    if (!pUrl) {
+        return FALSE;
+    }
+    if (pUrl->nScheme == INTERNET_SCHEME_HTTPS) {
+        dwFlags |= INTERNET_FLAG_SECURE;
+    }
+
+    /* credentials for the current server are only sent to the same origin */
+    bSameOrigin = a_pData->pHost && !stricmp(pUrl->pHost, a_pData->pHost) 
+        && pUrl->nPort == a_pData->nPort
+        && (dwFlags & INTERNET_FLAG_SECURE) == (a_pData->dwRequestFlags & INTERNET_FLAG_SECURE);
+
+    /* no context is used so that callbacks don't change the state of the 
+       current connection */
+    a_pWorker->hConnection = InternetConnectA(wininet_proxy_session(a_pData, pUrl), pUrl->pHost, 
+        pUrl->nPort, "", "", INTERNET_SERVICE_HTTP, 0, 0);
+    if (a_pWorker->hConnection) {
+        a_pWorker->hRequest = HttpOpenRequestA(a_pWorker->hConnection, "POST", 
+            pUrl->pUrlPath, "HTTP/1.1", NULL, NULL, dwFlags, 0);
+    }
+    if (!pUrl->bCached) {
+        free(pUrl);
+    }
+    if (!a_pWorker->hRequest) {
+        return FALSE;
+    }
+
+    wininet_add_saved_headers(a_pData, a_pWorker->hRequest, TRUE, !bSameOrigin);
+    return TRUE;
+}
+
+/*  Send the message to all fan-out endpoints concurrently, passing each 
+    response to the callback as it arrives. Once the required number of 
+    endpoints have responded successfully the remaining requests are 
+    cancelled and the first successful response is returned by frecv. The 
+    requests don't go through the circuit breaker, concurrency limiter or 
+    credential cache, which all work on the server of the soap call. */
+static int
+wininet_fanout_send(
+    struct soap *           soap,
+    struct wininet_data *   a_pData,
+    const char *            a_pSendBuf,
+    size_t                  a_nSendSize
+    )
+{
+    struct wininet_fanout * pFanout = a_pData->pFanout;
+    struct wininet_fanout_worker * aWorkers;
+    struct wininet_fanout_worker * pWorker;
+    unsigned nStarted = 0;
+    unsigned nSucceeded = 0;
+    unsigned nRequired = pFanout->nRequired ? pFanout->nRequired : pFanout->nEndpoints;
+    unsigned n;
+    DWORD dwTimeout = wininet_call_timeout(soap);
+    DWORD dwStart = GetTickCount();
+    DWORD dwElapsed;
+    DWORD dwLastError = 0;
+
+    WININET_LOG2(a_pData, "fanout_send: sending to %u endpoints, %u required", 
+        pFanout->nEndpoints, nRequired);
+
+    aWorkers = (struct wininet_fanout_worker *) 
+        calloc(pFanout->nEndpoints, sizeof(struct wininet_fanout_worker));
+    if (!aWorkers) {
+        return SOAP_EOM;
+    }
+    pFanout->nCompleted = 0;
+
+    /* every worker sends the same buffered message */
+    for (n = 0; n < pFanout->nEndpoints; ++n) {
+        pWorker = &aWorkers[n];
+        pWorker->pFanout  = pFanout;
+        pWorker->nIndex   = n;
+        pWorker->pBuf     = a_pSendBuf;
+        pWorker->uiBufLen = a_nSendSize;
+        if (wininet_fanout_open(a_pData, pWorker, pFanout->ppEndpoints[n])) {
+            pWorker->hThread = (HANDLE) _beginthreadex(NULL, 0, 
+                wininet_fanout_thread, pWorker, 0, NULL);
+        }
+        if (pWorker->hThread) {
+            ++nStarted;
+            ++a_pData->stats.nRequests;
+        }
+        else {
+            pWorker->dwError = GetLastError();
+            if (!pWorker->dwError) pWorker->dwError = ERROR_INTERNET_INTERNAL_ERROR;
+            WININET_LOGC2(a_pData, WININET_LOG_ERRORS, "fanout_send: failed to start request to '%s', error %lu", 
+                pFanout->ppEndpoints[n], pWorker->dwError);
+            if (pFanout->pCallback) {
+                pFanout->pCallback(pFanout->pContext, n, pFanout->ppEndpoints[n], 
+                    pWorker->dwError, 0, NULL, 0);
+            }
+            dwLastError = pWorker->dwError;
+        }
+    }
+
+    /* handle the responses in the order that they complete */
+    wininet_log_commit(a_pData);
+    for (n = 0; n < nStarted && nSucceeded < nRequired; ++n) {
+        dwElapsed = GetTickCount() - dwStart;
+        if (dwElapsed >= dwTimeout 
+            || WaitForSingleObject(pFanout->hCompleted, dwTimeout - dwElapsed) != WAIT_OBJECT_0) 
+        {
+            WININET_LOG0(a_pData, "fanout_send: timed out waiting for responses");
+            dwLastError = ERROR_INTERNET_TIMEOUT;
+            break;
+        }
+
+        pWorker = &aWorkers[pFanout->anCompleted[n]];
+        WININET_LOG3(a_pData, "fanout_send: '%s' completed, error %lu, status %lu", 
+            pFanout->ppEndpoints[pWorker->nIndex], pWorker->dwError, pWorker->dwStatusCode);
+        if (pFanout->pCallback) {
+            pFanout->pCallback(pFanout->pContext, pWorker->nIndex, 
+                pFanout->ppEndpoints[pWorker->nIndex], pWorker->dwError, 
+                pWorker->dwStatusCode, pWorker->pResponse, pWorker->uiResponseLen);
+        }
+
+        if (pWorker->dwError) {
+            dwLastError = pWorker->dwError;
+        }
+        else if (pWorker->dwStatusCode == HTTP_STATUS_OK) {
+            if (++nSucceeded == 1) {
+                /* frecv returns the first successful response */
+                a_pData->pReplay = pWorker->pResponse;
+                a_pData->uiReplayLen = pWorker->uiResponseLen;
+                a_pData->uiReplayPos = 0;
+                pWorker->pResponse = NULL;
+            }
+        }
+
+        /* stop waiting once the quorum can no longer be reached */
+        if (nSucceeded + (nStarted - n - 1) < nRequired) {
+            break;
+        }
+    }
+
+    /* cancel the requests that are still in progress and clean up */
+    for (n = 0; n < pFanout->nEndpoints; ++n) {
+        pWorker = &aWorkers[n];
+        if (pWorker->hRequest) {
+            InternetCloseHandle(pWorker->hRequest);
+        }
+        if (pWorker->hThread) {
+            WaitForSingleObject(pWorker->hThread, INFINITE);
+            CloseHandle(pWorker->hThread);
+        }
+        if (pWorker->hConnection) {
+            InternetCloseHandle(pWorker->hConnection);
+        }
+        free(pWorker->pResponse);
+    }
+    free(aWorkers);
+
+    /* consume the completions of the requests we didn't wait for */
+    while (WaitForSingleObject(pFanout->hCompleted, 0) == WAIT_OBJECT_0) {
+    }
+
+    a_pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+    if (nSucceeded < nRequired) {
+        WININET_LOG2(a_pData, "fanout_send: only %u of %u required responses", 
+            nSucceeded, nRequired);
+        wininet_response_reset(a_pData);
+        soap->error = (nSucceeded || !dwLastError) ? WININET_ERROR_QUORUM_FAILED : dwLastError;
+        return soap->error;
+    }
+    ++a_pData->stats.nFanouts;
+    return SOAP_OK;
+}
+
+/* gsoap documentation:
+    Called for all send operations to emit contents of s of length n. 
+    Should return SOAP_OK, or a gSOAP error code. Built-in gSOAP 
+    function: fsend
+
+   Notes:
+    I do a heap of buffering here because we need the entire message available
+    in a single buffer in order to iterate through the sending loop. I had 
+    hoped that the SOAP_IO_STORE flag would have worked to do the same, however
+    this still breaks the messages up into blocks. Although there were a number
+    of ways this could've been implemented, this works and supports all of the
+    possible SOAP_IO flags, even though the entire message is still buffered 
+    the same as if SOAP_IO_STORE was used.
+*/
+static int 
+wininet_fsend(
+    struct soap *   soap, 
+    const char *    a_pBuffer, 
+    size_t          a_uiBufferLen
+    )
+{
+    BOOL        bResult;
+    BOOL        bRetryPost;
+    BOOL        bStaleRetried = FALSE;
+    BOOL        bStale;
+    DWORD       dwStatusCode;
+    DWORD       dwStatusCodeLen;
+    DWORD       dwSendStart;
+    wininet_rseReturn errorResolved;
+    int         nResult = SOAP_OK;
+    int         nAttempt = 0;
+    int         nRedirects = 0;
+    size_t      nSendSize = 0;
+    char *      pSendBuf = NULL;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    _ASSERTE(pData->hRequest != NULL);
+
+    WININET_LOG1(pData, "fsend: data len = %lu bytes", a_uiBufferLen);
+
+    /* ensure that our connection hasn't been disconnected */
+    soap->error = SOAP_OK;
+    if (!wininet_have_connection(soap, pData)) {
+        return SOAP_EOF;
+    }
+
+    /*  on the first time, if we don't know the size of the buffer, then we are either using
+        chunked send, or we need to slowly allocate the buffer as it comes.
+    */
+    if (pData->uiBufferLen == 0 && pData->uiBufferLenMax == INVALID_BUFFER_LENGTH) {
+        /*  If we are using chunked sending, then we don't know how big the
+            buffer will need to be. So we start with a 0 length buffer and
+            grow it later to ensure that it is always large enough.
+         */
+        if ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK) {
+            /* ensure we have a buffer large enough for this chunksize 
+               buffer, plus the next chunk of actual data, and a few extra 
+               bytes for the final "0" chunksize block. */
+            size_t uiChunkSize = strtoul(a_pBuffer, NULL, 16);
+            _ASSERTE(a_uiBufferLen > 0);
+            pData->uiBufferLenMax = uiChunkSize + a_uiBufferLen + 16;
+        }
+
+        /* empty bodies will set the buffer length to 0, permit this */
+        if (a_uiBufferLen == 0) {
+            pData->uiBufferLenMax = 0;
+        }
+    }
+
+    /*  If the currently supplied buffer from gsoap holds the entire message then just use 
+        that buffer as is. This will only be true when (1) not using chunked send (so 
+        uiBufferLenMax has been previously set to the Content-Length header length), and 
+        (2) gsoap is sending the entire message at one time. 
+     */
+    if (a_uiBufferLen == pData->uiBufferLenMax) {
+        WININET_LOG0(pData, "fsend: using gsoap supplied data buffer");
+        nSendSize = a_uiBufferLen;
+        pSendBuf  = (char *) a_pBuffer;
+    }
+
+    /*  If not using the gsoap buffer, then ensure that the current allocation
+        is large enough for the entire message. This is because authentication 
+        may require the entire message to be sent multiple times. Since this 
+        send is only a part of the message, we need to buffer until we have the 
+        entire message.
+    */
+    if (!pSendBuf) {
+        size_t uiNewBufferLen = pData->uiBufferLen + a_uiBufferLen;
+        if (!pData->pBuffer || uiNewBufferLen > pData->uiBufferSize) {
+            int rc = wininet_growbuffer(pData, "fsend", uiNewBufferLen);
+            if (rc != SOAP_OK) return rc;
+        }
+
+        memcpy(pData->pBuffer + pData->uiBufferLen, a_pBuffer, a_uiBufferLen);
+        pData->uiBufferLen = uiNewBufferLen;
+
+        /*  when doing chunked transfers, and this is a chunk size block, and it is 
+            "0", then it is the last block. set the maximum size to continue to the 
+            actual send. */
+        if ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK
+             && pData->bIsChunkSize 
+             && a_pBuffer[2] == '0' && !isalnum(a_pBuffer[3]))
+        {
+            pData->uiBufferLenMax = pData->uiBufferLen;
+        }
+
+        /* continue if the entire message is not complete */
+        if (pData->uiBufferLen < pData->uiBufferLenMax) {
+            pData->bIsChunkSize = !pData->bIsChunkSize
+                && ((soap->mode & SOAP_IO) == SOAP_IO_CHUNK);
+            return SOAP_OK;
+        }
+
+        /* message is complete, set the sending buffer */
+        nSendSize = pData->uiBufferLen;
+        pSendBuf  = pData->pBuffer;
+
+        WININET_LOG3(pData, "fsend: using %d%% (%lu bytes) of %lu byte internal buffer", 
+            (int)((pData->uiBufferLen * 100) / pData->uiBufferSize), 
+            pData->uiBufferLen, pData->uiBufferSize);
+    }
+
+    /* send the message to all of the fan-out endpoints instead */
+    if (pData->pFanout) {
+        return wininet_fanout_send(soap, pData, pSendBuf, nSendSize);
+    }
+
+    /* return the response from the cache if we can */
+    if (pData->pCacheRules) {
+        switch (wininet_cache_check(pData, pSendBuf, nSendSize)) {
+        case WININET_CACHE_HIT:
+            pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+            return SOAP_OK;
+
+        case WININET_CACHE_STALE:
+            /* ask the server if our cached response is still valid */
+            wininet_add_conditional_headers(pData, pData->hRequest);
+            break;
+        }
+    }
+
+    /* wait for an identical message that is already being sent */
+    if (pData->bCoalesce && !pData->bRevalidating) {
+        struct wininet_cache_key key;
+        wininet_cache_key_init(pData, &key, pSendBuf, nSendSize);
+        if (wininet_flight_join(pData, &key, wininet_call_timeout(soap))) {
+            pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+            return SOAP_OK;
+        }
+    }
+
+    /* fail immediately if the server is known to be unhealthy */
+    if (!wininet_breaker_allow(pData)) {
+        wininet_capture_abort(pData);
+        pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+        soap->error = WININET_ERROR_CIRCUIT_OPEN;
+        return soap->error;
+    }
+
+    /* wait until the server can accept another message */
+    if (!wininet_limiter_acquire(pData)) {
+        wininet_capture_abort(pData);
+        pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+        soap->error = WININET_ERROR_LIMIT_EXCEEDED;
+        return soap->error;
+    }
+
+    /* output the data we are sending */
+    WININET_LOG2(pData, "fsend: sending message %lu bytes, trace %s", nSendSize, 
+        pData->szTraceParent[0] ? pData->szTraceParent : "(none)");
+    if (WININET_LOG_ON(pData, WININET_LOG_BODY) && nSendSize > 0) {
+        wininet_log_data(pData, "fsend: message data", pSendBuf, nSendSize);
+    }
+
+    /* we've now got the entire message, now we can enter our sending loop */
+    pData->dwEndpointsTried = 0;
+    bRetryPost = TRUE;
     while (bRetryPost) {
         bRetryPost = FALSE;
 
-        WININET_LOG1(pData, "fsend: sending message, attempt %d", nAttempt++);
-        bResult = HttpSendRequestA(
-            pData->hRequest, NULL, 0, pSendBuf, (DWORD)nSendSize);
-        if (!bResult) {
-            soap->error = GetLastError();
-            WININET_LOG2(pData, "fsend: error %d (%s) in HttpSendRequest", 
-                soap->error, wininet_error_message(pData, soap->error));
+        ++nAttempt;
+        WININET_LOG1(pData, "fsend: sending message, attempt %d", nAttempt);
+        ++pData->stats.nRequests;
+        dwSendStart = GetTickCount();
+        pData->dwSendStart = dwSendStart;
+        pData->bSlotAcquired = FALSE;
+        pData->bSending = TRUE;
+        if (pData->pEndpointState) {
+            InterlockedIncrement(&pData->pEndpointState->nOutstanding);
+        }
+        /* only the first attempt is hedged, retries after errors have been 
+           resolved must use the original request */
+        wininet_log_commit(pData);
+        bResult = wininet_send_hedged(soap, pData, pSendBuf, nSendSize, nAttempt == 1);
+        if (!bResult) {
+            soap->error = GetLastError();
+        }
+        wininet_record_slot_wait(pData);
+        if (pData->pEndpointState) {
+            InterlockedDecrement(&pData->pEndpointState->nOutstanding);
+            wininet_endpoint_complete(pData, bResult || !wininet_is_connect_error(soap->error), 
+                GetTickCount() - dwSendStart);
+        }
+        if (bResult) {
+            pData->dwLastUsed = GetTickCount();
+            pData->bConnUsed = TRUE;
+        }
+        else {
+            WININET_LOGC2(pData, WININET_LOG_ERRORS, "fsend: error %d (%s) in HttpSendRequest", 
+                soap->error, wininet_error_message(pData, soap->error));
+
+            /*  a kept alive connection may have been closed while it was idle. 
+                It is resent once, only on a reused connection, because the 
+                server may already have processed the message. The result of 
+                the resend is the one that counts for the circuit breaker. */
+            bStale = wininet_is_stale_error(soap->error) && !bStaleRetried && pData->bConnUsed
+                && (pData->dwActiveFlags & INTERNET_FLAG_KEEP_CONNECTION);
+            if (wininet_is_server_error(soap->error) && !bStale) {
+                wininet_breaker_record(pData, TRUE);
+            }
+
+            /* the server couldn't be reached, try one of the other endpoints */
+            if (wininet_is_connect_error(soap->error) && wininet_endpoint_failover(soap, pData)) {
+                pData->bDisconnect = FALSE; 
+                bRetryPost = TRUE;
+                continue;
+            }
+
+            if (bStale) {
+                bStaleRetried = TRUE;
+                if (wininet_stale_retry(soap, pData)) {
+                    pData->bDisconnect = FALSE; 
+                    bRetryPost = TRUE;
+                    continue;
+                }
+                wininet_breaker_record(pData, TRUE);
+            }
+            if (!pData->hRequest) {
+                nResult = SOAP_HTTP_ERROR;
+                break;
+            }
+
+            /* see if we can handle this error, see the MSDN documentation
+               for InternetErrorDlg for details */
+            switch (soap->error) {
+            case ERROR_INTERNET_HTTP_TO_HTTPS_ON_REDIR:
+            case ERROR_INTERNET_HTTPS_TO_HTTP_ON_REDIR:
+            case ERROR_INTERNET_INCORRECT_PASSWORD:
+            case ERROR_INTERNET_INVALID_CA:
+            case ERROR_INTERNET_POST_IS_NON_SECURE:
+            case ERROR_INTERNET_SEC_CERT_CN_INVALID:
+            case ERROR_INTERNET_SEC_CERT_DATE_INVALID:
+            case ERROR_INTERNET_CLIENT_AUTH_CERT_NEEDED:
+                errorResolved = rseDisplayDlg;
+                if (pData->pRseCallback) {
+                    WININET_LOGC0(pData, WININET_LOG_ERRORS, "fsend: calling client supplied error callback");
+                    errorResolved = pData->pRseCallback(pData->hRequest, soap->error);
+                }
+                if (errorResolved == rseDisplayDlg) {
+                    errorResolved = wininet_resolve_send_error(pData, soap->error);
+                    if (errorResolved == rseTrue) {
+                        WININET_LOGC1(pData, WININET_LOG_ERRORS, "fsend: error %d has been resolved (retrying)", soap->error);
+
+                        /*  we may have been disconnected by the error. Since we 
+                            are going to try again, we will automatically be 
+                            reconnected. Therefore we want to disregard any previous
+                            disconnection messages. 
+                            */
+                        pData->bDisconnect = FALSE; 
+                        bRetryPost = TRUE;
+                        nResult = SOAP_OK;
+                        continue;
+                    }
+                }
+                break;
+            }
+
+            /* if the error wasn't handled then we exit */
+            nResult = SOAP_HTTP_ERROR;
+            break;
+        }
+
+        /* get the status code from the response to determine if we need 
+           to authorize */
+        dwStatusCodeLen = sizeof(dwStatusCode);
+        bResult = HttpQueryInfo(
+            pData->hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, 
+            &dwStatusCode, &dwStatusCodeLen, NULL);
+        if (!bResult) {
+            soap->error = GetLastError();
+            WININET_LOGC2(pData, WININET_LOG_ERRORS, "fsend: error %d (%s) in HttpQueryInfo", 
+                soap->error, wininet_error_message(pData, soap->error));
+            nResult = SOAP_HTTP_ERROR;
+            break;
+        }
+
+        WININET_LOG1(pData, "fsend: HTTP status code = %lu", dwStatusCode);
+        wininet_breaker_record(pData, dwStatusCode == HTTP_STATUS_BAD_GATEWAY 
+            || dwStatusCode == HTTP_STATUS_SERVICE_UNAVAIL 
+            || dwStatusCode == HTTP_STATUS_GATEWAY_TIMEOUT);
+
+        /* authentication round trips aren't representative of the response time */
+        if (dwStatusCode != HTTP_STATUS_DENIED && dwStatusCode != HTTP_STATUS_PROXY_AUTH_REQ) {
+            wininet_record_latency(pData, GetTickCount() - dwSendStart);
+        }
+
+        /* our cached response is still valid, frecv will return it */
+        if (pData->bRevalidating && dwStatusCode == HTTP_STATUS_NOT_MODIFIED) {
+            pData->bRevalidating = FALSE;
+            wininet_capture_abort(pData);
+            if (wininet_cache_revalidated(pData)) {
+                WININET_LOG0(pData, "fsend: cached response is still valid");
+                ++pData->stats.nNotModified;
+                break;
+            }
+
+            /* the cached response has gone, send the request unconditionally */
+            WININET_LOG0(pData, "fsend: cached response was discarded, resending");
+            HttpAddRequestHeadersA(pData->hRequest, "If-None-Match:\r\n", (DWORD) -1L, HTTP_ADDREQ_FLAG_REPLACE);
+            HttpAddRequestHeadersA(pData->hRequest, "If-Modified-Since:\r\n", (DWORD) -1L, HTTP_ADDREQ_FLAG_REPLACE);
+            bRetryPost = TRUE;
+            continue;
+        }
+
+        /* follow redirects ourselves so that permanent ones can be cached */
+        if (pData->bRedirectCache) {
+            if (wininet_follow_redirect(soap, pData, dwStatusCode, &nRedirects)) {
+                pData->bDisconnect = FALSE; 
+                bRetryPost = TRUE;
+                continue;
+            }
+            if (!pData->hRequest) {
+                nResult = SOAP_HTTP_ERROR;
+                break;
+            }
+        }
+
+        /*  if we need authentication, then request the user for the 
+            appropriate data. Their reply is saved into the request so 
+            that we can use it later.
+         */
+        switch (dwStatusCode) {
+        case HTTP_STATUS_DENIED:            /* 401 */
+        case HTTP_STATUS_PROXY_AUTH_REQ:    /* 407 */
+            if (wininet_auth_challenged(pData, dwStatusCode == HTTP_STATUS_PROXY_AUTH_REQ 
+                ? WININET_AUTH_PROXY : WININET_AUTH_SERVER)) 
+            {
+                pData->bDisconnect = FALSE; 
+                bRetryPost = TRUE;
+                continue;
+            }
+            errorResolved = rseDisplayDlg;
+            WININET_LOG0(pData, "fsend: user authentication required");
+            if (pData->pRseCallback) {
+                WININET_LOGC0(pData, WININET_LOG_ERRORS, "fsend: calling client supplied error callback");
+                errorResolved = pData->pRseCallback(pData->hRequest, dwStatusCode);
+            }
+            if (errorResolved == rseDisplayDlg) {
+                errorResolved = wininet_resolve_send_error(pData, ERROR_INTERNET_INCORRECT_PASSWORD);
+            }
+            if (errorResolved == rseTrue) {
+                WININET_LOG0(pData, "fsend: authentication has been provided (retrying)");
+
+                /*  we may have been disconnected by the error. Since we 
+                    are going to try again, we will automatically be 
+                    reconnected. Therefore we want to disregard any previous
+                    disconnection messages. 
+                    */
+                pData->bDisconnect = FALSE; 
+                bRetryPost = TRUE;
+                nResult = SOAP_OK;
+                continue;
+            }
+            break;
+        }
+    }
+
+    /* the server has responded (or failed), let the next message through */
+    wininet_limiter_release(pData, TRUE, nResult != SOAP_OK 
+        ? wininet_is_server_error(soap->error) 
+        : (dwStatusCode == HTTP_STATUS_SERVICE_UNAVAIL || dwStatusCode == HTTP_STATUS_TOO_MANY_REQUESTS));
+
+    /* cache any credentials that were used for this message, requests 
+       waiting for our response must send their own if we failed */
+    if (nResult == SOAP_OK) {
+        wininet_auth_complete(pData, dwStatusCode);
+    }
+    else {
+        wininet_capture_abort(pData);
+    }
+
+    /* log the actual headers used */
+    if (WININET_LOG_ON(pData, WININET_LOG_HEADERS)) {
+        int rc = wininet_get_headers(pData, "fsend: actual", HTTP_QUERY_FLAG_REQUEST_HEADERS);
+        if (rc != SOAP_OK) return rc;
+        wininet_log_headers(pData, "fsend: actual");
+    }
+    WININET_LOG0(pData, "fsend: complete");
+    wininet_log_commit(pData);
+
+    /* signal to frecv that nothing has been received yet */
+    pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+
+    return nResult; 
+}
+
+/* gsoap documentation:
+    Called for all receive operations to fill buffer s of maximum length n. 
+    Should return the number of bytes read or 0 in case of an error, e.g. EOF.
+    Built-in gSOAP function: frecv
+ */
+static size_t 
+wininet_frecv(
+    struct soap *   soap, 
+    char *          a_pBuffer, 
+    size_t          a_uiBufferLen
+    ) 
+{ 
+    DWORD   dwBytesRead;
+    size_t  uiTotalBytesRead;
+    BOOL    bResult;
+    int     rc;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    soap->error = SOAP_OK;
+
+    /*  NOTE: we do not check here that our connection hasn't been 
+        disconnected because in HTTP/1.0 connections, it will always have been
+        disconnected by now. This is because the response is checked by the 
+        wininet_fsend function to ensure that we didn't need any special 
+        authentication. At that time the connection would have been 
+        disconnected. This is okay however as we can still read the response
+        from the request handle.
+     */
+
+    /* return a response that didn't come from the network */
+    if (pData->pReplay) {
+        uiTotalBytesRead = pData->uiReplayLen - pData->uiReplayPos;
+        if (uiTotalBytesRead > a_uiBufferLen) {
+            uiTotalBytesRead = a_uiBufferLen;
+        }
+        memcpy(a_pBuffer, pData->pReplay + pData->uiReplayPos, uiTotalBytesRead);
+        pData->uiReplayPos += uiTotalBytesRead;
+        WININET_LOG1(pData, "frecv: replayed %lu bytes", uiTotalBytesRead);
+        return uiTotalBytesRead;
+    }
+
+    if (!pData->hRequest) {
+		soap->error = SOAP_ERR;
+        return 0;
+    }
+    WININET_LOG1(pData, "frecv: available buffer len = %lu", a_uiBufferLen);
+
+    uiTotalBytesRead = 0;
+    if (pData->uiBufferLenMax == INVALID_BUFFER_LENGTH) {
+        const char *pHeader, *pHeaderNext = NULL;
+
+        pData->nLogFormat = LOGTYPE_UNKNOWN;
+        pData->uiBufferLenMax = 0; 
+
+        /* retrieve all of the response headers */
+        rc = wininet_get_headers(pData, "frecv:", 0);
+		if (rc != SOAP_OK) {
+			soap->error = rc;
+			return 0;
+		}
+        /* the headers also determine how the body is logged */
+        if (WININET_LOG_ON(pData, WININET_LOG_HEADERS | WININET_LOG_BODY)) {
+            wininet_log_headers(pData, "frecv:");
+        }
+
+        /* size required for end of headers CRLF */
+        if (a_uiBufferLen < 2) {
+            WININET_LOGC0(pData, WININET_LOG_HEADERS, "frecv: buffer too small for headers");
+			soap->error = SOAP_EOM;
+			return 0;
+        }
+
+        /* pass through some headers to gsoap */
+        for (pHeader = pData->pBuffer; *pHeader; pHeader = pHeaderNext) {
+            pHeaderNext = pHeader + strlen(pHeader)+1;
+
+            /*  don't pass through headers related to transport or authentication 
+                as this has been handled already by the wininet layer. */
+            if (0 == strnicmp(pHeader, "Transfer-Encoding:", 18) ||
+                0 == strnicmp(pHeader, "WWW-Authenticate:", 17))
+            {
+                continue;
+            }
+
+            dwBytesRead = (DWORD) (pHeaderNext - pHeader - 1);
+            if (uiTotalBytesRead + dwBytesRead + 4 > a_uiBufferLen) {
+                WININET_LOGC0(pData, WININET_LOG_HEADERS, "frecv: buffer too small for headers");
+				soap->error = SOAP_EOM;
+				return 0;
+            }
+
+            memcpy(&a_pBuffer[uiTotalBytesRead], pHeader, dwBytesRead);
+            uiTotalBytesRead += dwBytesRead;
+            a_pBuffer[uiTotalBytesRead++] = '\r'; 
+            a_pBuffer[uiTotalBytesRead++] = '\n';
+        }
+
+        /* terminate the headers */
+        a_pBuffer[uiTotalBytesRead++] = '\r'; 
+        a_pBuffer[uiTotalBytesRead++] = '\n';
+
+        /* only successful responses are captured */
+        if (pData->bCapture) {
+            wininet_capture_begin(pData, uiTotalBytesRead);
+        }
+    }
+
+    do {
+        /* read from the connection up to our maximum amount of data */
+        _ASSERTE(a_uiBufferLen <= ULONG_MAX);
+        wininet_log_commit(pData);
+        bResult = InternetReadFile(
+            pData->hRequest, 
+            &a_pBuffer[uiTotalBytesRead], 
+            (DWORD) a_uiBufferLen - uiTotalBytesRead, 
+            &dwBytesRead);
+        if (bResult) {
+            uiTotalBytesRead += dwBytesRead;
+            pData->dwLastUsed = GetTickCount();
+        }
+        else {
+            soap->error = GetLastError();
+            WININET_LOGC2(pData, WININET_LOG_ERRORS, "frecv: error %d (%s) in InternetReadFile", 
+                soap->error, wininet_error_message(pData, soap->error));
+            if (wininet_is_server_error(soap->error)) {
+                wininet_breaker_record(pData, TRUE);
+            }
+        }
+    } 
+    while (bResult && dwBytesRead && uiTotalBytesRead < a_uiBufferLen);
+
+    WININET_LOG1(pData, "frecv: received %lu bytes", uiTotalBytesRead);
+
+    /* keep a copy of the response for the cache */
+    if (pData->bCapture) {
+        if (!bResult) {
+            wininet_capture_abort(pData);
+        }
+        else {
+            wininet_capture_append(pData, a_pBuffer, uiTotalBytesRead);
+            if (dwBytesRead == 0 || (pData->uiCaptureBody != INVALID_BUFFER_LENGTH
+                && pData->uiCaptureLen - pData->uiCaptureHeaders >= pData->uiCaptureBody))
+            {
+                wininet_capture_complete(pData);
+            }
+        }
+    }
+
+    /* output the data we received */
+    if (WININET_LOG_ON(pData, WININET_LOG_BODY) && uiTotalBytesRead > 0) {
+        wininet_log_data(pData, "frecv: message data", a_pBuffer, uiTotalBytesRead);
+    }
+    if (!bResult || dwBytesRead == 0) {
+        pData->bInFlight = FALSE;
+    }
+    wininet_log_commit(pData);
+
+    return uiTotalBytesRead;
+} 
+
+static int 
+wininet_setlog_internal(
+    struct wininet_data *   a_pData,
+    const char *            a_pLogFile
+    )
+{
+    if (!a_pData) {
+        return SOAP_ERR;
+    }
+
+    if (a_pData->hLog) {
+        wininet_log_commit(a_pData);
+        wininet_logsink_release(a_pData->hLog);
+        a_pData->hLog = NULL;
+        a_pData->dwLogMask = 0;
+    }
+
+    /* instances logging to the same file share it */
+    if (a_pLogFile && *a_pLogFile) {
+        a_pData->hLog = wininet_logsink_get(a_pLogFile);
+        if (!a_pData->hLog) return SOAP_ERR;
+        a_pData->dwLogMask = a_pData->dwLogCategories;
+        wininet_log_write(a_pData, 
+            "----------------------------------------------------------------------\n", 71);
+        wininet_log_commit(a_pData);
+    }
+
+    return SOAP_OK;
+}
+
+/*=============================================================================
+  API Functions
+ ============================================================================*/
+
+#define WININET_INIT_EAGER          0   /* open the session during registration */
+#define WININET_INIT_LAZY           1   /* open the session when first needed */
+#define WININET_INIT_BACKGROUND     2   /* open the session on a worker thread */
+
+static int 
+wininet_register_mode(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pPluginData, 
+    void *                  a_pLogFile,
+    int                     a_nMode
+    )
+{
+    struct wininet_data * pData;
+    int rc;
+
+    /* can't use WININET_LOG0 as we don't exist yet */
+    DBGLOG(TEST, SOAP_MESSAGE(fdebug, "wininet %p: registration\n", soap));
+
+    pData = (struct wininet_data *) malloc(sizeof(struct wininet_data));
+    if (!pData) return SOAP_EOM;
+    memset(pData, 0, sizeof(struct wininet_data));
+    pData->nLogFormat = LOGTYPE_UNKNOWN;
+    pData->dwLogCategories = WININET_LOG_ALL;
+    pData->nRandom = (GetTickCount() ^ GetCurrentThreadId() ^ (unsigned) (DWORD_PTR) pData) | 1;
+    pData->nRequestId = GetTickCount();
+    {
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        pData->nTraceState = (ULONGLONG) counter.QuadPart 
+            ^ ((ULONGLONG) GetCurrentProcessId() << 32) 
+            ^ ((ULONGLONG) GetCurrentThreadId() << 16)
+            ^ (ULONGLONG) (DWORD_PTR) pData;
+    }
+
+    rc = wininet_setlog_internal(pData, (const char *) a_pLogFile);
+    if (rc != SOAP_OK) {
+        free(pData);
+        return rc;
+    }
+    
+    WININET_LOG0(pData, "init");
+
+    if ((soap->omode & SOAP_IO) == SOAP_IO_STORE) {
+        WININET_LOG0(pData, "use of SOAP_IO_STORE is not recommended");
+    }
+
+    /* guarantee that we have an internal buffer */
+    rc = wininet_growbuffer(pData, "init", 1);
+    if (rc != SOAP_OK) {
+        wininet_delete(soap, a_pPluginData);
+        return rc;
+    }
+
+    /* start our internet session, deferring it if requested */
+    if (a_nMode == WININET_INIT_BACKGROUND) {
+        pData->hInitDone = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (pData->hInitDone && !QueueUserWorkItem(wininet_session_thread, pData, WT_EXECUTEDEFAULT)) {
+            CloseHandle(pData->hInitDone);
+            pData->hInitDone = NULL;
+        }
+        WININET_LOG1(pData, "init: %s", pData->hInitDone 
+            ? "opening session in the background" : "failed to queue background initialization");
+    }
+    else if (a_nMode == WININET_INIT_LAZY) {
+        WININET_LOG0(pData, "init: session will be opened when first used");
+    }
+    else if (!wininet_session_open(pData)) {
+        soap->error = pData->dwInitError;
+        WININET_LOGC2(pData, WININET_LOG_ERRORS, "init: error %d (%s) in InternetOpen", 
+            soap->error, wininet_error_message(pData, soap->error));
+        wininet_delete(soap, a_pPluginData);
+        return FALSE;
+    }
+
+    /* set all of our callbacks */
+    soap->fopen    = wininet_fopen;
+    soap->fpoll    = wininet_fpoll;
+    soap->fposthdr = wininet_fposthdr;
+    soap->fsend    = wininet_fsend;
+    soap->frecv    = wininet_frecv;
+    soap->fclose   = wininet_fclose;
+
+    a_pPluginData->id        = wininet_id;
+    a_pPluginData->fcopy     = wininet_copy;
+    a_pPluginData->fdelete   = wininet_delete;
+    a_pPluginData->data      = pData;
+
+    return SOAP_OK;
+}
+
+/* register and set the logfile */
+int 
+wininet_register(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pPluginData, 
+    void *                  a_pLogFile
+    )
+{
+    return wininet_register_mode(soap, a_pPluginData, a_pLogFile, WININET_INIT_EAGER);
+}
+
+/* register without opening the internet session until it is needed */
+int 
+wininet_register_lazy(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pPluginData, 
+    void *                  a_pLogFile
+    )
+{
+    return wininet_register_mode(soap, a_pPluginData, a_pLogFile, WININET_INIT_LAZY);
+}
+
+/* register and open the internet session in the background */
+int 
+wininet_register_background(
+    struct soap *           soap, 
+    struct soap_plugin *    a_pPluginData, 
+    void *                  a_pLogFile
+    )
+{
+    return wininet_register_mode(soap, a_pPluginData, a_pLogFile, WININET_INIT_BACKGROUND);
+}
+
+/* start or stop logging */
+int 
+wininet_setlog(
+    struct soap *   soap,
+    const char *    a_pLogFile
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    return wininet_setlog_internal(pData, a_pLogFile);
+}
+
+/* set the flags */
+int 
+wininet_setflags(
+    struct soap *   soap, 
+    DWORD           a_dwRequestFlags
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+    
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "wininet_setflags: new flags = %lu", a_dwRequestFlags);
+    pData->dwRequestFlags = a_dwRequestFlags;
+    return SOAP_OK;
+}
+
+ /* set the optional user-agent string */
+extern int 
+wininet_setagent(
+    struct soap *   soap,
+    const char *    a_pUserAgent
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    
+    if (pData->pUserAgent) {
+        free(pData->pUserAgent);
+        pData->pUserAgent = NULL;
+    }
+
+    if (a_pUserAgent && *a_pUserAgent) {
+        WININET_LOG1(pData, "setagent: User-Agent = '%s'", a_pUserAgent);
+        pData->pUserAgent = strdup(a_pUserAgent);
+    }
+    else {
+        WININET_LOG0(pData, "setagent: User-Agent = (use default)");
+    }
+
+    return SOAP_OK;
+}
+
+/* set the optional callback */
+extern int 
+wininet_set_rse_callback(
+    struct soap *           soap,
+    wininet_rse_callback    a_pRsecallback
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "set_rse_callback: callback = '%p'", a_pRsecallback);
+    pData->pRseCallback = a_pRsecallback;
+    return SOAP_OK;
+}
+
+/* set the hedging parameters */
+extern int 
+wininet_sethedging(
+    struct soap *   soap,
+    DWORD           a_dwQuantile,
+    DWORD           a_dwMinDelay
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    if (a_dwQuantile > 100) a_dwQuantile = 100;
+    WININET_LOG2(pData, "sethedging: quantile = %lu%%, min delay = %lu ms", 
+        a_dwQuantile, a_dwMinDelay);
+    pData->dwHedgeQuantile = a_dwQuantile;
+    pData->dwHedgeMinDelay = a_dwMinDelay;
+    return SOAP_OK;
+}
+
+/* retrieve the statistics */
+extern int 
+wininet_getstats(
+    struct soap *           soap,
+    struct wininet_stats *  a_pStats
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData || !a_pStats) return SOAP_ERR;
+    *a_pStats = pData->stats;
+    return SOAP_OK;
+}
+
+/* enable or disable the credential cache */
+extern int 
+wininet_setauthcache(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setauthcache: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bAuthCache = a_bEnable;
+    return SOAP_OK;
+}
+
+/* remove all cached credentials */
+extern void 
+wininet_clearauthcache(void)
+{
+    struct wininet_auth * pAuth;
+
+    wininet_lock_enter(&wininet_auth_lock);
+    while (wininet_auth_list) {
+        pAuth = wininet_auth_list;
+        wininet_auth_list = pAuth->pNext;
+        wininet_auth_free(pAuth);
+    }
+    wininet_lock_leave(&wininet_auth_lock);
+}
+
+/* set the minimum message size for Expect: 100-continue */
+extern int 
+wininet_setexpectcontinue(
+    struct soap *   soap,
+    size_t          a_uiThreshold
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setexpectcontinue: threshold = %lu bytes", a_uiThreshold);
+    pData->uiExpectThreshold = a_uiThreshold;
+    return SOAP_OK;
+}
+
+/* enable or disable the redirect cache */
+extern int 
+wininet_setredirectcache(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
-            /* see if we can handle this error, see the MSDN documentation
-               for InternetErrorDlg for details */
-            switch (soap->error) {
-            case ERROR_INTERNET_HTTP_TO_HTTPS_ON_REDIR:
-            case ERROR_INTERNET_HTTPS_TO_HTTP_ON_REDIR:
-            case ERROR_INTERNET_INCORRECT_PASSWORD:
-            case ERROR_INTERNET_INVALID_CA:
-            case ERROR_INTERNET_POST_IS_NON_SECURE:
-            case ERROR_INTERNET_SEC_CERT_CN_INVALID:
-            case ERROR_INTERNET_SEC_CERT_DATE_INVALID:
-            case ERROR_INTERNET_CLIENT_AUTH_CERT_NEEDED:
-                errorResolved = rseDisplayDlg;
-                if (pData->pRseCallback) {
-                    WININET_LOG0(pData, "fsend: calling client supplied error callback");
-                    errorResolved = pData->pRseCallback(pData->hRequest, soap->error);
-                }
-                if (errorResolved == rseDisplayDlg) {
-                    errorResolved = wininet_resolve_send_error(pData, soap->error);
-                    if (errorResolved == rseTrue) {
-                        WININET_LOG1(pData, "fsend: error %d has been resolved (retrying)", soap->error);
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setredirectcache: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bRedirectCache = a_bEnable;
+    return SOAP_OK;
+}
 
-                        /*  we may have been disconnected by the error. Since we 
-                            are going to try again, we will automatically be 
-                            reconnected. Therefore we want to disregard any previous
-                            disconnection messages. 
-                            */
-                        pData->bDisconnect = FALSE; 
-                        bRetryPost = TRUE;
-                        nResult = SOAP_OK;
-                        continue;
-                    }
-                }
-                break;
-            }
+/* set the limits of the redirect cache */
+extern void 
+wininet_redirect_cache_config(
+    unsigned        a_nMaxEntries,
+    DWORD           a_dwTtlSeconds
+    )
+{
+    wininet_lock_enter(&wininet_redirect_lock);
+    wininet_redirect_max = a_nMaxEntries;
+    wininet_redirect_ttl = a_dwTtlSeconds * 1000;
+    wininet_lock_leave(&wininet_redirect_lock);
+}
 
-            /* if the error wasn't handled then we exit */
-            nResult = SOAP_HTTP_ERROR;
-            break;
-        }
+/* list the contents of the redirect cache */
+extern void 
+wininet_redirect_cache_enum(
+    wininet_redirect_callback   a_pCallback,
+    void *                      a_pContext
+    )
+{
+    struct wininet_redirect * pRedirect;
 
-        /* get the status code from the response to determine if we need 
-           to authorize */
-        dwStatusCodeLen = sizeof(dwStatusCode);
-        bResult = HttpQueryInfo(
-            pData->hRequest, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, 
-            &dwStatusCode, &dwStatusCodeLen, NULL);
-        if (!bResult) {
-            soap->error = GetLastError();
-            WININET_LOG2(pData, "fsend: error %d (%s) in HttpQueryInfo", 
-                soap->error, wininet_error_message(pData, soap->error));
-            nResult = SOAP_HTTP_ERROR;
-            break;
-        }
+    wininet_lock_enter(&wininet_redirect_lock);
+    for (pRedirect = wininet_redirect_list; pRedirect; pRedirect = pRedirect->pNext) {
+        a_pCallback(a_pContext, pRedirect->pFrom, pRedirect->pTo, pRedirect->nHits);
+    }
+    wininet_lock_leave(&wininet_redirect_lock);
+}
 
-        WININET_LOG1(pData, "fsend: HTTP status code = %lu", dwStatusCode);
+/* remove all entries from the redirect cache */
+extern void 
+wininet_redirect_cache_clear(void)
+{
+    struct wininet_redirect * pRedirect;
 
-        /*  if we need authentication, then request the user for the 
-            appropriate data. Their reply is saved into the request so 
-            that we can use it later.
-         */
-        switch (dwStatusCode) {
-        case HTTP_STATUS_DENIED:            /* 401 */
-        case HTTP_STATUS_PROXY_AUTH_REQ:    /* 407 */
-            errorResolved = rseDisplayDlg;
-            WININET_LOG0(pData, "fsend: user authentication required");
-            if (pData->pRseCallback) {
-                WININET_LOG0(pData, "fsend: calling client supplied error callback");
-                errorResolved = pData->pRseCallback(pData->hRequest, dwStatusCode);
-            }
-            if (errorResolved == rseDisplayDlg) {
-                errorResolved = wininet_resolve_send_error(pData, ERROR_INTERNET_INCORRECT_PASSWORD);
-            }
-            if (errorResolved == rseTrue) {
-                WININET_LOG0(pData, "fsend: authentication has been provided (retrying)");
+    wininet_lock_enter(&wininet_redirect_lock);
+    while (wininet_redirect_list) {
+        pRedirect = wininet_redirect_list;
+        wininet_redirect_list = pRedirect->pNext;
+        wininet_redirect_free(pRedirect);
+    }
+    wininet_redirect_count = 0;
+    wininet_lock_leave(&wininet_redirect_lock);
+}
 
-                /*  we may have been disconnected by the error. Since we 
-                    are going to try again, we will automatically be 
-                    reconnected. Therefore we want to disregard any previous
-                    disconnection messages. 
-                    */
-                pData->bDisconnect = FALSE; 
-                bRetryPost = TRUE;
-                nResult = SOAP_OK;
-                continue;
-            }
+/* set the operations whose responses may be cached */
+extern int 
+wininet_setcacheable(
+    struct soap *   soap,
+    const char *    a_pszAction,
+    DWORD           a_dwTtlSeconds
+    )
+{
+    struct wininet_cache_rule ** ppRule;
+    struct wininet_cache_rule * pRule;
+    BOOL bRevalidate = FALSE;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    WININET_LOG2(pData, "setcacheable: action = '%s', ttl = %lu seconds", 
+        a_pszAction ? a_pszAction : "(all)", a_dwTtlSeconds);
+
+    /* remove any existing rule for this action */
+    for (ppRule = &pData->pCacheRules; *ppRule; ppRule = &(*ppRule)->pNext) {
+        pRule = *ppRule;
+        if ((!a_pszAction && !pRule->pAction) 
+            || (a_pszAction && pRule->pAction && !strcmp(a_pszAction, pRule->pAction)))
+        {
+            *ppRule = pRule->pNext;
+            bRevalidate = pRule->bRevalidate;
+            free(pRule->pAction);
+            free(pRule);
             break;
         }
     }
+    if (!a_dwTtlSeconds) {
+        return SOAP_OK;
+    }
 
-    /* log the actual headers used */
-    if (pData->hLog) {
-        int rc = wininet_get_headers(pData, "fsend: actual", HTTP_QUERY_FLAG_REQUEST_HEADERS);
-        if (rc != SOAP_OK) return rc;
-        wininet_log_headers(pData, "fsend: actual");
-        WININET_LOG0(pData, "fsend: complete");
+    pRule = (struct wininet_cache_rule *) malloc(sizeof(struct wininet_cache_rule));
+    if (!pRule) return SOAP_EOM;
+    pRule->pAction = a_pszAction ? strdup(a_pszAction) : NULL;
+    pRule->dwTtl = a_dwTtlSeconds * 1000;
+    pRule->bRevalidate = bRevalidate;
+    if (a_pszAction && !pRule->pAction) {
+        free(pRule);
+        return SOAP_EOM;
     }
+    wininet_cache_rule_insert(pData, pRule);
+    return SOAP_OK;
+}
 
-    /* signal to frecv that nothing has been received yet */
-    pData->uiBufferLenMax = INVALID_BUFFER_LENGTH;
+/* set the memory budget of the response cache */
+extern void 
+wininet_cache_setlimit(
+    size_t          a_uiMaxBytes
+    )
+{
+    wininet_lock_enter(&wininet_cache_lock);
+    wininet_cache_limit = a_uiMaxBytes;
+    while (wininet_cache_lru_tail && wininet_cache_size > wininet_cache_limit) {
+        wininet_cache_remove(wininet_cache_lru_tail);
+    }
+    wininet_lock_leave(&wininet_cache_lock);
+}
 
-    return nResult; 
+/* retrieve the memory used by the response cache */
+extern void 
+wininet_cache_usage(
+    size_t *        a_puiBytes,
+    unsigned *      a_pnEntries
+    )
+{
+    wininet_lock_enter(&wininet_cache_lock);
+    if (a_puiBytes) *a_puiBytes = wininet_cache_size;
+    if (a_pnEntries) *a_pnEntries = wininet_cache_count;
+    wininet_lock_leave(&wininet_cache_lock);
 }
 
-/* gsoap documentation:
-    Called for all receive operations to fill buffer s of maximum length n. 
-    Should return the number of bytes read or 0 in case of an error, e.g. EOF.
-    Built-in gSOAP function: frecv
- */
-static size_t 
-wininet_frecv(
-    struct soap *   soap, 
-    char *          a_pBuffer, 
-    size_t          a_uiBufferLen
-    ) 
-{ 
-    DWORD   dwBytesRead;
-    size_t  uiTotalBytesRead;
-    BOOL    bResult;
-    int     rc;
+/* remove all responses from the response cache */
+extern void 
+wininet_cache_clear(void)
+{
+    wininet_lock_enter(&wininet_cache_lock);
+    while (wininet_cache_lru_tail) {
+        wininet_cache_remove(wininet_cache_lru_tail);
+    }
+    wininet_lock_leave(&wininet_cache_lock);
+}
+
+/* enable or disable revalidation of cached responses for an operation */
+extern int 
+wininet_setrevalidate(
+    struct soap *   soap,
+    const char *    a_pszAction,
+    BOOL            a_bRevalidate
+    )
+{
+    struct wininet_cache_rule * pRule;
     struct wininet_data * pData = (struct wininet_data *) 
         soap_lookup_plugin(soap, wininet_id);
 
-    soap->error = SOAP_OK;
-
-    /*  NOTE: we do not check here that our connection hasn't been 
-        disconnected because in HTTP/1.0 connections, it will always have been
-        disconnected by now. This is because the response is checked by the 
-        wininet_fsend function to ensure that we didn't need any special 
-        authentication. At that time the connection would have been 
-        disconnected. This is okay however as we can still read the response
-        from the request handle.
-     */
+    if (!pData) return SOAP_ERR;
+    WININET_LOG2(pData, "setrevalidate: action = '%s', %s", 
+        a_pszAction ? a_pszAction : "(all)", a_bRevalidate ? "enabled" : "disabled");
 
-    if (!pData->hRequest) {
-		soap->error = SOAP_ERR;
-        return 0;
+    for (pRule = pData->pCacheRules; pRule; pRule = pRule->pNext) {
+        if ((!a_pszAction && !pRule->pAction) 
+            || (a_pszAction && pRule->pAction && !strcmp(a_pszAction, pRule->pAction)))
+        {
+            break;
+        }
     }
-    WININET_LOG1(pData, "frecv: available buffer len = %lu", a_uiBufferLen);
-
-    uiTotalBytesRead = 0;
-    if (pData->uiBufferLenMax == INVALID_BUFFER_LENGTH) {
-        const char *pHeader, *pHeaderNext = NULL;
-
-        pData->nLogFormat = LOGTYPE_UNKNOWN;
-        pData->uiBufferLenMax = 0; 
 
-        /* retrieve all of the response headers */
-        rc = wininet_get_headers(pData, "frecv:", 0);
-		if (rc != SOAP_OK) {
-			soap->error = rc;
-			return 0;
-		}
-        if (pData->hLog) {
-            wininet_log_headers(pData, "frecv:");
+    if (!a_bRevalidate) {
+        if (pRule) {
+            pRule->bRevalidate = FALSE;
+            if (!pRule->dwTtl) {
+                return wininet_setcacheable(soap, a_pszAction, 0);
+            }
         }
+        return SOAP_OK;
+    }
 
-        /* size required for end of headers CRLF */
-        if (a_uiBufferLen < 2) {
-            WININET_LOG0(pData, "frecv: buffer too small for headers");
-			soap->error = SOAP_EOM;
-			return 0;
+    /* responses that are always revalidated have no lifetime */
+    if (!pRule) {
+        pRule = (struct wininet_cache_rule *) malloc(sizeof(struct wininet_cache_rule));
+        if (!pRule) return SOAP_EOM;
+        pRule->pAction = a_pszAction ? strdup(a_pszAction) : NULL;
+        pRule->dwTtl = 0;
+        if (a_pszAction && !pRule->pAction) {
+            free(pRule);
+            return SOAP_EOM;
         }
+        wininet_cache_rule_insert(pData, pRule);
+    }
+    pRule->bRevalidate = TRUE;
+    return SOAP_OK;
+}
 
-        /* pass through some headers to gsoap */
-        for (pHeader = pData->pBuffer; *pHeader; pHeader = pHeaderNext) {
-            pHeaderNext = pHeader + strlen(pHeader)+1;
+/* enable or disable coalescing of identical concurrent messages */
+extern int 
+wininet_setcoalescing(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
-            /*  don't pass through headers related to transport or authentication 
-                as this has been handled already by the wininet layer. */
-            if (0 == strnicmp(pHeader, "Transfer-Encoding:", 18) ||
-                0 == strnicmp(pHeader, "WWW-Authenticate:", 17))
-            {
-                continue;
-            }
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setcoalescing: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bCoalesce = a_bEnable;
+    return SOAP_OK;
+}
 
-            dwBytesRead = (DWORD) (pHeaderNext - pHeader - 1);
-            if (uiTotalBytesRead + dwBytesRead + 4 > a_uiBufferLen) {
-                WININET_LOG0(pData, "frecv: buffer too small for headers");
-				soap->error = SOAP_EOM;
-				return 0;
-            }
+/* enumerate the number of coalesced requests for each endpoint */
+extern void 
+wininet_coalesce_enum(
+    wininet_coalesce_callback   a_pCallback,
+    void *                      a_pContext
+    )
+{
+    struct wininet_coalesced * pCount;
 
-            memcpy(&a_pBuffer[uiTotalBytesRead], pHeader, dwBytesRead);
-            uiTotalBytesRead += dwBytesRead;
-            a_pBuffer[uiTotalBytesRead++] = '\r'; 
-            a_pBuffer[uiTotalBytesRead++] = '\n';
-        }
+    if (!a_pCallback) return;
+    wininet_lock_enter(&wininet_flight_lock);
+    for (pCount = wininet_coalesced_list; pCount; pCount = pCount->pNext) {
+        a_pCallback(a_pContext, pCount->pEndpoint, pCount->nCount);
+    }
+    wininet_lock_leave(&wininet_flight_lock);
+}
 
-        /* terminate the headers */
-        a_pBuffer[uiTotalBytesRead++] = '\r'; 
-        a_pBuffer[uiTotalBytesRead++] = '\n';
+/* set the equivalent endpoints that messages are sent to */
+extern int 
+wininet_setendpoints(
+    struct soap *           soap,
+    const char * const *    a_ppszEndpoints,
+    unsigned                a_nCount
+    )
+{
+    struct wininet_endpoint * apEndpoints[WININET_MAX_ENDPOINTS];
+    unsigned n;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    if (a_nCount > WININET_MAX_ENDPOINTS || (a_nCount && !a_ppszEndpoints)) {
+        return SOAP_ERR;
     }
 
-    do {
-        /* read from the connection up to our maximum amount of data */
-        _ASSERTE(a_uiBufferLen <= ULONG_MAX);
-        bResult = InternetReadFile(
-            pData->hRequest, 
-            &a_pBuffer[uiTotalBytesRead], 
-            (DWORD) a_uiBufferLen - uiTotalBytesRead, 
-            &dwBytesRead);
-        if (bResult) {
-            uiTotalBytesRead += dwBytesRead;
-        }
-        else {
-            soap->error = GetLastError();
-            WININET_LOG2(pData, "frecv: error %d (%s) in InternetReadFile", 
-                soap->error, wininet_error_message(pData, soap->error));
+    for (n = 0; n < a_nCount; ++n) {
+        WININET_LOG1(pData, "setendpoints: endpoint = '%s'", a_ppszEndpoints[n]);
+        apEndpoints[n] = wininet_endpoint_get(a_ppszEndpoints[n]);
+        if (!apEndpoints[n]) return SOAP_EOM;
+    }
+
+    memcpy(pData->apEndpoints, apEndpoints, a_nCount * sizeof(apEndpoints[0]));
+    pData->nEndpoints = a_nCount;
+    pData->pEndpointState = NULL;
+    return SOAP_OK;
+}
+
+/* start, reconfigure or stop the background endpoint health probe */
+extern BOOL 
+wininet_endpoint_probe(
+    DWORD   a_dwIntervalSeconds
+    )
+{
+    HANDLE hThread;
+    HANDLE hStop;
+    BOOL bResult = TRUE;
+
+    wininet_lock_enter(&wininet_endpoint_lock);
+    if (a_dwIntervalSeconds) {
+        wininet_probe_interval = a_dwIntervalSeconds * 1000;
+        if (!wininet_probe_thread) {
+            wininet_probe_stop = CreateEventA(NULL, TRUE, FALSE, NULL);
+            if (wininet_probe_stop) {
+                wininet_probe_thread = (HANDLE) _beginthreadex(NULL, 0, 
+                    wininet_probe_proc, NULL, 0, NULL);
+            }
+            if (!wininet_probe_thread) {
+                if (wininet_probe_stop) CloseHandle(wininet_probe_stop);
+                wininet_probe_stop = NULL;
+                bResult = FALSE;
+            }
         }
-    } 
-    while (bResult && dwBytesRead && uiTotalBytesRead < a_uiBufferLen);
+        wininet_lock_leave(&wininet_endpoint_lock);
+        return bResult;
+    }
 
-    WININET_LOG1(pData, "frecv: received %lu bytes", uiTotalBytesRead);
+    hThread = wininet_probe_thread;
+    hStop = wininet_probe_stop;
+    wininet_probe_thread = NULL;
+    wininet_probe_stop = NULL;
+    wininet_lock_leave(&wininet_endpoint_lock);
+
+    if (hThread) {
+        SetEvent(hStop);
+        WaitForSingleObject(hThread, INFINITE);
+        CloseHandle(hThread);
+        CloseHandle(hStop);
+    }
+    return TRUE;
+}
 
-    /* output the data we received */
-    if (pData->hLog && uiTotalBytesRead > 0) {
-        wininet_log_data(pData, "frecv: message data", a_pBuffer, uiTotalBytesRead);
+/* enumerate the state of all endpoints */
+extern void 
+wininet_endpoint_enum(
+    wininet_endpoint_callback   a_pCallback,
+    void *                      a_pContext
+    )
+{
+    struct wininet_endpoint * pEndpoint;
+    DWORD dwNow = GetTickCount();
+
+    if (!a_pCallback) return;
+    wininet_lock_enter(&wininet_endpoint_lock);
+    for (pEndpoint = wininet_endpoint_list; pEndpoint; pEndpoint = pEndpoint->pNext) {
+        a_pCallback(a_pContext, pEndpoint->pUrl, pEndpoint->dwLatency, 
+            pEndpoint->nOutstanding, wininet_endpoint_available(pEndpoint, dwNow));
     }
+    wininet_lock_leave(&wininet_endpoint_lock);
+}
 
-    return uiTotalBytesRead;
-} 
+/* enable or disable the circuit breaker */
+extern int 
+wininet_setcircuitbreaker(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
-static int 
-wininet_setlog_internal(
-    struct wininet_data *   a_pData,
-    const char *            a_pLogFile
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setcircuitbreaker: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bCircuitBreaker = a_bEnable;
+    pData->bBreakerTrial = FALSE;
+    return SOAP_OK;
+}
+
+/* configure when circuits are opened and for how long */
+extern void 
+wininet_circuit_config(
+    unsigned    a_nFailurePercent,
+    unsigned    a_nMinRequests,
+    DWORD       a_dwOpenSeconds
     )
 {
-    if (!a_pData) {
-        return SOAP_ERR;
-    }
+    wininet_lock_enter(&wininet_breaker_lock);
+    wininet_breaker_percent = a_nFailurePercent ? a_nFailurePercent : 1;
+    wininet_breaker_minimum = a_nMinRequests > WININET_CIRCUIT_WINDOW 
+        ? WININET_CIRCUIT_WINDOW : (a_nMinRequests ? a_nMinRequests : 1);
+    wininet_breaker_open_ms = a_dwOpenSeconds * 1000;
+    wininet_lock_leave(&wininet_breaker_lock);
+}
 
-    if (a_pData->hLog) {
-        fclose(a_pData->hLog);
-        a_pData->hLog = NULL;
-    }
+/* enumerate the circuit breaker state of all servers */
+extern void 
+wininet_circuit_enum(
+    wininet_circuit_callback    a_pCallback,
+    void *                      a_pContext
+    )
+{
+    struct wininet_breaker * pBreaker;
 
-    if (a_pLogFile && *a_pLogFile) {
-        a_pData->hLog = fopen(a_pLogFile, "a");
-        if (!a_pData->hLog) return SOAP_ERR;
-        fputs("----------------------------------------------------------------------\n", a_pData->hLog);
+    if (!a_pCallback) return;
+    wininet_lock_enter(&wininet_breaker_lock);
+    for (pBreaker = wininet_breaker_list; pBreaker; pBreaker = pBreaker->pNext) {
+        a_pCallback(a_pContext, pBreaker->pHost, pBreaker->nPort, 
+            pBreaker->nState, pBreaker->nOpened);
     }
+    wininet_lock_leave(&wininet_breaker_lock);
+}
+
+/* enable or disable the adaptive concurrency limit */
+extern int 
+wininet_setconcurrencylimit(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setconcurrencylimit: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bConcurrencyLimit = a_bEnable;
     return SOAP_OK;
 }
 
-/*=============================================================================
-  API Functions
- ============================================================================*/
+/* configure the adaptive concurrency limits of the process */
+extern void 
+wininet_limiter_config(
+    unsigned    a_nInitialLimit,
+    unsigned    a_nMaxLimit,
+    DWORD       a_dwLatencyLimit,
+    DWORD       a_dwQueueTimeout
+    )
+{
+    wininet_lock_enter(&wininet_limiter_lock);
+    wininet_limiter_max     = a_nMaxLimit ? a_nMaxLimit : 1;
+    wininet_limiter_initial = a_nInitialLimit ? a_nInitialLimit : 1;
+    if (wininet_limiter_initial > wininet_limiter_max) {
+        wininet_limiter_initial = wininet_limiter_max;
+    }
+    wininet_limiter_latency = a_dwLatencyLimit;
+    wininet_limiter_wait    = a_dwQueueTimeout;
+    wininet_lock_leave(&wininet_limiter_lock);
+}
 
-/* register and set the logfile */
-int 
-wininet_register(
-    struct soap *           soap, 
-    struct soap_plugin *    a_pPluginData, 
-    void *                  a_pLogFile
+/* enumerate the concurrency limit of all servers */
+extern void 
+wininet_limiter_enum(
+    wininet_limiter_callback    a_pCallback,
+    void *                      a_pContext
     )
 {
-    struct wininet_data * pData;
-    int rc;
+    struct wininet_limiter * pLimiter;
 
-    /* can't use WININET_LOG0 as we don't exist yet */
-    DBGLOG(TEST, SOAP_MESSAGE(fdebug, "wininet %p: registration\n", soap));
+    if (!a_pCallback) return;
+    wininet_lock_enter(&wininet_limiter_lock);
+    for (pLimiter = wininet_limiter_list; pLimiter; pLimiter = pLimiter->pNext) {
+        a_pCallback(a_pContext, pLimiter->pHost, pLimiter->nPort, pLimiter->nLimit, 
+            pLimiter->nInFlight, pLimiter->nQueued, pLimiter->nRejected);
+    }
+    wininet_lock_leave(&wininet_limiter_lock);
+}
 
-    pData = (struct wininet_data *) malloc(sizeof(struct wininet_data));
-    if (!pData) return SOAP_EOM;
-    memset(pData, 0, sizeof(struct wininet_data));
-    pData->nLogFormat = LOGTYPE_UNKNOWN;
+/* send each message to several endpoints concurrently */
+extern int 
+wininet_setfanout(
+    struct soap *           soap,
+    const char * const *    a_ppszEndpoints,
+    unsigned                a_nCount,
+    unsigned                a_nRequired,
+    wininet_fanout_callback a_pCallback,
+    void *                  a_pContext
+    )
+{
+    struct wininet_fanout * pFanout;
+    unsigned n;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
-    rc = wininet_setlog_internal(pData, (const char *) a_pLogFile);
-    if (rc != SOAP_OK) {
-        free(pData);
-        return rc;
+    if (!pData) return SOAP_ERR;
+    if (a_nRequired > a_nCount || (a_nCount && !a_ppszEndpoints)) {
+        return SOAP_ERR;
     }
-    
-    WININET_LOG0(pData, "init");
+    WININET_LOG2(pData, "setfanout: %u endpoints, %u required", a_nCount, a_nRequired);
 
-    if ((soap->omode & SOAP_IO) == SOAP_IO_STORE) {
-        WININET_LOG0(pData, "use of SOAP_IO_STORE is not recommended");
+    wininet_fanout_free(pData->pFanout);
+    pData->pFanout = NULL;
+    if (!a_nCount) {
+        return SOAP_OK;
     }
 
-    /* guarantee that we have an internal buffer */
-    rc = wininet_growbuffer(pData, "init", 1);
-    if (rc != SOAP_OK) {
-        wininet_delete(soap, a_pPluginData);
-        return rc;
+    pFanout = (struct wininet_fanout *) calloc(1, sizeof(struct wininet_fanout));
+    if (!pFanout) return SOAP_EOM;
+    pFanout->ppEndpoints = (char **) calloc(a_nCount, sizeof(char *));
+    pFanout->anCompleted = (unsigned *) calloc(a_nCount, sizeof(unsigned));
+    pFanout->hCompleted  = CreateSemaphoreA(NULL, 0, (LONG) a_nCount, NULL);
+    if (!pFanout->ppEndpoints || !pFanout->anCompleted || !pFanout->hCompleted) {
+        wininet_fanout_free(pFanout);
+        return SOAP_EOM;
+    }
+    for (n = 0; n < a_nCount; ++n) {
+        pFanout->ppEndpoints[n] = strdup(a_ppszEndpoints[n]);
+        if (!pFanout->ppEndpoints[n]) {
+            pFanout->nEndpoints = n;
+            wininet_fanout_free(pFanout);
+            return SOAP_EOM;
+        }
     }
+    pFanout->nEndpoints = a_nCount;
+    pFanout->nRequired  = a_nRequired;
+    pFanout->pCallback  = a_pCallback;
+    pFanout->pContext   = a_pContext;
+    pData->pFanout = pFanout;
+    return SOAP_OK;
+}
 
-    /* start our internet session using the standard IE proxy config */
-    pData->hInternet = InternetOpenA("gsoap/" WININET_VERSION, 
-        INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
-    if (!pData->hInternet) {
+/* establish a connection to an endpoint before it is first used */
+extern int 
+wininet_prewarm(
+    struct soap *   soap,
+    const char *    a_pszEndpoint
+    )
+{
+    DWORD dwStart = GetTickCount();
+    HINTERNET hSession;
+    DWORD dwFlags;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData || !a_pszEndpoint) return SOAP_ERR;
+    if (!wininet_session_ready(soap, pData)) return SOAP_ERR;
+
+    wininet_prewarm_reap(pData, FALSE);
+    if (!wininet_prewarm_prepare(soap, pData, a_pszEndpoint, &hSession, &dwFlags)) return SOAP_ERR;
+    if (!wininet_prewarm_endpoint(hSession, a_pszEndpoint, dwFlags)) {
         soap->error = GetLastError();
-        WININET_LOG2(pData, "init: error %d (%s) in InternetOpen", 
+        WININET_LOGC3(pData, WININET_LOG_ERRORS, "prewarm: '%s' failed with error %d (%s)", a_pszEndpoint,
             soap->error, wininet_error_message(pData, soap->error));
-        wininet_delete(soap, a_pPluginData);
-        return FALSE;
+        return SOAP_ERR;
     }
+    WININET_LOGC2(pData, WININET_LOG_TIMING, "prewarm: '%s' connected in %lu ms", a_pszEndpoint, 
+        GetTickCount() - dwStart);
+    ++pData->stats.nPrewarmed;
+    return SOAP_OK;
+}
 
-    /* set up the callback function so we get notifications */
-    InternetSetStatusCallbackA(pData->hInternet, wininet_callback);
+/* establish a connection to an endpoint in the background */
+extern int 
+wininet_prewarm_async(
+    struct soap *   soap,
+    const char *    a_pszEndpoint
+    )
+{
+    struct wininet_prewarm * pPrewarm;
+    HINTERNET hSession;
+    DWORD dwFlags;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
-    /* set all of our callbacks */
-    soap->fopen    = wininet_fopen;
-    soap->fpoll    = wininet_fpoll;
-    soap->fposthdr = wininet_fposthdr;
-    soap->fsend    = wininet_fsend;
-    soap->frecv    = wininet_frecv;
-    soap->fclose   = wininet_fclose;
+    if (!pData || !a_pszEndpoint) return SOAP_ERR;
+    if (!wininet_session_ready(soap, pData)) return SOAP_ERR;
 
-    a_pPluginData->id        = wininet_id;
-    a_pPluginData->fcopy     = wininet_copy;
-    a_pPluginData->fdelete   = wininet_delete;
-    a_pPluginData->data      = pData;
+    wininet_prewarm_reap(pData, FALSE);
+    if (!wininet_prewarm_prepare(soap, pData, a_pszEndpoint, &hSession, &dwFlags)) return SOAP_ERR;
+
+    pPrewarm = (struct wininet_prewarm *) calloc(1, sizeof(struct wininet_prewarm));
+    if (!pPrewarm) return SOAP_EOM;
+    pPrewarm->hInternet = hSession;
+    pPrewarm->dwFlags = dwFlags;
+    pPrewarm->pEndpoint = strdup(a_pszEndpoint);
+    if (!pPrewarm->pEndpoint) {
+        free(pPrewarm);
+        return SOAP_EOM;
+    }
+    pPrewarm->hThread = (HANDLE) _beginthreadex(NULL, 0, 
+        wininet_prewarm_thread, pPrewarm, 0, NULL);
+    if (!pPrewarm->hThread) {
+        free(pPrewarm->pEndpoint);
+        free(pPrewarm);
+        return SOAP_ERR;
+    }
 
+    WININET_LOG1(pData, "prewarm_async: connecting to '%s'", a_pszEndpoint);
+    pPrewarm->pNext = pData->pPrewarm;
+    pData->pPrewarm = pPrewarm;
     return SOAP_OK;
 }
 
-/* start or stop logging */
-int 
-wininet_setlog(
+/* enable or disable the process wide proxy decision cache */
+extern int 
+wininet_setproxycache(
     struct soap *   soap,
-    const char *    a_pLogFile
+    BOOL            a_bEnable
     )
 {
     struct wininet_data * pData = (struct wininet_data *) 
         soap_lookup_plugin(soap, wininet_id);
 
     if (!pData) return SOAP_ERR;
-    return wininet_setlog_internal(pData, a_pLogFile);
+    WININET_LOG1(pData, "setproxycache: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bProxyCache = a_bEnable;
+    return SOAP_OK;
 }
 
-/* set the flags */
-int 
-wininet_setflags(
-    struct soap *   soap, 
-    DWORD           a_dwRequestFlags
+/* set how long proxy decisions are used before they are refreshed */
+extern void 
+wininet_proxy_cache_config(
+    DWORD   a_dwTtlSeconds
+    )
+{
+    wininet_lock_enter(&wininet_proxy_lock);
+    wininet_proxy_ttl = a_dwTtlSeconds ? a_dwTtlSeconds * 1000 : INFINITE;
+    wininet_lock_leave(&wininet_proxy_lock);
+}
+
+/* replace the function used to find the proxy for a URL */
+extern void 
+wininet_set_proxy_resolver(
+    wininet_proxy_resolver  a_pResolver,
+    void *                  a_pContext
+    )
+{
+    wininet_lock_enter(&wininet_proxy_lock);
+    wininet_proxy_resolve_fn  = a_pResolver;
+    wininet_proxy_resolve_ctx = a_pContext;
+    wininet_lock_leave(&wininet_proxy_lock);
+}
+
+/* set the maximum number of connections to each server */
+extern BOOL 
+wininet_setmaxconns(
+    DWORD   a_dwMaxConns
+    )
+{
+    BOOL bResult;
+
+    if (!a_dwMaxConns) return FALSE;
+    wininet_lock_enter(&wininet_conns_lock);
+    bResult = wininet_conns_set(a_dwMaxConns);
+    wininet_conns_waits = 0;
+    wininet_lock_leave(&wininet_conns_lock);
+    return bResult;
+}
+
+/* get the maximum number of connections to each server */
+extern DWORD 
+wininet_getmaxconns(void)
+{
+    return wininet_conns_get();
+}
+
+/* raise the connections per server automatically when sends wait for one */
+extern void 
+wininet_conns_autotune(
+    DWORD   a_dwMaxConns,
+    DWORD   a_dwWaitThreshold
+    )
+{
+    wininet_lock_enter(&wininet_conns_lock);
+    wininet_conns_max = a_dwMaxConns;
+    wininet_conns_threshold = a_dwWaitThreshold;
+    wininet_conns_waits = 0;
+    wininet_lock_leave(&wininet_conns_lock);
+}
+
+/* set the time that a connection may be idle before it is replaced */
+extern int 
+wininet_setidletimeout(
+    struct soap *   soap,
+    DWORD           a_dwIdleTimeout
     )
 {
     struct wininet_data * pData = (struct wininet_data *) 
         soap_lookup_plugin(soap, wininet_id);
-    
+
     if (!pData) return SOAP_ERR;
-    WININET_LOG1(pData, "wininet_setflags: new flags = %lu", a_dwRequestFlags);
-    pData->dwRequestFlags = a_dwRequestFlags;
+    WININET_LOG1(pData, "setidletimeout: %lu ms", a_dwIdleTimeout);
+    pData->dwIdleTimeout = a_dwIdleTimeout;
     return SOAP_OK;
 }
 
- /* set the optional user-agent string */
+/* set or remove the constant headers sent with each message to an endpoint */
 extern int 
-wininet_setagent(
+wininet_setheadertemplate(
     struct soap *   soap,
-    const char *    a_pUserAgent
+    const char *    a_pszEndpoint,
+    const char *    a_pszHeaders
     )
 {
+    struct wininet_template ** ppTemplate;
+    struct wininet_template * pTemplate;
+    const char * pLine;
+    const char * pNext;
+    const char * pColon;
+    size_t nLineLen;
+    size_t nLen = 0;
+    char * pHeaders;
+    DWORD dwKeys = 0;
     struct wininet_data * pData = (struct wininet_data *) 
         soap_lookup_plugin(soap, wininet_id);
 
     if (!pData) return SOAP_ERR;
-    
-    if (pData->pUserAgent) {
-        free(pData->pUserAgent);
-        pData->pUserAgent = NULL;
+    WININET_LOG1(pData, "setheadertemplate: endpoint = '%s'", 
+        a_pszEndpoint ? a_pszEndpoint : "(all endpoints)");
+
+    /* remove any existing template for the endpoint */
+    for (ppTemplate = &pData->pTemplates; *ppTemplate; ppTemplate = &(*ppTemplate)->pNext) {
+        pTemplate = *ppTemplate;
+        if (a_pszEndpoint ? (pTemplate->pEndpoint && !strcmp(pTemplate->pEndpoint, a_pszEndpoint)) 
+            : !pTemplate->pEndpoint) 
+        {
+            *ppTemplate = pTemplate->pNext;
+            free(pTemplate->pEndpoint);
+            free(pTemplate->pHeaders);
+            free(pTemplate);
+            break;
+        }
+    }
+    pData->pTemplate = NULL;
+    if (!a_pszHeaders || !*a_pszHeaders) {
+        return SOAP_OK;
     }
 
-    if (a_pUserAgent && *a_pUserAgent) {
-        WININET_LOG1(pData, "setagent: User-Agent = '%s'", a_pUserAgent);
-        pData->pUserAgent = strdup(a_pUserAgent);
+    /* format the headers once, each line is terminated by CR LF */
+    pHeaders = (char *) malloc(2 * strlen(a_pszHeaders) + 1);
+    if (!pHeaders) return SOAP_EOM;
+    for (pLine = a_pszHeaders; *pLine; pLine = pNext) {
+        pNext = strchr(pLine, '\n');
+        pNext = pNext ? pNext + 1 : pLine + strlen(pLine);
+        nLineLen = pNext - pLine;
+        while (nLineLen > 0 && (pLine[nLineLen-1] == '\r' || pLine[nLineLen-1] == '\n')) {
+            --nLineLen;
+        }
+        if (!nLineLen) continue;
+
+        /*  the variable headers are always supplied by gsoap. SOAPAction 
+            also identifies the operation for the response cache, so it must 
+            come from gsoap too. */
+        pColon = (const char *) memchr(pLine, ':', nLineLen);
+        if (!pColon || pColon == pLine
+            || !strnicmp(pLine, "Content-Length:", 15)
+            || !strnicmp(pLine, "Transfer-Encoding:", 18)
+            || !strnicmp(pLine, "SOAPAction:", 11)) 
+        {
+            WININET_LOGC2(pData, WININET_LOG_HEADERS, "setheadertemplate: invalid header '%.*s'", (int) nLineLen, pLine);
+            free(pHeaders);
+            return SOAP_ERR;
+        }
+        dwKeys |= wininet_template_key(pLine, pColon - pLine);
+        memcpy(pHeaders + nLen, pLine, nLineLen);
+        nLen += nLineLen;
+        pHeaders[nLen++] = '\r';
+        pHeaders[nLen++] = '\n';
     }
-    else {
-        WININET_LOG0(pData, "setagent: User-Agent = (use default)");
+    pHeaders[nLen] = 0;
+
+    pTemplate = (struct wininet_template *) malloc(sizeof(struct wininet_template));
+    if (!pTemplate) {
+        free(pHeaders);
+        return SOAP_EOM;
+    }
+    pTemplate->pEndpoint = a_pszEndpoint ? strdup(a_pszEndpoint) : NULL;
+    if (a_pszEndpoint && !pTemplate->pEndpoint) {
+        free(pHeaders);
+        free(pTemplate);
+        return SOAP_EOM;
     }
+    pTemplate->pHeaders = pHeaders;
+    pTemplate->nHeadersLen = nLen;
+    pTemplate->dwKeys = dwKeys;
+    pTemplate->pNext = pData->pTemplates;
+    pData->pTemplates = pTemplate;
+    return SOAP_OK;
+}
+
+/* enable or disable the traceparent header */
+extern int 
+wininet_settracing(
+    struct soap *   soap,
+    BOOL            a_bEnable
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
 
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "settracing: %s", a_bEnable ? "enabled" : "disabled");
+    pData->bTracing = a_bEnable;
     return SOAP_OK;
 }
 
-/* set the optional callback */
+/* set or clear the trace context that the following messages belong to */
 extern int 
-wininet_set_rse_callback(
-    struct soap *           soap,
-    wininet_rse_callback    a_pRsecallback
+wininet_settraceparent(
+    struct soap *   soap,
+    const char *    a_pszTraceParent
     )
 {
     struct wininet_data * pData = (struct wininet_data *) 
         soap_lookup_plugin(soap, wininet_id);
 
     if (!pData) return SOAP_ERR;
-    WININET_LOG1(pData, "set_rse_callback: callback = '%p'", a_pRsecallback);
-    pData->pRseCallback = a_pRsecallback;
+    if (!a_pszTraceParent || !*a_pszTraceParent) {
+        pData->szTraceContext[0] = 0;
+        return SOAP_OK;
+    }
+    if (!wininet_trace_valid(a_pszTraceParent)) {
+        WININET_LOG1(pData, "settraceparent: invalid traceparent '%s'", a_pszTraceParent);
+        return SOAP_ERR;
+    }
+    memcpy(pData->szTraceContext, a_pszTraceParent, WININET_TRACEPARENT_LEN + 1);
+    return SOAP_OK;
+}
+
+/* get the traceparent sent with the current or last message */
+extern const char * 
+wininet_gettraceparent(
+    struct soap *   soap
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return "";
+    return pData->szTraceParent;
+}
+
+/* set how often the log files are flushed */
+extern void 
+wininet_setlogflush(
+    DWORD   a_dwFlushMs
+    )
+{
+    wininet_log_flush_ms = a_dwFlushMs;
+}
+
+/* drop log output instead of waiting when a log file falls behind */
+extern void 
+wininet_setlogdrop(
+    BOOL    a_bDrop
+    )
+{
+    wininet_log_drop = a_bDrop;
+}
+
+/* write and flush everything that has been logged */
+extern void 
+wininet_flushlog(void)
+{
+    struct wininet_logsink * pSink;
+
+    /* the lock keeps the logs from being closed while they are drained */
+    wininet_lock_enter(&wininet_logsink_lock);
+    for (pSink = wininet_logsinks; pSink; pSink = pSink->pNext) {
+        wininet_logsink_drain(pSink);
+    }
+    wininet_lock_leave(&wininet_logsink_lock);
+}
+
+/* set the categories of information that are logged */
+extern int 
+wininet_setloglevel(
+    struct soap *   soap,
+    DWORD           a_dwCategories
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+
+    if (!pData) return SOAP_ERR;
+    WININET_LOG1(pData, "setloglevel: categories = %lX", a_dwCategories);
+    pData->dwLogCategories = a_dwCategories;
+    pData->dwLogMask = pData->hLog ? a_dwCategories : 0;
     return SOAP_OK;
 }
@@ -35,7 +35,7 @@ Features
      compile without win64 warnings).
  + all debug trace goes to the gsoap TEST.log file 
  + supports multiple threads (all plugin data is stored in the 
-     soap structure - no static variables)
+     soap structure, the optional process wide caches are locked)
 
 -------------------------------------------------------------------------------
 Limitations
@@ -64,6 +64,14 @@ For example:
      ...
      soap_done(&soap);
 
+Registration opens the WinInet session immediately. When many soap contexts 
+are created at startup and not all of them are used, register with 
+wininet_register_lazy instead to open the session on the first call, or with
+wininet_register_background to open it on a worker thread from the system 
+thread pool so that it is ready by the first call. 
+
+     soap_register_plugin( &soap, wininet_register_lazy );
+
 -------------------------------------------------------------------------------
 Creating a logfile
 -------------------------------------------------------------------------------
@@ -89,6 +97,27 @@ Note that if the log file cannot be created then no error is generated. In
 particular, if the gsoap plugin is running in the context of IE protected mode
 then note that only some directories are writable (FOLDERID_LocalAppDataLow).
 
+Log output is written by a background thread so that logging doesn't block the 
+calls. All instances that log to the same file share it and its writer thread. 
+Each instance collects its output and passes it to the writer at the end of 
+each call, before it waits for the network or another request, or sooner if 
+there is a lot of it or it has been kept for 100 ms. Lines are never split 
+between the output of different instances. If the writer falls too far behind 
+then logging waits for it. Alternatively wininet_setlogdrop() drops the output 
+instead and a line noting how much was dropped is written. By default the file 
+is flushed after each batch of output is written, use wininet_setlogflush() to 
+flush less often. wininet_flushlog() waits until all output passed to the 
+writers so far has been written, e.g. before the process exits. The file is 
+closed when the last instance using it is deleted or changes its log with 
+wininet_setlog(), so that it can then be rotated or deleted.
+
+Everything is logged by default. The categories that are logged can be 
+changed at any time with wininet_setloglevel(), for example to keep the 
+status, error and timing lines but not the message bodies:
+
+     wininet_setloglevel( &soap, 
+         WININET_LOG_STATUS | WININET_LOG_ERRORS | WININET_LOG_TIMING );
+
 -------------------------------------------------------------------------------
 Adding extra flags
 -------------------------------------------------------------------------------
@@ -179,6 +208,304 @@ To disable the dialog, supply your own custom error resolving callback using
 wininet_set_rse_callback() function. It is possible to disable some warning
 dialogs by setting the appropriate flags with wininet_setflags().
 
+-------------------------------------------------------------------------------
+Credential cache
+-------------------------------------------------------------------------------
+
+Normally every call to an authenticated endpoint sends the entire message, 
+receives a 401 or 407 challenge, resolves it and then sends the entire 
+message again. When the credential cache is enabled with 
+wininet_setauthcache(), the credentials that were accepted are cached for 
+the lifetime of the process (shared by all plugin instances) and are 
+supplied to later requests. Server credentials are cached per host, port 
+and realm, and are used for the URL paths below the directory of the 
+request that they were accepted for. Proxy credentials are cached per proxy 
+and realm. When a server challenges for another realm than the one of the 
+credentials sent, the cached credentials for that realm are used instead. 
+Basic credentials for a server are sent preemptively over https only, with 
+every request for the message including resends and fan-out requests to 
+the same origin. This saves the 401 round trip; other schemes and proxy 
+credentials are never sent preemptively, so WinInet still needs the 
+challenge but doesn't prompt for credentials. If the server rejects cached 
+credentials they are removed from the cache and the normal challenge 
+handling is used.
+
+The cache can be cleared with wininet_clearauthcache(). The number of 
+challenge round trips saved is available from wininet_getstats().
+
+-------------------------------------------------------------------------------
+Response cache
+-------------------------------------------------------------------------------
+
+All requests are sent with the no-cache flags so that WinInet never returns 
+a stale response. For operations whose results rarely change, an in-process 
+response cache can be enabled per SOAPAction with wininet_setcacheable(). 
+Identical messages to the same endpoint are then answered from memory without
+using the network until the lifetime expires.
+
+For example, cache the responses of a lookup operation for 5 minutes:
+     wininet_setcacheable( &soap, "urn:example#GetCountries", 300 );
+
+Large responses that rarely change but must be checked can instead be 
+revalidated with wininet_setrevalidate(). The cached response is then only 
+returned after the server has confirmed with a 304 that it hasn't changed, 
+which transfers a few hundred bytes instead of the entire response. The 
+ETag and Last-Modified of the 304 replace those of the cached response and 
+its lifetime starts again.
+
+The cache is shared by all plugin instances in the process and is limited by 
+wininet_cache_setlimit(). A cached response is only returned for a message 
+sent with the same credentials, i.e. the same Authorization and Cookie 
+headers, which includes gSOAP's userid and the credential cache. Credentials 
+that WinInet supplies itself (e.g. integrated Windows authentication, or those 
+entered in its dialog) and other headers that identify the caller are not 
+known to the plugin, so only enable caching for operations whose response is 
+the same for every caller that uses them in the process. The hits and misses 
+are available from wininet_getstats() and the memory used from 
+wininet_cache_usage().
+
+-------------------------------------------------------------------------------
+Hedged requests
+-------------------------------------------------------------------------------
+
+When one slow server or proxy hop dominates the response time of read-only
+operations, hedging can be enabled with wininet_sethedging(). If no response 
+has been received within the configured quantile of recent response times, 
+the already buffered message is sent again on a second connection. Whichever
+response arrives first is used and the other request is cancelled.
+
+For example, hedge at the 95th percentile but never before 50 ms:
+     wininet_sethedging( &soap, 95, 50 );
+
+Hedging must only be enabled for idempotent operations as the server may 
+receive the message twice. The number of hedged requests sent and the number 
+that responded first are available from wininet_getstats().
+
+-------------------------------------------------------------------------------
+Request coalescing
+-------------------------------------------------------------------------------
+
+When many threads send the same message at the same moment (e.g. after a 
+shared cache expired), only one of them needs to go to the server. With 
+wininet_setcoalescing() enabled, a message that is identical to one already 
+being sent to the same endpoint (same SOAPAction, credentials and message 
+content) waits for that response and receives a copy of it. As with the 
+response cache, only the Authorization and Cookie headers identify the 
+credentials, see above. If the first request fails, the
+waiting requests send their own message.
+
+     wininet_setcoalescing( &soap, TRUE );
+
+Coalescing must only be enabled for idempotent operations. The number of 
+coalesced requests is available from wininet_getstats() for the instance and 
+from wininet_coalesce_enum() for each endpoint in the process.
+
+-------------------------------------------------------------------------------
+Load balancing
+-------------------------------------------------------------------------------
+
+When a service is available from several equivalent servers, all of them can 
+be given to wininet_setendpoints(). The endpoint passed to the soap call is 
+then ignored and each new connection is made to one of these instead. Two of 
+the endpoints are picked at random and the one with the lower average 
+response time (weighted by the number of requests in progress from this 
+process) is used. If a server can't be reached, the message is sent to the 
+next endpoint and the unreachable one is avoided for a short time.
+
+     const char * endpoints[] = { 
+         "http://server1/service", "http://server2/service" };
+     wininet_setendpoints( &soap, endpoints, 2 );
+
+A background thread started with wininet_endpoint_probe() sends a HEAD 
+request to each endpoint periodically so that servers are known to be down 
+(or back up) before a message is sent to them. The state of each endpoint is 
+available from wininet_endpoint_enum().
+
+-------------------------------------------------------------------------------
+Circuit breaker
+-------------------------------------------------------------------------------
+
+When a server is down, every call waits for the full timeout before failing.
+With wininet_setcircuitbreaker() enabled, the results of recent messages to 
+each server (host and port) are tracked for the process. When too many of 
+them fail with a connection error, a timeout or a 502, 503 or 504 status, the 
+circuit is opened and messages to that server fail immediately with the error 
+WININET_ERROR_CIRCUIT_OPEN without using the network. After the open time 
+a single trial message is sent (half-open) and its result decides whether 
+the circuit is closed again.
+
+     wininet_setcircuitbreaker( &soap, TRUE );
+     wininet_circuit_config( 50, 10, 30 ); // 50% of at least 10 messages, open for 30 s
+
+The state of each server is available from wininet_circuit_enum() and the 
+number of state changes and refused messages from wininet_getstats().
+
+-------------------------------------------------------------------------------
+Concurrency limit
+-------------------------------------------------------------------------------
+
+Sending too many messages at once to a server can make its response time 
+collapse. With wininet_setconcurrencylimit() enabled, the number of messages 
+in progress to each server (host and port) from all plugin instances in the 
+process is limited. The limit adapts to the server: it is increased by one 
+after a full limit of messages succeeded, and reduced by a quarter (at least 
+one) when the server responds with 503 or 429, fails with a connection error 
+or timeout, or takes longer than the configured latency limit.
+
+Messages above the limit wait for a slot up to the configured queue timeout
+and then fail with the error WININET_ERROR_LIMIT_EXCEEDED.
+
+     wininet_setconcurrencylimit( &soap, TRUE );
+     wininet_limiter_config( 8, 64, 2000, 500 ); // start at 8, max 64, 2 s, wait 500 ms
+
+The current limit, messages in progress, queue depth and refused messages of 
+each server are available from wininet_limiter_enum().
+
+-------------------------------------------------------------------------------
+Fan-out
+-------------------------------------------------------------------------------
+
+To send the same message to many endpoints (e.g. shards of a service) and 
+merge the replies, configure the endpoints with wininet_setfanout(). The 
+message is then serialized once by the soap call and the same buffer is sent
+to all endpoints concurrently. Each response is passed to the callback as it
+arrives (in the thread of the soap call). 
+
+When the required number of endpoints have responded with status 200, the 
+remaining requests are cancelled and the soap call returns the first of them,
+so the call takes as long as the K-th fastest endpoint. If not enough 
+endpoints succeed, the call fails with the error WININET_ERROR_QUORUM_FAILED 
+(or the error of the requests if none received a response).
+
+The fan-out requests bypass the circuit breaker, the concurrency limiter and 
+the credential cache of the plugin, and no authentication is done for them. 
+The headers of the message are sent to every endpoint, but Authorization and 
+Cookie headers only to endpoints with the same origin as the soap call. A 
+401 or 407 response is passed to the callback like any other response and 
+doesn't count towards the required number of endpoints.
+
+     wininet_setfanout( &soap, shards, 24, 20, OnShardResponse, &results );
+
+-------------------------------------------------------------------------------
+Pre-warming connections
+-------------------------------------------------------------------------------
+
+The first call to a server pays for the proxy detection, name resolution, 
+TCP connection and TLS handshake. These can be done ahead of time with 
+wininet_prewarm(), or in the background with wininet_prewarm_async(), which 
+send a HEAD request to the endpoint. The request uses the same flags, 
+timeouts and cached proxy decision as a soap call would. WinInet keeps the 
+connection open for the plugin instance and the first soap call to that 
+server then uses it.
+
+     wininet_prewarm_async( &soap, "https://server/service" );
+
+-------------------------------------------------------------------------------
+Proxy cache
+-------------------------------------------------------------------------------
+
+When automatic proxy detection (WPAD or a PAC script) is configured, WinInet 
+may spend hundreds of milliseconds finding the proxy for each new connection
+of each plugin instance. With wininet_setproxycache() enabled, the proxy for
+each server is found once for the process and used for each connection to 
+it. As WinInet only sets the proxy for a whole session, the plugin instance 
+opens a session for each proxy decision and connects to the server on it. 
+The decision is refreshed in the background after the lifetime set by 
+wininet_proxy_cache_config() (default 5 minutes), and the refresh is waited 
+for when the plugin instance is deleted. Static proxy settings are left to 
+WinInet.
+
+The OS decision is found using WinHTTP (loaded when first needed). Another
+resolver, e.g. a stub PAC evaluator for testing, can be installed with 
+wininet_set_proxy_resolver(). The time spent finding proxies and the number 
+of cached decisions used are available from wininet_getstats().
+
+-------------------------------------------------------------------------------
+Connections per server
+-------------------------------------------------------------------------------
+
+WinInet limits the number of connections to each server for the process 
+(by default 2 on older versions of Windows). When more threads than this 
+call the same server, the extra requests wait inside WinInet for a 
+connection. The limit can be set with wininet_setmaxconns(), or raised 
+automatically with wininet_conns_autotune() when sends repeatedly wait for 
+longer than a threshold. 
+
+     wininet_conns_autotune( 32, 50 ); // up to 32 connections, raise after 50 ms waits
+
+The time spent waiting for a connection and the time spent on the network 
+are reported separately by wininet_getstats().
+
+-------------------------------------------------------------------------------
+Idle connections
+-------------------------------------------------------------------------------
+
+Servers and proxies close kept alive connections that have been idle for a 
+while, and the next message sent on one of them fails. When an idle timeout is 
+set, the plugin's connection and request handles are replaced when gSOAP polls 
+a connection that has been idle for longer. gSOAP polls a kept alive 
+connection before reusing it, the check isn't made at any other time. This 
+only resets the plugin's state: WinInet's own pooled socket is not closed and 
+may still be used for the next message, in which case a failure is handled by 
+the retry below. Choose a timeout a little shorter than the server's keep 
+alive timeout.
+
+     wininet_setidletimeout( soap, 30000 ); // replace connections idle for 30 s
+
+WinInet keeps its own pool of sockets, so a stale socket may still be used. 
+If a send on a kept alive connection that has been used before fails because 
+the connection was reset or aborted, the message is resent once on a new 
+connection. This happens whether or not an idle timeout is set. The reset 
+may also happen after the server has processed the message, for example 
+while the response is being read, so the server may receive a message twice. 
+Operations that must not be repeated should not use keep alive connections.
+
+-------------------------------------------------------------------------------
+Header templates
+-------------------------------------------------------------------------------
+
+Messages to one endpoint usually send the same headers. A template of these 
+constant headers can be set for an endpoint with wininet_setheadertemplate(). 
+It is formatted once and copied into each message, and gsoap's headers of the 
+same name are dropped. Content-Length and the other variable headers are 
+still supplied by gsoap for each message. SOAPAction can't be included as it 
+identifies the operation of each message.
+
+     wininet_setheadertemplate( soap, "http://server/service", 
+         "Content-Type: text/xml; charset=utf-8\r\n"
+         "Accept: text/xml\r\n"
+         "X-Client: quotes" );
+
+-------------------------------------------------------------------------------
+Tracing
+-------------------------------------------------------------------------------
+
+When tracing is enabled with wininet_settracing(), each message is sent with 
+a W3C traceparent header. Each message is a new span. It is part of the trace 
+set by wininet_settraceparent(), or of a new trace if none is set. The ids are 
+generated by the instance without locks. The traceparent is written to the 
+log, the log lines written while the message is in flight include its span 
+id after the instance, and when logging it replaces the request id in the 
+User-Agent. It can be retrieved with wininet_gettraceparent() so that the 
+client's own timings can be joined with the server's traces.
+
+     wininet_settracing( soap, TRUE );
+     wininet_settraceparent( soap, incomingTraceParent );
+     soap_call_ns__method( soap, ... );
+     record( wininet_gettraceparent( soap ), latency );
+
+-------------------------------------------------------------------------------
+Threads
+-------------------------------------------------------------------------------
+
+For the best throughput with many threads, give each thread its own soap 
+structure with the plugin registered. Each instance then has its own WinInet 
+session, handles, buffers, request ids and statistics, and sending a 
+message touches no state that is shared with other threads. Only the 
+optional process wide features (the authentication, redirect, response and 
+proxy caches, coalescing, endpoints, circuit breakers, concurrency limits 
+and connection tuning) take a lock, and only when they are enabled.
+
 -------------------------------------------------------------------------------
 License 
 -------------------------------------------------------------------------------
@@ -242,10 +569,42 @@ extern "C" {
  */
 extern int wininet_register(struct soap *a_pSoap, struct soap_plugin *a_pPluginData, void *a_pLogFile);
 
+/*! register the plugin like wininet_register but don't open the WinInet 
+    session until the first connection */
+extern int wininet_register_lazy(struct soap *a_pSoap, struct soap_plugin *a_pPluginData, void *a_pLogFile);
+
+/*! register the plugin like wininet_register but open the WinInet session on 
+    a worker thread. The first connection waits for it if necessary. */
+extern int wininet_register_background(struct soap *a_pSoap, struct soap_plugin *a_pPluginData, void *a_pLogFile);
+
 /*! set or cancel the logfile after plugin registration. Set to NULL or empty string
     to disable logging. */
 extern int wininet_setlog(struct soap * soap, const char * a_pLogFile);
 
+/*! set the interval in ms that the log files are flushed at. Set to 0 (the 
+    default) to flush after each batch of output is written. */
+extern void wininet_setlogflush(DWORD a_dwFlushMs);
+
+/*! drop log output instead of waiting when a log file's writer falls too 
+    far behind. The default is FALSE, nothing is dropped. */
+extern void wininet_setlogdrop(BOOL a_bDrop);
+
+/*! wait until everything logged so far has been written to the log files */
+extern void wininet_flushlog(void);
+
+/*! categories of information written to the log */
+#define WININET_LOG_CALLS       0x01    /*!< plugin calls and decisions */
+#define WININET_LOG_STATUS      0x02    /*!< WinInet status callbacks */
+#define WININET_LOG_HEADERS     0x04    /*!< request and response headers */
+#define WININET_LOG_BODY        0x08    /*!< message data */
+#define WININET_LOG_ERRORS      0x10    /*!< errors and their resolution */
+#define WININET_LOG_TIMING      0x20    /*!< time taken by each send */
+#define WININET_LOG_ALL         0x3F
+
+/*! set the categories that are logged (WININET_LOG_xxx), the default is 
+    WININET_LOG_ALL. Nothing is logged unless a log file has been set. */
+extern int wininet_setloglevel(struct soap * soap, DWORD a_dwCategories);
+
 /*! set the extra flags after plugin registration. Set to 0 for default flags. */
 extern int wininet_setflags(struct soap * soap, DWORD a_dwRequestFlags);
 
@@ -267,6 +626,293 @@ typedef wininet_rseReturn (*wininet_rse_callback)(HINTERNET a_hHttpRequest, DWOR
     without using the built-in Windows dialogs. */
 extern int wininet_set_rse_callback(struct soap *a_pSoap, wininet_rse_callback a_pRseCallback);
 
+/*! enable hedged requests. When no response has been received after the 
+    a_dwQuantile percentile (e.g. 95) of recent response times, or after 
+    a_dwMinDelay milliseconds if that is longer, a duplicate of the request is 
+    sent on a second connection and the first response received is used. 
+    Only enable this for idempotent (e.g. read-only) operations. Set 
+    a_dwQuantile to 0 to disable. */
+extern int wininet_sethedging(struct soap * soap, DWORD a_dwQuantile, DWORD a_dwMinDelay);
+
+/*! enable or disable the credential cache. When enabled, credentials that 
+    were accepted by a server or proxy are cached for the process lifetime 
+    and supplied with later requests to the same server and realm or through 
+    the same proxy. Basic server credentials are sent preemptively over https, 
+    avoiding the 401 round trip. */
+extern int wininet_setauthcache(struct soap * soap, BOOL a_bEnable);
+
+/*! remove all cached credentials from the process wide cache */
+extern void wininet_clearauthcache(void);
+
+/*! send messages of at least a_uiThreshold bytes with an "Expect: 100-continue" 
+    header. The headers are sent first and the body is written in blocks so 
+    that a server which rejects the message (e.g. authentication required or 
+    message too large) stops the upload early. Set to 0 to disable. */
+extern int wininet_setexpectcontinue(struct soap * soap, size_t a_uiThreshold);
+
+/*! enable or disable the redirect cache. When enabled, redirects are followed
+    by the plugin instead of WinInet. Permanent redirects (301, 308) are cached 
+    for the process (shared by all plugin instances) and later connections to 
+    the original endpoint go directly to the new location. Only redirects 
+    from https to https are cached. Redirects from https to http are not 
+    followed, and the Authorization and Cookie headers are not sent when a 
+    redirect leads to another server. */
+extern int wininet_setredirectcache(struct soap * soap, BOOL a_bEnable);
+
+/*! set the maximum number of entries (0 = unlimited) and the lifetime of 
+    entries in seconds (0 = unlimited) of the redirect cache. */
+extern void wininet_redirect_cache_config(unsigned a_nMaxEntries, DWORD a_dwTtlSeconds);
+
+/*! redirect cache enumeration callback signature */
+typedef void (*wininet_redirect_callback)(void * a_pContext, const char * a_pszFrom, 
+    const char * a_pszTo, unsigned long a_nHits);
+
+/*! list the contents of the redirect cache. The callback must not call any 
+    of the redirect cache functions. */
+extern void wininet_redirect_cache_enum(wininet_redirect_callback a_pCallback, void * a_pContext);
+
+/*! remove all entries from the redirect cache */
+extern void wininet_redirect_cache_clear(void);
+
+/*! allow responses to an operation to be cached for a_dwTtlSeconds. The 
+    operation is matched against the SOAPAction header (without quotes), or 
+    NULL for all operations. Responses are cached in memory for the process, 
+    keyed by the endpoint, SOAPAction and a hash of the message. Only enable 
+    this for operations whose responses don't change within the lifetime. 
+    Set a_dwTtlSeconds to 0 to remove the rule. */
+extern int wininet_setcacheable(struct soap * soap, const char * a_pszAction, DWORD a_dwTtlSeconds);
+
+/*! enable revalidation of cached responses for an operation (see 
+    wininet_setcacheable). Responses are stored with their ETag and 
+    Last-Modified headers. When a cached response has expired, the request is 
+    sent with If-None-Match and If-Modified-Since headers and if the server 
+    replies 304 (Not Modified) the cached response is returned. If no rule 
+    exists for the operation, one is created that always revalidates. */
+extern int wininet_setrevalidate(struct soap * soap, const char * a_pszAction, BOOL a_bRevalidate);
+
+/*! set the memory budget of the process wide response cache. The least
+    recently used responses are discarded to stay within the budget. The 
+    default is 8 MB. */
+extern void wininet_cache_setlimit(size_t a_uiMaxBytes);
+
+/*! retrieve the memory used and the number of entries in the response cache */
+extern void wininet_cache_usage(size_t * a_puiBytes, unsigned * a_pnEntries);
+
+/*! remove all responses from the response cache */
+extern void wininet_cache_clear(void);
+
+/*! enable or disable coalescing of identical concurrent messages. While a 
+    message is being sent by any plugin instance in the process, identical 
+    messages to the same endpoint wait for its response instead of being sent.
+    Only enable this for idempotent operations. */
+extern int wininet_setcoalescing(struct soap * soap, BOOL a_bEnable);
+
+/*! callback for wininet_coalesce_enum */
+typedef void (*wininet_coalesce_callback)(void * a_pContext, 
+    const char * a_pszEndpoint, unsigned long a_nCoalesced);
+
+/*! enumerate the number of coalesced requests for each endpoint */
+extern void wininet_coalesce_enum(wininet_coalesce_callback a_pCallback, void * a_pContext);
+
+/*! set equivalent endpoints to use instead of the endpoint of the soap call.
+    Each new connection is made to the endpoint expected to respond fastest 
+    and messages are sent to another endpoint if the server can't be reached.
+    At most 32 endpoints may be given. Set a_nCount to 0 to use the endpoint 
+    of the soap call again. */
+extern int wininet_setendpoints(struct soap * soap, const char * const * a_ppszEndpoints, unsigned a_nCount);
+
+/*! start the background health probe of all endpoints configured by 
+    wininet_setendpoints() with a check every a_dwIntervalSeconds, or stop it 
+    if a_dwIntervalSeconds is 0. Returns FALSE if the thread couldn't start. */
+extern BOOL wininet_endpoint_probe(DWORD a_dwIntervalSeconds);
+
+/*! callback for wininet_endpoint_enum. a_dwLatency is the average response 
+    time in ms (0 if unknown). */
+typedef void (*wininet_endpoint_callback)(void * a_pContext, const char * a_pszEndpoint, 
+    DWORD a_dwLatency, LONG a_nOutstanding, BOOL a_bAvailable);
+
+/*! enumerate the state of all endpoints configured in the process */
+extern void wininet_endpoint_enum(wininet_endpoint_callback a_pCallback, void * a_pContext);
+
+/*! error returned when a message is refused because the circuit breaker of 
+    the server is open */
+#define WININET_ERROR_CIRCUIT_OPEN  ((DWORD)0x20000001)
+
+/*! circuit breaker states */
+#define WININET_CIRCUIT_CLOSED      0   /*!< messages are sent */
+#define WININET_CIRCUIT_OPEN        1   /*!< messages fail immediately */
+#define WININET_CIRCUIT_HALF_OPEN   2   /*!< a trial message is being sent */
+
+/*! enable or disable the circuit breaker. When enabled, messages to a server
+    that has recently failed too often are refused with the error 
+    WININET_ERROR_CIRCUIT_OPEN instead of being sent. */
+extern int wininet_setcircuitbreaker(struct soap * soap, BOOL a_bEnable);
+
+/*! configure the circuit breakers of the process. A circuit is opened when 
+    at least a_nFailurePercent of the recent messages (up to 20) failed and at 
+    least a_nMinRequests messages have been sent, and stays open for 
+    a_dwOpenSeconds. The default is 50%, 10 messages and 30 seconds. */
+extern void wininet_circuit_config(unsigned a_nFailurePercent, unsigned a_nMinRequests, DWORD a_dwOpenSeconds);
+
+/*! callback for wininet_circuit_enum. a_nState is WININET_CIRCUIT_xxx and 
+    a_nOpened is the number of times the circuit was opened. */
+typedef void (*wininet_circuit_callback)(void * a_pContext, const char * a_pszHost, 
+    INTERNET_PORT a_nPort, int a_nState, unsigned long a_nOpened);
+
+/*! enumerate the circuit breaker state of all servers */
+extern void wininet_circuit_enum(wininet_circuit_callback a_pCallback, void * a_pContext);
+
+/*! error returned when a message is refused because the concurrency limit of
+    the server was reached */
+#define WININET_ERROR_LIMIT_EXCEEDED ((DWORD)0x20000002)
+
+/*! enable or disable the adaptive limit of messages in progress to each 
+    server, shared by all plugin instances in the process */
+extern int wininet_setconcurrencylimit(struct soap * soap, BOOL a_bEnable);
+
+/*! configure the concurrency limits of the process. Each server starts with 
+    a_nInitialLimit (default 8) and is never allowed more than a_nMaxLimit 
+    (default 256). Responses slower than a_dwLatencyLimit ms reduce the limit 
+    (0 = disabled, the default). Messages above the limit wait for up to 
+    a_dwQueueTimeout ms for a slot (default 0, refuse immediately). */
+extern void wininet_limiter_config(unsigned a_nInitialLimit, unsigned a_nMaxLimit, 
+    DWORD a_dwLatencyLimit, DWORD a_dwQueueTimeout);
+
+/*! callback for wininet_limiter_enum */
+typedef void (*wininet_limiter_callback)(void * a_pContext, const char * a_pszHost, 
+    INTERNET_PORT a_nPort, unsigned a_nLimit, unsigned a_nInFlight, unsigned a_nQueued, 
+    unsigned long a_nRejected);
+
+/*! enumerate the concurrency limit state of all servers */
+extern void wininet_limiter_enum(wininet_limiter_callback a_pCallback, void * a_pContext);
+
+/*! error returned when fewer than the required number of fan-out endpoints 
+    responded successfully */
+#define WININET_ERROR_QUORUM_FAILED ((DWORD)0x20000003)
+
+/*! callback for each fan-out response. a_dwError is 0 if a response was 
+    received, a_pResponse contains the response headers and body. */
+typedef void (*wininet_fanout_callback)(void * a_pContext, unsigned a_nIndex, 
+    const char * a_pszEndpoint, DWORD a_dwError, DWORD a_dwStatusCode, 
+    const char * a_pResponse, size_t a_uiResponseLen);
+
+/*! send each message to all of the endpoints concurrently instead of the 
+    endpoint of the soap call. The call succeeds and returns the first 
+    successful response once a_nRequired endpoints have responded with 200 
+    (0 = all of them) and the remaining requests are cancelled. Every 
+    response received is passed to a_pCallback. Set a_nCount to 0 to disable.
+    Only enable this for idempotent operations. The requests bypass the 
+    circuit breaker, concurrency limiter and credential cache, and 
+    authentication challenges are not answered. */
+extern int wininet_setfanout(struct soap * soap, const char * const * a_ppszEndpoints, 
+    unsigned a_nCount, unsigned a_nRequired, wininet_fanout_callback a_pCallback, void * a_pContext);
+
+/*! connect to an endpoint now so that the first call to it doesn't need to 
+    resolve the name, connect or negotiate TLS. The connection is kept for the 
+    plugin instance. */
+extern int wininet_prewarm(struct soap * soap, const char * a_pszEndpoint);
+
+/*! connect to an endpoint in the background (see wininet_prewarm). Returns 
+    immediately. */
+extern int wininet_prewarm_async(struct soap * soap, const char * a_pszEndpoint);
+
+/*! proxy decisions returned by a wininet_proxy_resolver */
+#define WININET_PROXY_DEFAULT   0   /*!< use the system settings */
+#define WININET_PROXY_DIRECT    1   /*!< connect directly */
+#define WININET_PROXY_NAMED     2   /*!< use the proxy list returned in a_pszProxy */
+
+/*! find the proxy for a URL, returning WININET_PROXY_xxx */
+typedef int (*wininet_proxy_resolver)(void * a_pContext, const char * a_pszUrl, 
+    char * a_pszProxy, size_t a_uiProxyLen);
+
+/*! enable or disable the process wide cache of the proxy to use for each 
+    server. When disabled the system settings are used for each connection. */
+extern int wininet_setproxycache(struct soap * soap, BOOL a_bEnable);
+
+/*! set how long proxy decisions are used before they are refreshed in the
+    background (0 = for the lifetime of the process). The default is 300. */
+extern void wininet_proxy_cache_config(DWORD a_dwTtlSeconds);
+
+/*! replace the function used to find the proxy for a URL. Set a_pResolver to
+    NULL to use the OS automatic proxy settings again. */
+extern void wininet_set_proxy_resolver(wininet_proxy_resolver a_pResolver, void * a_pContext);
+
+/*! set the maximum number of connections that WinInet makes to each server 
+    for the process. Returns FALSE on failure. */
+extern BOOL wininet_setmaxconns(DWORD a_dwMaxConns);
+
+/*! get the maximum number of connections that WinInet makes to each server */
+extern DWORD wininet_getmaxconns(void);
+
+/*! raise the connections per server by 2 (up to a_dwMaxConns) each time 
+    that 8 sends have waited more than a_dwWaitThreshold ms for a connection.
+    Set a_dwMaxConns to 0 to disable. */
+extern void wininet_conns_autotune(DWORD a_dwMaxConns, DWORD a_dwWaitThreshold);
+
+/*! replace the plugin's connection handles when gSOAP polls a connection 
+    that has been idle for more than a_dwIdleTimeout ms. WinInet's pooled 
+    socket isn't closed, see "Idle connections". Set to 0 (the default) to 
+    always reuse them. */
+extern int wininet_setidletimeout(struct soap * soap, DWORD a_dwIdleTimeout);
+
+/*! set the constant headers sent with each message to an endpoint (or to all 
+    endpoints without their own template if a_pszEndpoint is NULL). The 
+    headers are lines of "Key: value" and replace any headers of the same 
+    name from gsoap. Content-Length, Transfer-Encoding and SOAPAction can't 
+    be included. 
+    Set a_pszHeaders to NULL to remove the template. */
+extern int wininet_setheadertemplate(struct soap * soap, const char * a_pszEndpoint, 
+    const char * a_pszHeaders);
+
+/*! enable or disable sending a W3C traceparent header with each message */
+extern int wininet_settracing(struct soap * soap, BOOL a_bEnable);
+
+/*! set the traceparent of the caller's context, following messages are sent 
+    as children of it. Set to NULL to start a new trace for each message. 
+    Returns SOAP_ERR if the value isn't a valid traceparent. */
+extern int wininet_settraceparent(struct soap * soap, const char * a_pszTraceParent);
+
+/*! get the traceparent sent with the current or last message, or an empty 
+    string if tracing is disabled */
+extern const char * wininet_gettraceparent(struct soap * soap);
+
+/*! statistics collected by the plugin */
+struct wininet_stats {
+    unsigned long nRequests;        /*!< requests sent (including retries) */
+    unsigned long nHedged;          /*!< hedged requests sent */
+    unsigned long nHedgeWins;       /*!< hedged requests that responded first */
+    unsigned long nAuthPreemptive;  /*!< requests sent with cached credentials */
+    unsigned long nAuthSaved;       /*!< challenge round trips avoided by cached credentials */
+    unsigned long nAuthRejected;    /*!< cached credentials rejected by the server or proxy */
+    unsigned long nExpectContinue;  /*!< requests sent with Expect: 100-continue */
+    unsigned long nExpectRejected;  /*!< uploads stopped early by the server */
+    unsigned long nRedirectsFollowed; /*!< redirect responses followed */
+    unsigned long nRedirectHits;    /*!< connections made directly to a cached redirect target */
+    unsigned long nCacheHits;       /*!< responses returned from the response cache */
+    unsigned long nCacheMisses;     /*!< cacheable messages that were not in the response cache */
+    unsigned long nRevalidated;     /*!< conditional requests sent for expired cached responses */
+    unsigned long nNotModified;     /*!< cached responses confirmed as unchanged by the server */
+    unsigned long nCoalesced;       /*!< responses copied from an identical request in progress */
+    unsigned long nFailovers;       /*!< messages resent to another endpoint */
+    unsigned long nCircuitOpened;   /*!< circuits opened by the results of our messages */
+    unsigned long nCircuitClosed;   /*!< circuits closed by a successful trial message */
+    unsigned long nCircuitRejected; /*!< messages refused because the circuit was open */
+    unsigned long nLimitQueued;     /*!< messages that waited for the concurrency limit */
+    unsigned long nLimitRejected;   /*!< messages refused by the concurrency limit */
+    unsigned long nFanouts;         /*!< messages sent to fan-out endpoints that reached the quorum */
+    unsigned long nPrewarmed;       /*!< connections established by wininet_prewarm */
+    unsigned long nProxyResolved;   /*!< proxy decisions made before connecting */
+    unsigned long nProxyResolveMs;  /*!< time spent making those decisions in ms */
+    unsigned long nProxyHits;       /*!< connections that used a cached proxy decision */
+    unsigned long nSlotWaitMs;      /*!< time sends waited for WinInet to provide a connection */
+    unsigned long nNetworkMs;       /*!< time sends spent connecting, sending and waiting for the response */
+    unsigned long nIdleClosed;      /*!< connections closed because they had been idle too long */
+    unsigned long nStaleRetries;    /*!< messages resent because the server had closed the connection */
+};
+
+/*! retrieve the statistics collected since the plugin was registered */
+extern int wininet_getstats(struct soap * soap, struct wininet_stats * a_pStats);
+
 #ifdef __cplusplus
 }
 #endif 
@@ -0,0 +1,71 @@
+/*
+    The cost of request headers. The same message is sent with a growing
+    number of extra headers, which the plugin collects from gSOAP one at a
+    time and submits to WinInet when the header block is complete.
+*/
+#include "harness.h"
+
+#define CALLS           2000
+#define MAX_HEADERS     64
+
+/* print the time per call with a_nHeaders extra headers */
+static void
+bench_headers(
+    struct soap *       soap,
+    struct standin *    a_pServer,
+    const char *        a_pMsg,
+    int                 a_nHeaders
+    )
+{
+    char    szHeaders[MAX_HEADERS * 48];
+    size_t  nLen = 0;
+    double  dStart, dElapsed;
+    int     n;
+
+    szHeaders[0] = 0;
+    for (n = 0; n < a_nHeaders; ++n) {
+        nLen += _snprintf(szHeaders + nLen, sizeof(szHeaders) - nLen, 
+            "%sX-Bench-Header-%02d: value-%02d-0123456789", n ? "\r\n" : "", n, n);
+    }
+
+    dStart = harness_now_us();
+    for (n = 0; n < CALLS; ++n) {
+        /* gSOAP clears the extra headers once they are sent */
+        soap->http_extra_header = a_nHeaders ? szHeaders : NULL;
+        CHECK(harness_post(soap, a_pServer->szUrl, "urn:standin#ping", 
+            a_pMsg, strlen(a_pMsg)) == SOAP_OK);
+    }
+    dElapsed = harness_now_us() - dStart;
+
+    printf("  %3d extra headers  %8.1f us/call\n", a_nHeaders, dElapsed / CALLS);
+}
+
+int
+main(void)
+{
+    struct standin server;
+    struct soap * soap;
+    char *  pMsg;
+    int     nHeaders;
+
+    if (!standin_start(&server)) {
+        printf("bench_headers: can't start the stand-in server\n");
+        return 1;
+    }
+    soap = harness_client(wininet_register);
+    pMsg = harness_message(512);
+    if (!soap || !pMsg) return 1;
+
+    /* open the connection before the first run */
+    CHECK(harness_post(soap, server.szUrl, "urn:standin#ping", pMsg, strlen(pMsg)) == SOAP_OK);
+
+    printf("bench_headers: %d calls per run\n", CALLS);
+    for (nHeaders = 0; nHeaders <= MAX_HEADERS; nHeaders = nHeaders ? nHeaders * 2 : 1) {
+        bench_headers(soap, &server, pMsg, nHeaders);
+    }
+
+    free(pMsg);
+    harness_free(soap);
+    standin_stop(&server);
+    return harness_result("bench_headers");
+}
@@ -0,0 +1,77 @@
+/*
+    Hex dump speed (wininet_log_data_hex) against the byte at a time 
+    formatter it replaced, which wrote each line to the log file. Both write
+    to NUL so that the disk isn't measured. The formatting alone is also
+    timed for the reference, writing to memory.
+
+    The plugin source is included to call its log functions directly.
+*/
+#include "harness.h"
+#include "../gsoapWinInet.cpp"
+#include "hexref.h"
+
+#define DUMP_SIZE       (256 * 1024)
+#define ITERATIONS      40
+
+int
+main(void)
+{
+    struct soap * soap;
+    struct wininet_data * pData;
+    unsigned char * pBuf;
+    char *  pOut;
+    FILE *  hNul;
+    double  dStart, dFile, dMemory, dPlugin;
+    double  dMB = (double) DUMP_SIZE * ITERATIONS / (1024.0 * 1024.0);
+    size_t  n;
+    int     i;
+
+    soap = harness_client(wininet_register);
+    pBuf = (unsigned char *) malloc(DUMP_SIZE);
+    pOut = (char *) malloc((DUMP_SIZE / 24 + 1) * 114);
+    hNul = fopen("NUL", "w");
+    CHECK(soap && pBuf && pOut && hNul);
+    if (!soap || !pBuf || !pOut || !hNul) return harness_result("bench_hexdump");
+    for (n = 0; n < DUMP_SIZE; ++n) {
+        pBuf[n] = (unsigned char) (n * 131 + n / 251);
+    }
+
+    dStart = harness_now_us();
+    for (i = 0; i < ITERATIONS; ++i) {
+        reference_hex(hNul, NULL, pBuf, DUMP_SIZE);
+    }
+    fflush(hNul);
+    dFile = harness_now_us() - dStart;
+
+    dStart = harness_now_us();
+    for (i = 0; i < ITERATIONS; ++i) {
+        reference_hex(NULL, pOut, pBuf, DUMP_SIZE);
+    }
+    dMemory = harness_now_us() - dStart;
+
+    CHECK(wininet_setlog(soap, "NUL") == SOAP_OK);
+    CHECK(wininet_setloglevel(soap, WININET_LOG_BODY) == SOAP_OK);
+    pData = (struct wininet_data *) soap_lookup_plugin(soap, wininet_id);
+    dStart = harness_now_us();
+    for (i = 0; i < ITERATIONS; ++i) {
+        wininet_log_data_hex(pData, pBuf, DUMP_SIZE);
+        wininet_log_commit(pData);
+    }
+    wininet_flushlog();
+    dPlugin = harness_now_us() - dStart;
+
+    printf("bench_hexdump: %d dumps of %d KB\n", ITERATIONS, DUMP_SIZE / 1024);
+    printf("  reference, fwrite per line  %8.1f MB/s\n", dMB * 1000000.0 / dFile);
+    printf("  reference, to memory        %8.1f MB/s\n", dMB * 1000000.0 / dMemory);
+#ifdef WININET_HEX_SSE2
+    printf("  plugin (SSE2), to the log   %8.1f MB/s\n", dMB * 1000000.0 / dPlugin);
+#else
+    printf("  plugin, to the log          %8.1f MB/s\n", dMB * 1000000.0 / dPlugin);
+#endif
+
+    fclose(hNul);
+    free(pBuf);
+    free(pOut);
+    harness_free(soap);
+    return harness_result("bench_hexdump");
+}
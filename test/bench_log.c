@@ -0,0 +1,176 @@
+/*
+    Logging cost with many threads sharing one log file. The plugin's log
+    (records per instance, a writer thread per file) is compared with the
+    previous scheme of fprintf and fflush for every line. Afterwards the
+    plugin's log is checked for lost and interleaved lines.
+
+    The plugin source is included to call its log functions directly.
+*/
+#include "harness.h"
+#include "../gsoapWinInet.cpp"
+
+#include <process.h>
+#include <sys/timeb.h>
+#include <time.h>
+
+#define THREADS         8
+#define LINES           20000   /* per thread */
+#define LINES_PER_CALL  20      /* lines logged during one soap call */
+
+struct bench_thread
+{
+    struct soap *   soap;
+    FILE *          hFile;      /* the previous scheme if set */
+    int             nThread;
+};
+
+/* a log line the way it was written before, see the baseline commit */
+static void
+bench_log_fprintf(
+    FILE *          a_hFile,
+    const void *    a_pData,
+    const char *    a_pFormat,
+    ...
+    )
+{
+    va_list args;
+    struct timeb tb;
+    struct tm * ptm;
+
+    va_start(args, a_pFormat);
+    ftime(&tb);
+    ptm = localtime(&tb.time);
+    fprintf(a_hFile, "%02u/%02u %02u:%02u:%02u.%03u %p ",
+        ptm->tm_mon + 1, ptm->tm_mday,
+        ptm->tm_hour, ptm->tm_min, ptm->tm_sec, tb.millitm,
+        a_pData);
+    vfprintf(a_hFile, a_pFormat, args);
+    fputc('\n', a_hFile);
+    fflush(a_hFile);
+    va_end(args);
+}
+
+static unsigned __stdcall
+bench_thread_proc(
+    void * a_pArg
+    )
+{
+    struct bench_thread * pThread = (struct bench_thread *) a_pArg;
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(pThread->soap, wininet_id);
+    int n;
+
+    for (n = 0; n < LINES; ++n) {
+        if (pThread->hFile) {
+            bench_log_fprintf(pThread->hFile, pData, 
+                "bench: thread %d line %d status = %lu", pThread->nThread, n, 200UL);
+            continue;
+        }
+        WININET_LOG3(pData, "bench: thread %d line %d status = %lu", 
+            pThread->nThread, n, 200UL);
+        if (n % LINES_PER_CALL == LINES_PER_CALL - 1) {
+            wininet_log_commit(pData);
+        }
+    }
+    wininet_log_commit(pData);
+    return 0;
+}
+
+/* log from all threads and return the time taken in microseconds */
+static double
+bench_run(
+    struct soap **  a_apSoap,
+    FILE *          a_hFile
+    )
+{
+    struct bench_thread aThread[THREADS];
+    HANDLE  ahThread[THREADS];
+    double  dStart;
+    int     n;
+
+    dStart = harness_now_us();
+    for (n = 0; n < THREADS; ++n) {
+        aThread[n].soap = a_apSoap[n];
+        aThread[n].hFile = a_hFile;
+        aThread[n].nThread = n;
+        ahThread[n] = (HANDLE) _beginthreadex(NULL, 0, bench_thread_proc, &aThread[n], 0, NULL);
+        CHECK(ahThread[n] != NULL);
+    }
+    for (n = 0; n < THREADS; ++n) {
+        if (!ahThread[n]) continue;
+        WaitForSingleObject(ahThread[n], INFINITE);
+        CloseHandle(ahThread[n]);
+    }
+    wininet_flushlog();
+    return harness_now_us() - dStart;
+}
+
+/*  check that every line of every thread is in the log exactly once and that 
+    each thread's lines are in order and whole */
+static void
+bench_check_log(
+    const char *    a_pszPath
+    )
+{
+    static int anNext[THREADS];
+    char    szLine[512];
+    const char * pText;
+    FILE *  hFile = fopen(a_pszPath, "r");
+    int     nThread, nLine;
+    long    nBench = 0;
+
+    CHECK(hFile != NULL);
+    if (!hFile) return;
+    while (fgets(szLine, sizeof(szLine), hFile)) {
+        pText = strstr(szLine, "bench: ");
+        if (!pText) continue;
+        ++nBench;
+        CHECK(sscanf(pText, "bench: thread %d line %d", &nThread, &nLine) == 2);
+        CHECK(strstr(pText, "status = 200\n") != NULL);
+        CHECK(strstr(pText + 7, "bench: ") == NULL);
+        if (nThread < 0 || nThread >= THREADS) continue;
+        CHECK(nLine == anNext[nThread]);
+        anNext[nThread] = nLine + 1;
+    }
+    fclose(hFile);
+    CHECK(nBench == (long) THREADS * LINES);
+}
+
+int
+main(void)
+{
+    static const char szPath[] = "bench_log.log";
+    static const char szBasePath[] = "bench_log_fprintf.log";
+    struct soap * apSoap[THREADS];
+    FILE *  hBase;
+    double  dPlugin, dBase;
+    int     n;
+
+    remove(szPath);
+    for (n = 0; n < THREADS; ++n) {
+        apSoap[n] = harness_client(wininet_register);
+        CHECK(apSoap[n] != NULL);
+        if (!apSoap[n]) return harness_result("bench_log");
+        CHECK(wininet_setlog(apSoap[n], szPath) == SOAP_OK);
+        CHECK(wininet_setloglevel(apSoap[n], WININET_LOG_CALLS) == SOAP_OK);
+    }
+    hBase = fopen(szBasePath, "w");
+    CHECK(hBase != NULL);
+    if (!hBase) return harness_result("bench_log");
+
+    dBase = bench_run(apSoap, hBase);
+    dPlugin = bench_run(apSoap, NULL);
+    fclose(hBase);
+
+    printf("bench_log: %d threads logging %d lines each to one file\n", THREADS, LINES);
+    printf("  fprintf+fflush  %10.0f lines/s\n", THREADS * LINES * 1000000.0 / dBase);
+    printf("  plugin          %10.0f lines/s\n", THREADS * LINES * 1000000.0 / dPlugin);
+
+    for (n = 0; n < THREADS; ++n) {
+        harness_free(apSoap[n]);
+    }
+    bench_check_log(szPath);
+    remove(szPath);
+    remove(szBasePath);
+    return harness_result("bench_log");
+}
@@ -0,0 +1,72 @@
+/*
+    First call latency with and without wininet_prewarm. Every round uses a
+    new soap context so that the first call needs a new connection, unless
+    it was pre-warmed. Only the connection set up is saved on loopback, the
+    name resolution, proxy detection and TLS handshake that a real server
+    adds are not measured here.
+*/
+#include "harness.h"
+
+#define ROUNDS  50
+
+/*  the time of the first call on a new context in microseconds. The
+    connections opened for it are added to *a_pnConnections. */
+static double
+bench_first_call(
+    struct standin *    a_pServer,
+    const char *        a_pMsg,
+    BOOL                a_bPrewarm,
+    LONG *              a_pnConnections
+    )
+{
+    struct soap * soap = harness_client(wininet_register);
+    double  dStart, dElapsed;
+    LONG    nConnections;
+    int     rc;
+
+    if (!soap) return 0;
+    if (a_bPrewarm) {
+        CHECK(wininet_prewarm(soap, a_pServer->szUrl) == SOAP_OK);
+    }
+    nConnections = a_pServer->nConnections;
+    dStart = harness_now_us();
+    rc = harness_post(soap, a_pServer->szUrl, "urn:standin#ping", a_pMsg, strlen(a_pMsg));
+    dElapsed = harness_now_us() - dStart;
+    CHECK(rc == SOAP_OK);
+    *a_pnConnections += a_pServer->nConnections - nConnections;
+    harness_free(soap);
+    return dElapsed;
+}
+
+int
+main(void)
+{
+    struct standin server;
+    char *  pMsg;
+    double  dCold = 0, dWarm = 0;
+    LONG    nColdConns = 0, nWarmConns = 0;
+    int     n;
+
+    if (!standin_start(&server)) {
+        printf("bench_prewarm: can't start the stand-in server\n");
+        return 1;
+    }
+    pMsg = harness_message(512);
+    if (!pMsg) return 1;
+
+    /* alternate so that both see the same conditions */
+    for (n = 0; n < ROUNDS; ++n) {
+        dCold += bench_first_call(&server, pMsg, FALSE, &nColdConns);
+        dWarm += bench_first_call(&server, pMsg, TRUE, &nWarmConns);
+    }
+
+    printf("bench_prewarm: %d rounds, first call on a new context\n", ROUNDS);
+    printf("  cold       %8.1f us   %ld connections opened by the call\n",
+        dCold / ROUNDS, (long) nColdConns);
+    printf("  prewarmed  %8.1f us   %ld connections opened by the call\n",
+        dWarm / ROUNDS, (long) nWarmConns);
+
+    free(pMsg);
+    standin_stop(&server);
+    return harness_result("bench_prewarm");
+}
@@ -0,0 +1,78 @@
+/*
+    Start up cost of wininet_register, wininet_register_lazy and
+    wininet_register_background. Many contexts are created and registered
+    as a service would at start up, then only some of them make a call.
+*/
+#include "harness.h"
+
+#define CONTEXTS    64
+#define USED        8       /* contexts that make a call */
+
+typedef int (*bench_register)(struct soap *, struct soap_plugin *, void *);
+
+/* register, use and free the contexts, print the times unless a_pszName is NULL */
+static void
+bench_mode(
+    struct standin *    a_pServer,
+    const char *        a_pMsg,
+    const char *        a_pszName,
+    bench_register      a_pRegister
+    )
+{
+    struct soap * apSoap[CONTEXTS];
+    double  dStart, dRegister, dCalls = 0, dFree;
+    int     n;
+
+    dStart = harness_now_us();
+    for (n = 0; n < CONTEXTS; ++n) {
+        apSoap[n] = harness_client(a_pRegister);
+        CHECK(apSoap[n] != NULL);
+    }
+    dRegister = harness_now_us() - dStart;
+
+    for (n = 0; n < USED; ++n) {
+        if (!apSoap[n]) continue;
+        dStart = harness_now_us();
+        CHECK(harness_post(apSoap[n], a_pServer->szUrl, "urn:standin#ping", 
+            a_pMsg, strlen(a_pMsg)) == SOAP_OK);
+        dCalls += harness_now_us() - dStart;
+    }
+
+    dStart = harness_now_us();
+    for (n = 0; n < CONTEXTS; ++n) {
+        if (apSoap[n]) harness_free(apSoap[n]);
+    }
+    dFree = harness_now_us() - dStart;
+
+    if (a_pszName) {
+        printf("  %-11s %10.1f %10.1f %10.1f\n", a_pszName, 
+            dRegister / 1000.0, dCalls / USED / 1000.0, dFree / 1000.0);
+    }
+}
+
+int
+main(void)
+{
+    struct standin server;
+    char *  pMsg;
+
+    if (!standin_start(&server)) {
+        printf("bench_startup: can't start the stand-in server\n");
+        return 1;
+    }
+    pMsg = harness_message(512);
+    if (!pMsg) return 1;
+
+    /* load WinInet and its configuration before the first measurement */
+    bench_mode(&server, pMsg, NULL, wininet_register);
+
+    printf("bench_startup: %d contexts registered, %d of them used (ms)\n", CONTEXTS, USED);
+    printf("  %-11s %10s %10s %10s\n", "", "register", "1st call", "free");
+    bench_mode(&server, pMsg, "eager", wininet_register);
+    bench_mode(&server, pMsg, "lazy", wininet_register_lazy);
+    bench_mode(&server, pMsg, "background", wininet_register_background);
+
+    free(pMsg);
+    standin_stop(&server);
+    return harness_result("bench_startup");
+}
@@ -0,0 +1,116 @@
+/*
+    Throughput with many threads, each with its own soap context, calling the
+    stand-in server as fast as they can. Calls per second should grow with
+    the threads until the machine is saturated rather than flatten early on
+    state shared by the plugin instances.
+*/
+#include "harness.h"
+
+#include <process.h>
+
+#define MAX_THREADS     64
+#define DURATION_MS     2000
+
+struct bench_thread
+{
+    struct standin *    pServer;
+    const char *        pMsg;
+    volatile LONG *     pbStop;
+    LONG                nCalls;
+    LONG                nErrors;
+};
+
+static unsigned __stdcall
+bench_thread_proc(
+    void * a_pArg
+    )
+{
+    struct bench_thread * pThread = (struct bench_thread *) a_pArg;
+    struct soap * soap = harness_client(wininet_register);
+
+    if (!soap) {
+        ++pThread->nErrors;
+        return 0;
+    }
+    while (!*pThread->pbStop) {
+        if (harness_post(soap, pThread->pServer->szUrl, "urn:standin#ping", 
+            pThread->pMsg, strlen(pThread->pMsg)) == SOAP_OK) 
+        {
+            ++pThread->nCalls;
+        }
+        else {
+            ++pThread->nErrors;
+        }
+    }
+    harness_free(soap);
+    return 0;
+}
+
+/* run a_nThreads callers for DURATION_MS and print the calls per second */
+static void
+bench_threads(
+    struct standin *    a_pServer,
+    const char *        a_pMsg,
+    int                 a_nThreads
+    )
+{
+    struct bench_thread aThread[MAX_THREADS];
+    HANDLE  ahThread[MAX_THREADS];
+    volatile LONG bStop = FALSE;
+    LONG    nCalls = 0, nErrors = 0;
+    double  dStart, dElapsed;
+    int     n;
+
+    dStart = harness_now_us();
+    for (n = 0; n < a_nThreads; ++n) {
+        aThread[n].pServer = a_pServer;
+        aThread[n].pMsg = a_pMsg;
+        aThread[n].pbStop = &bStop;
+        aThread[n].nCalls = 0;
+        aThread[n].nErrors = 0;
+        ahThread[n] = (HANDLE) _beginthreadex(NULL, 0, bench_thread_proc, &aThread[n], 0, NULL);
+        CHECK(ahThread[n] != NULL);
+    }
+    Sleep(DURATION_MS);
+    InterlockedExchange(&bStop, TRUE);
+    for (n = 0; n < a_nThreads; ++n) {
+        if (!ahThread[n]) continue;
+        WaitForSingleObject(ahThread[n], INFINITE);
+        CloseHandle(ahThread[n]);
+        nCalls += aThread[n].nCalls;
+        nErrors += aThread[n].nErrors;
+    }
+    dElapsed = harness_now_us() - dStart;
+    CHECK(nErrors == 0);
+
+    printf("  %3d threads  %10.0f calls/s  %6.1f us/call  %ld errors\n", a_nThreads, 
+        nCalls * 1000000.0 / dElapsed, nCalls ? dElapsed * a_nThreads / nCalls : 0.0, 
+        (long) nErrors);
+}
+
+int
+main(void)
+{
+    struct standin server;
+    char *  pMsg;
+    int     nThreads;
+
+    if (!standin_start(&server)) {
+        printf("bench_threads: can't start the stand-in server\n");
+        return 1;
+    }
+    pMsg = harness_message(512);
+    if (!pMsg) return 1;
+
+    /* WinInet's default limit of connections per server would cap the runs */
+    CHECK(wininet_setmaxconns(MAX_THREADS));
+
+    printf("bench_threads: %d ms per run\n", DURATION_MS);
+    for (nThreads = 1; nThreads <= MAX_THREADS; nThreads *= 2) {
+        bench_threads(&server, pMsg, nThreads);
+    }
+
+    free(pMsg);
+    standin_stop(&server);
+    return harness_result("bench_threads");
+}
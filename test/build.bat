@@ -0,0 +1,23 @@
+@echo off
+rem Build the tests and benchmarks, see README.txt
+if "%GSOAP%"=="" (
+    echo Set GSOAP to the gSOAP directory that holds stdsoap2.c
+    exit /b 1
+)
+set CFLAGS=/nologo /O2 /W3 /DWITH_NONAMESPACES /I.. /I"%GSOAP%"
+set LIBS=ws2_32.lib wininet.lib
+rem programs that include the plugin source to reach its internals
+set WHITEBOX=bench_log test_hexdump bench_hexdump
+
+if not "%1"=="" (
+    call :build %1
+    exit /b %ERRORLEVEL%
+)
+for %%f in (test_*.c bench_*.c) do call :build %%~nf || exit /b 1
+exit /b 0
+
+:build
+set PLUGIN=..\gsoapWinInet.cpp
+for %%w in (%WHITEBOX%) do if /i "%%w"=="%1" set PLUGIN=
+cl %CFLAGS% %1.c standin.c %PLUGIN% "%GSOAP%\stdsoap2.c" %LIBS%
+exit /b %ERRORLEVEL%
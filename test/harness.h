@@ -0,0 +1,142 @@
+/*
+===============================================================================
+TEST HARNESS
+-------------------------------------------------------------------------------
+
+Shared helpers for the plugin's tests and benchmarks, see README.txt. Each
+test is a small program that returns 0 when all of its checks pass.
+
+===============================================================================
+*/
+#ifndef INCLUDED_harness_h
+#define INCLUDED_harness_h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "standin.h"
+
+#ifndef HARNESS_NO_PLUGIN
+#include "gsoapWinInet.h"
+#endif
+
+static int harness_failures = 0;
+
+/* report a failed check and carry on so that all failures are listed */
+#define CHECK(expr)                                                         \
+    do {                                                                    \
+        if (!(expr)) {                                                      \
+            printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #expr);\
+            ++harness_failures;                                             \
+        }                                                                   \
+    } while (0)
+
+/* print the result and return the exit code for main */
+static int
+harness_result(
+    const char *    a_pszTest
+    )
+{
+    printf("%s: %s\n", a_pszTest, harness_failures ? "FAILED" : "passed");
+    return harness_failures ? 1 : 0;
+}
+
+/* the time in microseconds from an arbitrary start */
+static double
+harness_now_us(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (double) now.QuadPart * 1000000.0 / (double) freq.QuadPart;
+}
+
+#ifndef HARNESS_NO_PLUGIN
+
+/* a soap context that uses the plugin, registered with a_pRegister */
+static struct soap *
+harness_client(
+    int (*a_pRegister)(struct soap *, struct soap_plugin *, void *)
+    )
+{
+    struct soap * soap = soap_new();
+
+    if (!soap) return NULL;
+    soap_register_plugin(soap, a_pRegister);
+    soap->connect_timeout = 10;
+    soap->send_timeout = 10;
+    soap->recv_timeout = 10;
+    return soap;
+}
+
+static void
+harness_free(
+    struct soap *   soap
+    )
+{
+    soap_destroy(soap);
+    soap_end(soap);
+    soap_free(soap);
+}
+
+/*  post a message and read the response body. Returns SOAP_OK or the gSOAP
+    error. The message is stored so that it is sent with a Content-Length,
+    as the plugin buffers it anyway. */
+static int
+harness_post(
+    struct soap *   soap,
+    const char *    a_pszEndpoint,
+    const char *    a_pszAction,
+    const char *    a_pBody,
+    size_t          a_nLen
+    )
+{
+    size_t nResponse = 0;
+
+    soap->http_content = "text/xml; charset=utf-8";
+    soap->omode = (soap->omode & ~SOAP_IO) | SOAP_IO_STORE;
+    if (soap_connect_command(soap, SOAP_POST_FILE, a_pszEndpoint, a_pszAction)
+        || soap_send_raw(soap, a_pBody, a_nLen)
+        || soap_end_send(soap)
+        || soap_begin_recv(soap)
+        || !soap_http_get_body(soap, &nResponse)
+        || soap_end_recv(soap))
+    {
+        int nError = soap->error ? soap->error : SOAP_NO_DATA;
+        soap_closesock(soap);
+        return nError;
+    }
+    return soap_closesock(soap);
+}
+
+/* a message of about a_nLen bytes for the stand-in server */
+static char *
+harness_message(
+    size_t          a_nLen
+    )
+{
+    static const char szHead[] =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+        "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+        "<SOAP-ENV:Body><ns:ping xmlns:ns=\"urn:standin\"><data>";
+    static const char szTail[] =
+        "</data></ns:ping></SOAP-ENV:Body></SOAP-ENV:Envelope>";
+    size_t nFill = a_nLen > sizeof(szHead) + sizeof(szTail)
+        ? a_nLen - (sizeof(szHead) - 1) - (sizeof(szTail) - 1) : 0;
+    char * pMsg = (char *) malloc(sizeof(szHead) + nFill + sizeof(szTail));
+
+    if (!pMsg) return NULL;
+    memcpy(pMsg, szHead, sizeof(szHead) - 1);
+    memset(pMsg + sizeof(szHead) - 1, 'x', nFill);
+    memcpy(pMsg + sizeof(szHead) - 1 + nFill, szTail, sizeof(szTail));
+    return pMsg;
+}
+
+#endif /* HARNESS_NO_PLUGIN */
+
+#endif /* INCLUDED_harness_h */
@@ -0,0 +1,68 @@
+/*
+===============================================================================
+REFERENCE HEX DUMP
+-------------------------------------------------------------------------------
+
+The hex dump formatter as it was before wininet_log_data_hex was rewritten,
+for test_hexdump and bench_hexdump to compare against. Keep it unchanged.
+
+===============================================================================
+*/
+#ifndef INCLUDED_hexref_h
+#define INCLUDED_hexref_h
+
+#include <stdio.h>
+#include <string.h>
+
+/*  the formatter from the baseline commit. The lines are written to a_hFile 
+    as before, or to a_pOut if a_hFile is NULL. Returns the length written. */
+static size_t
+reference_hex(
+    FILE *          a_hFile,
+    char *          a_pOut,
+    const void *    a_pBuf,
+    const size_t    a_nBufLen
+    )
+{
+#define cols        24
+#define linelen     (7 + cols*3 + cols/3 + 2 + cols + 2) /* offset + hex + space + space + ascii + LF NUL */
+
+    char line[linelen]; 
+    const unsigned char * pBuf = (const unsigned char *) a_pBuf;
+    const char hex[] = "0123456789abcdef";
+    size_t n, idx = 0, out = 0;
+
+    line[sizeof(line)-1] = 0;
+    line[sizeof(line)-2] = '\n';
+
+    while (idx < a_nBufLen) {
+        size_t count = idx + cols > a_nBufLen ? a_nBufLen - idx : cols;
+        memset(line, ' ', sizeof(line)-2);
+        for (n = 0; n < count; ++n) {
+            unsigned char ch = pBuf[idx+n];
+            line[0] = '0' + (char) ((idx / 10000) % 10);
+            line[1] = '0' + (char) ((idx / 1000) % 10);
+            line[2] = '0' + (char) ((idx / 100) % 10);
+            line[3] = '0' + (char) ((idx / 10) % 10);
+            line[4] = '0' + (char) ((idx / 1) % 10);
+            line[5] = ':';
+            line[7+n*3+0+n/8] = hex[ch >> 4];
+            line[7+n*3+1+n/8] = hex[ch & 0xF];
+            line[7+3+cols*3+2+n] = ch >= 32 && ch < 127 ? ch : '.';
+        }
+        idx += count;
+        if (a_hFile) {
+            fwrite(line, 1, sizeof(line)-1, a_hFile);
+        }
+        else {
+            memcpy(a_pOut + out, line, sizeof(line)-1);
+        }
+        out += sizeof(line)-1;
+    }
+    return out;
+
+#undef linelen
+#undef cols
+}
+
+#endif /* INCLUDED_hexref_h */
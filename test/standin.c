@@ -0,0 +1,306 @@
+/*
+===============================================================================
+LOOPBACK STAND-IN SERVER, see standin.h
+===============================================================================
+*/
+#include "standin.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <process.h>
+
+#pragma comment(lib, "ws2_32.lib")
+
+#define STANDIN_HEADERS_MAX     16384   /* largest request header block */
+
+static const char standin_response[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+    "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://schemas.xmlsoap.org/soap/envelope/\">"
+    "<SOAP-ENV:Body><ns:pingResponse xmlns:ns=\"urn:standin\"><ok>true</ok>"
+    "</ns:pingResponse></SOAP-ENV:Body></SOAP-ENV:Envelope>";
+
+/* a connection being served */
+struct standin_conn
+{
+    struct standin *    pServer;
+    SOCKET              s;
+};
+
+/* take one from a counter of following requests, -1 means all of them */
+static BOOL
+standin_take(
+    volatile LONG * a_pnCount
+    )
+{
+    LONG n;
+
+    do {
+        n = *a_pnCount;
+        if (n == 0) return FALSE;
+        if (n < 0) return TRUE;
+    }
+    while (InterlockedCompareExchange(a_pnCount, n - 1, n) != n);
+    return TRUE;
+}
+
+static BOOL
+standin_send(
+    SOCKET          a_s,
+    const char *    a_pBuf,
+    size_t          a_nLen
+    )
+{
+    int nSent;
+
+    while (a_nLen > 0) {
+        nSent = send(a_s, a_pBuf, (int) a_nLen, 0);
+        if (nSent <= 0) return FALSE;
+        a_pBuf += nSent;
+        a_nLen -= nSent;
+    }
+    return TRUE;
+}
+
+/*  find a header in the header block and return its value, or NULL. The
+    block is NUL terminated. */
+static const char *
+standin_header(
+    const char *    a_pHeaders,
+    const char *    a_pszName
+    )
+{
+    size_t nLen = strlen(a_pszName);
+    const char * pLine;
+
+    for (pLine = strstr(a_pHeaders, "\r\n"); pLine; pLine = strstr(pLine, "\r\n")) {
+        pLine += 2;
+        if (!_strnicmp(pLine, a_pszName, nLen) && pLine[nLen] == ':') {
+            pLine += nLen + 1;
+            while (*pLine == ' ') ++pLine;
+            return pLine;
+        }
+    }
+    return NULL;
+}
+
+/*  answer a request with a status and no body. Returns FALSE if the
+    connection is to be closed. */
+static BOOL
+standin_reply_status(
+    SOCKET      a_s,
+    int         a_nStatus,
+    BOOL        a_bClose
+    )
+{
+    char szReply[256];
+    int nLen;
+
+    nLen = _snprintf(szReply, sizeof(szReply),
+        "HTTP/1.1 %d %s\r\n"
+        "%s"
+        "Content-Length: 0\r\n"
+        "Connection: %s\r\n\r\n",
+        a_nStatus, a_nStatus == 401 ? "Unauthorized" : "Rejected",
+        a_nStatus == 401 ? "WWW-Authenticate: Basic realm=\"standin\"\r\n" : "",
+        a_bClose ? "close" : "keep-alive");
+    return standin_send(a_s, szReply, nLen) && !a_bClose;
+}
+
+/* serve the requests of one connection until the client closes it */
+static unsigned __stdcall
+standin_conn_thread(
+    void * a_pArg
+    )
+{
+    struct standin_conn * pConn = (struct standin_conn *) a_pArg;
+    struct standin * pServer = pConn->pServer;
+    char *      pBuf;
+    char *      pEnd;
+    const char * pValue;
+    char        szHeader[256];
+    size_t      nHave = 0;
+    size_t      nHeaders;
+    size_t      nBody;
+    size_t      nTake;
+    BOOL        bExpect;
+    BOOL        bHead;
+    int         nStatus;
+    int         nRead;
+    int         nLen;
+
+    pBuf = (char *) malloc(STANDIN_HEADERS_MAX + 1);
+    while (pBuf) {
+        /* read a complete header block */
+        pBuf[nHave] = 0;
+        while (!(pEnd = strstr(pBuf, "\r\n\r\n"))) {
+            if (nHave == STANDIN_HEADERS_MAX) goto done;
+            nRead = recv(pConn->s, pBuf + nHave, (int) (STANDIN_HEADERS_MAX - nHave), 0);
+            if (nRead <= 0) goto done;
+            nHave += nRead;
+            pBuf[nHave] = 0;
+        }
+        nHeaders = pEnd + 4 - pBuf;
+        pEnd[2] = 0;
+
+        InterlockedIncrement(&pServer->nRequests);
+        bHead = !strncmp(pBuf, "HEAD ", 5);
+        pValue = standin_header(pBuf, "Content-Length");
+        nBody = pValue ? (size_t) strtoul(pValue, NULL, 10) : 0;
+        pValue = standin_header(pBuf, "Expect");
+        bExpect = pValue && !_strnicmp(pValue, "100-continue", 12);
+        if (bExpect) {
+            InterlockedIncrement(&pServer->nExpect);
+        }
+
+        /*  a request that is refused before its body is answered at once,
+            and the connection closed if the body wasn't sent */
+        nStatus = 0;
+        if (standin_take(&pServer->nChallenge)) {
+            nStatus = 401;
+        }
+        else if (pServer->nRejectStatus) {
+            nStatus = pServer->nRejectStatus;
+        }
+        if (nStatus && bExpect) {
+            standin_reply_status(pConn->s, nStatus, TRUE);
+            goto done;
+        }
+        if (bExpect && !standin_send(pConn->s, "HTTP/1.1 100 Continue\r\n\r\n", 25)) {
+            goto done;
+        }
+
+        /* read the body, some of it may already be in the buffer */
+        nHave -= nHeaders;
+        memmove(pBuf, pBuf + nHeaders, nHave);
+        nTake = nHave < nBody ? nHave : nBody;
+        InterlockedExchangeAdd(&pServer->nBodyBytes, (LONG) nTake);
+        nHave -= nTake;
+        memmove(pBuf, pBuf + nTake, nHave);
+        nBody -= nTake;
+        while (nBody > 0) {
+            nRead = recv(pConn->s, pBuf, (int) (nBody < STANDIN_HEADERS_MAX ? nBody : STANDIN_HEADERS_MAX), 0);
+            if (nRead <= 0) goto done;
+            InterlockedExchangeAdd(&pServer->nBodyBytes, nRead);
+            nBody -= nRead;
+        }
+
+        if (nStatus) {
+            if (!standin_reply_status(pConn->s, nStatus, FALSE)) goto done;
+            continue;
+        }
+
+        if (standin_take(&pServer->nDelayNext)) {
+            Sleep(pServer->dwDelayMs);
+        }
+        nLen = _snprintf(szHeader, sizeof(szHeader),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/xml; charset=utf-8\r\n"
+            "Content-Length: %u\r\n\r\n",
+            (unsigned) (sizeof(standin_response) - 1));
+        if (!standin_send(pConn->s, szHeader, nLen)
+            || (!bHead && !standin_send(pConn->s, standin_response, sizeof(standin_response) - 1)))
+        {
+            goto done;
+        }
+    }
+
+done:
+    free(pBuf);
+    closesocket(pConn->s);
+    free(pConn);
+    return 0;
+}
+
+static unsigned __stdcall
+standin_listen_thread(
+    void * a_pArg
+    )
+{
+    struct standin * pServer = (struct standin *) a_pArg;
+    struct standin_conn * pConn;
+    HANDLE hThread;
+    SOCKET s;
+    int nNoDelay = 1;
+
+    while (!pServer->bStop) {
+        s = accept(pServer->sListen, NULL, NULL);
+        if (s == INVALID_SOCKET) break;
+        InterlockedIncrement(&pServer->nConnections);
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char *) &nNoDelay, sizeof(nNoDelay));
+
+        pConn = (struct standin_conn *) malloc(sizeof(struct standin_conn));
+        hThread = NULL;
+        if (pConn) {
+            pConn->pServer = pServer;
+            pConn->s = s;
+            hThread = (HANDLE) _beginthreadex(NULL, 0, standin_conn_thread, pConn, 0, NULL);
+        }
+        if (hThread) {
+            CloseHandle(hThread);
+        }
+        else {
+            free(pConn);
+            closesocket(s);
+        }
+    }
+    return 0;
+}
+
+extern BOOL
+standin_start(
+    struct standin * a_pServer
+    )
+{
+    WSADATA wsaData;
+    struct sockaddr_in addr;
+    int nAddrLen = sizeof(addr);
+
+    memset(a_pServer, 0, sizeof(*a_pServer));
+    a_pServer->sListen = INVALID_SOCKET;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    a_pServer->sListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (a_pServer->sListen == INVALID_SOCKET
+        || bind(a_pServer->sListen, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || getsockname(a_pServer->sListen, (struct sockaddr *) &addr, &nAddrLen) != 0
+        || listen(a_pServer->sListen, SOMAXCONN) != 0)
+    {
+        standin_stop(a_pServer);
+        return FALSE;
+    }
+    _snprintf(a_pServer->szUrl, sizeof(a_pServer->szUrl),
+        "http://127.0.0.1:%u/service", (unsigned) ntohs(addr.sin_port));
+
+    a_pServer->hThread = (HANDLE) _beginthreadex(NULL, 0,
+        standin_listen_thread, a_pServer, 0, NULL);
+    if (!a_pServer->hThread) {
+        standin_stop(a_pServer);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+extern void
+standin_stop(
+    struct standin * a_pServer
+    )
+{
+    InterlockedExchange(&a_pServer->bStop, TRUE);
+    if (a_pServer->sListen != INVALID_SOCKET) {
+        closesocket(a_pServer->sListen);
+        a_pServer->sListen = INVALID_SOCKET;
+    }
+    if (a_pServer->hThread) {
+        WaitForSingleObject(a_pServer->hThread, INFINITE);
+        CloseHandle(a_pServer->hThread);
+        a_pServer->hThread = NULL;
+    }
+    WSACleanup();
+}
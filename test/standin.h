@@ -0,0 +1,62 @@
+/*
+===============================================================================
+LOOPBACK STAND-IN SERVER
+-------------------------------------------------------------------------------
+
+A minimal HTTP/1.1 server on 127.0.0.1 for the plugin's tests and benchmarks.
+It answers every request with a small SOAP response on a kept-alive
+connection, and its behaviour can be changed while it runs to inject delays,
+reject uploads and count what it received. Each connection is served by its
+own thread. Only what the tests need is implemented.
+
+     struct standin server;
+     standin_start( &server );
+     server.nDelayNext = 1;      // delay the next request by dwDelayMs
+     ... call server.szUrl ...
+     standin_stop( &server );
+
+===============================================================================
+*/
+#ifndef INCLUDED_standin_h
+#define INCLUDED_standin_h
+
+#include <winsock2.h>
+#include <windows.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct standin
+{
+    /* behaviour, may be changed while the server runs */
+    volatile DWORD  dwDelayMs;          /* delay before a delayed response */
+    volatile LONG   nDelayNext;         /* number of following requests to delay, -1 for all */
+    volatile LONG   nRejectStatus;      /* status to reject uploads with, e.g. 413, 0 to accept */
+    volatile LONG   nChallenge;         /* number of following requests to answer with 401 */
+
+    /* what was received */
+    volatile LONG   nConnections;       /* connections accepted */
+    volatile LONG   nRequests;          /* requests received */
+    volatile LONG   nExpect;            /* requests sent with Expect: 100-continue */
+    volatile LONG   nBodyBytes;         /* request body bytes received */
+
+    /* set by standin_start */
+    char            szUrl[64];          /* http://127.0.0.1:port/service */
+    SOCKET          sListen;
+    HANDLE          hThread;
+    volatile LONG   bStop;
+};
+
+/*! start the server on an ephemeral port. Returns FALSE on failure. */
+extern BOOL standin_start(struct standin * a_pServer);
+
+/*! stop the server, waiting for its listening thread. Connections that are
+    still open are closed by their threads when the client closes them. */
+extern void standin_stop(struct standin * a_pServer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* INCLUDED_standin_h */
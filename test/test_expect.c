@@ -0,0 +1,77 @@
+/*
+    Expect: 100-continue (wininet_setexpectcontinue). Large messages are only
+    uploaded once the stand-in server has agreed to take them, so a rejected
+    or challenged message costs no upload. Smaller messages are sent as
+    before.
+*/
+#include "harness.h"
+
+#define LARGE_MESSAGE   (64 * 1024)
+#define THRESHOLD       (16 * 1024)
+
+int
+main(void)
+{
+    struct standin server;
+    struct wininet_stats stats;
+    struct soap * soap;
+    char *  pLarge;
+    char *  pSmall;
+    size_t  nLarge;
+    int     rc;
+
+    if (!standin_start(&server)) {
+        printf("test_expect: can't start the stand-in server\n");
+        return 1;
+    }
+    soap = harness_client(wininet_register);
+    pLarge = harness_message(LARGE_MESSAGE);
+    pSmall = harness_message(512);
+    CHECK(soap && pLarge && pSmall);
+    if (!soap || !pLarge || !pSmall) return harness_result("test_expect");
+    nLarge = strlen(pLarge);
+    CHECK(wininet_setexpectcontinue(soap, THRESHOLD) == SOAP_OK);
+
+    /* accepted: the body is sent once after the 100 Continue */
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pLarge, nLarge);
+    CHECK(rc == SOAP_OK);
+    CHECK(server.nExpect == 1);
+    CHECK(server.nBodyBytes == (LONG) nLarge);
+
+    /* rejected: the server refuses the upload before any of the body is sent */
+    server.nRejectStatus = 413;
+    server.nBodyBytes = 0;
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pLarge, nLarge);
+    CHECK(rc == 413);
+    CHECK(server.nExpect == 2);
+    CHECK(server.nBodyBytes == 0);
+    server.nRejectStatus = 0;
+
+    /* challenged: without credentials the 401 ends the call, still no upload */
+    server.nChallenge = 1;
+    server.nBodyBytes = 0;
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pLarge, nLarge);
+    CHECK(rc == 401);
+    CHECK(server.nExpect == 3);
+    CHECK(server.nBodyBytes == 0);
+
+    /* below the threshold nothing changes */
+    server.nBodyBytes = 0;
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pSmall, strlen(pSmall));
+    CHECK(rc == SOAP_OK);
+    CHECK(server.nExpect == 3);
+    CHECK(server.nBodyBytes == (LONG) strlen(pSmall));
+
+    CHECK(wininet_getstats(soap, &stats) == SOAP_OK);
+    CHECK(stats.nExpectContinue == 3);
+    /*  whether the refusals count as stopped uploads depends on how much of
+        the body WinInet had buffered before the server closed the connection,
+        so they are only reported */
+    printf("test_expect: %lu of 2 refused uploads stopped early\n", stats.nExpectRejected);
+
+    free(pLarge);
+    free(pSmall);
+    harness_free(soap);
+    standin_stop(&server);
+    return harness_result("test_expect");
+}
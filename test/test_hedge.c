@@ -0,0 +1,76 @@
+/*
+    Hedged requests (wininet_sethedging). Once enough response times have
+    been recorded, a request that the stand-in server holds back is sent
+    again on a second connection and the duplicate's response is used long
+    before the delayed one arrives.
+*/
+#include "harness.h"
+
+#define WARMUP_CALLS    20      /* more than WININET_HEDGE_MIN_SAMPLES */
+#define SERVER_DELAY    2000    /* ms the first request is held back */
+#define MIN_DELAY       50      /* ms before hedging at the earliest */
+
+int
+main(void)
+{
+    struct standin server;
+    struct wininet_stats stats;
+    struct soap * soap;
+    char *  pMsg;
+    double  dStart;
+    double  dElapsedMs;
+    LONG    nRequests;
+    int     rc;
+    int     n;
+
+    if (!standin_start(&server)) {
+        printf("test_hedge: can't start the stand-in server\n");
+        return 1;
+    }
+    soap = harness_client(wininet_register);
+    pMsg = harness_message(512);
+    CHECK(soap && pMsg);
+    if (!soap || !pMsg) return harness_result("test_hedge");
+    CHECK(wininet_sethedging(soap, 95, MIN_DELAY) == SOAP_OK);
+
+    /* fast calls to learn the response times, none of them are hedged */
+    for (n = 0; n < WARMUP_CALLS; ++n) {
+        rc = harness_post(soap, server.szUrl, "urn:standin#ping", pMsg, strlen(pMsg));
+        CHECK(rc == SOAP_OK);
+    }
+    CHECK(wininet_getstats(soap, &stats) == SOAP_OK);
+    CHECK(stats.nHedged == 0);
+    CHECK(server.nRequests == WARMUP_CALLS);
+
+    /* the next request is held back, the hedged duplicate answers first */
+    server.dwDelayMs = SERVER_DELAY;
+    server.nDelayNext = 1;
+    nRequests = server.nRequests;
+    dStart = harness_now_us();
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pMsg, strlen(pMsg));
+    dElapsedMs = (harness_now_us() - dStart) / 1000.0;
+    CHECK(rc == SOAP_OK);
+    CHECK(dElapsedMs < SERVER_DELAY / 2);
+    CHECK(server.nRequests == nRequests + 2);
+    CHECK(wininet_getstats(soap, &stats) == SOAP_OK);
+    CHECK(stats.nHedged == 1);
+    CHECK(stats.nHedgeWins == 1);
+    printf("test_hedge: delayed call answered in %.1f ms\n", dElapsedMs);
+
+    /* disabled again, the delay is waited out */
+    CHECK(wininet_sethedging(soap, 0, 0) == SOAP_OK);
+    server.dwDelayMs = 200;
+    server.nDelayNext = 1;
+    dStart = harness_now_us();
+    rc = harness_post(soap, server.szUrl, "urn:standin#ping", pMsg, strlen(pMsg));
+    dElapsedMs = (harness_now_us() - dStart) / 1000.0;
+    CHECK(rc == SOAP_OK);
+    CHECK(dElapsedMs >= 150);
+    CHECK(wininet_getstats(soap, &stats) == SOAP_OK);
+    CHECK(stats.nHedged == 1);
+
+    free(pMsg);
+    harness_free(soap);
+    standin_stop(&server);
+    return harness_result("test_hedge");
+}
@@ -0,0 +1,143 @@
+/*
+    Hex dumps (wininet_log_data_hex) compared with the byte at a time
+    formatter they replaced. Every byte value is dumped, including 0x7F and
+    the high bytes, in lengths that end with partial lines, from unaligned
+    buffers and past the offsets 0x10000 and 100000 where the 5 digit
+    offset wraps. A few lines are also checked against literal output.
+
+    The plugin source is included to call its log functions directly.
+*/
+#include "harness.h"
+#include "../gsoapWinInet.cpp"
+#include "hexref.h"
+
+#define HEX_LOG         "test_hexdump.log"
+#define HEX_LINE_LEN    114     /* including the LF */
+#define HEX_MAX         (100000 + 4 * 24 + 5)
+
+/*  dump a buffer through the plugin's log and return the hex dump lines that 
+    were written, without the log's other lines. Returns the length. */
+static size_t
+plugin_hex(
+    struct soap *   soap,
+    char *          a_pOut,
+    size_t          a_nOutSize,
+    const void *    a_pBuf,
+    size_t          a_nBufLen
+    )
+{
+    struct wininet_data * pData = (struct wininet_data *) 
+        soap_lookup_plugin(soap, wininet_id);
+    char    szLine[256];
+    size_t  nLen, out = 0;
+    FILE *  hFile;
+
+    remove(HEX_LOG);
+    CHECK(wininet_setlog(soap, HEX_LOG) == SOAP_OK);
+    CHECK(wininet_setloglevel(soap, WININET_LOG_BODY) == SOAP_OK);
+    wininet_log_data_hex(pData, a_pBuf, a_nBufLen);
+    CHECK(wininet_setlog(soap, NULL) == SOAP_OK);
+
+    hFile = fopen(HEX_LOG, "r");
+    CHECK(hFile != NULL);
+    if (!hFile) return 0;
+    while (fgets(szLine, sizeof(szLine), hFile)) {
+        nLen = strlen(szLine);
+        /* the hex lines start with a 5 digit offset, the others with a date */
+        if (szLine[5] != ':' || szLine[2] == '/') continue;
+        CHECK(out + nLen <= a_nOutSize);
+        if (out + nLen > a_nOutSize) break;
+        memcpy(a_pOut + out, szLine, nLen);
+        out += nLen;
+    }
+    fclose(hFile);
+    remove(HEX_LOG);
+    return out;
+}
+
+/* the plugin must produce exactly what the reference does */
+static void
+check_hex(
+    struct soap *           soap,
+    char *                  a_pExpect,
+    char *                  a_pActual,
+    size_t                  a_nOutSize,
+    const unsigned char *   a_pBuf,
+    size_t                  a_nBufLen
+    )
+{
+    size_t nExpect = reference_hex(NULL, a_pExpect, a_pBuf, a_nBufLen);
+    size_t nActual = plugin_hex(soap, a_pActual, a_nOutSize, a_pBuf, a_nBufLen);
+    size_t n;
+
+    CHECK(nExpect == (a_nBufLen + 23) / 24 * HEX_LINE_LEN);
+    CHECK(nActual == nExpect);
+    if (nActual == nExpect && !memcmp(a_pActual, a_pExpect, nExpect)) return;
+
+    for (n = 0; n < nActual && n < nExpect && a_pActual[n] == a_pExpect[n]; ++n) {}
+    n -= n % HEX_LINE_LEN;
+    printf("length %lu differs at %lu:\n  expected: %.*s  actual:   %.*s", 
+        (unsigned long) a_nBufLen, (unsigned long) n,
+        HEX_LINE_LEN, a_pExpect + n, HEX_LINE_LEN, a_pActual + n);
+    ++harness_failures;
+}
+
+int
+main(void)
+{
+    static const size_t anLengths[] = {
+        0, 1, 5, 7, 8, 9, 16, 17, 23, 24, 25, 47, 48, 49, 256, 1000, 
+        0x10000 - 1, 0x10000, 0x10000 + 1, 0x10000 + 30, 100000 - 24, 
+        100000, 100000 + 1, 100000 + 24 + 23, HEX_MAX - 16 };
+    static const char * const apszGolden[] = {
+        "00000: 00 01 02 03 04 05 06 07  08 09 0a 0b 0c 0d 0e 0f  10 11 12 13 14 15 16 17    ........................",
+        "00120: 78 79 7a 7b 7c 7d 7e 7f  80 81 82 83 84 85 86 87  88 89 8a 8b 8c 8d 8e 8f    xyz{|}~.................",
+        "00048: 30 31 32 33 34 35 36 37  38 39 3a 3b 3c 3d 3e 3f  40 41 42 43 44 45 46 47    0123456789:;<=>?@ABCDEFG" };
+    static const char szPartial[] = 
+        "00000: 41 42 7f ff 20                                                               AB..                         \n";
+    unsigned char * pBuf;
+    char *  pExpect;
+    char *  pActual;
+    size_t  nOutSize = (HEX_MAX / 24 + 1) * HEX_LINE_LEN;
+    size_t  nLen, n;
+    struct soap * soap;
+
+    soap = harness_client(wininet_register);
+    pBuf = (unsigned char *) malloc(HEX_MAX + 16);
+    pExpect = (char *) malloc(nOutSize);
+    pActual = (char *) malloc(nOutSize);
+    CHECK(soap && pBuf && pExpect && pActual);
+    if (!soap || !pBuf || !pExpect || !pActual) return harness_result("test_hexdump");
+
+    /* every byte value, repeating */
+    for (n = 0; n < HEX_MAX + 16; ++n) {
+        pBuf[n] = (unsigned char) n;
+    }
+
+    /* literal lines, the first and sixth lines of the dump and a partial line */
+    nLen = plugin_hex(soap, pActual, nOutSize, pBuf, 256);
+    CHECK(nLen == 11 * HEX_LINE_LEN);
+    CHECK(!strncmp(pActual, apszGolden[0], strlen(apszGolden[0])));
+    CHECK(!strncmp(pActual + 5 * HEX_LINE_LEN, apszGolden[1], strlen(apszGolden[1])));
+    CHECK(!strncmp(pActual + 2 * HEX_LINE_LEN, apszGolden[2], strlen(apszGolden[2])));
+    nLen = plugin_hex(soap, pActual, nOutSize, "AB\x7f\xff ", 5);
+    CHECK(nLen == sizeof(szPartial) - 1 && !memcmp(pActual, szPartial, nLen));
+
+    /* the same output as the reference, from aligned and unaligned buffers */
+    for (n = 0; n < sizeof(anLengths) / sizeof(anLengths[0]); ++n) {
+        check_hex(soap, pExpect, pActual, nOutSize, pBuf, anLengths[n]);
+        check_hex(soap, pExpect, pActual, nOutSize, pBuf + 3, anLengths[n]);
+    }
+
+    /* bytes that don't repeat with the line length */
+    for (n = 0; n < HEX_MAX + 16; ++n) {
+        pBuf[n] = (unsigned char) (n * 131 + n / 251);
+    }
+    check_hex(soap, pExpect, pActual, nOutSize, pBuf + 1, HEX_MAX - 16);
+
+    free(pBuf);
+    free(pExpect);
+    free(pActual);
+    harness_free(soap);
+    return harness_result("test_hexdump");
+}